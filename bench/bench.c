@@ -0,0 +1,186 @@
+/********************************************************************
+
+  Benchmark scaffolding
+
+  Author: Markku Heiskari
+  Version history in github
+
+  (C) Copyright 2024, Creoir Oy
+
+  Global data and publish policies for the benchmark programs, which
+  link the application modules without actionMain.c. The policies
+  cover the bench/ topics only and switch off de-duplication, rate
+  limits, spooling and barge-in, so the benchmarks measure the
+  publish path itself.
+
+  Results are printed to stdout, one line per measurement. Latency
+  percentiles come from the sorted samples, not from LATENCY_HIST,
+  whose log2 buckets are too coarse to compare two implementations.
+
+********************************************************************/
+
+/********************************************************************
+  INCLUDES
+********************************************************************/
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include "actionMain.h"
+#include "util.h"
+#include "bench.h"
+
+/********************************************************************
+  FILE SCOPE VARIABLES
+********************************************************************/
+
+globalData_type *pGlobalData;
+static globalData_type globalData;
+
+const mqtt_publish_policy mqttPublishPolicyRegister[] = {
+  { .topic = BENCH_TOPIC_QOS0, .qos = 0, .retain = false, .lane = MQTT_LANE_NORMAL, .expiryMs = 0, .dedupMs = 0, .ratePerSec = 0, .burst = 0, .spoolTtlMs = 0, .bargeIn = false },
+  { .topic = BENCH_TOPIC_QOS1, .qos = 1, .retain = false, .lane = MQTT_LANE_NORMAL, .expiryMs = 0, .dedupMs = 0, .ratePerSec = 0, .burst = 0, .spoolTtlMs = 0, .bargeIn = false },
+  { .topic = BENCH_TOPIC_QOS2, .qos = 2, .retain = false, .lane = MQTT_LANE_NORMAL, .expiryMs = 0, .dedupMs = 0, .ratePerSec = 0, .burst = 0, .spoolTtlMs = 0, .bargeIn = false },
+  { .topic = "#",              .qos = 1, .retain = false, .lane = MQTT_LANE_NORMAL, .expiryMs = 0, .dedupMs = 0, .ratePerSec = 0, .burst = 0, .spoolTtlMs = 0, .bargeIn = false },
+};
+const size_t mqttPublishPolicyRegisterSize = sizeof(mqttPublishPolicyRegister)/sizeof(mqtt_publish_policy);
+
+
+/********************************************************************
+  FUNCTIONS
+********************************************************************/
+
+/********************************************************************
+  bench_init()
+
+  Parameters: void
+  Returns:    void
+
+  Description:
+  Sets up pGlobalData like app_init() does before the command line
+  is read, with only errors printed.
+
+********************************************************************/
+void bench_init( void ){
+  memset( &globalData, 0x00, sizeof(globalData_type) );
+  pGlobalData = &globalData;
+  pGlobalData->debugMask = DBG_ERROR | DBG_FATAL;
+  pGlobalData->outboxSize = 256;
+  pGlobalData->eventWorkers = 1;
+  pGlobalData->mqttConnected = 1;
+} // End of bench_init()
+
+
+/********************************************************************
+  bench_cpuNs()
+
+  Parameters: void
+  Returns:    Process CPU time in nanoseconds
+
+********************************************************************/
+uint64_t bench_cpuNs( void ){
+  struct timespec ts;
+
+  clock_gettime( CLOCK_PROCESS_CPUTIME_ID, &ts );
+  return (uint64_t)ts.tv_sec * 1000000000ULL + (uint64_t)ts.tv_nsec;
+} // End of bench_cpuNs()
+
+
+/********************************************************************
+  bench_spin()
+
+  Parameters: (in)  Nanoseconds
+  Returns:    void
+
+********************************************************************/
+void bench_spin( uint64_t ns ){
+  uint64_t end;
+
+  if( 0 == ns ) return;
+  end = monotonic_ns() + ns;
+  while( monotonic_ns() < end );
+} // End of bench_spin()
+
+
+/********************************************************************
+  bench_sleepUntil()
+
+  Parameters: (in)  monotonic_ns() deadline
+  Returns:    void
+
+  Description:
+  Sleeps for the bulk of the wait and spins the last 50 us, so
+  producers keep their rate above the timer slack.
+
+********************************************************************/
+void bench_sleepUntil( uint64_t deadlineNs ){
+  struct timespec ts;
+  uint64_t        now = monotonic_ns();
+
+  if( deadlineNs > now + 50000 ){
+    ts.tv_sec = (time_t)( ( deadlineNs - now - 50000 ) / 1000000000ULL );
+    ts.tv_nsec = (long)( ( deadlineNs - now - 50000 ) % 1000000000ULL );
+    nanosleep( &ts, NULL );
+  }
+  while( monotonic_ns() < deadlineNs );
+} // End of bench_sleepUntil()
+
+
+/********************************************************************
+  compareSamples()
+
+  Parameters: (in)  Samples to compare
+  Returns:    qsort() order
+
+********************************************************************/
+static int compareSamples( const void *pA, const void *pB ){
+  uint64_t a = *(const uint64_t*)pA;
+  uint64_t b = *(const uint64_t*)pB;
+
+  return ( a > b ) - ( a < b );
+} // End of compareSamples()
+
+
+/********************************************************************
+  bench_report()
+
+  Parameters: (in)  Label
+              (in)  Samples in nanoseconds, sorted in place
+              (in)  Number of samples
+  Returns:    void
+
+********************************************************************/
+void bench_report( const char *pName, uint64_t *pSamples, size_t count ){
+  if( 0 == count ){
+    printf( "%-44s no samples\n", pName );
+    return;
+  }
+  qsort( pSamples, count, sizeof(uint64_t), compareSamples );
+  printf( "%-44s n=%-8zu p50 %9.2f  p90 %9.2f  p99 %9.2f  p99.9 %9.2f  max %9.2f us\n", pName, count,
+          pSamples[count * 50 / 100] / 1000.0, pSamples[count * 90 / 100] / 1000.0,
+          pSamples[count * 99 / 100] / 1000.0, pSamples[count * 999 / 1000] / 1000.0,
+          pSamples[count - 1] / 1000.0 );
+} // End of bench_report()
+
+
+/********************************************************************
+  bench_rate()
+
+  Parameters: (in)  Label
+              (in)  Operations done
+              (in)  Elapsed time in nanoseconds
+              (in)  Process CPU time in nanoseconds, 0=not measured
+  Returns:    void
+
+********************************************************************/
+void bench_rate( const char *pName, uint64_t count, uint64_t wallNs, uint64_t cpuNs ){
+  if( 0 == wallNs ) wallNs = 1;
+  if( cpuNs ){
+    printf( "%-44s %12.0f ops/s  %9.1f ns/op  cpu %7.1f ns/op\n", pName, count * 1e9 / wallNs,
+            (double)wallNs / ( count ? count : 1 ), (double)cpuNs / ( count ? count : 1 ) );
+  }else{
+    printf( "%-44s %12.0f ops/s  %9.1f ns/op\n", pName, count * 1e9 / wallNs, (double)wallNs / ( count ? count : 1 ) );
+  }
+} // End of bench_rate()
+
+/** End of bench.c ***************************************************/
@@ -0,0 +1,94 @@
+/**
+ * @file bench.h
+ * @author Markku Heiskari
+ * @brief Shared parts of the benchmark programs in bench/. The programs link the
+ * application modules without actionMain.c, so this provides the global data,
+ * a publish policy register of benchmark topics and the measurement helpers.
+ * Build and run them all with "make bench".
+ *
+ * @copyright Copyright (c) 2024 Creoir Oy
+ *
+ */
+
+#ifndef __bench_h
+#define __bench_h
+
+/********************************************************************
+  INCLUDES
+********************************************************************/
+#include <stddef.h>
+#include <stdint.h>
+#include "actionMain.h"
+
+/********************************************************************
+  DEFINES
+********************************************************************/
+#define BENCH_TOPIC_QOS0                "bench/qos0"  //!< Benchmark topic with a QoS 0 policy
+#define BENCH_TOPIC_QOS1                "bench/qos1"  //!< Benchmark topic with a QoS 1 policy
+#define BENCH_TOPIC_QOS2                "bench/qos2"  //!< Benchmark topic with a QoS 2 policy
+
+
+/********************************************************************
+  PROTOTYPES
+********************************************************************/
+
+/**
+ * @brief Sets up pGlobalData with the application defaults and errors-only debug output
+ *
+ */
+void bench_init( void );
+
+/**
+ * @brief CPU time used by the whole process
+ *
+ * @return uint64_t Nanoseconds
+ */
+uint64_t bench_cpuNs( void );
+
+/**
+ * @brief Busy waits. Stands in for handler or library work of a known cost.
+ *
+ * @param ns Nanoseconds to spin
+ */
+void bench_spin( uint64_t ns );
+
+/**
+ * @brief Sleeps until a monotonic_ns() deadline. Paces producers.
+ *
+ * @param deadlineNs monotonic_ns() to wake up at
+ */
+void bench_sleepUntil( uint64_t deadlineNs );
+
+/**
+ * @brief Sorts latency samples and prints count, p50, p90, p99, p99.9 and max in microseconds
+ *
+ * @param pName Label of the result line
+ * @param pSamples Samples in nanoseconds. Sorted in place.
+ * @param count Number of samples
+ */
+void bench_report( const char *pName, uint64_t *pSamples, size_t count );
+
+/**
+ * @brief Prints a throughput result line
+ *
+ * @param pName Label of the result line
+ * @param count Operations done
+ * @param wallNs Elapsed time
+ * @param cpuNs Process CPU time used, 0=not measured
+ */
+void bench_rate( const char *pName, uint64_t count, uint64_t wallNs, uint64_t cpuNs );
+
+
+/* Stand-in for libmosquitto's publish, see benchMosquitto.c. Programs that talk to a real broker link -lmosquitto instead. */
+
+extern unsigned int bench_publishCostNs;   //!< Time one mosquitto_publish() call spins, like libmosquitto's packet build and socket write
+
+/**
+ * @brief Called with the payload of every message passed to mosquitto_publish(). NULL=none.
+ *
+ */
+extern void (*bench_pfPublished)( const void *pPayload, int payloadLen );
+
+#endif
+
+/* EOF *************************************************************/
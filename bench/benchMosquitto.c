@@ -0,0 +1,70 @@
+/********************************************************************
+
+  libmosquitto stand-in for the benchmarks
+
+  Author: Markku Heiskari
+  Version history in github
+
+  (C) Copyright 2024, Creoir Oy
+
+  Replaces the two libmosquitto calls of the publish path, so the
+  outbox and event benchmarks run without a broker and measure the
+  application's own hand-offs. mosquitto_publish() spins for
+  bench_publishCostNs, like the packet build and socket write of the
+  real call, and acknowledges QoS 1 and 2 messages at once, as a
+  broker on the loopback interface nearly does.
+
+********************************************************************/
+
+/********************************************************************
+  INCLUDES
+********************************************************************/
+#include <stdatomic.h>
+#include "actionMain.h"
+#include "mqttOutbox.h"
+#include "bench.h"
+
+/********************************************************************
+  FILE SCOPE VARIABLES
+********************************************************************/
+
+unsigned int bench_publishCostNs = 2000;
+void       (*bench_pfPublished)( const void *pPayload, int payloadLen );
+
+static atomic_int nextMid;
+
+
+/********************************************************************
+  FUNCTIONS
+********************************************************************/
+
+/********************************************************************
+  mosquitto_publish()
+
+  Parameters: See mosquitto.h
+  Returns:    MOSQ_ERR_SUCCESS
+
+********************************************************************/
+int mosquitto_publish( struct mosquitto *mosq, int *mid, const char *topic, int payloadlen, const void *payload, int qos, bool retain ){
+  int msgId = atomic_fetch_add( &nextMid, 1 ) + 1;
+
+  bench_spin( bench_publishCostNs );
+  if( bench_pfPublished ) bench_pfPublished( payload, payloadlen );
+  if( mid ) *mid = msgId;
+  if( qos > 0 ) mqttOutbox_acked( msgId );
+  return MOSQ_ERR_SUCCESS;
+} // End of mosquitto_publish()
+
+
+/********************************************************************
+  mosquitto_strerror()
+
+  Parameters: (in)  Error code
+  Returns:    Description
+
+********************************************************************/
+const char *mosquitto_strerror( int mosq_errno ){
+  return ( MOSQ_ERR_SUCCESS == mosq_errno ) ? "No error." : "Error.";
+} // End of mosquitto_strerror()
+
+/** End of benchMosquitto.c ******************************************/
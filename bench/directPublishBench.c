@@ -0,0 +1,198 @@
+/********************************************************************
+
+  MQTT publish benchmark: sender thread vs direct publish
+
+  Author: Markku Heiskari
+  Version history in github
+
+  (C) Copyright 2024, Creoir Oy
+
+  Compares the two ways mqtt_endPublish() hands a message to
+  libmosquitto: committing it to the outbox and waking the
+  mqtt_sender() thread, or publishing it on the calling thread
+  (--directPublish). The handoff latency runs from the
+  mqtt_endPublish() call until mosquitto_publish() is called; the
+  payload carries the time of the call. CPU time is the whole
+  process, divided by the messages published.
+
+  Messages are published one at a time at a steady rate, and in an
+  unpaced run by PRODUCERS threads at once, where direct publishers
+  wait for each other on the publish mutex.
+
+********************************************************************/
+
+/********************************************************************
+  INCLUDES
+********************************************************************/
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdatomic.h>
+#include <unistd.h>
+#include <time.h>
+#include <pthread.h>
+#include "actionMain.h"
+#include "util.h"
+#include "mqttOutbox.h"
+#include "bench.h"
+
+/********************************************************************
+  DEFINES
+********************************************************************/
+#define PRODUCERS               4
+#define STEADY_MESSAGES         4000
+#define STEADY_GAP_US           500
+#define BURST_MESSAGES          20000       // Per producer
+#define MAX_MESSAGES            ( PRODUCERS * BURST_MESSAGES )
+
+/********************************************************************
+  FILE SCOPE VARIABLES
+********************************************************************/
+
+extern globalData_type  *pGlobalData;
+
+static uint64_t         handoffSamples[MAX_MESSAGES];
+static atomic_size_t    numHandoffs;
+
+
+/********************************************************************
+  FUNCTIONS
+********************************************************************/
+
+/********************************************************************
+  published()
+
+  Parameters: (in)  Payload passed to mosquitto_publish()
+              (in)  Payload length
+  Returns:    void
+
+  Description:
+  bench_pfPublished. Takes the handoff latency from the time stamp
+  at the start of the payload.
+
+********************************************************************/
+static void published( const void *pPayload, int payloadLen ){
+  size_t i = atomic_fetch_add( &numHandoffs, 1 );
+
+  (void)payloadLen;
+  if( i < MAX_MESSAGES ) handoffSamples[i] = monotonic_ns() - strtoull( pPayload, NULL, 10 );
+} // End of published()
+
+
+/********************************************************************
+  publishOne()
+
+  Parameters: (in)  Sequence number
+  Returns:    0=Success, negative=error
+
+  Description:
+  Fills a small status message and stamps it just before
+  mqtt_endPublish().
+
+********************************************************************/
+static int publishOne( unsigned int seq ){
+  MQTT_OUTMSG *pMsg;
+  int          len;
+
+  pMsg = mqtt_beginPublish( BENCH_TOPIC_QOS1, __FUNCTION__ );
+  if( NULL == pMsg ) return -1;
+  len = snprintf( pMsg->pPayload, MQTT_SEND_PAYLOAD_SIZE, "%020llu {\"state\":\"listening\",\"seq\":%u}", 0ULL, seq );
+  snprintf( pMsg->pPayload, 21, "%020llu", (unsigned long long)monotonic_ns() );
+  pMsg->pPayload[20] = ' ';
+  return mqtt_endPublish( pMsg, len, __FUNCTION__ );
+} // End of publishOne()
+
+
+/********************************************************************
+  producer()
+
+  Parameters: (in)  Messages to publish
+  Returns:    NULL
+
+********************************************************************/
+static void* producer( void *pArg ){
+  unsigned int count = (unsigned int)(uintptr_t)pArg;
+  unsigned int i;
+
+  for( i = 0; i < count; i++ ) publishOne( i );
+  return NULL;
+} // End of producer()
+
+
+/********************************************************************
+  run()
+
+  Parameters: (in)  Nonzero: --directPublish, zero: sender thread
+              (in)  Nonzero: PRODUCERS unpaced, zero: steady rate
+  Returns:    void
+
+********************************************************************/
+static void run( int direct, int burst ){
+  pthread_t       threads[PRODUCERS];
+  struct timespec ts;
+  char            label[96];
+  size_t          count = burst ? (size_t)PRODUCERS * BURST_MESSAGES : STEADY_MESSAGES;
+  uint64_t        startNs, wallNs, cpuNs, next;
+  unsigned int    i;
+
+  pGlobalData->directPublish = direct;
+  atomic_store( &numHandoffs, 0 );
+  startNs = monotonic_ns();
+  cpuNs = bench_cpuNs();
+  if( burst ){
+    for( i = 0; i < PRODUCERS; i++ ) pthread_create( &threads[i], NULL, producer, (void*)(uintptr_t)BURST_MESSAGES );
+    for( i = 0; i < PRODUCERS; i++ ) pthread_join( threads[i], NULL );
+  }else{
+    // Sleep without the spin of bench_sleepUntil(), which would count as CPU time of the messages
+    next = startNs;
+    for( i = 0; i < STEADY_MESSAGES; i++ ){
+      next += STEADY_GAP_US * 1000ULL;
+      ts.tv_sec = (time_t)( next / 1000000000ULL );
+      ts.tv_nsec = (long)( next % 1000000000ULL );
+      clock_nanosleep( CLOCK_MONOTONIC, TIMER_ABSTIME, &ts, NULL );
+      publishOne( i );
+    }
+  }
+  // Let the sender catch up
+  for( i = 0; i < 1000 && atomic_load( &numHandoffs ) < count; i++ ) usleep( 1000 );
+  wallNs = monotonic_ns() - startNs;
+  cpuNs = bench_cpuNs() - cpuNs;
+
+  snprintf( label, sizeof(label), "%s %s", direct ? "direct" : "sender", burst ? "burst " : "steady" );
+  bench_rate( label, count, wallNs, cpuNs );
+  snprintf( label + strlen(label), sizeof(label) - strlen(label), " handoff" );
+  bench_report( label, handoffSamples, atomic_load( &numHandoffs ) < count ? atomic_load( &numHandoffs ) : count );
+} // End of run()
+
+
+/********************************************************************
+  main()
+
+  Parameters: void
+  Returns:    0=OK, 1=setup failed
+
+  Description:
+  mqtt_sender() runs in both modes, as in the application, where it
+  is the fallback of --directPublish. It runs until the process
+  exits.
+
+********************************************************************/
+int main( void ){
+  pthread_t thread;
+  int       direct;
+
+  bench_init();
+  bench_pfPublished = published;
+  if( mqttOutbox_init( pGlobalData->outboxSize, 0 ) ) return 1;
+  if( pthread_create( &thread, NULL, mqtt_sender, NULL ) ) return 1;
+
+  printf( "# MQTT handoff: sender thread vs --directPublish, steady every %d us, %d producers unpaced, %u ns publish\n",
+          STEADY_GAP_US, PRODUCERS, bench_publishCostNs );
+  for( direct = 0; direct <= 1; direct++ ){
+    run( direct, 0 );
+    run( direct, 1 );
+  }
+  return 0;
+}
+
+/** End of directPublishBench.c **************************************/
@@ -0,0 +1,213 @@
+/********************************************************************
+
+  Event queue benchmark: batch drain
+
+  Author: Markku Heiskari
+  Version history in github
+
+  (C) Copyright 2024, Creoir Oy
+
+  Events per second through the event queue at several producer
+  rates, with the consumer taking one event per call
+  (eventQueue_pop()) or draining up to EVQ_BATCH_MAX at once
+  (eventQueue_popBatch(), as app_eventloop() does).
+
+  Two producers push at a fixed total rate, or as fast as they can.
+  The consumer releases each payload and spins for a small handler
+  cost. The producer threads live through all runs, like the MQTT
+  threads of the application: the payload pool gives each producer
+  thread a free list of its own. Besides the delivered rate the
+  results show the CPU time per event and the mean batch size: a
+  batch size near 1 means the consumer wakes up for every event.
+
+********************************************************************/
+
+/********************************************************************
+  INCLUDES
+********************************************************************/
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+#include "actionMain.h"
+#include "util.h"
+#include "eventQueue.h"
+#include "eventPayload.h"
+#include "bench.h"
+
+/********************************************************************
+  DEFINES
+********************************************************************/
+#define PRODUCERS               2
+#define RUN_MS                  1000        // Length of a paced run
+#define UNPACED_EVENTS          200000      // Events per producer, unpaced run
+#define HANDLER_NS              200         // Work per dispatched event
+#define PAYLOAD_LENGTH          64
+
+/********************************************************************
+  TYPES
+********************************************************************/
+
+typedef struct
+{
+  unsigned int   events;            // Events to push
+  unsigned int   rate;              // Events per second, 0=unpaced
+} PRODUCER_T;
+
+/********************************************************************
+  FILE SCOPE VARIABLES
+********************************************************************/
+
+static EVENTQUEUE_T    *pQueue;
+static PRODUCER_T       prod;             // Parameters of the current run
+static pthread_barrier_t startBarrier;    // Producers and main thread, at the start of a run
+static uint64_t         totalEvents;      // Consumer stops after these
+static uint64_t         batches;          // Consumer only: pop calls that returned events
+
+
+/********************************************************************
+  FUNCTIONS
+********************************************************************/
+
+/********************************************************************
+  producer()
+
+  Parameters: (in)  Not used
+  Returns:    NULL
+
+  Description:
+  Pushes prod.events events per run. A run with no events ends the
+  thread.
+
+********************************************************************/
+static void* producer( void *pArg ){
+  APPLICATION_EVENTDATA  eventData;
+  char                   text[PAYLOAD_LENGTH];
+  uint64_t               next;
+  unsigned int           i;
+
+  (void)pArg;
+  memset( text, 'x', sizeof(text) );
+  for(;;){
+    pthread_barrier_wait( &startBarrier );
+    if( 0 == prod.events ) break;
+    next = monotonic_ns();
+    for( i = 0; i < prod.events; i++ ){
+      if( prod.rate ){
+        next += 1000000000ULL / prod.rate;
+        bench_sleepUntil( next );
+      }
+      memset( &eventData, 0x00, sizeof(eventData) );
+      eventData.pPayload = eventPayload_create( text, sizeof(text) );
+      eventQueue_push( pQueue, EVT_MQTT_INTENT_RECOGNIZED, &eventData );
+    }
+  }
+  return NULL;
+} // End of producer()
+
+
+/********************************************************************
+  consumer()
+
+  Parameters: (in)  Max events per call. 1=eventQueue_pop().
+  Returns:    NULL
+
+********************************************************************/
+static void* consumer( void *pArg ){
+  EVENTITEM_T            items[EVQ_BATCH_MAX];
+  APPLICATION_EVENTDATA  eventData;
+  APPLICATION_EVENT      event;
+  int                    batch = (int)(intptr_t)pArg;
+  uint64_t               done = 0;
+  int                    i, n;
+
+  batches = 0;
+  while( done < totalEvents ){
+    if( 1 == batch ){
+      eventQueue_pop( pQueue, &event, &eventData );
+      eventPayload_release( eventData.pPayload );
+      bench_spin( HANDLER_NS );
+      n = 1;
+    }else{
+      n = eventQueue_popBatch( pQueue, items, batch );
+      for( i = 0; i < n; i++ ){
+        eventPayload_release( items[i].eventData.pPayload );
+        bench_spin( HANDLER_NS );
+      }
+    }
+    done += n;
+    batches++;
+  }
+  return NULL;
+} // End of consumer()
+
+
+/********************************************************************
+  run()
+
+  Parameters: (in)  Max events per consumer call
+              (in)  Total events per second, 0=unpaced
+  Returns:    void
+
+********************************************************************/
+static void run( int batch, unsigned int rate ){
+  pthread_t   consThread;
+  char        label[96];
+  uint64_t    startNs, wallNs, cpuNs;
+
+  prod.rate = rate / PRODUCERS;
+  prod.events = rate ? (unsigned int)( (uint64_t)prod.rate * RUN_MS / 1000 ) : UNPACED_EVENTS;
+  totalEvents = (uint64_t)prod.events * PRODUCERS;
+
+  startNs = monotonic_ns();
+  cpuNs = bench_cpuNs();
+  pthread_create( &consThread, NULL, consumer, (void*)(intptr_t)batch );
+  pthread_barrier_wait( &startBarrier );
+  pthread_join( consThread, NULL );
+  wallNs = monotonic_ns() - startNs;
+  cpuNs = bench_cpuNs() - cpuNs;
+
+  if( rate ) snprintf( label, sizeof(label), "%s %7u/s", 1 == batch ? "single" : "batch ", rate );
+  else snprintf( label, sizeof(label), "%s unpaced", 1 == batch ? "single" : "batch " );
+  bench_rate( label, totalEvents, wallNs, cpuNs );
+  printf( "%-44s mean batch %.2f\n", "", (double)totalEvents / ( batches ? batches : 1 ) );
+} // End of run()
+
+
+/********************************************************************
+  main()
+
+  Parameters: void
+  Returns:    0=OK, 1=setup failed
+
+  Description:
+  Each producer rate with single pops and with batch drain.
+
+********************************************************************/
+int main( void ){
+  static const unsigned int rates[] = { 1000, 10000, 50000, 200000, 0 };
+  pthread_t prodThread[PRODUCERS];
+  size_t    i;
+
+  bench_init();
+  eventPayload_initPool( PAYLOAD_POOL_DEFAULT_BLOCKS, PAYLOAD_POOL_DEFAULT_BLOCKSIZE, PAYLOAD_FALLBACK_HEAP );
+  pQueue = eventQueue_create( EVQ_DEFAULT_CAPACITY );
+  if( NULL == pQueue ) return 1;
+  eventQueue_setOverflow( pQueue, EVT_MQTT_INTENT_RECOGNIZED, EVQ_OVERFLOW_BLOCK );
+  pthread_barrier_init( &startBarrier, NULL, PRODUCERS + 1 );
+  for( i = 0; i < PRODUCERS; i++ ) pthread_create( &prodThread[i], NULL, producer, NULL );
+
+  printf( "# Event queue drain: %d producers, %d ns handler, single pop vs batch of %d\n", PRODUCERS, HANDLER_NS, EVQ_BATCH_MAX );
+  for( i = 0; i < sizeof(rates) / sizeof(rates[0]); i++ ){
+    run( 1, rates[i] );
+    run( EVQ_BATCH_MAX, rates[i] );
+  }
+  prod.events = 0;
+  pthread_barrier_wait( &startBarrier );
+  for( i = 0; i < PRODUCERS; i++ ) pthread_join( prodThread[i], NULL );
+
+  eventQueue_destroy( pQueue );
+  return 0;
+}
+
+/** End of eventBatchBench.c *****************************************/
@@ -0,0 +1,284 @@
+/********************************************************************
+
+  Event queue benchmark: ring vs linked list
+
+  Author: Markku Heiskari
+  Version history in github
+
+  (C) Copyright 2024, Creoir Oy
+
+  Measures enqueue to dequeue latency and throughput of the event
+  queue (eventQueue.c) against a copy of the linked-list queue it
+  replaced. The list keeps the old design: a node of 10 kB inline
+  payload malloc()ed per event, one mutex over head and tail, a
+  counting semaphore for the consumer, and the payload copied with
+  strcpy() on push and again on pop. The CSDK mt_mutex/mt_semaphore
+  wrappers are plain pthread mutexes and POSIX semaphores, so those
+  are used directly.
+
+  Each event carries a 300 byte intent payload that starts with its
+  monotonic_ns() push time; the consumer takes the latency from it.
+  Producers either push as fast as they can (throughput, and the
+  latency includes the time spent queued behind a full queue) or at
+  a fixed rate (latency of a mostly idle queue).
+
+********************************************************************/
+
+/********************************************************************
+  INCLUDES
+********************************************************************/
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+#include <semaphore.h>
+#include "actionMain.h"
+#include "util.h"
+#include "eventQueue.h"
+#include "eventPayload.h"
+#include "bench.h"
+
+/********************************************************************
+  DEFINES
+********************************************************************/
+#define LIST_PAYLOAD_SIZE       10240       // Inline payload of the old APPLICATION_EVENTDATA
+#define PAYLOAD_LENGTH          300         // Typical creoir/asr/intentRecognized message
+#define MAX_PRODUCERS           4
+#define BURST_EVENTS            200000      // Events per producer, unpaced runs
+#define PACED_EVENTS            20000       // Events of the paced run
+#define PACED_RATE              20000       // Events per second of the paced run
+
+/********************************************************************
+  TYPES
+********************************************************************/
+
+// Event data and node of the linked-list queue
+typedef struct
+{
+  char *payloadPtr;
+  char topicPayload[LIST_PAYLOAD_SIZE];
+} LIST_EVENTDATA;
+
+typedef struct LISTNODE
+{
+  APPLICATION_EVENT        eventType;
+  LIST_EVENTDATA           eventData;
+  struct LISTNODE         *next;
+} LISTNODE_T;
+
+typedef struct
+{
+  int            ring;              // Nonzero: eventQueue.c, zero: linked list
+  unsigned int   events;            // Events to push
+  unsigned int   rate;              // Events per second, 0=unpaced
+} PRODUCER_T;
+
+/********************************************************************
+  FILE SCOPE VARIABLES
+********************************************************************/
+
+static LISTNODE_T      *listHead;
+static LISTNODE_T      *listTail;
+static pthread_mutex_t  listMutex = PTHREAD_MUTEX_INITIALIZER;
+static sem_t            listSem;
+
+static EVENTQUEUE_T    *pRing;
+
+static uint64_t        *pSamples;         // Consumer only
+static size_t           numSamples;
+static char             payloadText[PAYLOAD_LENGTH + 1];
+
+
+/********************************************************************
+  FUNCTIONS
+********************************************************************/
+
+/********************************************************************
+  listPush() / listPop()
+
+  The linked-list queue as it was, minus the debug output.
+
+********************************************************************/
+static void listPush( APPLICATION_EVENT event, const LIST_EVENTDATA *eventData ){
+  LISTNODE_T *newEvent;
+
+  pthread_mutex_lock( &listMutex );
+  newEvent = malloc( sizeof(LISTNODE_T) );
+  newEvent->eventType = event;
+  strcpy( newEvent->eventData.topicPayload, eventData->topicPayload );
+  newEvent->eventData.payloadPtr = eventData->payloadPtr;
+  newEvent->next = NULL;
+  if( NULL == listHead ) listHead = newEvent;
+  if( NULL == listTail ){
+    listTail = newEvent;
+  }else{
+    listTail->next = newEvent;
+    listTail = newEvent;
+  }
+  pthread_mutex_unlock( &listMutex );
+  sem_post( &listSem );
+} // End of listPush()
+
+static void listPop( APPLICATION_EVENT *event, LIST_EVENTDATA *eventData ){
+  LISTNODE_T *eventNode;
+
+  while( sem_wait( &listSem ) );
+  pthread_mutex_lock( &listMutex );
+  if( NULL != listHead ){
+    eventNode = listHead;
+    *event = eventNode->eventType;
+    strcpy( eventData->topicPayload, eventNode->eventData.topicPayload );
+    eventData->payloadPtr = eventNode->eventData.payloadPtr;
+    listHead = listHead->next;
+    if( NULL == listHead ) listTail = NULL;
+    free( eventNode );
+  }
+  pthread_mutex_unlock( &listMutex );
+} // End of listPop()
+
+
+/********************************************************************
+  producer()
+
+  Parameters: (in)  PRODUCER_T
+  Returns:    NULL
+
+  Description:
+  Builds each message the way the MQTT handler does for the queue
+  under test and pushes it. The push time is written over the first
+  20 characters of the payload.
+
+********************************************************************/
+static void* producer( void *pArg ){
+  const PRODUCER_T      *pProd = pArg;
+  static _Thread_local LIST_EVENTDATA listData;   // 10 kB, too big for the stack of every thread
+  APPLICATION_EVENTDATA  eventData;
+  char                   text[PAYLOAD_LENGTH + 1];
+  uint64_t               next = monotonic_ns();
+  unsigned int           i;
+
+  memcpy( text, payloadText, sizeof(text) );
+  for( i = 0; i < pProd->events; i++ ){
+    if( pProd->rate ){
+      next += 1000000000ULL / pProd->rate;
+      bench_sleepUntil( next );
+    }
+    snprintf( text, 21, "%020llu", (unsigned long long)monotonic_ns() );
+    text[20] = ' ';
+    if( pProd->ring ){
+      memset( &eventData, 0x00, sizeof(eventData) );
+      eventData.pPayload = eventPayload_create( text, PAYLOAD_LENGTH );
+      eventQueue_push( pRing, EVT_MQTT_INTENT_RECOGNIZED, &eventData );
+    }else{
+      memcpy( listData.topicPayload, text, sizeof(text) );
+      listData.payloadPtr = NULL;
+      listPush( EVT_MQTT_INTENT_RECOGNIZED, &listData );
+    }
+  }
+  return NULL;
+} // End of producer()
+
+
+/********************************************************************
+  consumer()
+
+  Parameters: (in)  Nonzero: ring, zero: linked list
+  Returns:    NULL
+
+  Description:
+  Takes numSamples events and records their queue latency.
+
+********************************************************************/
+static void* consumer( void *pArg ){
+  static LIST_EVENTDATA  listData;
+  APPLICATION_EVENTDATA  eventData;
+  APPLICATION_EVENT      event;
+  int                    ring = (int)(intptr_t)pArg;
+  size_t                 i;
+
+  for( i = 0; i < numSamples; i++ ){
+    if( ring ){
+      eventQueue_pop( pRing, &event, &eventData );
+      pSamples[i] = monotonic_ns() - strtoull( eventData.pPayload->data, NULL, 10 );
+      eventPayload_release( eventData.pPayload );
+    }else{
+      listPop( &event, &listData );
+      pSamples[i] = monotonic_ns() - strtoull( listData.topicPayload, NULL, 10 );
+    }
+  }
+  return NULL;
+} // End of consumer()
+
+
+/********************************************************************
+  run()
+
+  Parameters: (in)  Nonzero: ring, zero: linked list
+              (in)  Number of producer threads
+              (in)  Events per producer
+              (in)  Events per second per producer, 0=unpaced
+  Returns:    void
+
+********************************************************************/
+static void run( int ring, int producers, unsigned int events, unsigned int rate ){
+  pthread_t   prodThread[MAX_PRODUCERS];
+  pthread_t   consThread;
+  PRODUCER_T  prod = { ring, events, rate };
+  char        label[96];
+  uint64_t    startNs, wallNs, cpuNs;
+  int         i;
+
+  numSamples = (size_t)producers * events;
+  startNs = monotonic_ns();
+  cpuNs = bench_cpuNs();
+  pthread_create( &consThread, NULL, consumer, (void*)(intptr_t)ring );
+  for( i = 0; i < producers; i++ ) pthread_create( &prodThread[i], NULL, producer, &prod );
+  for( i = 0; i < producers; i++ ) pthread_join( prodThread[i], NULL );
+  pthread_join( consThread, NULL );
+  wallNs = monotonic_ns() - startNs;
+  cpuNs = bench_cpuNs() - cpuNs;
+
+  snprintf( label, sizeof(label), "%s %dP %s", ring ? "ring" : "list", producers, rate ? "paced" : "burst" );
+  if( !rate ) bench_rate( label, numSamples, wallNs, cpuNs );
+  snprintf( label + strlen(label), sizeof(label) - strlen(label), " latency" );
+  bench_report( label, pSamples, numSamples );
+} // End of run()
+
+
+/********************************************************************
+  main()
+
+  Parameters: void
+  Returns:    0=OK, 1=setup failed
+
+  Description:
+  Unpaced runs with 1 and 4 producers, then one paced run, each on
+  the list first and then on the ring.
+
+********************************************************************/
+int main( void ){
+  int ring, producers;
+
+  bench_init();
+  eventPayload_initPool( PAYLOAD_POOL_DEFAULT_BLOCKS, PAYLOAD_POOL_DEFAULT_BLOCKSIZE, PAYLOAD_FALLBACK_HEAP );
+  pRing = eventQueue_create( EVQ_DEFAULT_CAPACITY );
+  sem_init( &listSem, 0, 0 );
+  pSamples = malloc( sizeof(uint64_t) * MAX_PRODUCERS * BURST_EVENTS );
+  if( NULL == pRing || NULL == pSamples ) return 1;
+  // The list never sheds events. Block, so both queues deliver every event.
+  eventQueue_setOverflow( pRing, EVT_MQTT_INTENT_RECOGNIZED, EVQ_OVERFLOW_BLOCK );
+  memset( payloadText, 'x', PAYLOAD_LENGTH );
+  memcpy( payloadText + 24, "{\"intent\":\"TOGGLE_ROUTES\",\"confidence\":87,\"slots\":[]}", 52 );
+
+  printf( "# Event queue: ring (capacity %d) vs linked list, %d byte payloads\n", EVQ_DEFAULT_CAPACITY, PAYLOAD_LENGTH );
+  for( producers = 1; producers <= MAX_PRODUCERS; producers *= 4 ){
+    for( ring = 0; ring <= 1; ring++ ) run( ring, producers, BURST_EVENTS, 0 );
+  }
+  for( ring = 0; ring <= 1; ring++ ) run( ring, 1, PACED_EVENTS, PACED_RATE );
+
+  eventQueue_destroy( pRing );
+  free( pSamples );
+  return 0;
+}
+
+/** End of eventQueueBench.c *****************************************/
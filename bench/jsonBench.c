@@ -0,0 +1,293 @@
+/********************************************************************
+
+  Inbound JSON benchmark: json_extract() vs cJSON
+
+  Author: Markku Heiskari
+  Version history in github
+
+  (C) Copyright 2024, Creoir Oy
+
+  Decoding cost of the three inbound records with json_extract()
+  and field tables like those of action.c, against cJSON_Parse(),
+  looking up the same members and copying them into the same
+  records, and cJSON_Delete(), as the handlers did before.
+
+  The payloads are the files of bench/payloads, as the ASR and the
+  biometrics publish them, unknown members included. Another payload
+  directory can be given as the argument. Before timing, both
+  decoders must agree on the main fields of each record.
+
+********************************************************************/
+
+/********************************************************************
+  INCLUDES
+********************************************************************/
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stddef.h>
+#include "cJSON.h"
+#include "actionMain.h"
+#include "action.h"
+#include "util.h"
+#include "bench.h"
+
+/********************************************************************
+  DEFINES
+********************************************************************/
+#define PAYLOAD_DIR             "bench/payloads"
+#define MAX_PAYLOAD             4096
+#define ITERATIONS              200000
+#define FIELD_BIT(i)            ( 1 << (i) ) // As in action.c
+
+/********************************************************************
+  TYPES
+********************************************************************/
+
+typedef enum
+{
+  RECORD_INTENT,
+  RECORD_REJECTION,
+  RECORD_IDENTIFICATION,
+  RECORD_COUNT
+}RECORD_TYPE;
+
+typedef union
+{
+  ASR_INTENT_T           intent;
+  ASR_REJECTION_T        rejection;
+  BIOM_IDENTIFICATION_T  identification;
+}RECORD_T;
+
+/********************************************************************
+  FILE SCOPE VARIABLES
+********************************************************************/
+
+/* Field tables of action.c, which keeps them static */
+enum { SLOT_FIELD_NAME, SLOT_FIELD_VALUE, SLOT_FIELDS };
+static const JSON_FIELD slotFields[SLOT_FIELDS] =
+{
+  [SLOT_FIELD_NAME]  = { .pName = JSONKEY_SLOTNAME,  .type = JSON_FIELD_STRING, .offset = offsetof(ASR_SLOT_T, name),  .size = ASR_NAME_SIZE },
+  [SLOT_FIELD_VALUE] = { .pName = JSONKEY_SLOTVALUE, .type = JSON_FIELD_TEXT,   .offset = offsetof(ASR_SLOT_T, value), .size = ASR_TEXT_SIZE },
+};
+
+enum { INTENT_FIELD_INTENT, INTENT_FIELD_CONFIDENCE, INTENT_FIELD_SLOTS, INTENT_FIELDS };
+static const JSON_FIELD intentFields[INTENT_FIELDS] =
+{
+  [INTENT_FIELD_INTENT]     = { .pName = JSONKEY_INTENT,     .type = JSON_FIELD_STRING, .offset = offsetof(ASR_INTENT_T, intent),     .size = ASR_NAME_SIZE },
+  [INTENT_FIELD_CONFIDENCE] = { .pName = JSONKEY_CONFIDENCE, .type = JSON_FIELD_INT,    .offset = offsetof(ASR_INTENT_T, confidence) },
+  [INTENT_FIELD_SLOTS]      = { .pName = JSONKEY_SLOTS,      .type = JSON_FIELD_ARRAY,  .offset = offsetof(ASR_INTENT_T, slots),      .size = sizeof(ASR_SLOT_T),
+                                .required = FIELD_BIT(SLOT_FIELD_NAME), .pItems = slotFields, .numItems = SLOT_FIELDS,
+                                .countOffset = offsetof(ASR_INTENT_T, numSlots), .maxCount = ASR_MAX_SLOTS },
+};
+
+enum { REJECTION_FIELD_CODE, REJECTION_FIELD_TEXT, REJECTION_FIELD_INTENT, REJECTION_FIELD_CONFIDENCE, REJECTION_FIELDS };
+static const JSON_FIELD rejectionFields[REJECTION_FIELDS] =
+{
+  [REJECTION_FIELD_CODE]       = { .pName = JSONKEY_REASONCODE, .type = JSON_FIELD_INT,  .offset = offsetof(ASR_REJECTION_T, reasonCode) },
+  [REJECTION_FIELD_TEXT]       = { .pName = JSONKEY_REASONTEXT, .type = JSON_FIELD_TEXT, .offset = offsetof(ASR_REJECTION_T, reasonText), .size = ASR_TEXT_SIZE },
+  [REJECTION_FIELD_INTENT]     = { .pName = JSONKEY_INTENT,     .type = JSON_FIELD_TEXT, .offset = offsetof(ASR_REJECTION_T, intent),     .size = ASR_NAME_SIZE },
+  [REJECTION_FIELD_CONFIDENCE] = { .pName = JSONKEY_CONFIDENCE, .type = JSON_FIELD_INT,  .offset = offsetof(ASR_REJECTION_T, confidence) },
+};
+
+enum { IDENTIFICATION_FIELD_NAME, IDENTIFICATION_FIELD_SCORE, IDENTIFICATION_FIELDS };
+static const JSON_FIELD identificationFields[IDENTIFICATION_FIELDS] =
+{
+  [IDENTIFICATION_FIELD_NAME]  = { .pName = JSONKEY_NAME,  .type = JSON_FIELD_STRING, .offset = offsetof(BIOM_IDENTIFICATION_T, name),  .size = ASR_NAME_SIZE },
+  [IDENTIFICATION_FIELD_SCORE] = { .pName = JSONKEY_SCORE, .type = JSON_FIELD_INT,    .offset = offsetof(BIOM_IDENTIFICATION_T, score) },
+};
+
+static const struct
+{
+  const char        *pFile;
+  const JSON_FIELD  *pFields;
+  int                numFields;
+} records[RECORD_COUNT] = {
+  [RECORD_INTENT]         = { "intentRecognized.json",    intentFields,         INTENT_FIELDS },
+  [RECORD_REJECTION]      = { "intentNotRecognized.json", rejectionFields,      REJECTION_FIELDS },
+  [RECORD_IDENTIFICATION] = { "identification.json",      identificationFields, IDENTIFICATION_FIELDS },
+};
+
+
+/********************************************************************
+  FUNCTIONS
+********************************************************************/
+
+/********************************************************************
+  copyItem()
+
+  Parameters: (out) Buffer
+              (in)  Buffer size
+              (in)  cJSON item, NULL=not found
+  Returns:    void
+
+  Description:
+  Stores a string, or a number, like JSON_FIELD_TEXT does.
+
+********************************************************************/
+static void copyItem( char *pBuffer, size_t size, const cJSON *pItem ){
+  if( cJSON_IsString( pItem ) ) snprintf( pBuffer, size, "%s", pItem->valuestring );
+  else if( cJSON_IsNumber( pItem ) ) snprintf( pBuffer, size, "%g", pItem->valuedouble );
+} // End of copyItem()
+
+
+/********************************************************************
+  cjsonDecode()
+
+  Parameters: (in)  Record type
+              (in)  Payload
+              (in)  Payload length
+              (out) Record
+  Returns:    0=OK, negative=parse error
+
+  Description:
+  Decodes the record with cJSON, the way the handlers did before
+  json_extract().
+
+********************************************************************/
+static int cjsonDecode( RECORD_TYPE type, const char *pJson, size_t length, RECORD_T *pRecord ){
+  cJSON  *pAll, *pItem, *pSlots, *pSlot;
+  int     n = 0;
+
+  pAll = cJSON_ParseWithLength( pJson, length );
+  if( NULL == pAll ) return -1;
+  switch( type ){
+    case RECORD_INTENT:
+      copyItem( pRecord->intent.intent, ASR_NAME_SIZE, cJSON_GetObjectItem( pAll, JSONKEY_INTENT ) );
+      pItem = cJSON_GetObjectItem( pAll, JSONKEY_CONFIDENCE );
+      if( pItem ) pRecord->intent.confidence = pItem->valueint;
+      pSlots = cJSON_GetObjectItem( pAll, JSONKEY_SLOTS );
+      cJSON_ArrayForEach( pSlot, pSlots ){
+        if( n >= ASR_MAX_SLOTS ) break;
+        pItem = cJSON_GetObjectItem( pSlot, JSONKEY_SLOTNAME );
+        if( NULL == pItem ) continue;
+        copyItem( pRecord->intent.slots[n].name, ASR_NAME_SIZE, pItem );
+        copyItem( pRecord->intent.slots[n].value, ASR_TEXT_SIZE, cJSON_GetObjectItem( pSlot, JSONKEY_SLOTVALUE ) );
+        n++;
+      }
+      pRecord->intent.numSlots = n;
+      break;
+    case RECORD_REJECTION:
+      pItem = cJSON_GetObjectItem( pAll, JSONKEY_REASONCODE );
+      if( pItem ) pRecord->rejection.reasonCode = pItem->valueint;
+      copyItem( pRecord->rejection.reasonText, ASR_TEXT_SIZE, cJSON_GetObjectItem( pAll, JSONKEY_REASONTEXT ) );
+      copyItem( pRecord->rejection.intent, ASR_NAME_SIZE, cJSON_GetObjectItem( pAll, JSONKEY_INTENT ) );
+      pItem = cJSON_GetObjectItem( pAll, JSONKEY_CONFIDENCE );
+      if( pItem ) pRecord->rejection.confidence = pItem->valueint;
+      break;
+    default:
+      copyItem( pRecord->identification.name, ASR_NAME_SIZE, cJSON_GetObjectItem( pAll, JSONKEY_NAME ) );
+      pItem = cJSON_GetObjectItem( pAll, JSONKEY_SCORE );
+      if( pItem ) pRecord->identification.score = pItem->valueint;
+      break;
+  }
+  cJSON_Delete( pAll );
+  return 0;
+} // End of cjsonDecode()
+
+
+/********************************************************************
+  sameRecord()
+
+  Parameters: (in)  Record type
+              (in)  Record from json_extract()
+              (in)  Record from cJSON
+  Returns:    Nonzero if the main fields are equal
+
+********************************************************************/
+static int sameRecord( RECORD_TYPE type, const RECORD_T *pA, const RECORD_T *pB ){
+  int i;
+
+  switch( type ){
+    case RECORD_INTENT:
+      if( strcmp( pA->intent.intent, pB->intent.intent ) || pA->intent.confidence != pB->intent.confidence ) return 0;
+      if( pA->intent.numSlots != pB->intent.numSlots ) return 0;
+      for( i = 0; i < pA->intent.numSlots; i++ ){
+        if( strcmp( pA->intent.slots[i].name, pB->intent.slots[i].name ) ) return 0;
+      }
+      return 1;
+    case RECORD_REJECTION:
+      return pA->rejection.reasonCode == pB->rejection.reasonCode && pA->rejection.confidence == pB->rejection.confidence &&
+             0 == strcmp( pA->rejection.reasonText, pB->rejection.reasonText ) && 0 == strcmp( pA->rejection.intent, pB->rejection.intent );
+    default:
+      return pA->identification.score == pB->identification.score && 0 == strcmp( pA->identification.name, pB->identification.name );
+  }
+} // End of sameRecord()
+
+
+/********************************************************************
+  loadPayload()
+
+  Parameters: (in)  Directory
+              (in)  File name
+              (out) Buffer of MAX_PAYLOAD bytes
+  Returns:    Length, negative=error
+
+********************************************************************/
+static long loadPayload( const char *pDir, const char *pFile, char *pBuffer ){
+  char    path[512];
+  FILE   *fp;
+  size_t  length;
+
+  snprintf( path, sizeof(path), "%s/%s", pDir, pFile );
+  fp = fopen( path, "rb" );
+  if( NULL == fp ){
+    printf( "Cannot open %s\n", path );
+    return -1;
+  }
+  length = fread( pBuffer, 1, MAX_PAYLOAD, fp );
+  fclose( fp );
+  while( length && ( '\n' == pBuffer[length - 1] || '\r' == pBuffer[length - 1] ) ) length--;
+  return (long)length;
+} // End of loadPayload()
+
+
+/********************************************************************
+  main()
+
+  Parameters: (in)  [payload directory]
+  Returns:    0=OK, 1=payload missing or the decoders disagree
+
+********************************************************************/
+int main( int argc, char *argv[] ){
+  const char  *pDir = ( argc > 1 ) ? argv[1] : PAYLOAD_DIR;
+  static char  payload[MAX_PAYLOAD];
+  RECORD_T     extracted, parsed;
+  char         label[96];
+  long         length;
+  uint64_t     startNs, wallNs;
+  int          type, i;
+
+  bench_init();
+  printf( "# Inbound JSON: json_extract() vs cJSON_Parse() with lookups and copies, %d decodes\n", ITERATIONS );
+  for( type = 0; type < RECORD_COUNT; type++ ){
+    length = loadPayload( pDir, records[type].pFile, payload );
+    if( length < 0 ) return 1;
+
+    memset( &extracted, 0x00, sizeof(extracted) );
+    memset( &parsed, 0x00, sizeof(parsed) );
+    if( json_extract( payload, (size_t)length, records[type].pFields, records[type].numFields, &extracted ) < 0 ||
+        cjsonDecode( (RECORD_TYPE)type, payload, (size_t)length, &parsed ) ||
+        !sameRecord( (RECORD_TYPE)type, &extracted, &parsed ) ){
+      printf( "%s: json_extract() and cJSON disagree\n", records[type].pFile );
+      return 1;
+    }
+
+    startNs = monotonic_ns();
+    for( i = 0; i < ITERATIONS; i++ ){
+      json_extract( payload, (size_t)length, records[type].pFields, records[type].numFields, &extracted );
+    }
+    wallNs = monotonic_ns() - startNs;
+    snprintf( label, sizeof(label), "json_extract %s (%ld B)", records[type].pFile, length );
+    bench_rate( label, ITERATIONS, wallNs, 0 );
+
+    startNs = monotonic_ns();
+    for( i = 0; i < ITERATIONS; i++ ) cjsonDecode( (RECORD_TYPE)type, payload, (size_t)length, &parsed );
+    wallNs = monotonic_ns() - startNs;
+    snprintf( label, sizeof(label), "cJSON        %s (%ld B)", records[type].pFile, length );
+    bench_rate( label, ITERATIONS, wallNs, 0 );
+  }
+  return 0;
+}
+
+/** End of jsonBench.c ***********************************************/
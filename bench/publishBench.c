@@ -0,0 +1,262 @@
+/********************************************************************
+
+  MQTT publish benchmark: outbox vs single send slot
+
+  Author: Markku Heiskari
+  Version history in github
+
+  (C) Copyright 2024, Creoir Oy
+
+  Publish latency of the outbox (mqtt_beginPublish() and
+  mqtt_endPublish() with the mqtt_sender() thread) against a copy of
+  the single shared send slot it replaced. The slot keeps the old
+  design: getMQTTsendAccess() takes the send mutex and, while the
+  previous message is unsent, lets go of it and sleeps 100 ms before
+  trying again; sendMQTTtopic() marks the slot unsent and signals
+  the sender thread, which publishes with QoS 2.
+
+  Two latencies are reported per message:
+  - call:     time the publishing thread spends in the publish calls
+  - handoff:  from the start of the publish call until the sender
+              thread calls mosquitto_publish()
+  mosquitto_publish() is the stand-in of benchMosquitto.c. The
+  publishing thread either sends bursts of BURST_SIZE messages, as an
+  event handler answering with several topics does, or one message
+  at a time at a steady rate.
+
+********************************************************************/
+
+/********************************************************************
+  INCLUDES
+********************************************************************/
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdatomic.h>
+#include <unistd.h>
+#include <pthread.h>
+#include "actionMain.h"
+#include "util.h"
+#include "mqttOutbox.h"
+#include "bench.h"
+
+/********************************************************************
+  DEFINES
+********************************************************************/
+#define BURSTS                  20
+#define BURST_SIZE              4
+#define BURST_GAP_MS            20          // From the start of a burst to the next one
+#define STEADY_MESSAGES         400
+#define STEADY_GAP_MS           5
+#define MAX_MESSAGES            STEADY_MESSAGES
+#define OLD_ACCESS_TRIES        100
+
+/********************************************************************
+  TYPES
+********************************************************************/
+
+// The shared send slot of the old design
+typedef struct
+{
+  char  topic[MQTT_SEND_TOPIC_SIZE];
+  char  payload[MQTT_SEND_PAYLOAD_SIZE];
+  int   dataSent;                   // 0=the slot holds an unsent message
+} OLD_SLOT_T;
+
+/********************************************************************
+  FILE SCOPE VARIABLES
+********************************************************************/
+
+extern globalData_type  *pGlobalData;
+
+static OLD_SLOT_T       oldSlot = { .dataSent = 1 };
+static pthread_mutex_t  oldMutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t   oldCond = PTHREAD_COND_INITIALIZER;
+static int              oldStop;
+
+static uint64_t         callSamples[MAX_MESSAGES];
+static uint64_t         handoffSamples[MAX_MESSAGES];
+static atomic_size_t    numHandoffs;
+
+
+/********************************************************************
+  FUNCTIONS
+********************************************************************/
+
+/********************************************************************
+  oldSender()
+
+  Parameters: (in)  Not used
+  Returns:    NULL
+
+  Description:
+  The old mqtt_sender(), minus the debug output and timing.
+
+********************************************************************/
+static void* oldSender( void *pArg ){
+  (void)pArg;
+  for(;;){
+    pthread_mutex_lock( &oldMutex );
+    if( 0 != oldSlot.dataSent ) pthread_cond_wait( &oldCond, &oldMutex );
+    if( oldStop ){
+      pthread_mutex_unlock( &oldMutex );
+      break;
+    }
+    mosquitto_publish( NULL, NULL, oldSlot.topic, (int)strlen( oldSlot.payload ), oldSlot.payload, 2, false );
+    oldSlot.dataSent = 1;
+    pthread_mutex_unlock( &oldMutex );
+  }
+  return NULL;
+} // End of oldSender()
+
+
+/********************************************************************
+  oldGetAccess() / oldSend()
+
+  The old getMQTTsendAccess() and sendMQTTtopic().
+
+********************************************************************/
+static int oldGetAccess( void ){
+  int i;
+
+  for( i = 0; i < OLD_ACCESS_TRIES; i++ ){
+    pthread_mutex_lock( &oldMutex );
+    if( 1 == oldSlot.dataSent ) return 0;
+    pthread_mutex_unlock( &oldMutex );
+    usleep( 100000U );
+  }
+  return -1;
+} // End of oldGetAccess()
+
+static void oldSend( void ){
+  oldSlot.dataSent = 0;
+  pthread_cond_signal( &oldCond );
+  pthread_mutex_unlock( &oldMutex );
+} // End of oldSend()
+
+
+/********************************************************************
+  published()
+
+  Parameters: (in)  Payload passed to mosquitto_publish()
+              (in)  Payload length
+  Returns:    void
+
+  Description:
+  bench_pfPublished. Takes the handoff latency from the time stamp
+  at the start of the payload.
+
+********************************************************************/
+static void published( const void *pPayload, int payloadLen ){
+  size_t i = atomic_fetch_add( &numHandoffs, 1 );
+
+  (void)payloadLen;
+  if( i < MAX_MESSAGES ) handoffSamples[i] = monotonic_ns() - strtoull( pPayload, NULL, 10 );
+} // End of published()
+
+
+/********************************************************************
+  publishOne()
+
+  Parameters: (in)  Nonzero: outbox, zero: old send slot
+  Returns:    Time spent in the publish calls in nanoseconds
+
+  Description:
+  Publishes a 200 byte answer whose payload starts with the
+  monotonic_ns() time of the call.
+
+********************************************************************/
+static uint64_t publishOne( int outbox ){
+  static const char  text[] = "{\"text\":\"The route to the northern checkpoint is clear. Two units are on the way and will report on arrival.\",\"voice\":\"en-GB\",\"volume\":80}";
+  MQTT_OUTMSG       *pMsg;
+  uint64_t           startNs = monotonic_ns();
+  int                len;
+
+  if( outbox ){
+    pMsg = mqtt_beginPublish( BENCH_TOPIC_QOS2, __FUNCTION__ );
+    if( NULL == pMsg ) return 0;
+    len = snprintf( pMsg->pPayload, MQTT_SEND_PAYLOAD_SIZE, "%020llu %s", (unsigned long long)startNs, text );
+    mqtt_endPublish( pMsg, len, __FUNCTION__ );
+  }else{
+    if( oldGetAccess() < 0 ) return 0;
+    snprintf( oldSlot.topic, sizeof(oldSlot.topic), "%s", BENCH_TOPIC_QOS2 );
+    snprintf( oldSlot.payload, sizeof(oldSlot.payload), "%020llu %s", (unsigned long long)startNs, text );
+    oldSend();
+  }
+  return monotonic_ns() - startNs;
+} // End of publishOne()
+
+
+/********************************************************************
+  run()
+
+  Parameters: (in)  Nonzero: outbox, zero: old send slot
+              (in)  Nonzero: bursts, zero: steady rate
+  Returns:    void
+
+********************************************************************/
+static void run( int outbox, int burst ){
+  char          label[96];
+  unsigned int  groups = burst ? BURSTS : STEADY_MESSAGES;
+  unsigned int  perGroup = burst ? BURST_SIZE : 1;
+  uint64_t      gapNs = (uint64_t)( burst ? BURST_GAP_MS : STEADY_GAP_MS ) * 1000000ULL;
+  uint64_t      next = monotonic_ns();
+  size_t        count = 0;
+  unsigned int  i, j;
+
+  atomic_store( &numHandoffs, 0 );
+  for( i = 0; i < groups; i++ ){
+    bench_sleepUntil( next );
+    for( j = 0; j < perGroup; j++ ) callSamples[count++] = publishOne( outbox );
+    next += gapNs;
+    if( next < monotonic_ns() ) next = monotonic_ns();
+  }
+  // Let the sender catch up
+  for( i = 0; i < 1000 && atomic_load( &numHandoffs ) < count; i++ ) usleep( 1000 );
+
+  snprintf( label, sizeof(label), "%s %s call", outbox ? "outbox" : "slot  ", burst ? "burst " : "steady" );
+  bench_report( label, callSamples, count );
+  snprintf( label, sizeof(label), "%s %s handoff", outbox ? "outbox" : "slot  ", burst ? "burst " : "steady" );
+  bench_report( label, handoffSamples, atomic_load( &numHandoffs ) < count ? atomic_load( &numHandoffs ) : count );
+} // End of run()
+
+
+/********************************************************************
+  main()
+
+  Parameters: void
+  Returns:    0=OK, 1=setup failed
+
+  Description:
+  The old send slot first, then the outbox. The outbox is set up
+  only after the old runs: its ack tracking ignores the acks of the
+  old sender while it has no slots.
+
+********************************************************************/
+int main( void ){
+  pthread_t thread;
+
+  bench_init();
+  bench_pfPublished = published;
+
+  printf( "# MQTT publish: outbox (%u slots) vs single send slot, bursts of %d every %d ms, steady every %d ms\n",
+          pGlobalData->outboxSize, BURST_SIZE, BURST_GAP_MS, STEADY_GAP_MS );
+  if( pthread_create( &thread, NULL, oldSender, NULL ) ) return 1;
+  run( 0, 1 );
+  run( 0, 0 );
+  pthread_mutex_lock( &oldMutex );
+  oldStop = 1;
+  oldSlot.dataSent = 0;
+  pthread_cond_signal( &oldCond );
+  pthread_mutex_unlock( &oldMutex );
+  pthread_join( thread, NULL );
+
+  // mqtt_sender() runs until the process exits
+  if( mqttOutbox_init( pGlobalData->outboxSize, 0 ) ) return 1;
+  if( pthread_create( &thread, NULL, mqtt_sender, NULL ) ) return 1;
+  run( 1, 1 );
+  run( 1, 0 );
+  return 0;
+}
+
+/** End of publishBench.c ********************************************/
@@ -0,0 +1,253 @@
+/********************************************************************
+
+  MQTT publish benchmark: QoS levels against a broker
+
+  Author: Markku Heiskari
+  Version history in github
+
+  (C) Copyright 2024, Creoir Oy
+
+  Publishes through the outbox and the mqtt_sender() thread to a
+  real broker with the publish policies of bench.c, one topic per
+  QoS level, and subscribes to the same topics. Per QoS it reports
+  - ack:        from mqtt_beginPublish() to the completion callback
+                (PUBACK for QoS 1, PUBCOMP for QoS 2, socket write
+                for QoS 0)
+  - round trip: from mqtt_beginPublish() until the message comes
+                back from the broker
+  for messages at a steady rate, and the delivered rate of a burst
+  published as fast as the outbox takes them, within the in-flight
+  window of MQTT_INFLIGHT_DEFAULT_WINDOW.
+
+  Links libmosquitto, not benchMosquitto.c. Broker address and port
+  are the optional arguments, default MQTT_HOST_ADDRESS and
+  MQTT_HOST_PORT. Without a broker the benchmark prints a note and
+  exits with 0, so "make bench" runs without one.
+
+********************************************************************/
+
+/********************************************************************
+  INCLUDES
+********************************************************************/
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <stdatomic.h>
+#include <unistd.h>
+#include <pthread.h>
+#include "mosquitto.h"
+#include "actionMain.h"
+#include "util.h"
+#include "mqttOutbox.h"
+#include "bench.h"
+
+/********************************************************************
+  DEFINES
+********************************************************************/
+#define STEADY_MESSAGES         2000
+#define STEADY_GAP_US           1000
+#define BURST_MESSAGES          10000
+#define MAX_MESSAGES            BURST_MESSAGES
+#define WAIT_MS                 5000        // Longest wait for the broker at each step
+
+/********************************************************************
+  FILE SCOPE VARIABLES
+********************************************************************/
+
+extern globalData_type  *pGlobalData;
+
+static atomic_int       connected;
+static atomic_int       subscribed;
+static const char      *pBenchTopic;      // Topic of the current run
+
+static uint64_t         startNs[MAX_MESSAGES];
+static uint64_t         ackSamples[MAX_MESSAGES];
+static uint64_t         tripSamples[MAX_MESSAGES];
+static atomic_size_t    numAcks;
+static atomic_size_t    numTrips;
+
+
+/********************************************************************
+  FUNCTIONS
+********************************************************************/
+
+/********************************************************************
+  libmosquitto callbacks
+
+  on_publish() passes acks to the outbox like the application's own.
+  on_message() takes the round trip time from the time stamp at the
+  start of the payload.
+
+********************************************************************/
+static void on_connect( struct mosquitto *mosq, void *obj, int reason_code ){
+  if( 0 == reason_code ) atomic_store( &connected, 1 );
+} // End of on_connect()
+
+static void on_subscribe( struct mosquitto *mosq, void *obj, int mid, int qos_count, const int *granted_qos ){
+  atomic_store( &subscribed, 1 );
+} // End of on_subscribe()
+
+static void on_publish( struct mosquitto *mosq, void *obj, int mid ){
+  mqttOutbox_acked( mid );
+} // End of on_publish()
+
+static void on_message( struct mosquitto *mosq, void *obj, const struct mosquitto_message *msg ){
+  char    stamp[21];
+  size_t  i;
+
+  if( NULL == pBenchTopic || strcmp( msg->topic, pBenchTopic ) || msg->payloadlen < 20 ) return;
+  memcpy( stamp, msg->payload, 20 );
+  stamp[20] = '\0';
+  i = atomic_fetch_add( &numTrips, 1 );
+  if( i < MAX_MESSAGES ) tripSamples[i] = monotonic_ns() - strtoull( stamp, NULL, 10 );
+} // End of on_message()
+
+
+/********************************************************************
+  published()
+
+  Parameters: See MQTT_PUBLISH_DONE
+  Returns:    void
+
+  Description:
+  Completion callback of the benchmark messages. pUser points to the
+  start time of the message.
+
+********************************************************************/
+static void published( void *pUser, int mid, MQTT_PUBLISH_RESULT result ){
+  size_t i;
+
+  if( MQTT_PUBLISH_ACKED != result ) return;
+  i = atomic_fetch_add( &numAcks, 1 );
+  if( i < MAX_MESSAGES ) ackSamples[i] = monotonic_ns() - *(const uint64_t*)pUser;
+} // End of published()
+
+
+/********************************************************************
+  waitFor()
+
+  Parameters: (in)  Flag or counter
+              (in)  Value to wait for
+  Returns:    Nonzero if reached within WAIT_MS
+
+********************************************************************/
+static int waitFor( atomic_size_t *pCount, size_t target ){
+  int i;
+
+  for( i = 0; i < WAIT_MS && atomic_load( pCount ) < target; i++ ) usleep( 1000 );
+  return atomic_load( pCount ) >= target;
+} // End of waitFor()
+
+
+/********************************************************************
+  run()
+
+  Parameters: (in)  Topic with the QoS policy to measure
+              (in)  Nonzero: burst, zero: steady rate
+  Returns:    void
+
+********************************************************************/
+static void run( const char *pTopic, int burst ){
+  MQTT_OUTMSG  *pMsg;
+  char          label[96];
+  size_t        count = burst ? BURST_MESSAGES : STEADY_MESSAGES;
+  size_t        i;
+  uint64_t      next, wallNs, cpuNs;
+
+  pBenchTopic = pTopic;
+  atomic_store( &numAcks, 0 );
+  atomic_store( &numTrips, 0 );
+  cpuNs = bench_cpuNs();
+  next = monotonic_ns();
+  for( i = 0; i < count; i++ ){
+    if( !burst ){
+      bench_sleepUntil( next );
+      next += STEADY_GAP_US * 1000ULL;
+    }
+    startNs[i] = monotonic_ns();
+    pMsg = mqtt_beginPublish( pTopic, __FUNCTION__ );
+    if( NULL == pMsg ) break;
+    pMsg->pfDone = published;
+    pMsg->pUser = &startNs[i];
+    mqtt_endPublish( pMsg, snprintf( pMsg->pPayload, MQTT_SEND_PAYLOAD_SIZE,
+                     "%020llu {\"bench\":\"%s\",\"seq\":%zu}", (unsigned long long)startNs[i], pTopic, i ), __FUNCTION__ );
+  }
+  if( !waitFor( &numTrips, i ) ) printf( "%s: %zu of %zu messages came back\n", pTopic, atomic_load( &numTrips ), i );
+  waitFor( &numAcks, i );
+  wallNs = monotonic_ns() - startNs[0];
+  cpuNs = bench_cpuNs() - cpuNs;
+  pBenchTopic = NULL;
+
+  if( burst ){
+    snprintf( label, sizeof(label), "%s burst", pTopic );
+    bench_rate( label, atomic_load( &numTrips ), wallNs, cpuNs );
+  }else{
+    snprintf( label, sizeof(label), "%s ack", pTopic );
+    bench_report( label, ackSamples, atomic_load( &numAcks ) < i ? atomic_load( &numAcks ) : i );
+    snprintf( label, sizeof(label), "%s round trip", pTopic );
+    bench_report( label, tripSamples, atomic_load( &numTrips ) < i ? atomic_load( &numTrips ) : i );
+  }
+} // End of run()
+
+
+/********************************************************************
+  main()
+
+  Parameters: (in)  [broker address] [port]
+  Returns:    0=OK or no broker, 1=setup failed
+
+********************************************************************/
+int main( int argc, char *argv[] ){
+  static const char *topics[] = { BENCH_TOPIC_QOS0, BENCH_TOPIC_QOS1, BENCH_TOPIC_QOS2 };
+  const char        *pHost = ( argc > 1 ) ? argv[1] : MQTT_HOST_ADDRESS;
+  int                port = atoi( ( argc > 2 ) ? argv[2] : MQTT_HOST_PORT );
+  struct mosquitto  *mosq;
+  pthread_t          thread;
+  size_t             i;
+  int                rc;
+
+  bench_init();
+  mosquitto_lib_init();
+  mosq = mosquitto_new( NULL, true, NULL );
+  if( NULL == mosq ) return 1;
+  mosquitto_connect_callback_set( mosq, on_connect );
+  mosquitto_subscribe_callback_set( mosq, on_subscribe );
+  mosquitto_publish_callback_set( mosq, on_publish );
+  mosquitto_message_callback_set( mosq, on_message );
+  mosquitto_max_inflight_messages_set( mosq, MQTT_INFLIGHT_DEFAULT_WINDOW );
+
+  rc = mosquitto_connect( mosq, pHost, port, 60 );
+  if( MOSQ_ERR_SUCCESS != rc ){
+    printf( "# MQTT QoS: no broker at %s:%d (%s), skipped\n", pHost, port, mosquitto_strerror( rc ) );
+    mosquitto_destroy( mosq );
+    mosquitto_lib_cleanup();
+    return 0;
+  }
+  pGlobalData->mosquittoClient = mosq;
+  if( MOSQ_ERR_SUCCESS != mosquitto_loop_start( mosq ) ) return 1;
+  for( i = 0; i < WAIT_MS && !atomic_load( &connected ); i++ ) usleep( 1000 );
+  if( !atomic_load( &connected ) ){
+    printf( "# MQTT QoS: broker at %s:%d did not accept the connection, skipped\n", pHost, port );
+    return 0;
+  }
+  mosquitto_subscribe( mosq, NULL, "bench/#", 2 );
+  for( i = 0; i < WAIT_MS && !atomic_load( &subscribed ); i++ ) usleep( 1000 );
+
+  // mqtt_sender() runs until the process exits
+  if( mqttOutbox_init( pGlobalData->outboxSize, MQTT_INFLIGHT_DEFAULT_WINDOW ) ) return 1;
+  if( pthread_create( &thread, NULL, mqtt_sender, NULL ) ) return 1;
+
+  printf( "# MQTT QoS: broker %s:%d, steady every %d us, burst of %d, in-flight window %d\n",
+          pHost, port, STEADY_GAP_US, BURST_MESSAGES, MQTT_INFLIGHT_DEFAULT_WINDOW );
+  for( i = 0; i < sizeof(topics) / sizeof(topics[0]); i++ ){
+    run( topics[i], 0 );
+    run( topics[i], 1 );
+  }
+
+  mosquitto_disconnect( mosq );
+  mosquitto_loop_stop( mosq, false );
+  return 0;
+}
+
+/** End of qosBench.c ************************************************/
@@ -0,0 +1,202 @@
+/********************************************************************
+
+  Inbound topic routing benchmark: router vs linear scan
+
+  Author: Markku Heiskari
+  Version history in github
+
+  (C) Copyright 2024, Creoir Oy
+
+  Lookup cost of mqttRouter_match() against the loop of the old
+  on_message(), which called mqtt_topic_compare() for every entry of
+  the action register, with registers of 5, 100 and 1000 topics.
+
+  The register holds the five topics of mqttActionRegister and, in
+  the larger ones, device topics "creoir/devNNN/sensorN" of which
+  every tenth is a "creoir/devNNN/#" filter. The received topics are
+  a fixed mix: a quarter each of the application's own topics, exact
+  device topics, topics under a device filter and topics no entry
+  matches. Both lookups must find the same number of handlers.
+
+********************************************************************/
+
+/********************************************************************
+  INCLUDES
+********************************************************************/
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "actionMain.h"
+#include "util.h"
+#include "mqttRouter.h"
+#include "bench.h"
+
+/********************************************************************
+  DEFINES
+********************************************************************/
+#define MAX_ENTRIES             1000
+#define TOPIC_LENGTH            64
+#define RECEIVED_TOPICS         1024        // Distinct received topics, a power of two
+#define LOOKUPS                 200000
+
+/********************************************************************
+  FILE SCOPE VARIABLES
+********************************************************************/
+
+static const char *appTopics[] = {
+  "creoir/asr/wakewordDetected",
+  "creoir/asr/intentRecognized",
+  "creoir/asr/intentNotRecognized",
+  "creoir/biometrics/identification",
+  "creoir/app/stop",
+};
+#define APP_TOPICS              ( (unsigned int)( sizeof(appTopics) / sizeof(appTopics[0]) ) )
+
+static char             entryTopics[MAX_ENTRIES][TOPIC_LENGTH];
+static mqtt_action      entries[MAX_ENTRIES];
+static char             received[RECEIVED_TOPICS][TOPIC_LENGTH];
+
+
+/********************************************************************
+  FUNCTIONS
+********************************************************************/
+
+/********************************************************************
+  handler()
+
+  Handler of every entry. Never called.
+
+********************************************************************/
+static int handler( const char *pTopic, EVENTPAYLOAD_T *pPayload ){
+  (void)pTopic;
+  (void)pPayload;
+  return 0;
+} // End of handler()
+
+
+/********************************************************************
+  buildRegister()
+
+  Parameters: (in)  Number of entries
+  Returns:    void
+
+  Description:
+  Fills entries and the received topics for a register of the given
+  size. Device d has entry APP_TOPICS + d.
+
+********************************************************************/
+static void buildRegister( unsigned int count ){
+  unsigned int devices = count - APP_TOPICS;
+  unsigned int i, pick, seed = 12345;
+
+  for( i = 0; i < count; i++ ){
+    if( i < APP_TOPICS ) snprintf( entryTopics[i], TOPIC_LENGTH, "%s", appTopics[i] );
+    else if( 0 == ( i - APP_TOPICS ) % 10 ) snprintf( entryTopics[i], TOPIC_LENGTH, "creoir/dev%03u/#", i - APP_TOPICS );
+    else snprintf( entryTopics[i], TOPIC_LENGTH, "creoir/dev%03u/sensor%u", i - APP_TOPICS, i % 7 );
+    entries[i].topic = entryTopics[i];
+    entries[i].function = handler;
+  }
+
+  for( i = 0; i < RECEIVED_TOPICS; i++ ){
+    seed = seed * 1103515245u + 12345u;
+    pick = ( seed >> 8 ) % ( devices ? devices : 1 );
+    switch( i % 4 ){
+      case 0:
+        snprintf( received[i], TOPIC_LENGTH, "%s", appTopics[ ( seed >> 4 ) % APP_TOPICS ] );
+        break;
+      case 1:   // Exact device topic, or the filter's device
+        if( devices && ( pick % 10 ) ) snprintf( received[i], TOPIC_LENGTH, "creoir/dev%03u/sensor%u", pick, ( pick + APP_TOPICS ) % 7 );
+        else snprintf( received[i], TOPIC_LENGTH, "creoir/dev%03u/sensor9", pick );
+        break;
+      case 2:   // Under a device filter
+        snprintf( received[i], TOPIC_LENGTH, "creoir/dev%03u/state/battery", devices ? pick - pick % 10 : 0 );
+        break;
+      default:
+        snprintf( received[i], TOPIC_LENGTH, "creoir/unknown/topic%u", pick );
+        break;
+    }
+  }
+} // End of buildRegister()
+
+
+/********************************************************************
+  linearMatch()
+
+  Parameters: (in)  Received topic
+              (in)  Entries in the register
+  Returns:    Number of matching entries
+
+  Description:
+  The loop of the old on_message().
+
+********************************************************************/
+static int linearMatch( const char *pTopic, unsigned int count ){
+  unsigned int i;
+  int          matches = 0;
+
+  for( i = 0; i < count; i++ ){
+    if( 1 == mqtt_topic_compare( entries[i].topic, pTopic ) && matches < MQTT_ROUTER_MAX_MATCHES ) matches++;
+  }
+  return matches;
+} // End of linearMatch()
+
+
+/********************************************************************
+  run()
+
+  Parameters: (in)  Entries in the register
+  Returns:    0=OK, 1=the lookups disagree or the router failed
+
+********************************************************************/
+static int run( unsigned int count ){
+  MQTT_ROUTE_HANDLER pHandlers[MQTT_ROUTER_MAX_MATCHES];
+  char               label[96];
+  unsigned long      linearHits = 0, routerHits = 0;
+  uint64_t           startNs, wallNs;
+  unsigned int       i;
+
+  buildRegister( count );
+  if( mqttRouter_build( entries, count ) ) return 1;
+
+  startNs = monotonic_ns();
+  for( i = 0; i < LOOKUPS; i++ ) linearHits += linearMatch( received[ i & ( RECEIVED_TOPICS - 1 ) ], count );
+  wallNs = monotonic_ns() - startNs;
+  snprintf( label, sizeof(label), "linear scan %4u topics", count );
+  bench_rate( label, LOOKUPS, wallNs, 0 );
+
+  startNs = monotonic_ns();
+  for( i = 0; i < LOOKUPS; i++ ){
+    routerHits += mqttRouter_match( received[ i & ( RECEIVED_TOPICS - 1 ) ], pHandlers, MQTT_ROUTER_MAX_MATCHES );
+  }
+  wallNs = monotonic_ns() - startNs;
+  snprintf( label, sizeof(label), "router      %4u topics", count );
+  bench_rate( label, LOOKUPS, wallNs, 0 );
+
+  mqttRouter_destroy();
+  if( linearHits != routerHits ){
+    printf( "%u topics: linear scan found %lu handlers, router %lu\n", count, linearHits, routerHits );
+    return 1;
+  }
+  return 0;
+} // End of run()
+
+
+/********************************************************************
+  main()
+
+  Parameters: void
+  Returns:    0=OK, 1=the lookups disagree
+
+********************************************************************/
+int main( void ){
+  int errors = 0;
+
+  bench_init();
+  printf( "# Topic routing: mqttRouter_match() vs linear mqtt_topic_compare() scan, %d lookups\n", LOOKUPS );
+  errors += run( APP_TOPICS );
+  errors += run( 100 );
+  errors += run( MAX_ENTRIES );
+  return errors ? 1 : 0;
+}
+
+/** End of routerBench.c *********************************************/
@@ -0,0 +1,272 @@
+/********************************************************************
+
+  Event dispatch benchmark: worker threads
+
+  Author: Markku Heiskari
+  Version history in github
+
+  (C) Copyright 2024, Creoir Oy
+
+  Event throughput with 1, 2, 4 and 8 dispatch threads
+  (--eventWorkers). Every worker has a queue of its own and events
+  are routed to them as routeEvent() in actionMain.c does: by event
+  type and the FNV-1a hash of the coalescing key, so events of one
+  type and key stay in order on one thread.
+
+  Two kinds of traffic are measured:
+  - keyed:  biometric identifications of 32 speakers, which spread
+            over the workers by speaker
+  - mixed:  the same, interleaved with intents, rejections and
+            wakewords, which carry no key and so each stay on one
+            worker
+  and two kinds of handler:
+  - cpu:    spins HANDLER_CPU_NS, like JSON parsing and building the
+            reply. Scales only up to the number of CPUs.
+  - wait:   spins HANDLER_WAIT_CPU_NS and then sleeps HANDLER_WAIT_NS,
+            like a handler waiting on the CSDK or a blocking publish.
+
+  Events are pushed without a key, so none of them coalesce, but are
+  routed with the hash of the key they would carry. The main thread
+  is the only producer, as the MQTT thread is in the application.
+
+********************************************************************/
+
+/********************************************************************
+  INCLUDES
+********************************************************************/
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <pthread.h>
+#include "actionMain.h"
+#include "util.h"
+#include "eventQueue.h"
+#include "eventPayload.h"
+#include "bench.h"
+
+/********************************************************************
+  DEFINES
+********************************************************************/
+#define MAX_WORKERS             8
+#define SPEAKERS                32
+#define CPU_EVENTS              20000       // Events of a cpu handler run
+#define WAIT_EVENTS             10000       // Events of a wait handler run
+#define HANDLER_CPU_NS          20000
+#define HANDLER_WAIT_CPU_NS     2000
+#define HANDLER_WAIT_NS         100000
+#define PAYLOAD_LENGTH          64
+
+/********************************************************************
+  TYPES
+********************************************************************/
+
+typedef struct
+{
+  EVENTQUEUE_T  *pQueue;
+  unsigned int   events;            // Events routed to this worker
+  uint64_t       cpuNs;             // Handler spin per event
+  uint64_t       waitNs;            // Handler sleep per event
+} WORKER_T;
+
+/********************************************************************
+  FILE SCOPE VARIABLES
+********************************************************************/
+
+static WORKER_T         workers[MAX_WORKERS];
+static unsigned int     speakerHash[SPEAKERS];
+static unsigned char   *pSpeaker;         // Speaker of each event, SPEAKERS=no key
+static APPLICATION_EVENT *pType;          // Type of each event
+
+
+/********************************************************************
+  FUNCTIONS
+********************************************************************/
+
+/********************************************************************
+  routeIndex()
+
+  Parameters: (in)  Event
+              (in)  Hash of the event key, 0 if none
+              (in)  Number of workers
+  Returns:    Index of the worker queue
+
+  Description:
+  The routing of routeEvent() in actionMain.c.
+
+********************************************************************/
+static unsigned int routeIndex( APPLICATION_EVENT event, unsigned int keyHash, unsigned int numWorkers ){
+  if( numWorkers <= 1 ) return 0;
+  return ( (unsigned int)event * 2654435761u ^ keyHash ) % numWorkers;
+} // End of routeIndex()
+
+
+/********************************************************************
+  worker()
+
+  Parameters: (in)  WORKER_T
+  Returns:    NULL
+
+  Description:
+  Dispatch loop of one worker, like runEventQueue(): drains the queue
+  in batches and runs the handler for each event.
+
+********************************************************************/
+static void* worker( void *pArg ){
+  WORKER_T        *pWorker = pArg;
+  EVENTITEM_T      items[EVQ_BATCH_MAX];
+  struct timespec  ts;
+  unsigned int     done = 0;
+  int              i, n;
+
+  ts.tv_sec = 0;
+  ts.tv_nsec = (long)pWorker->waitNs;
+  while( done < pWorker->events ){
+    n = eventQueue_popBatch( pWorker->pQueue, items, EVQ_BATCH_MAX );
+    for( i = 0; i < n; i++ ){
+      eventPayload_release( items[i].eventData.pPayload );
+      bench_spin( pWorker->cpuNs );
+      if( pWorker->waitNs ) nanosleep( &ts, NULL );
+    }
+    done += n;
+  }
+  return NULL;
+} // End of worker()
+
+
+/********************************************************************
+  buildTraffic()
+
+  Parameters: (in)  Nonzero: mixed traffic, zero: keyed only
+              (in)  Number of events
+  Returns:    void
+
+  Description:
+  Fills pType with the event types and pSpeaker with the speaker of
+  each event.
+
+********************************************************************/
+static void buildTraffic( int mixed, unsigned int events ){
+  static const APPLICATION_EVENT unkeyed[] = { EVT_MQTT_INTENT_RECOGNIZED, EVT_MQTT_INTENT_NOT_RECOGNIZED, EVT_MQTT_WAKEWORD };
+  unsigned int i;
+
+  for( i = 0; i < events; i++ ){
+    if( mixed && ( i % 4 ) ){
+      pType[i] = unkeyed[ i % 4 - 1 ];
+      pSpeaker[i] = SPEAKERS;
+    }else{
+      pType[i] = EVT_MQTT_BIOM_IDENTIFICATION;
+      pSpeaker[i] = (unsigned char)( ( i * 7 ) % SPEAKERS );
+    }
+  }
+} // End of buildTraffic()
+
+
+/********************************************************************
+  run()
+
+  Parameters: (in)  Number of workers
+              (in)  Nonzero: mixed traffic, zero: keyed only
+              (in)  Nonzero: wait handler, zero: cpu handler
+              (in)  Wall time of the 1 worker run, 0=this is it
+  Returns:    Wall time in nanoseconds
+
+********************************************************************/
+static uint64_t run( unsigned int numWorkers, int mixed, int wait, uint64_t baseNs ){
+  pthread_t              threads[MAX_WORKERS];
+  unsigned char          route[CPU_EVENTS];
+  APPLICATION_EVENTDATA  eventData;
+  char                   text[PAYLOAD_LENGTH];
+  char                   label[96];
+  unsigned int           events = wait ? WAIT_EVENTS : CPU_EVENTS;
+  unsigned int           i, keyHash;
+  uint64_t               startNs, wallNs, cpuNs;
+
+  buildTraffic( mixed, events );
+  for( i = 0; i < numWorkers; i++ ){
+    workers[i].events = 0;
+    workers[i].cpuNs = wait ? HANDLER_WAIT_CPU_NS : HANDLER_CPU_NS;
+    workers[i].waitNs = wait ? HANDLER_WAIT_NS : 0;
+  }
+  for( i = 0; i < events; i++ ){
+    keyHash = ( SPEAKERS == pSpeaker[i] ) ? 0 : speakerHash[ pSpeaker[i] ];
+    route[i] = (unsigned char)routeIndex( pType[i], keyHash, numWorkers );
+    workers[ route[i] ].events++;
+  }
+  memset( text, 'x', sizeof(text) );
+
+  startNs = monotonic_ns();
+  cpuNs = bench_cpuNs();
+  for( i = 0; i < numWorkers; i++ ) pthread_create( &threads[i], NULL, worker, &workers[i] );
+  for( i = 0; i < events; i++ ){
+    memset( &eventData, 0x00, sizeof(eventData) );
+    eventData.pPayload = eventPayload_create( text, sizeof(text) );
+    eventQueue_push( workers[ route[i] ].pQueue, pType[i], &eventData );
+  }
+  for( i = 0; i < numWorkers; i++ ) pthread_join( threads[i], NULL );
+  wallNs = monotonic_ns() - startNs;
+  cpuNs = bench_cpuNs() - cpuNs;
+
+  snprintf( label, sizeof(label), "%s %s %u worker%s", mixed ? "mixed" : "keyed", wait ? "wait" : "cpu ",
+            numWorkers, 1 == numWorkers ? "" : "s" );
+  bench_rate( label, events, wallNs, cpuNs );
+  printf( "%-44s speedup %.2f\n", "", baseNs ? (double)baseNs / wallNs : 1.0 );
+  return wallNs;
+} // End of run()
+
+
+/********************************************************************
+  main()
+
+  Parameters: void
+  Returns:    0=OK, 1=setup failed
+
+  Description:
+  Each traffic and handler kind with 1, 2, 4 and 8 workers.
+
+********************************************************************/
+int main( void ){
+  static const APPLICATION_EVENT types[] = { EVT_MQTT_INTENT_RECOGNIZED, EVT_MQTT_INTENT_NOT_RECOGNIZED, EVT_MQTT_WAKEWORD, EVT_MQTT_BIOM_IDENTIFICATION };
+  char          key[16];
+  const char   *p;
+  unsigned int  i, j, numWorkers;
+  uint64_t      baseNs;
+  int           mixed, wait;
+
+  bench_init();
+  eventPayload_initPool( PAYLOAD_POOL_DEFAULT_BLOCKS, PAYLOAD_POOL_DEFAULT_BLOCKSIZE, PAYLOAD_FALLBACK_HEAP );
+  pSpeaker = malloc( CPU_EVENTS );
+  pType = malloc( sizeof(APPLICATION_EVENT) * CPU_EVENTS );
+  if( NULL == pSpeaker || NULL == pType ) return 1;
+  for( i = 0; i < MAX_WORKERS; i++ ){
+    workers[i].pQueue = eventQueue_create( EVQ_DEFAULT_CAPACITY );
+    if( NULL == workers[i].pQueue ) return 1;
+    for( j = 0; j < sizeof(types) / sizeof(types[0]); j++ ) eventQueue_setOverflow( workers[i].pQueue, types[j], EVQ_OVERFLOW_BLOCK );
+  }
+  // The hash of pushEventKeyed()
+  for( i = 0; i < SPEAKERS; i++ ){
+    snprintf( key, sizeof(key), "speaker%02u", i );
+    speakerHash[i] = 2166136261u;
+    for( p = key; *p; p++ ) speakerHash[i] = ( speakerHash[i] ^ (unsigned char)*p ) * 16777619u;
+  }
+
+  printf( "# Event workers: %ld CPUs online, cpu handler %d ns, wait handler %d ns + %d ns sleep\n",
+          sysconf( _SC_NPROCESSORS_ONLN ), HANDLER_CPU_NS, HANDLER_WAIT_CPU_NS, HANDLER_WAIT_NS );
+  for( mixed = 0; mixed <= 1; mixed++ ){
+    for( wait = 0; wait <= 1; wait++ ){
+      baseNs = 0;
+      for( numWorkers = 1; numWorkers <= MAX_WORKERS; numWorkers *= 2 ){
+        if( 0 == baseNs ) baseNs = run( numWorkers, mixed, wait, 0 );
+        else run( numWorkers, mixed, wait, baseNs );
+      }
+    }
+  }
+
+  for( i = 0; i < MAX_WORKERS; i++ ) eventQueue_destroy( workers[i].pQueue );
+  free( pSpeaker );
+  free( pType );
+  return 0;
+}
+
+/** End of workersBench.c ********************************************/
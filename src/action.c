@@ -21,13 +21,19 @@
 #include <windows.h>
 #endif
 #include <string.h>
+#include <stddef.h>
+#include <stdatomic.h>
 #include "actionMain.h"
 #include "util.h"
 #include "action.h"
+#include "eventQueue.h"
+#include "eventPayload.h"
+#include "mqttOutbox.h"
 
 /********************************************************************
   DEFINES
 ********************************************************************/
+#define FIELD_BIT(i)                      ( 1 << (i) ) //!< json_extract() result bit of a field table index
 
 
 /********************************************************************
@@ -36,6 +42,86 @@
 
 extern globalData_type  *pGlobalData;
 
+/* Field tables of the inbound records for json_extract(). The index enums give the result bits. */
+enum { SLOT_FIELD_NAME, SLOT_FIELD_VALUE, SLOT_FIELDS };
+static const JSON_FIELD slotFields[SLOT_FIELDS] =
+{
+  [SLOT_FIELD_NAME]  = { .pName = JSONKEY_SLOTNAME,  .type = JSON_FIELD_STRING, .offset = offsetof(ASR_SLOT_T, name),  .size = ASR_NAME_SIZE },
+  [SLOT_FIELD_VALUE] = { .pName = JSONKEY_SLOTVALUE, .type = JSON_FIELD_TEXT,   .offset = offsetof(ASR_SLOT_T, value), .size = ASR_TEXT_SIZE },
+};
+
+enum { INTENT_FIELD_INTENT, INTENT_FIELD_CONFIDENCE, INTENT_FIELD_SLOTS, INTENT_FIELDS };
+static const JSON_FIELD intentFields[INTENT_FIELDS] =
+{
+  [INTENT_FIELD_INTENT]     = { .pName = JSONKEY_INTENT,     .type = JSON_FIELD_STRING, .offset = offsetof(ASR_INTENT_T, intent),     .size = ASR_NAME_SIZE },
+  [INTENT_FIELD_CONFIDENCE] = { .pName = JSONKEY_CONFIDENCE, .type = JSON_FIELD_INT,    .offset = offsetof(ASR_INTENT_T, confidence) },
+  [INTENT_FIELD_SLOTS]      = { .pName = JSONKEY_SLOTS,      .type = JSON_FIELD_ARRAY,  .offset = offsetof(ASR_INTENT_T, slots),      .size = sizeof(ASR_SLOT_T),
+                                .required = FIELD_BIT(SLOT_FIELD_NAME), .pItems = slotFields, .numItems = SLOT_FIELDS,
+                                .countOffset = offsetof(ASR_INTENT_T, numSlots), .maxCount = ASR_MAX_SLOTS },
+};
+
+enum { REJECTION_FIELD_CODE, REJECTION_FIELD_TEXT, REJECTION_FIELD_INTENT, REJECTION_FIELD_CONFIDENCE, REJECTION_FIELDS };
+static const JSON_FIELD rejectionFields[REJECTION_FIELDS] =
+{
+  [REJECTION_FIELD_CODE]       = { .pName = JSONKEY_REASONCODE, .type = JSON_FIELD_INT,  .offset = offsetof(ASR_REJECTION_T, reasonCode) },
+  [REJECTION_FIELD_TEXT]       = { .pName = JSONKEY_REASONTEXT, .type = JSON_FIELD_TEXT, .offset = offsetof(ASR_REJECTION_T, reasonText), .size = ASR_TEXT_SIZE },
+  [REJECTION_FIELD_INTENT]     = { .pName = JSONKEY_INTENT,     .type = JSON_FIELD_TEXT, .offset = offsetof(ASR_REJECTION_T, intent),     .size = ASR_NAME_SIZE },
+  [REJECTION_FIELD_CONFIDENCE] = { .pName = JSONKEY_CONFIDENCE, .type = JSON_FIELD_INT,  .offset = offsetof(ASR_REJECTION_T, confidence) },
+};
+
+enum { IDENTIFICATION_FIELD_NAME, IDENTIFICATION_FIELD_SCORE, IDENTIFICATION_FIELDS };
+static const JSON_FIELD identificationFields[IDENTIFICATION_FIELDS] =
+{
+  [IDENTIFICATION_FIELD_NAME]  = { .pName = JSONKEY_NAME,  .type = JSON_FIELD_STRING, .offset = offsetof(BIOM_IDENTIFICATION_T, name),  .size = ASR_NAME_SIZE },
+  [IDENTIFICATION_FIELD_SCORE] = { .pName = JSONKEY_SCORE, .type = JSON_FIELD_INT,    .offset = offsetof(BIOM_IDENTIFICATION_T, score) },
+};
+
+/* Fixed outbound messages. Serialized once by action_init(). */
+static const struct
+{
+  const char *pTopic;
+  const char *pMember;
+  const char *pValue;
+} promptSource[PROMPT_COUNT] = {
+  [PROMPT_SPEECH_STOP]                = { "creoir/talk/stop",  "reason",    "bargeIn" },
+  [PROMPT_WAKEUP_CHIME]               = { "creoir/talk/speak", "file",      "/usr/share/creoir/wakeup.wav" },
+  [PROMPT_STARTUP_CHIME]              = { "creoir/talk/speak", "file",      "/usr/share/creoir/startup.wav" },
+  [PROMPT_LOW_CONFIDENCE_CHIME]       = { "creoir/talk/speak", "file",      "/usr/share/creoir/low_confidence.wav" },
+  [PROMPT_TSP_DUMP_SAVED]             = { "creoir/talk/speak", "utterance", "Tactical situation dump saved." },
+  [PROMPT_MAIN_DISPLAY_DUMP_SAVED]    = { "creoir/talk/speak", "utterance", "Main display dump saved." },
+  [PROMPT_SHIP_SETTINGS]              = { "creoir/talk/speak", "utterance", "Ship settings available at left side display." },
+  [PROMPT_DISPLAY_PATTERNS_ENABLED]   = { "creoir/talk/speak", "utterance", "Display patterns enabled." },
+  [PROMPT_DISPLAY_PATTERNS_DISABLED]  = { "creoir/talk/speak", "utterance", "Display patterns disabled." },
+  [PROMPT_ROUTES_VISIBLE]             = { "creoir/talk/speak", "utterance", "Routes are now visible." },
+  [PROMPT_ROUTES_HIDDEN]              = { "creoir/talk/speak", "utterance", "Routes are now hidden." },
+  [PROMPT_MAP_NORTH_UP]               = { "creoir/talk/speak", "utterance", "Map orientation is north up." },
+  [PROMPT_MAP_HEADING_UP]             = { "creoir/talk/speak", "utterance", "Map orientation is ship heading up." },
+  [PROMPT_TRUE_MOTION]                = { "creoir/talk/speak", "utterance", "True motion mode on map is active." },
+  [PROMPT_RANGE_RINGS_ENABLED]        = { "creoir/talk/speak", "utterance", "Map range rings enabled." },
+  [PROMPT_RANGE_RINGS_HIDDEN]         = { "creoir/talk/speak", "utterance", "Map range rings hidden." },
+  [PROMPT_RANGE_RINGS_DISABLED]       = { "creoir/talk/speak", "utterance", "Map range rings disabled." },
+  [PROMPT_BEARING_SCALE_ENABLED]      = { "creoir/talk/speak", "utterance", "Bearing scale range enabled." },
+  [PROMPT_BEARING_SCALE_HIDDEN]       = { "creoir/talk/speak", "utterance", "Bearing scale range hidden." },
+  [PROMPT_BEARING_SCALE_DISABLED]     = { "creoir/talk/speak", "utterance", "Bearing scale range disabled." },
+  [PROMPT_DAY_MODE]                   = { "creoir/talk/speak", "utterance", "Day mode activated." },
+  [PROMPT_DUSK_MODE]                  = { "creoir/talk/speak", "utterance", "Dusk mode activated." },
+  [PROMPT_NIGHT_MODE]                 = { "creoir/talk/speak", "utterance", "Night mode activated." },
+  [PROMPT_MAP_CENTERED]               = { "creoir/talk/speak", "utterance", "Map center set to ship position." },
+  [PROMPT_TACTICAL_FIGURES_SHOWN]     = { "creoir/talk/speak", "utterance", "Tactical figures shown." },
+  [PROMPT_TACTICAL_FIGURES_HIDDEN]    = { "creoir/talk/speak", "utterance", "Tactical figures hidden." },
+  [PROMPT_SMALL_MAP]                  = { "creoir/talk/speak", "utterance", "Changed to small map window size." },
+  [PROMPT_FULL_MAP]                   = { "creoir/talk/speak", "utterance", "Changed to full map window size." },
+  [PROMPT_ACTIVE_WINDOW_SAVED]        = { "creoir/talk/speak", "utterance", "Active window saved." },
+  [PROMPT_WINDOWS_MINIMIZED]          = { "creoir/talk/speak", "utterance", "All windows minimized." },
+  [PROMPT_WINDOWS_SHOWN]              = { "creoir/talk/speak", "utterance", "All windows shown." },
+  [PROMPT_PATTERNS_ENABLED]           = { "creoir/talk/speak", "utterance", "Patterns enabled." },
+  [PROMPT_PATTERNS_DISABLED]          = { "creoir/talk/speak", "utterance", "Patterns disabled." },
+  [PROMPT_ROUTE_DISPLAY_ENABLED]      = { "creoir/talk/speak", "utterance", "Route display enabled." },
+  [PROMPT_ROUTE_DISPLAY_DISABLED]     = { "creoir/talk/speak", "utterance", "Route display disabled." },
+};
+
+static MQTT_STATIC_MSG promptCache[PROMPT_COUNT];
+
 
 /********************************************************************
   FUNCTIONS
@@ -55,45 +141,84 @@ extern globalData_type  *pGlobalData;
 
 ********************************************************************/
 int postSampleMessage( const char *pString ){
-  char  *pPayload;
-  cJSON *jsonString;
-  cJSON *jsonSomeNumber;
-  cJSON *jsonAnotherString;
-  cJSON *jsonPayload;
-
-  jsonString = cJSON_CreateString( pString );
-  jsonSomeNumber = cJSON_CreateNumber( 1024 );
-  jsonAnotherString = cJSON_CreateString( "lorem ipsum" );
-  jsonPayload = cJSON_CreateObject();
-  cJSON_AddItemToObject( jsonPayload,"sample_data_string_1", jsonString );
-  cJSON_AddItemToObject( jsonPayload,"sample_numeric_value", jsonSomeNumber );
-  cJSON_AddItemToObject( jsonPayload,"sample_data_string_1", jsonAnotherString );
-  pPayload = cJSON_PrintUnformatted( jsonPayload );
-
-  if( !pPayload ){
-    dbg_out(DBG_ERROR,"Fatal error creating payload at %s()\n", __FUNCTION__ );
-    cJSON_Delete( jsonPayload );
-    return -1;
-  }
+  JSON_WRITER  json;
+  MQTT_OUTMSG *pMsg;
 
-  if( getMQTTsendAccess( &pGlobalData->mqttSendMutex, __FUNCTION__) < 0 ){
-    dbg_out( DBG_ERROR,"Did not get mutex lock for %s(). Aborting MQTT publish.\n",__FUNCTION__ );
+  pMsg = mqtt_beginPublish( "creoir/sample/testTopic", __FUNCTION__ );
+  if( NULL == pMsg ){
+    dbg_out( DBG_ERROR,"Did not get MQTT send slot for %s(). Aborting MQTT publish.\n",__FUNCTION__ );
     return -1;
   }
 
-  // Write topic data to shared memory
-  sprintf( pGlobalData->mqttSharedData.pTopic,"%s", "creoir/sample/testTopic" );
-  strcpy( pGlobalData->mqttSharedData.pPayload, pPayload );
+  // Serialize straight into the send slot
+  json_writerInit( &json, pMsg->pPayload, MQTT_SEND_PAYLOAD_SIZE );
+  json_writeString( &json, "sample_data_string_1", pString );
+  json_writeNumber( &json, "sample_numeric_value", 1024 );
+  json_writeString( &json, "sample_data_string_1", "lorem ipsum" );
 
   // Send the topic
-  sendMQTTtopic(__FUNCTION__);
+  return mqtt_endPublish( pMsg, json_writerFinish( &json ), __FUNCTION__ );
+
+} // End of postSampleMessage()
 
-  free( pPayload );
-  cJSON_Delete( jsonPayload );
 
+/********************************************************************
+  action_init()
+
+  Parameters: void
+  Returns:    0 = ok, nonzero = error code.
+
+  Description:
+  Serializes the fixed outbound messages of promptSource once.
+  Sending one later only queues a reference to its text.
+
+********************************************************************/
+int action_init( void ){
+  JSON_WRITER json;
+  char        buf[512];
+  char       *pText;
+  int         i, len;
+
+  for( i = 0; i < PROMPT_COUNT; i++ ){
+    json_writerInit( &json, buf, sizeof(buf) );
+    json_writeString( &json, promptSource[i].pMember, promptSource[i].pValue );
+    len = json_writerFinish( &json );
+    pText = ( len < 0 ) ? NULL : malloc( len + 1 );
+    if( NULL == pText ){
+      dbg_out( DBG_ERROR, "%s() Unable to build prompt %d\n", __FUNCTION__, i );
+      return -1;
+    }
+    memcpy( pText, buf, len + 1 );
+    promptCache[i].pTopic = promptSource[i].pTopic;
+    promptCache[i].pPayload = pText;
+    promptCache[i].length = (size_t)len;
+    // A chime acknowledges each wake word, even right after the previous one
+    promptCache[i].repeatable = ( PROMPT_WAKEUP_CHIME == i || PROMPT_STARTUP_CHIME == i || PROMPT_LOW_CONFIDENCE_CHIME == i );
+  }
+  dbg_out( DBG_VERBOSE, "%s() %d fixed prompts cached\n", __FUNCTION__, PROMPT_COUNT );
   return 0;
+} // End of action_init()
 
-} // End of postSampleMessage()
+
+/********************************************************************
+  action_sendPrompt()
+
+  Parameters: [in]  Prompt id
+  Returns:    0 = ok, nonzero = error code.
+
+  Description:
+  Publishes a fixed message from the prompt cache.
+
+********************************************************************/
+int action_sendPrompt( ACTION_PROMPT prompt ){
+
+  if( prompt >= PROMPT_COUNT || NULL == promptCache[prompt].pPayload ){
+    dbg_out( DBG_ERROR, "%s() Prompt %d not available\n", __FUNCTION__, prompt );
+    return -10;
+  }
+  dbg_out( DBG_VERBOSE, "Sending %s\n", promptSource[prompt].pValue );
+  return mqtt_publishStatic( &promptCache[prompt], __FUNCTION__ ) ? -100 : 0;
+} // End of action_sendPrompt()
 
 
 /********************************************************************
@@ -107,63 +232,191 @@ int postSampleMessage( const char *pString ){
 
 ********************************************************************/
 int cleanMemAllocations( void ){
+  int i;
 
+  // Queued messages may still refer to the prompts
+  if( mqttOutbox_depth() ){
+    dbg_out( DBG_NOTE, "%s() MQTT outbox not empty. Prompt cache left allocated.\n", __FUNCTION__ );
+    return -1;
+  }
+  for( i = 0; i < PROMPT_COUNT; i++ ){
+    free( (char*)promptCache[i].pPayload );
+    promptCache[i].pPayload = NULL;
+  }
   return 0;
 } // End of cleanMemAllocations()
 
 
 /********************************************************************
-  handleEvt_onWakeword()
+  parseIntent()
 
-  Parameters: Pointer to event loop data structure
-  Returns:    0 = ok, nonzero = error code.
+  Parameters: [in]  creoir/asr/intentRecognized payload
+              [in]  Payload length
+              [out] Decoded record
+
+  Returns:    0 = ok, -2 = not JSON, -100 = required key missing
 
   Description:
-  Handles event EVT_MQTT_WAKEWORD
-  From main event loop
+  Decodes a recognition result. Intent and confidence are required.
+  Slots without a name and slots beyond ASR_MAX_SLOTS are skipped.
 
 ********************************************************************/
-int handleEvt_onWakeword( APPLICATION_EVENTDATA *eventData ){
+static int parseIntent( const char *pJson, size_t length, ASR_INTENT_T *pOut ){
+  int found;
 
+  memset( pOut, 0x00, sizeof(ASR_INTENT_T) );
 
-  cJSON *jsonWAW;
-  cJSON *jsonPayload;
-  char  *pPayload;
+  found = json_extract( pJson, length, intentFields, INTENT_FIELDS, pOut );
+  if( found < 0 ){
+    dbg_out( DBG_ERROR, "%s() Cannot parse topic payload\n", __FUNCTION__ );
+    return -2;
+  }
+  if( !( found & FIELD_BIT(INTENT_FIELD_INTENT) ) ){
+    dbg_out( DBG_ERROR, "No intent in recognition result\n" );
+    return -100;
+  }
+  if( !( found & FIELD_BIT(INTENT_FIELD_CONFIDENCE) ) ){
+    dbg_out( DBG_ERROR, "No confidence in recognition result\n" );
+    return -100;
+  }
+  return 0;
+} // End of parseIntent()
 
-  if( NULL == eventData ){
-    dbg_out(DBG_ERROR, "%s() eventData null pointer error\n", __FUNCTION__);
+
+/********************************************************************
+  parseRejection()
+
+  Parameters: [in]  creoir/asr/intentNotRecognized payload
+              [in]  Payload length
+              [out] Decoded record
+
+  Returns:    0 = ok, -2 = not JSON, -100 = required key missing
+
+  Description:
+  Decodes a recognition failure. Reason code and text are required,
+  the rejected intent and its confidence are optional.
+
+********************************************************************/
+static int parseRejection( const char *pJson, size_t length, ASR_REJECTION_T *pOut ){
+  int found;
+
+  memset( pOut, 0x00, sizeof(ASR_REJECTION_T) );
+
+  found = json_extract( pJson, length, rejectionFields, REJECTION_FIELDS, pOut );
+  if( found < 0 ){
+    dbg_out( DBG_ERROR, "%s() Cannot parse topic payload\n", __FUNCTION__ );
+    return -2;
+  }
+  if( !( found & FIELD_BIT(REJECTION_FIELD_CODE) ) ){
+    dbg_out( DBG_ERROR, "No reasonCode in intentNotRecognized\n" );
+    return -100;
   }
+  if( !( found & FIELD_BIT(REJECTION_FIELD_TEXT) ) ){
+    dbg_out( DBG_ERROR, "No reasonText in intentNotRecognized\n" );
+    return -100;
+  }
+  pOut->hasConfidence = ( found & FIELD_BIT(REJECTION_FIELD_CONFIDENCE) ) != 0;
+  return 0;
+} // End of parseRejection()
 
-  dbg_out(DBG_NOTE,"Wakeword detected\n" );
 
-  jsonPayload = cJSON_CreateObject();
+/********************************************************************
+  parseIdentification()
 
-  jsonWAW = cJSON_CreateString( "/usr/share/creoir/wakeup.wav" );
-  cJSON_AddItemToObject( jsonPayload,"file", jsonWAW );
-  pPayload = cJSON_PrintUnformatted( jsonPayload );
+  Parameters: [in]  creoir/biometrics/identification payload
+              [in]  Payload length
+              [out] Decoded record
 
-  if( !pPayload ){
-    dbg_out(DBG_ERROR,"Fatal error creating payload at %s()\n", __FUNCTION__ );
-    cJSON_Delete( jsonPayload );
-    return -1;
+  Returns:    0 = ok, -2 = not JSON, -100 = no name
+
+  Description:
+  Decodes a speaker identification. The name is required, the score
+  is optional.
+
+********************************************************************/
+static int parseIdentification( const char *pJson, size_t length, BIOM_IDENTIFICATION_T *pOut ){
+  int found;
+
+  memset( pOut, 0x00, sizeof(BIOM_IDENTIFICATION_T) );
+
+  found = json_extract( pJson, length, identificationFields, IDENTIFICATION_FIELDS, pOut );
+  if( found < 0 ){
+    dbg_out( DBG_ERROR, "%s() Cannot parse topic payload\n", __FUNCTION__ );
+    return -2;
+  }
+  if( !( found & FIELD_BIT(IDENTIFICATION_FIELD_NAME) ) ){
+    dbg_out( DBG_VERBOSE, "No name string in biometrics/identification\n" );
+    return -100;
   }
+  pOut->hasScore = ( found & FIELD_BIT(IDENTIFICATION_FIELD_SCORE) ) != 0;
+  return 0;
+} // End of parseIdentification()
+
+
+/********************************************************************
+  pushRecord()
+
+  Parameters: [in]  Event to push
+              [in]  Raw MQTT payload. Released on success.
+              [in]  Decoded record
+              [in]  Size of the record
+              [in]  Coalescing key or NULL
+
+  Returns:    0 = ok, nonzero = error code. The caller then still
+              owns the raw payload.
 
-  if( getMQTTsendAccess( &pGlobalData->mqttSendMutex, __FUNCTION__) < 0 ){
-    dbg_out( DBG_ERROR,"Did not get mutex lock for %s(). Aborting MQTT publish.\n",__FUNCTION__ );
+  Description:
+  Queues a record decoded on the receiving thread in place of the raw
+  payload. See --parseOnReceive.
+
+********************************************************************/
+static int pushRecord( APPLICATION_EVENT event, EVENTPAYLOAD_T *pPayload, const void *pRecord, size_t size, const char *pKey ){
+  APPLICATION_EVENTDATA eventData;
+
+  memset( &eventData, 0x00, sizeof(APPLICATION_EVENTDATA) );
+  eventData.pPayload = eventPayload_create( pRecord, size );
+  if( NULL == eventData.pPayload ){
+    dbg_out( DBG_ERROR, "%s() No payload block for the record of event %d\n", __FUNCTION__, event );
     return -1;
   }
+  eventData.parsed = 1;
+  eventPayload_release( pPayload );
 
-  // Write topic data to shared memory
-  sprintf( pGlobalData->mqttSharedData.pTopic,"%s", "creoir/talk/speak" );
-  strcpy( pGlobalData->mqttSharedData.pPayload, pPayload );
+  if( pKey ) pushEventKeyed( event, &eventData, pKey );
+  else pushEvent( event, &eventData );
+  return 0;
+} // End of pushRecord()
 
-  // Send the topic
-  sendMQTTtopic(__FUNCTION__);
 
-  free( pPayload );
-  cJSON_Delete( jsonPayload );
+/********************************************************************
+  handleEvt_onWakeword()
+
+  Parameters: Pointer to event loop data structure
+  Returns:    0 = ok, nonzero = error code.
 
-  return 0;
+  Description:
+  Handles event EVT_MQTT_WAKEWORD, and EVT_KEYPRESS (push-to-talk)
+  From main event loop
+
+  Starts a new interaction: speech still queued for the previous one
+  is dropped, and with --bargeInStop the vocalizer is told to stop
+  what it is playing, before the wakeup chime.
+
+********************************************************************/
+int handleEvt_onWakeword( APPLICATION_EVENTDATA *eventData ){
+  unsigned int cancelled;
+
+  if( NULL == eventData ){
+    dbg_out(DBG_ERROR, "%s() eventData null pointer error\n", __FUNCTION__);
+  }
+
+  dbg_out(DBG_NOTE,"Wakeword detected\n" );
+
+  cancelled = mqttOutbox_bargeIn();
+  if( cancelled ) dbg_out( DBG_NOTE, "%s() %u queued prompts of the previous interaction cancelled\n", __FUNCTION__, cancelled );
+  if( pGlobalData->bargeInStop ) action_sendPrompt( PROMPT_SPEECH_STOP );
+
+  return action_sendPrompt( PROMPT_WAKEUP_CHIME );
 
 } // End of handleEvt_onWakeword()
 
@@ -181,262 +434,190 @@ int handleEvt_onWakeword( APPLICATION_EVENTDATA *eventData ){
 ********************************************************************/
 int handleEvt_intentRecognized(APPLICATION_EVENTDATA* eventData) {
 
-  int    i, numSlots;
-  int    ret = 0;
-  cJSON* jsonAll;
-  cJSON* jsonIntent;
-  cJSON* jsonConfidence;
-  cJSON* jsonSlotArray;
-  cJSON* jsonSingleSlot;
-  cJSON* jsonSlotName;
-  cJSON* jsonSlotValue;
+  int    ret;
+  ASR_INTENT_T        record;
+  const ASR_INTENT_T *pIntent;
 
-  static short patternOn=0;
-  static short routesOn=0;
-  static short rangeOn=0;
-  static short bearingScaleOn=0;
-  static short tacticalFigOn=0;
+  // Toggle states are flipped atomically. With --eventWorkers handlers may run on several threads.
+  static atomic_int patternOn=0;
+  static atomic_int routesOn=0;
+  static atomic_int rangeOn=0;
+  static atomic_int bearingScaleOn=0;
+  static atomic_int tacticalFigOn=0;
 
 
-  if (NULL == eventData) {
+  if (NULL == eventData || NULL == eventData->pPayload) {
     dbg_out( DBG_ERROR,"%s() No payload. Nothing to parse!\n", __FUNCTION__ );
     return -1;
   }
 
-  jsonAll = cJSON_Parse(eventData->topicPayload);
-  if (!jsonAll) {
-    dbg_out(DBG_ERROR, "%s() Cannot parse topic payload\n", __FUNCTION__);
-    return -2;
+  // Decoded already on the receiving thread with --parseOnReceive
+  if( eventData->parsed ){
+    pIntent = (const ASR_INTENT_T*)eventData->pPayload->data;
+  }else{
+    ret = parseIntent( eventData->pPayload->data, eventData->pPayload->length, &record );
+    if( ret ) return ret;
+    pIntent = &record;
   }
-
-  // Parse intent /////////////////
-  jsonIntent = cJSON_GetObjectItem(jsonAll, JSONKEY_INTENT);
-  if (!jsonIntent) {
-    dbg_out(DBG_ERROR, "No intent in recognition result\n");
-    cJSON_Delete(jsonAll);
-    return -100;
-  }
-
-  // Parse confidence /////////////////
-  jsonConfidence = cJSON_GetObjectItem(jsonAll, JSONKEY_CONFIDENCE);
-  if (!jsonConfidence) {
-    dbg_out(DBG_ERROR, "No confidence in recognition result\n");
-    cJSON_Delete(jsonAll);
-    return -100;
-  }
-  dbg_out( DBG_NOTE,"Intent %s recognized with confidence %d\n" , jsonIntent->valuestring, jsonConfidence->valueint );
-
-
-  // Parse slots /////////////////
-  jsonSlotArray = cJSON_GetObjectItem(jsonAll, JSONKEY_SLOTS);
+  dbg_out( DBG_NOTE,"Intent %s recognized with confidence %d\n" , pIntent->intent, pIntent->confidence );
 
 
   // CATCH THE INTENTS ///////////
   ////////////////////////////////
 
-  if( strcmp( jsonIntent->valuestring,INTENT_SAVE_TSP_DUMP ) == 0 ){
+  if( strcmp( pIntent->intent,INTENT_SAVE_TSP_DUMP ) == 0 ){
     // Specific handler for this intent. Called function should do the nuts and bolts for the intent.
-    action_saveTacticalSituation( jsonConfidence->valueint, jsonSlotArray );
+    action_saveTacticalSituation( pIntent );
 
-  }else if( strcmp( jsonIntent->valuestring,INTENT_SAVE_MAIN_DISPLAY_DUMP ) == 0 ){
+  }else if( strcmp( pIntent->intent,INTENT_SAVE_MAIN_DISPLAY_DUMP ) == 0 ){
     // General speech response to recognized intent. This is for demonstration purposes only.
-    action_JustRespondSpeech( "Main display dump saved." );
+    action_sendPrompt( PROMPT_MAIN_DISPLAY_DUMP_SAVED );
 
-  }else if( strcmp( jsonIntent->valuestring,INTENT_OPEN_OWN_SHIP_SETTINGS ) == 0 ){
+  }else if( strcmp( pIntent->intent,INTENT_OPEN_OWN_SHIP_SETTINGS ) == 0 ){
     // General speech response to recognized intent. This is for demonstration purposes only.
-    action_JustRespondSpeech( "Ship settings available at left side display." );
+    action_sendPrompt( PROMPT_SHIP_SETTINGS );
   
-  }else if( strcmp( jsonIntent->valuestring,INTENT_DISPLAY_PATTERNS ) == 0 ){
+  }else if( strcmp( pIntent->intent,INTENT_DISPLAY_PATTERNS ) == 0 ){
     // General speech response to recognized intent. This is for demonstration purposes only.
     patternOn = 1;
-    action_JustRespondSpeech( "Display patterns enabled." );
+    action_sendPrompt( PROMPT_DISPLAY_PATTERNS_ENABLED );
 
-  }else if( strcmp( jsonIntent->valuestring,INTENT_HIDE_PATTERNS ) == 0 ){
+  }else if( strcmp( pIntent->intent,INTENT_HIDE_PATTERNS ) == 0 ){
     // General speech response to recognized intent. This is for demonstration purposes only.
     patternOn = 0;
-    action_JustRespondSpeech( "Display patterns disabled." );
+    action_sendPrompt( PROMPT_DISPLAY_PATTERNS_DISABLED );
 
-  }else if( strcmp( jsonIntent->valuestring,INTENT_DISPLAY_ROUTES ) == 0 ){
+  }else if( strcmp( pIntent->intent,INTENT_DISPLAY_ROUTES ) == 0 ){
     // General speech response to recognized intent. This is for demonstration purposes only.
     routesOn=1;
-    action_JustRespondSpeech( "Routes are now visible." );
+    action_sendPrompt( PROMPT_ROUTES_VISIBLE );
 
-  }else if( strcmp( jsonIntent->valuestring,INTENT_HIDE_ROUTES ) == 0 ){
+  }else if( strcmp( pIntent->intent,INTENT_HIDE_ROUTES ) == 0 ){
     // General speech response to recognized intent. This is for demonstration purposes only.
     routesOn=0;
-    action_JustRespondSpeech( "Routes are now hidden." );
+    action_sendPrompt( PROMPT_ROUTES_HIDDEN );
 
-  }else if( strcmp( jsonIntent->valuestring,INTENT_MAP_NORTH_UP ) == 0 ){
+  }else if( strcmp( pIntent->intent,INTENT_MAP_NORTH_UP ) == 0 ){
     // General speech response to recognized intent. This is for demonstration purposes only.
-    action_JustRespondSpeech( "Map orientation is north up." );
+    action_sendPrompt( PROMPT_MAP_NORTH_UP );
 
-  }else if( strcmp( jsonIntent->valuestring,INTENT_MAP_HEADING_UP ) == 0 ){
+  }else if( strcmp( pIntent->intent,INTENT_MAP_HEADING_UP ) == 0 ){
     // General speech response to recognized intent. This is for demonstration purposes only.
-    action_JustRespondSpeech( "Map orientation is ship heading up." );
+    action_sendPrompt( PROMPT_MAP_HEADING_UP );
 
-  }else if( strcmp( jsonIntent->valuestring,INTENT_TRUE_MOTION ) == 0 ){
+  }else if( strcmp( pIntent->intent,INTENT_TRUE_MOTION ) == 0 ){
     // General speech response to recognized intent. This is for demonstration purposes only.
-    action_JustRespondSpeech( "True motion mode on map is active." );
+    action_sendPrompt( PROMPT_TRUE_MOTION );
 
-  }else if( strcmp( jsonIntent->valuestring,INTENT_DISPLAY_MAP_RANGE_RINGS ) == 0 ){
+  }else if( strcmp( pIntent->intent,INTENT_DISPLAY_MAP_RANGE_RINGS ) == 0 ){
     // General speech response to recognized intent. This is for demonstration purposes only.
     rangeOn=1;
-    action_JustRespondSpeech( "Map range rings enabled." );
+    action_sendPrompt( PROMPT_RANGE_RINGS_ENABLED );
 
-  }else if( strcmp( jsonIntent->valuestring,INTENT_HIDE_MAP_RANGE_RINGS ) == 0 ){
+  }else if( strcmp( pIntent->intent,INTENT_HIDE_MAP_RANGE_RINGS ) == 0 ){
     // General speech response to recognized intent. This is for demonstration purposes only.
     rangeOn=0;
-    action_JustRespondSpeech( "Map range rings hidden." );
+    action_sendPrompt( PROMPT_RANGE_RINGS_HIDDEN );
 
-  }else if( strcmp( jsonIntent->valuestring,INTENT_DSPLY_BEARING_SCALE_RANGE ) == 0 ){
+  }else if( strcmp( pIntent->intent,INTENT_DSPLY_BEARING_SCALE_RANGE ) == 0 ){
     // General speech response to recognized intent. This is for demonstration purposes only.
     bearingScaleOn=1;
-    action_JustRespondSpeech( "Bearing scale range enabled." );
+    action_sendPrompt( PROMPT_BEARING_SCALE_ENABLED );
 
-  }else if( strcmp( jsonIntent->valuestring,INTENT_HIDE_BEARING_SCALE_RANGE ) == 0 ){
+  }else if( strcmp( pIntent->intent,INTENT_HIDE_BEARING_SCALE_RANGE ) == 0 ){
     // General speech response to recognized intent. This is for demonstration purposes only.
     bearingScaleOn=0;
-    action_JustRespondSpeech( "Bearing scale range hidden." );
+    action_sendPrompt( PROMPT_BEARING_SCALE_HIDDEN );
   
-  }else if( strcmp( jsonIntent->valuestring,INTENT_SWITCH_TO_DAY_MODE ) == 0 ){
+  }else if( strcmp( pIntent->intent,INTENT_SWITCH_TO_DAY_MODE ) == 0 ){
     // General speech response to recognized intent. This is for demonstration purposes only.
-    action_JustRespondSpeech( "Day mode activated." );
+    action_sendPrompt( PROMPT_DAY_MODE );
   
-  }else if( strcmp( jsonIntent->valuestring,INTENT_SWITCH_TO_DUSK_MODE ) == 0 ){
+  }else if( strcmp( pIntent->intent,INTENT_SWITCH_TO_DUSK_MODE ) == 0 ){
     // General speech response to recognized intent. This is for demonstration purposes only.
-    action_JustRespondSpeech( "Dusk mode activated." );
+    action_sendPrompt( PROMPT_DUSK_MODE );
   
-  }else if( strcmp( jsonIntent->valuestring,INTENT_SWITCH_TO_NIGHT_MODE ) == 0 ){
+  }else if( strcmp( pIntent->intent,INTENT_SWITCH_TO_NIGHT_MODE ) == 0 ){
     // General speech response to recognized intent. This is for demonstration purposes only.
-    action_JustRespondSpeech( "Night mode activated." );
+    action_sendPrompt( PROMPT_NIGHT_MODE );
   
-  }else if( strcmp( jsonIntent->valuestring,INTENT_CENTRE_MAP_TO_OWN_SHIP ) == 0 ){
+  }else if( strcmp( pIntent->intent,INTENT_CENTRE_MAP_TO_OWN_SHIP ) == 0 ){
     // General speech response to recognized intent. This is for demonstration purposes only.
-    action_JustRespondSpeech( "Map center set to ship position." );
+    action_sendPrompt( PROMPT_MAP_CENTERED );
   
-  }else if( strcmp( jsonIntent->valuestring,INTENT_DISPLAY_TACTICAL_FIGURES ) == 0 ){
+  }else if( strcmp( pIntent->intent,INTENT_DISPLAY_TACTICAL_FIGURES ) == 0 ){
     // General speech response to recognized intent. This is for demonstration purposes only.
     tacticalFigOn=1;
-    action_JustRespondSpeech( "Tactical figures shown." );
+    action_sendPrompt( PROMPT_TACTICAL_FIGURES_SHOWN );
     
-  }else if( strcmp( jsonIntent->valuestring,INTENT_HIDE_TACTICAL_FIGURES ) == 0 ){
+  }else if( strcmp( pIntent->intent,INTENT_HIDE_TACTICAL_FIGURES ) == 0 ){
     // General speech response to recognized intent. This is for demonstration purposes only.
     tacticalFigOn=0;
-    action_JustRespondSpeech( "Tactical figures hidden." );
+    action_sendPrompt( PROMPT_TACTICAL_FIGURES_HIDDEN );
     
-  }else if( strcmp( jsonIntent->valuestring,INTENT_REDUCE_MAP_SIZE ) == 0 ){
+  }else if( strcmp( pIntent->intent,INTENT_REDUCE_MAP_SIZE ) == 0 ){
     // General speech response to recognized intent. This is for demonstration purposes only.
-    action_JustRespondSpeech( "Changed to small map window size." );
+    action_sendPrompt( PROMPT_SMALL_MAP );
 
-  }else if( strcmp( jsonIntent->valuestring,INTENT_GO_TO_NORMAL_MAP_SIZE ) == 0 ){
+  }else if( strcmp( pIntent->intent,INTENT_GO_TO_NORMAL_MAP_SIZE ) == 0 ){
     // General speech response to recognized intent. This is for demonstration purposes only.
-    action_JustRespondSpeech( "Changed to full map window size." );
+    action_sendPrompt( PROMPT_FULL_MAP );
 
-  }else if( strcmp( jsonIntent->valuestring,INTENT_SAVE_ACTIVE_WINDOW ) == 0 ){
+  }else if( strcmp( pIntent->intent,INTENT_SAVE_ACTIVE_WINDOW ) == 0 ){
     // General speech response to recognized intent. This is for demonstration purposes only.
-    action_JustRespondSpeech( "Active window saved." );
+    action_sendPrompt( PROMPT_ACTIVE_WINDOW_SAVED );
 
-  }else if( strcmp( jsonIntent->valuestring,INTENT_MINIMIZE_ALL_WINDOWS ) == 0 ){
+  }else if( strcmp( pIntent->intent,INTENT_MINIMIZE_ALL_WINDOWS ) == 0 ){
     // General speech response to recognized intent. This is for demonstration purposes only.
-    action_JustRespondSpeech( "All windows minimized." );
+    action_sendPrompt( PROMPT_WINDOWS_MINIMIZED );
 
-  }else if( strcmp( jsonIntent->valuestring,INTENT_DISPLAY_ALL_WINDOWS ) == 0 ){
+  }else if( strcmp( pIntent->intent,INTENT_DISPLAY_ALL_WINDOWS ) == 0 ){
     // General speech response to recognized intent. This is for demonstration purposes only.
-    action_JustRespondSpeech( "All windows shown." );
+    action_sendPrompt( PROMPT_WINDOWS_SHOWN );
 
-  }else if( strcmp( jsonIntent->valuestring,INTENT_TOGGLE_PATTERNS ) == 0 ){
+  }else if( strcmp( pIntent->intent,INTENT_TOGGLE_PATTERNS ) == 0 ){
     // Keep track of pattern status. Response based on changed state.
-    if(patternOn){
-      patternOn = 0;
-      action_JustRespondSpeech( "Patterns disabled." );
+    if( atomic_fetch_xor( &patternOn, 1 ) ){
+      action_sendPrompt( PROMPT_PATTERNS_DISABLED );
     }else{
-      patternOn = 1;
-      action_JustRespondSpeech( "Patterns enabled." );
+      action_sendPrompt( PROMPT_PATTERNS_ENABLED );
     }
 
-  }else if( strcmp( jsonIntent->valuestring,INTENT_TOGGLE_ROUTES ) == 0 ){
+  }else if( strcmp( pIntent->intent,INTENT_TOGGLE_ROUTES ) == 0 ){
     // Keep track of route display status. Response based on changed state.
-    if(routesOn){
-      routesOn = 0;
-      action_JustRespondSpeech( "Route display disabled." );
+    if( atomic_fetch_xor( &routesOn, 1 ) ){
+      action_sendPrompt( PROMPT_ROUTE_DISPLAY_DISABLED );
     }else{
-      routesOn = 1;
-      action_JustRespondSpeech( "Route display enabled." );
+      action_sendPrompt( PROMPT_ROUTE_DISPLAY_ENABLED );
     }
 
-  }else if( strcmp( jsonIntent->valuestring,INTENT_TOGGLE_MAP_RANGE_RINGS ) == 0 ){
+  }else if( strcmp( pIntent->intent,INTENT_TOGGLE_MAP_RANGE_RINGS ) == 0 ){
     // Keep track of range ring status. Response based on changed state.
-    if(rangeOn){
-      rangeOn = 0;
-      action_JustRespondSpeech( "Map range rings disabled." );
+    if( atomic_fetch_xor( &rangeOn, 1 ) ){
+      action_sendPrompt( PROMPT_RANGE_RINGS_DISABLED );
     }else{
-      rangeOn = 1;
-      action_JustRespondSpeech( "Map range rings enabled." );
+      action_sendPrompt( PROMPT_RANGE_RINGS_ENABLED );
     }
   
-  }else if( strcmp( jsonIntent->valuestring,INTENT_TOGGLE_BEARING_SCALE_RANGE ) == 0 ){
+  }else if( strcmp( pIntent->intent,INTENT_TOGGLE_BEARING_SCALE_RANGE ) == 0 ){
     // Keep track of scale range status. Response based on changed state.
-    if(bearingScaleOn){
-      bearingScaleOn = 0;
-      action_JustRespondSpeech( "Bearing scale range disabled." );
+    if( atomic_fetch_xor( &bearingScaleOn, 1 ) ){
+      action_sendPrompt( PROMPT_BEARING_SCALE_DISABLED );
     }else{
-      bearingScaleOn = 1;
-      action_JustRespondSpeech( "Bearing scale range enabled." );
+      action_sendPrompt( PROMPT_BEARING_SCALE_ENABLED );
     }
 
-  }else if( strcmp( jsonIntent->valuestring,INTENT_TOGGLE_TACTICAL_FIGURES ) == 0 ){
+  }else if( strcmp( pIntent->intent,INTENT_TOGGLE_TACTICAL_FIGURES ) == 0 ){
     // Keep track of tactical figure status. Response based on changed state.
-    if(tacticalFigOn){
-      tacticalFigOn = 0;
-      action_JustRespondSpeech( "Tactical figures hidden." );
+    if( atomic_fetch_xor( &tacticalFigOn, 1 ) ){
+      action_sendPrompt( PROMPT_TACTICAL_FIGURES_HIDDEN );
     }else{
-      tacticalFigOn = 1;
-      action_JustRespondSpeech( "Tactical figures shown." );
+      action_sendPrompt( PROMPT_TACTICAL_FIGURES_SHOWN );
     }
 
   } // End if(INTENTS)
 
 
-
-
-
-  #if 0
-
-  // Parse slots /////////////////
-  if( !jsonSlotArray ){
-    dbg_out(DBG_ERROR, "No slot array in recognition result\n");
-    cJSON_Delete(jsonAll);
-    return -100;
-  }
-  numSlots = cJSON_GetArraySize( jsonSlotArray );
-  for( i=0;i<numSlots;i++ ){
-    jsonSingleSlot = cJSON_GetArrayItem( jsonSlotArray,i );
-    if( !jsonSingleSlot ){
-      dbg_out( DBG_ERROR,"%s() Failed to parse slot array index %d/%d\n", __FUNCTION__, i, numSlots );
-      continue;
-    }
-    jsonSlotName = cJSON_GetObjectItem( jsonSingleSlot, JSONKEY_SLOTNAME );
-    if( !jsonSlotName ){
-      dbg_out( DBG_ERROR,"%s() No slot name in array index %d/%d\n", __FUNCTION__, i, numSlots );
-      continue;
-    }
-    jsonSlotValue = cJSON_GetObjectItem( jsonSingleSlot, JSONKEY_SLOTVALUE );
-    if( !jsonSlotName ){
-      dbg_out( DBG_ERROR,"%s() No slot value in array index %d/%d\n", __FUNCTION__, i, numSlots );
-      continue;
-    }
-
-    // Now print out this slot name/value pair
-    dbg_out( DBG_NOTE,"Slot [%s] value [%s]\n", jsonSlotName->valuestring, jsonSlotValue->valuestring );
-
-  } // End for(slots)
-
-  #endif
-
-
-// Free the memory allocated by cJSON object
-cJSON_free( jsonAll );
-
 return 0;
 
 } // End of handleEvt_intentRecognized()
@@ -454,62 +635,37 @@ return 0;
 ********************************************************************/
 int handleEvt_intentNotRecognized(APPLICATION_EVENTDATA* eventData) {
 
-  int    i, numSlots;
-  int    ret = 0;
-  cJSON* jsonAll;
-  cJSON* jsonIntent;
-  cJSON* jsonConfidence;
-  cJSON* jsonReasonCode;
-  cJSON* jsonReasonText;
+  int    ret;
+  ASR_REJECTION_T        record;
+  const ASR_REJECTION_T *pReject;
 
 
-  if (NULL == eventData) {
+  if (NULL == eventData || NULL == eventData->pPayload) {
     dbg_out( DBG_ERROR,"%s() No payload. Nothing to parse!\n", __FUNCTION__ );
     return -1;
   }
 
-  jsonAll = cJSON_Parse(eventData->topicPayload);
-  if (!jsonAll) {
-    dbg_out(DBG_ERROR, "%s() Cannot parse topic payload\n", __FUNCTION__);
-    return -2;
-  }
-
-  // Parse reason /////////////////
-  jsonReasonCode = cJSON_GetObjectItem(jsonAll, JSONKEY_REASONCODE);
-  if( !jsonReasonCode ) {
-    dbg_out(DBG_ERROR, "No reasonCode in intentNotRecognized\n");
-    cJSON_Delete(jsonAll);
-    return -100;
+  // Decoded already on the receiving thread with --parseOnReceive
+  if( eventData->parsed ){
+    pReject = (const ASR_REJECTION_T*)eventData->pPayload->data;
+  }else{
+    ret = parseRejection( eventData->pPayload->data, eventData->pPayload->length, &record );
+    if( ret ) return ret;
+    pReject = &record;
   }
-  jsonReasonText = cJSON_GetObjectItem(jsonAll, JSONKEY_REASONTEXT);
-  if( !jsonReasonText ) {
-    dbg_out(DBG_ERROR, "No reasonText in intentNotRecognized\n");
-    cJSON_Delete(jsonAll);
-    return -100;
-  }
-  dbg_out( DBG_NOTE,"Reconition rejected because of code %d [%s]\n", jsonReasonCode->valueint, jsonReasonText->valuestring );
-
+  dbg_out( DBG_NOTE,"Reconition rejected because of code %d [%s]\n", pReject->reasonCode, pReject->reasonText );
 
-  // Parse intent /////////////////
-  jsonIntent = cJSON_GetObjectItem(jsonAll, JSONKEY_INTENT);
-  if( jsonIntent ){
-    dbg_out( DBG_NORM, "Rejected intent: %s\n",jsonIntent->valuestring );
+  if( pReject->intent[0] ){
+    dbg_out( DBG_NORM, "Rejected intent: %s\n", pReject->intent );
   }
-
-  // Parse confidence /////////////////
-  jsonConfidence = cJSON_GetObjectItem(jsonAll, JSONKEY_CONFIDENCE);
-  if( jsonConfidence ){
-    dbg_out( DBG_NORM,"Rejected confidence: %d\n", jsonConfidence->valueint );
+  if( pReject->hasConfidence ){
+    dbg_out( DBG_NORM,"Rejected confidence: %d\n", pReject->confidence );
   }
 
-  if( 2==jsonReasonCode->valueint || 1==jsonReasonCode->valueint ){
+  if( 2==pReject->reasonCode || 1==pReject->reasonCode ){
     action_playLowConfidence();
   }
 
-
-// Free the memory allocated by cJSON object
-cJSON_free( jsonAll );
-
 return 0;
 
 } // End of handleEvt_intentNotRecognized()
@@ -527,112 +683,59 @@ return 0;
 ********************************************************************/
 int handleEvt_MQTTuserIdentified(APPLICATION_EVENTDATA* eventData) {
 
-  int    i, numSlots;
-  int    ret = 0;
-  cJSON* jsonAll;
-  cJSON* jsonIntent;
-  cJSON* jsonConfidence;
-  cJSON* jsonName;
-  cJSON* jsonReasonText;
-  cJSON* jsonUtterance;
-  cJSON* jsonOutPayload;
-  char  *pPayloadOut;
+  int    ret;
+  BIOM_IDENTIFICATION_T        record;
+  const BIOM_IDENTIFICATION_T *pIdent;
+  JSON_WRITER  json;
+  MQTT_OUTMSG *pMsg;
   char   szPrompt[512];
   time_t timeNow;
-  static time_t  previousSpeech=0;
+  static _Atomic time_t previousSpeech=0;
 
 
-  if (NULL == eventData) {
+  if (NULL == eventData || NULL == eventData->pPayload) {
     dbg_out( DBG_ERROR,"%s() No payload. Nothing to parse!\n", __FUNCTION__ );
     return -1;
   }
 
-  jsonAll = cJSON_Parse(eventData->topicPayload);
-  if (!jsonAll) {
-    dbg_out(DBG_ERROR, "%s() Cannot parse topic payload\n", __FUNCTION__);
-    return -2;
-  }
-
-  // Parse reason /////////////////
-  jsonName = cJSON_GetObjectItem(jsonAll, "name");
-  if( !jsonName ) {
-    dbg_out(DBG_VERBOSE, "No name in biometrics/identification\n");
-    cJSON_Delete(jsonAll);
-    return -100;
-  }
-
-  // Parse name /////////////////
-  if( NULL == jsonName->valuestring ){
-    dbg_out(DBG_ERROR, "Name is not a string in biometrics/identification\n");
-    cJSON_Delete(jsonAll);
-    return -100;
+  // Decoded already on the receiving thread with --parseOnReceive
+  if( eventData->parsed ){
+    pIdent = (const BIOM_IDENTIFICATION_T*)eventData->pPayload->data;
+  }else{
+    ret = parseIdentification( eventData->pPayload->data, eventData->pPayload->length, &record );
+    if( ret ) return ret;
+    pIdent = &record;
   }
+  dbg_out( DBG_NOTE,"Name: %s\n", pIdent->name );
 
-  dbg_out( DBG_NOTE,"Name: %s\n",jsonName->valuestring );
-
-  // Parse confidence /////////////////
-  jsonConfidence = cJSON_GetObjectItem(jsonAll, "score");
-  if( jsonConfidence ){
-    dbg_out( DBG_NORM,"Confidence score: %d\n", jsonConfidence->valueint );
+  if( pIdent->hasScore ){
+    dbg_out( DBG_NORM,"Confidence score: %d\n", pIdent->score );
   }
 
 
+  // Atomic, as identifications may be handled by several dispatch threads
   timeNow = time( NULL );
-  if( timeNow - previousSpeech <10000 ){
+  if( timeNow - atomic_load( &previousSpeech ) <10000 ){
     dbg_out( DBG_NOTE,"Not greeting since previous prompt less than 10 seconds ago\n" );
     return 0;
   }
 
-  sprintf( szPrompt,"Well hello my friend %s. How are you today?",jsonName->valuestring );
-
-
-  jsonOutPayload = cJSON_CreateObject();
-  if (!jsonOutPayload) {
-    dbg_out(DBG_ERROR, "%s() Fatal error creating JSON object\n", __FUNCTION__);
-    cJSON_Delete(jsonAll);
-    return -10;
-  }
-
+  snprintf( szPrompt, sizeof(szPrompt), "Well hello my friend %s. How are you today?",pIdent->name );
   dbg_out( DBG_VERBOSE,"Prompt: %s\n",szPrompt );
 
-  jsonUtterance = cJSON_CreateString( szPrompt );
-
-  cJSON_AddItemToObject(jsonOutPayload, "utterance", jsonUtterance);
-  
-
-  pPayloadOut = cJSON_PrintUnformatted(jsonOutPayload);
-
-  if (!pPayloadOut) {
-    dbg_out(DBG_ERROR, "Fatal error in creating creoir/talk/speak JSON payload\n");
-    cJSON_Delete(jsonOutPayload);
-    return -10;
-  }
-
-  dbg_out(DBG_VERBOSE, "Sending speech request\n");
-
   // Send the topic
   /////////////////
-  if (getMQTTsendAccess(&pGlobalData->mqttSendMutex, __FUNCTION__) < 0) {
-    dbg_out(DBG_ERROR, "Did not get mutex lock for %s(). Aborting MQTT publish.\n", __FUNCTION__);
-    free(pPayloadOut);
-    cJSON_Delete(jsonOutPayload);
+  dbg_out(DBG_VERBOSE, "Sending speech request\n");
+  pMsg = mqtt_beginPublish( "creoir/talk/speak", __FUNCTION__ );
+  if( NULL == pMsg ){
+    dbg_out(DBG_ERROR, "Did not get MQTT send slot for %s(). Aborting MQTT publish.\n", __FUNCTION__);
     return -100;
   }
-
-  // Write message data to shared memory
-  sprintf(pGlobalData->mqttSharedData.pTopic, "%s", "creoir/talk/speak");
-  strcpy(pGlobalData->mqttSharedData.pPayload, pPayloadOut);
-
-  // Send the topic
-  sendMQTTtopic(__FUNCTION__);
-
-  dbg_out(DBG_VERBOSE, "Speech on the way\n");
-
-  free(pPayloadOut);
-  cJSON_Delete(jsonOutPayload);
-
-  // Free the memory allocated by cJSON object
-  cJSON_free( jsonAll );
+  json_writerInit( &json, pMsg->pPayload, MQTT_SEND_PAYLOAD_SIZE );
+  json_writeString( &json, "utterance", szPrompt );
+  if( 0 == mqtt_endPublish( pMsg, json_writerFinish( &json ), __FUNCTION__ ) ){
+    dbg_out(DBG_VERBOSE, "Speech on the way\n");
+  }
 
 return 0;
 
@@ -649,23 +752,22 @@ return 0;
   Gets called once MQTT topic creoir/asr/wakewordDetected is received
 
 ********************************************************************/
-int handle_MQTTonWakeword( const char* pTopic, const char *pData ){
+int handle_MQTTonWakeword( const char* pTopic, EVENTPAYLOAD_T *pPayload ){
 
   APPLICATION_EVENTDATA eventData;
   memset(&eventData, 0x00, sizeof(APPLICATION_EVENTDATA));
-  eventData.payloadPtr = NULL;
 
   dbg_out( DBG_VERBOSE,"%s() handler called.\n", __FUNCTION__ );
 
 
-  if( !pData ){
+  if( !pPayload ){
     dbg_out( DBG_ERROR,"No MQTT data in topic.\n" );
     return -1;
   }
 
-  dbg_out( DBG_MQTT,"Data:%s\n",pData );
+  dbg_out( DBG_MQTT,"Data:%s\n",pPayload->data );
 
-  strcpy( eventData.topicPayload, pData );
+  eventData.pPayload = pPayload;
   dbg_out(DBG_VERBOSE,"Pushing event EVT_MQTT_WAKEWORD\n" );
   pushEvent( EVT_MQTT_WAKEWORD, &eventData );
 
@@ -686,22 +788,28 @@ int handle_MQTTonWakeword( const char* pTopic, const char *pData ){
   Gets called once MQTT topic creoir/asr/intentRecognized is received
 
 ********************************************************************/
-int handle_MQTTintentRecognized(const char* pTopic, const char* pData) {
+int handle_MQTTintentRecognized(const char* pTopic, EVENTPAYLOAD_T *pPayload) {
 
   APPLICATION_EVENTDATA eventData;
   memset(&eventData, 0x00, sizeof(APPLICATION_EVENTDATA));
-  eventData.payloadPtr = NULL;
 
   dbg_out(DBG_VERBOSE, "%s() handler called.\n", __FUNCTION__);
 
-  if (!pData) {
+  if (!pPayload) {
     dbg_out(DBG_ERROR, "No MQTT data in topic.\n");
     return -1;
   }
 
-  dbg_out(DBG_MQTT, "Data:%s\n", pData);
+  dbg_out(DBG_MQTT, "Data:%s\n", pPayload->data);
+
+  if( pGlobalData->parseOnReceive ){
+    ASR_INTENT_T record;
+    if( parseIntent( pPayload->data, pPayload->length, &record ) ) return -2;
+    dbg_out(DBG_VERBOSE, "Pushing decoded event EVT_MQTT_INTENT_RECOGNIZED\n");
+    return pushRecord( EVT_MQTT_INTENT_RECOGNIZED, pPayload, &record, sizeof(record), NULL );
+  }
 
-  strcpy(eventData.topicPayload, pData);
+  eventData.pPayload = pPayload;
   dbg_out(DBG_VERBOSE, "Pushing event EVT_MQTT_INTENT_RECOGNIZED\n");
   pushEvent( EVT_MQTT_INTENT_RECOGNIZED, &eventData );
 
@@ -721,22 +829,28 @@ int handle_MQTTintentRecognized(const char* pTopic, const char* pData) {
   Gets called once MQTT topic creoir/asr/intentNotRecognized is received
 
 ********************************************************************/
-int handle_MQTTintentNotRecognized(const char* pTopic, const char* pData) {
+int handle_MQTTintentNotRecognized(const char* pTopic, EVENTPAYLOAD_T *pPayload) {
 
   APPLICATION_EVENTDATA eventData;
   memset(&eventData, 0x00, sizeof(APPLICATION_EVENTDATA));
-  eventData.payloadPtr = NULL;
 
   dbg_out(DBG_VERBOSE, "%s() handler called.\n", __FUNCTION__);
 
-  if (!pData) {
+  if (!pPayload) {
     dbg_out(DBG_ERROR, "No MQTT data in topic.\n");
     return -1;
   }
 
-  dbg_out(DBG_MQTT, "Data:%s\n", pData);
+  dbg_out(DBG_MQTT, "Data:%s\n", pPayload->data);
 
-  strcpy(eventData.topicPayload, pData);
+  if( pGlobalData->parseOnReceive ){
+    ASR_REJECTION_T record;
+    if( parseRejection( pPayload->data, pPayload->length, &record ) ) return -2;
+    dbg_out(DBG_VERBOSE, "Pushing decoded event EVT_MQTT_INTENT_NOT_RECOGNIZED\n");
+    return pushRecord( EVT_MQTT_INTENT_NOT_RECOGNIZED, pPayload, &record, sizeof(record), NULL );
+  }
+
+  eventData.pPayload = pPayload;
   dbg_out(DBG_VERBOSE, "Pushing event EVT_MQTT_INTENT_NOT_RECOGNIZED\n");
   pushEvent( EVT_MQTT_INTENT_NOT_RECOGNIZED, &eventData );
 
@@ -756,24 +870,36 @@ int handle_MQTTintentNotRecognized(const char* pTopic, const char* pData) {
   Gets called once MQTT topic creoir/biometrics/identification is received
 
 ********************************************************************/
-int handle_MQTTuserIdentified(const char* pTopic, const char* pData) {
+int handle_MQTTuserIdentified(const char* pTopic, EVENTPAYLOAD_T *pPayload) {
 
   APPLICATION_EVENTDATA eventData;
+  BIOM_IDENTIFICATION_T key;
   memset(&eventData, 0x00, sizeof(APPLICATION_EVENTDATA));
-  eventData.payloadPtr = NULL;
 
   dbg_out(DBG_VERBOSE, "%s() handler called.\n", __FUNCTION__);
 
-  if (!pData) {
+  if (!pPayload) {
     dbg_out(DBG_ERROR, "No MQTT data in topic.\n");
     return -1;
   }
 
-  dbg_out(DBG_MQTT, "Data:%s\n", pData);
+  dbg_out(DBG_MQTT, "Data:%s\n", pPayload->data);
+
+  if( pGlobalData->parseOnReceive ){
+    BIOM_IDENTIFICATION_T record;
+    if( parseIdentification( pPayload->data, pPayload->length, &record ) ) return -2;
+    dbg_out(DBG_VERBOSE, "Pushing decoded event EVT_MQTT_BIOM_IDENTIFICATION\n");
+    return pushRecord( EVT_MQTT_BIOM_IDENTIFICATION, pPayload, &record, sizeof(record), record.name );
+  }
 
-  strcpy(eventData.topicPayload, pData);
+  // Speaker name is the coalescing key. Only the newest identification per speaker is handled.
+  // Decoded like parseIdentification() does, so the key is the same with and without --parseOnReceive.
+  key.name[0] = 0;
+  if (json_extract(pPayload->data, pPayload->length, &identificationFields[IDENTIFICATION_FIELD_NAME], 1, &key) < 0) key.name[0] = 0;
+
+  eventData.pPayload = pPayload;
   dbg_out(DBG_VERBOSE, "Pushing event EVT_MQTT_BIOM_IDENTIFICATION\n");
-  pushEvent( EVT_MQTT_BIOM_IDENTIFICATION, &eventData );
+  pushEventKeyed( EVT_MQTT_BIOM_IDENTIFICATION, &eventData, key.name );
 
   return 0;
 
@@ -791,21 +917,20 @@ int handle_MQTTuserIdentified(const char* pTopic, const char* pData) {
   Parses creoir/app/stop MQTT topic
     
 ********************************************************************/
-int handleMQTT_app_stop( const char* pTopic, const char *pData ){
+int handleMQTT_app_stop( const char* pTopic, EVENTPAYLOAD_T *pPayload ){
 
   APPLICATION_EVENTDATA eventData;
   memset(&eventData, 0x00, sizeof(APPLICATION_EVENTDATA));
-  eventData.payloadPtr = NULL;
   
   dbg_out( DBG_VERBOSE,"%s() handler called.\n", __FUNCTION__ );
 
-  if( !pData ){
+  if( !pPayload ){
     dbg_out( DBG_ERROR,"No MQTT data in topic.\n" );
     return -1;
   }
-  dbg_out( DBG_MQTT,"Data:%s\n",pData );
+  dbg_out( DBG_MQTT,"Data:%s\n",pPayload->data );
 
-  strcpy( eventData.topicPayload, pData );
+  eventData.pPayload = pPayload;
   pushEvent( EVT_APP_STOP, &eventData );
 
   return 0;
@@ -816,67 +941,24 @@ int handleMQTT_app_stop( const char* pTopic, const char *pData ){
 /********************************************************************
   action_saveTacticalSituation()
 
-  Parameters: [in]  Confidence
-              [in]  Ptr to slot array (cJSON) 
+  Parameters: [in]  Recognition result with confidence and slots
 
   Returns:    0 = ok, nonzero = error code.
 
   Description:
-  Handles intent SAVE_TSP_DUMP
+  Handles intent SAVE_TSP_DUMP. The slots are only logged; the
+  dump itself is left to the integration.
     
 ********************************************************************/
-int action_saveTacticalSituation( int iConfidence, cJSON* jsonSlotArray ){
-
-  char  *pPayloadOut;
-  cJSON *jsonOutPayload;
-  cJSON *jsonUtterance;
-
-  // Compose speech request
-  ///////////////////////////////////////////
-  jsonOutPayload = cJSON_CreateObject();
-  if (!jsonOutPayload) {
-    dbg_out(DBG_ERROR, "%s() Fatal error creating JSON object\n", __FUNCTION__);
-    return -10;
-  }
-
-
-  jsonUtterance = cJSON_CreateString( "Tactical situation dump saved." );
-
-  cJSON_AddItemToObject(jsonOutPayload, "utterance", jsonUtterance);
-  
-
-  pPayloadOut = cJSON_PrintUnformatted(jsonOutPayload);
-
-  if (!pPayloadOut) {
-    dbg_out(DBG_ERROR, "Fatal error in creating creoir/talk/speak JSON payload\n");
-    cJSON_Delete(jsonOutPayload);
-    return -10;
-  }
-
-  dbg_out(DBG_VERBOSE, "Sending speech request\n");
-
-  // Send the topic
-  /////////////////
-  if (getMQTTsendAccess(&pGlobalData->mqttSendMutex, __FUNCTION__) < 0) {
-    dbg_out(DBG_ERROR, "Did not get mutex lock for %s(). Aborting MQTT publish.\n", __FUNCTION__);
-    free(pPayloadOut);
-    cJSON_Delete(jsonOutPayload);
-    return -100;
-  }
-
-  // Write message data to shared memory
-  sprintf(pGlobalData->mqttSharedData.pTopic, "%s", "creoir/talk/speak");
-  strcpy(pGlobalData->mqttSharedData.pPayload, pPayloadOut);
-
-  // Send the topic
-  sendMQTTtopic(__FUNCTION__);
-
-  dbg_out(DBG_VERBOSE, "Speech on the way\n");
+int action_saveTacticalSituation( const ASR_INTENT_T *pIntent ){
+  int i;
 
-  free(pPayloadOut);
-  cJSON_Delete(jsonOutPayload);
-  return 0;
+  // Print out the slot name/value pairs
+  for( i=0;i<pIntent->numSlots;i++ ){
+    dbg_out( DBG_VERBOSE,"Slot [%s] value [%s]\n", pIntent->slots[i].name, pIntent->slots[i].value );
+  } // End for(slots)
 
+  return action_sendPrompt( PROMPT_TSP_DUMP_SAVED );
 
 } // End of action_saveTacticalSituation()
 
@@ -894,58 +976,31 @@ int action_saveTacticalSituation( int iConfidence, cJSON* jsonSlotArray ){
     
 ********************************************************************/
 int action_JustRespondSpeech( const char* pUtterance ){
+  JSON_WRITER  json;
+  MQTT_OUTMSG *pMsg;
 
-  char  *pPayloadOut;
-  cJSON *jsonOutPayload;
-  cJSON *jsonUtterance;
+  dbg_out(DBG_VERBOSE, "Sending speech request\n");
 
-  // Compose speech request
+  // Compose the request straight into the send slot
   ///////////////////////////////////////////
-  jsonOutPayload = cJSON_CreateObject();
-  if (!jsonOutPayload) {
-    dbg_out(DBG_ERROR, "%s() Fatal error creating JSON object\n", __FUNCTION__);
-    return -10;
-  }
-
-
-  jsonUtterance = cJSON_CreateString( pUtterance );
-
-  cJSON_AddItemToObject(jsonOutPayload, "utterance", jsonUtterance);
-  
-
-  pPayloadOut = cJSON_PrintUnformatted(jsonOutPayload);
-
-  if (!pPayloadOut) {
-    dbg_out(DBG_ERROR, "%s() Fatal error in creating creoir/talk/speak JSON payload\n", __FUNCTION__ );
-    cJSON_Delete(jsonOutPayload);
-    return -10;
+  pMsg = mqtt_beginPublish( "creoir/talk/speak", __FUNCTION__ );
+  if( NULL == pMsg ){
+    dbg_out(DBG_ERROR, "Did not get MQTT send slot for %s(). Aborting MQTT publish.\n", __FUNCTION__);
+    return -100;
   }
 
-  dbg_out(DBG_VERBOSE, "Sending speech request\n");
+  json_writerInit( &json, pMsg->pPayload, MQTT_SEND_PAYLOAD_SIZE );
+  json_writeString( &json, "utterance", pUtterance );
 
   // Send the topic
   /////////////////
-  if (getMQTTsendAccess(&pGlobalData->mqttSendMutex, __FUNCTION__) < 0) {
-    dbg_out(DBG_ERROR, "Did not get mutex lock for %s(). Aborting MQTT publish.\n", __FUNCTION__);
-    free(pPayloadOut);
-    cJSON_Delete(jsonOutPayload);
-    return -100;
+  if( mqtt_endPublish( pMsg, json_writerFinish( &json ), __FUNCTION__ ) < 0 ){
+    return -10;
   }
 
-  // Write message data to shared memory
-  sprintf(pGlobalData->mqttSharedData.pTopic, "%s", "creoir/talk/speak");
-  strcpy(pGlobalData->mqttSharedData.pPayload, pPayloadOut);
-
-  // Send the topic
-  sendMQTTtopic(__FUNCTION__);
-
   dbg_out(DBG_VERBOSE, "Speech on the way\n");
-
-  free(pPayloadOut);
-  cJSON_Delete(jsonOutPayload);
   return 0;
 
-
 } // End of action_JustRespondSpeech()
 
 
@@ -964,55 +1019,7 @@ int action_JustRespondSpeech( const char* pUtterance ){
 ********************************************************************/
 int action_playLowConfidence( void ){
 
-  char  *pPayloadOut;
-  cJSON *jsonOutPayload;
-  cJSON *jsonWAV;
-
-  // Compose payload
-  ///////////////////////////////////////////
-  jsonOutPayload = cJSON_CreateObject();
-  if (!jsonOutPayload) {
-    dbg_out(DBG_ERROR, "%s() Fatal error creating JSON object\n", __FUNCTION__);
-    return -10;
-  }
-
-
-  jsonWAV = cJSON_CreateString( "/usr/share/creoir/low_confidence.wav" );
-
-  cJSON_AddItemToObject(jsonOutPayload, "file", jsonWAV);
-  
-
-  pPayloadOut = cJSON_PrintUnformatted(jsonOutPayload);
-
-  if (!pPayloadOut) {
-    dbg_out(DBG_ERROR, "Fatal error in creating creoir/talk/speak JSON payload\n");
-    cJSON_Delete(jsonOutPayload);
-    return -10;
-  }
-
-  dbg_out(DBG_VERBOSE, "Sending play request\n");
-
-  // Send the topic
-  /////////////////
-  if (getMQTTsendAccess(&pGlobalData->mqttSendMutex, __FUNCTION__) < 0) {
-    dbg_out(DBG_ERROR, "Did not get mutex lock for %s(). Aborting MQTT publish.\n", __FUNCTION__);
-    free(pPayloadOut);
-    cJSON_Delete(jsonOutPayload);
-    return -100;
-  }
-
-  // Write message data to shared memory
-  sprintf(pGlobalData->mqttSharedData.pTopic, "%s", "creoir/talk/speak");
-  strcpy(pGlobalData->mqttSharedData.pPayload, pPayloadOut);
-
-  // Send the topic
-  sendMQTTtopic(__FUNCTION__);
-
-  dbg_out(DBG_VERBOSE, "Request on the way\n");
-
-  free(pPayloadOut);
-  cJSON_Delete(jsonOutPayload);
-  return 0;
+  return action_sendPrompt( PROMPT_LOW_CONFIDENCE_CHIME );
 
 } // End of action_playLowConfidence()
 
@@ -1033,68 +1040,35 @@ int action_playLowConfidence( void ){
     
 ********************************************************************/
 int setGrammar( const char* pGrammarName, int iTimeout, const char* pActionAfterResult ){
+  JSON_WRITER  json;
+  MQTT_OUTMSG *pMsg;
 
-  char  *pPayloadOut;
-  cJSON *jsonOutPayload;
-  cJSON *jsonGrammar;
-  cJSON *jsonTimeout;
-  cJSON *jsonActionAfterResult;
-  cJSON *jsonContextArray;
+  dbg_out(DBG_VERBOSE, "Sending grammar request\n");
 
-  // Compose payload
+  // Compose the request straight into the send slot
   ///////////////////////////////////////////
-  jsonOutPayload = cJSON_CreateObject();
-  if (!jsonOutPayload) {
-    dbg_out(DBG_ERROR, "%s() Fatal error creating JSON object\n", __FUNCTION__);
-    return -10;
-  }
-
-
-  jsonGrammar = cJSON_CreateString( pGrammarName );
-
-  jsonContextArray = cJSON_CreateArray();
-  cJSON_AddItemToArray( jsonContextArray,jsonGrammar );
-  cJSON_AddItemToObject( jsonOutPayload, "contextNames", jsonContextArray );
-
-  jsonTimeout = cJSON_CreateNumber( iTimeout );
-  cJSON_AddItemToObject( jsonOutPayload, "timeOut", jsonTimeout );
-
-  jsonActionAfterResult = cJSON_CreateString( pActionAfterResult );
-  cJSON_AddItemToObject( jsonOutPayload, "actionAfterResult", jsonActionAfterResult );
-
-  pPayloadOut = cJSON_PrintUnformatted( jsonOutPayload );
-
-  if (!pPayloadOut) {
-    dbg_out(DBG_ERROR, "Fatal error in creating creoir/asr/setContext JSON payload\n");
-    cJSON_Delete(jsonOutPayload);
-    return -10;
+  pMsg = mqtt_beginPublish( "creoir/asr/setContext", __FUNCTION__ );
+  if( NULL == pMsg ){
+    dbg_out(DBG_ERROR, "Did not get MQTT send slot for %s(). Aborting MQTT publish.\n", __FUNCTION__);
+    return -100;
   }
 
-  dbg_out(DBG_VERBOSE, "Sending grammar request\n");
+  json_writerInit( &json, pMsg->pPayload, MQTT_SEND_PAYLOAD_SIZE );
+  json_writeArrayBegin( &json, "contextNames" );
+  json_writeString( &json, NULL, pGrammarName );
+  json_writeArrayEnd( &json );
+  json_writeNumber( &json, "timeOut", iTimeout );
+  json_writeString( &json, "actionAfterResult", pActionAfterResult );
 
   // Send the topic
   /////////////////
-  if (getMQTTsendAccess(&pGlobalData->mqttSendMutex, __FUNCTION__) < 0) {
-    dbg_out(DBG_ERROR, "Did not get mutex lock for %s(). Aborting MQTT publish.\n", __FUNCTION__);
-    free(pPayloadOut);
-    cJSON_Delete(jsonOutPayload);
-    return -100;
+  if( mqtt_endPublish( pMsg, json_writerFinish( &json ), __FUNCTION__ ) < 0 ){
+    return -10;
   }
 
-  // Write message data to shared memory
-  sprintf(pGlobalData->mqttSharedData.pTopic, "%s", "creoir/asr/setContext");
-  strcpy(pGlobalData->mqttSharedData.pPayload, pPayloadOut);
-
-  // Send the topic
-  sendMQTTtopic(__FUNCTION__);
-
   dbg_out(DBG_VERBOSE, "Context request on the way\n");
-
-  free(pPayloadOut);
-  cJSON_Delete(jsonOutPayload);
   return 0;
 
-
 } // End of setGrammar()
 
 
@@ -1111,45 +1085,13 @@ int setGrammar( const char* pGrammarName, int iTimeout, const char* pActionAfter
 ********************************************************************/
 int handleEvt_onStartup( APPLICATION_EVENTDATA *eventData ){
 
-
-  cJSON *jsonWAW;
-  cJSON *jsonPayload;
-  char  *pPayload;
-
   if( NULL == eventData ){
     dbg_out(DBG_ERROR, "%s() eventData null pointer error\n", __FUNCTION__);
   }
 
   dbg_out(DBG_VERBOSE,"Requesting startup chime\n" );
 
-  jsonPayload = cJSON_CreateObject();
-
-  jsonWAW = cJSON_CreateString( "/usr/share/creoir/startup.wav" );
-  cJSON_AddItemToObject( jsonPayload,"file", jsonWAW );
-  pPayload = cJSON_PrintUnformatted( jsonPayload );
-
-  if( !pPayload ){
-    dbg_out(DBG_ERROR,"Fatal error creating payload at %s()\n", __FUNCTION__ );
-    cJSON_Delete( jsonPayload );
-    return -1;
-  }
-
-  if( getMQTTsendAccess( &pGlobalData->mqttSendMutex, __FUNCTION__) < 0 ){
-    dbg_out( DBG_ERROR,"Did not get mutex lock for %s(). Aborting MQTT publish.\n",__FUNCTION__ );
-    return -1;
-  }
-
-  // Write topic data to shared memory
-  sprintf( pGlobalData->mqttSharedData.pTopic,"%s", "creoir/talk/speak" );
-  strcpy( pGlobalData->mqttSharedData.pPayload, pPayload );
-
-  // Send the topic
-  sendMQTTtopic(__FUNCTION__);
-
-  free( pPayload );
-  cJSON_Delete( jsonPayload );
-
-  return 0;
+  return action_sendPrompt( PROMPT_STARTUP_CHIME );
 
 } // End of handleEvt_onStartup()
 
@@ -31,6 +31,8 @@
 
 #define JSONKEY_REASONCODE                "reasonCode"            //!< Numeric reason why recognition failed
 #define JSONKEY_REASONTEXT                "reasonText"            //!< Textual reason why recognition failed
+#define JSONKEY_NAME                      "name"                  //!< Speaker name in biometric identification
+#define JSONKEY_SCORE                     "score"                 //!< Identification score in biometric identification
 
 #define INTENT_SAVE_TSP_DUMP              "SAVE_TSP_DUMP"
 #define INTENT_SAVE_MAIN_DISPLAY_DUMP     "SAVE_MAIN_DISPLAY_DUMP"
@@ -63,12 +65,109 @@
 #define INTENT_MINIMIZE_ALL_WINDOWS       "MINIMIZE_ALL_WINDOWS"
 #define INTENT_DISPLAY_ALL_WINDOWS        "DISPLAY_ALL_WINDOWS"
 
+#define ASR_MAX_SLOTS                     8                       //!< Slots kept from one recognition result
+#define ASR_NAME_SIZE                     64                      //!< Intent, slot name and speaker name buffers
+#define ASR_TEXT_SIZE                     128                     //!< Slot value and reason text buffers
+
 
 
 /********************************************************************
   DATA TYPES
 ********************************************************************/
 
+/**
+ * @brief Fixed outbound messages. Pre-serialized by action_init() and sent with action_sendPrompt().
+ * 
+ */
+typedef enum
+{
+  // Vocalizer control
+  PROMPT_SPEECH_STOP,
+  // Chimes
+  PROMPT_WAKEUP_CHIME,
+  PROMPT_STARTUP_CHIME,
+  PROMPT_LOW_CONFIDENCE_CHIME,
+  // Spoken responses to intents
+  PROMPT_TSP_DUMP_SAVED,
+  PROMPT_MAIN_DISPLAY_DUMP_SAVED,
+  PROMPT_SHIP_SETTINGS,
+  PROMPT_DISPLAY_PATTERNS_ENABLED,
+  PROMPT_DISPLAY_PATTERNS_DISABLED,
+  PROMPT_ROUTES_VISIBLE,
+  PROMPT_ROUTES_HIDDEN,
+  PROMPT_MAP_NORTH_UP,
+  PROMPT_MAP_HEADING_UP,
+  PROMPT_TRUE_MOTION,
+  PROMPT_RANGE_RINGS_ENABLED,
+  PROMPT_RANGE_RINGS_HIDDEN,
+  PROMPT_RANGE_RINGS_DISABLED,
+  PROMPT_BEARING_SCALE_ENABLED,
+  PROMPT_BEARING_SCALE_HIDDEN,
+  PROMPT_BEARING_SCALE_DISABLED,
+  PROMPT_DAY_MODE,
+  PROMPT_DUSK_MODE,
+  PROMPT_NIGHT_MODE,
+  PROMPT_MAP_CENTERED,
+  PROMPT_TACTICAL_FIGURES_SHOWN,
+  PROMPT_TACTICAL_FIGURES_HIDDEN,
+  PROMPT_SMALL_MAP,
+  PROMPT_FULL_MAP,
+  PROMPT_ACTIVE_WINDOW_SAVED,
+  PROMPT_WINDOWS_MINIMIZED,
+  PROMPT_WINDOWS_SHOWN,
+  PROMPT_PATTERNS_ENABLED,
+  PROMPT_PATTERNS_DISABLED,
+  PROMPT_ROUTE_DISPLAY_ENABLED,
+  PROMPT_ROUTE_DISPLAY_DISABLED,
+  PROMPT_COUNT                          //!< Number of prompts. Keep last.
+}ACTION_PROMPT;
+
+
+/**
+ * @brief One slot of a recognition result
+ * 
+ */
+typedef struct
+{
+  char          name[ASR_NAME_SIZE];    //!< JSONKEY_SLOTNAME
+  char          value[ASR_TEXT_SIZE];   //!< JSONKEY_SLOTVALUE. Numbers as written.
+}ASR_SLOT_T;
+
+/**
+ * @brief Decoded creoir/asr/intentRecognized
+ * 
+ */
+typedef struct
+{
+  char          intent[ASR_NAME_SIZE];  //!< JSONKEY_INTENT
+  int           confidence;             //!< JSONKEY_CONFIDENCE, 0-10000
+  int           numSlots;               //!< Valid entries in slots
+  ASR_SLOT_T    slots[ASR_MAX_SLOTS];   //!< JSONKEY_SLOTS, the first ASR_MAX_SLOTS
+}ASR_INTENT_T;
+
+/**
+ * @brief Decoded creoir/asr/intentNotRecognized
+ * 
+ */
+typedef struct
+{
+  int           reasonCode;             //!< JSONKEY_REASONCODE
+  char          reasonText[ASR_TEXT_SIZE]; //!< JSONKEY_REASONTEXT
+  char          intent[ASR_NAME_SIZE];  //!< Rejected intent. Empty if none.
+  int           confidence;             //!< Confidence of the rejected intent
+  bool          hasConfidence;          //!< The result had a confidence
+}ASR_REJECTION_T;
+
+/**
+ * @brief Decoded creoir/biometrics/identification
+ * 
+ */
+typedef struct
+{
+  char          name[ASR_NAME_SIZE];    //!< Speaker name
+  int           score;                  //!< Identification score
+  bool          hasScore;               //!< The result had a score
+}BIOM_IDENTIFICATION_T;
 
 
 /********************************************************************
@@ -76,14 +175,30 @@
 ********************************************************************/
 
 
+/**
+ * @brief Builds the prompt cache. Called once from app_init().
+ * 
+ * @return int 0=OK, nonzero=Error code
+ */
+int action_init( void );
+
+
+/**
+ * @brief Publishes a fixed message from the prompt cache. Does not serialize or allocate.
+ * 
+ * @param prompt The prompt
+ * @return int 0=OK, nonzero=Error code
+ */
+int action_sendPrompt( ACTION_PROMPT prompt );
+
+
 /**
  * @brief Handles intent SAVE_TSP_DUMP
  * 
- * @param int iConfidence      Confidence level of intent
- * @param cJSON* jsonSlotArray Ptr to slot array (may be null)
+ * @param pIntent Recognition result with confidence and slots
  * @return int 0=OK, nonzero=Error code
  */
-int action_saveTacticalSituation( int iConfidence, cJSON* jsonSlotArray );
+int action_saveTacticalSituation( const ASR_INTENT_T *pIntent );
 
 
 /**
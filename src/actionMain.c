@@ -34,6 +34,13 @@
 #include "actionMain.h"
 #include "util.h"
 #include "action.h"
+#include "eventQueue.h"
+#include "eventPayload.h"
+#include "mqttOutbox.h"
+#include "mqttStats.h"
+#include "mqttSpool.h"
+#include "mqttRouter.h"
+#include "reactor.h"
 
 /********************************************************************
   LOCAL DEFINES
@@ -49,13 +56,48 @@
 // Globally available heap data
 globalData_type *pGlobalData;
 
+// Link MQTT topics and related handler functions. Copied to the topic router by app_init().
+const mqtt_action mqttActionRegister[] = {
+  {"creoir/asr/wakewordDetected",       &handle_MQTTonWakeword},
+  {"creoir/asr/intentRecognized",       &handle_MQTTintentRecognized},
+  {"creoir/asr/intentNotRecognized",    &handle_MQTTintentNotRecognized},
+  {"creoir/biometrics/identification",  &handle_MQTTuserIdentified},
+  {"creoir/app/stop",                   &handleMQTT_app_stop},
+};
+const size_t mqttActionRegisterSize = sizeof(mqttActionRegister)/sizeof(mqtt_action);
+
+/* Publish options per outgoing topic. First match wins; keep the catch-all entry last. */
+const mqtt_publish_policy mqttPublishPolicyRegister[] = {
+  { .topic = "creoir/talk/speak",      .qos = 1, .retain = false, .lane = MQTT_LANE_HIGH,   .expiryMs = 5000,  .dedupMs = 1500, .ratePerSec = 2, .burst = 4, .spoolTtlMs = 0,       .bargeIn = true  },  // Chimes and speech are stale after a few seconds. Repeats flood the vocalizer.
+  { .topic = "creoir/talk/stop",       .qos = 1, .retain = false, .lane = MQTT_LANE_HIGH,   .expiryMs = 1000,  .dedupMs = 0,    .ratePerSec = 0, .burst = 0, .spoolTtlMs = 0,       .bargeIn = false },  // Barge-in. Must reach the vocalizer before the next chime.
+  { .topic = "creoir/asr/setContext",  .qos = 1, .retain = false, .lane = MQTT_LANE_NORMAL, .expiryMs = 0,     .dedupMs = 0,    .ratePerSec = 0, .burst = 0, .spoolTtlMs = 600000,  .bargeIn = false },  // Setting a grammar twice is harmless. The ASR needs the last one.
+  { .topic = MQTT_STATS_DEFAULT_TOPIC, .qos = 0, .retain = false, .lane = MQTT_LANE_LOW,    .expiryMs = 10000, .dedupMs = 0,    .ratePerSec = 0, .burst = 0, .spoolTtlMs = 0,       .bargeIn = false },  // Telemetry. The next report replaces a lost one.
+  { .topic = "#",                      .qos = 2, .retain = false, .lane = MQTT_LANE_NORMAL, .expiryMs = 0,     .dedupMs = 0,    .ratePerSec = 0, .burst = 0, .spoolTtlMs = 3600000, .bargeIn = false },
+};
+const size_t mqttPublishPolicyRegisterSize = sizeof(mqttPublishPolicyRegister)/sizeof(mqtt_publish_policy);
+_Static_assert( sizeof(mqttPublishPolicyRegister)/sizeof(mqtt_publish_policy) <= MQTT_MAX_PUBLISH_POLICIES, "Increase MQTT_MAX_PUBLISH_POLICIES" );
+
+// Dispatch threads 1..eventWorkers-1. The main thread serves worker queue 0.
+static pthread_t eventWorker[EVENT_MAX_WORKERS];
+
+// Per event type latency histograms. Filled only with --eventTiming=1.
+static LATENCY_HIST dwellHist[EVT_COUNT];     // From pushEvent() to dispatch
+static LATENCY_HIST handlerHist[EVT_COUNT];   // Handler execution
+
 
 /********************************************************************
   LOCAL PROTOTYPES (Global ones are in header file)
 ********************************************************************/
 int app_init( void );
 int app_eventloop(void);
+int popEvents( EVENTITEM_T *pEvents, int maxEvents );
 void* readKeyboard( void* voidParam );
+static int  startEventWorkers( void );
+static void stopEventWorkers( void );
+static void* eventWorkerThread( void* pQueue );
+static void runEventQueue( EVENTQUEUE_T *pQueue );
+static EVENTQUEUE_T* routeEvent( APPLICATION_EVENT event, unsigned int keyHash );
+static void logEventTiming( int type );
 
 /********************************************************************
   FUNCTIONS
@@ -80,6 +122,23 @@ void printUsage(void) {
   printf("  --verbose=<0/1/2/3>\n");
   printf("  --mqttHost=<address>\n");
   printf("  --mqttPort=<port>>\n");
+  printf("  --eventQueueSize=<max queued events>\n");
+  printf("  --overflowPolicy=<EVT_x:block/oldest/newest/lowest,...>\n");
+  printf("  --eventWorkers=<number of event dispatch threads>\n");
+  printf("  --eventTiming=<0/1>   Measure event queue dwell and handler times. Press 's' to print.\n");
+  printf("  --reactor=<0/1>       Run MQTT, keyboard and event handlers in one thread\n");
+  printf("  --outboxSize=<outbound MQTT message slots>\n");
+  printf("  --inflightWindow=<unacknowledged QoS 1/2 publishes, 0=no limit>\n");
+  printf("  --directPublish=<0/1> Publish on the calling thread instead of the MQTT sender thread\n");
+  printf("  --bargeInStop=<0/1>   Ask the vocalizer to stop speaking when a new interaction starts\n");
+  printf("  --parseOnReceive=<0/1> Decode ASR and biometrics messages on the MQTT thread before queuing\n");
+  printf("  --spoolFile=<path>    Keep outbound MQTT messages in this file while disconnected\n");
+  printf("  --spoolSize=<bytes>   Size of the spool file (default %d)\n", MQTT_SPOOL_DEFAULT_SIZE);
+  printf("  --statsTopic=<topic>  Periodic MQTT statistics topic (default %s)\n", MQTT_STATS_DEFAULT_TOPIC);
+  printf("  --statsInterval=<seconds between statistics, 0=off>\n");
+  printf("  --payloadPoolSize=<blocks, 0=heap only>\n");
+  printf("  --payloadBlockSize=<bytes>\n");
+  printf("  --payloadPoolFallback=<heap/drop>\n");
   
   printf("\n\n");
 
@@ -117,6 +176,33 @@ static int getArg(char* arg, char** prop, char** value) {
 }  // End of getArg()
 
 
+/********************************************************************
+  getCountArg()
+
+  Parameters: [in]  Property (key)
+              [in]  Value of the property
+              [in]  Smallest accepted value
+              [out] Count. Left unchanged if the value is rejected.
+  Returns:    0 = ok, 1 = value rejected
+
+  Description:
+  Parses a count option. atoi() of a negative value would wrap
+  around in the unsigned field, so such values are rejected and
+  the default is kept.
+
+********************************************************************/
+static int getCountArg(const char* prop, const char* value, int minValue, unsigned int* pCount) {
+    int i = atoi(value);
+
+    if (i < minValue) {
+        dbg_out(DBG_ERROR, "%s=%s rejected. Must be at least %d. Using %u.\n", prop, value, minValue, *pCount);
+        return 1;
+    }
+    *pCount = (unsigned int)i;
+    return 0;
+}  // End of getCountArg()
+
+
 
 /********************************************************************
   readKeyboard()
@@ -132,12 +218,8 @@ static int getArg(char* arg, char** prop, char** value) {
 void* readKeyboard( void* voidParam ){
 
   char c;
-  APPLICATION_EVENTDATA eventData;
   static struct termios oldTerm, newTerm;   // Needed by Ubuntu
 
-  memset(&eventData, 0x00, sizeof(APPLICATION_EVENTDATA));
-  eventData.payloadPtr = NULL;
-
   dbg_out( DBG_VERBOSE,"Keyboard reader thread started.\n" );
 
   // No pressing of Enter to have characters fed to application getchar()
@@ -149,10 +231,7 @@ void* readKeyboard( void* voidParam ){
   // Loops forever. Unless application is exiting.
   while( !pGlobalData->appExit ){
     c = getchar();
-    if( ' ' == c || 'w' == c | 'W' == c){
-      eventData.topicPayload[0]=c;
-      pushEvent( EVT_KEYPRESS, &eventData );
-    }
+    handleKey( c );
   } // End while(forever)
 
   tcsetattr( STDIN_FILENO, TCSANOW, &oldTerm);
@@ -164,6 +243,36 @@ void* readKeyboard( void* voidParam ){
 
 
 
+/********************************************************************
+  handleKey()
+
+  Parameters: (in) Key
+
+  Returns:    void
+
+  Description:
+  Posts keyboard events to main loop. Called by readKeyboard() or by
+  the reactor loop.
+    
+********************************************************************/
+void handleKey( char c ){
+
+  APPLICATION_EVENTDATA eventData;
+
+  memset(&eventData, 0x00, sizeof(APPLICATION_EVENTDATA));
+
+  if( ' ' == c || 'w' == c || 'W' == c){
+    eventData.param = c;
+    pushEvent( EVT_KEYPRESS, &eventData );
+  }else if( 's' == c || 'S' == c ){
+    logEventTiming( DBG_NOTE );
+    mqttOutbox_logStats( DBG_NOTE );
+    mqttSpool_logStats( DBG_NOTE );
+    mqttStats_log( DBG_NOTE );
+  }
+}  // End of handleKey()
+
+
 /********************************************************************
   main()
 
@@ -188,16 +297,21 @@ int main( int argc, char *argv[] ) {
 
   pGlobalData->appExit = 0; // If set to nonzero, "forever" loops will terminate.
 
-  // Allocate memory for shared MQTT send data
-  pGlobalData->mqttSharedData.pTopic = malloc( MQTT_SEND_TOPIC_SIZE );
-  pGlobalData->mqttSharedData.pPayload = malloc( MQTT_SEND_PAYLOAD_SIZE );
-  pGlobalData->mqttSharedData.dataSent=1;
-
   // Default parameters for MQTT broker
   strcpy( pGlobalData->mqttHost, MQTT_HOST_ADDRESS );
   strcpy( pGlobalData->mqttPort, MQTT_HOST_PORT );
 
   pGlobalData->debugMask=DBG_FATAL+DBG_ERROR+DBG_NOTE+DBG_IMPORTANT;
+  pGlobalData->eventQueueSize = EVQ_DEFAULT_CAPACITY;
+  pGlobalData->eventWorkers = 1;
+  pGlobalData->outboxSize = MQTT_OUTBOX_DEFAULT_SLOTS;
+  pGlobalData->inflightWindow = MQTT_INFLIGHT_DEFAULT_WINDOW;
+  pGlobalData->spoolSize = MQTT_SPOOL_DEFAULT_SIZE;
+  strcpy( pGlobalData->statsTopic, MQTT_STATS_DEFAULT_TOPIC );
+  pGlobalData->statsInterval = MQTT_STATS_DEFAULT_INTERVAL;
+  pGlobalData->payloadPoolSize = PAYLOAD_POOL_DEFAULT_BLOCKS;
+  pGlobalData->payloadBlockSize = PAYLOAD_POOL_DEFAULT_BLOCKSIZE;
+  pGlobalData->payloadPoolFallback = PAYLOAD_FALLBACK_HEAP;
 
   dbg_out(DBG_NOTE, "Biometrics test action code version %d.%d.%d\n", APP_VERSION_MAJOR, APP_VERSION_MINOR, APP_VERSION_BUILD);
 
@@ -235,6 +349,59 @@ int main( int argc, char *argv[] ) {
     }else if (0 == strcmp(argKey, "--mqttPort")) {
       strcpy( pGlobalData->mqttPort,argValue );
       dbg_out( DBG_VERBOSE, "Using MQTT host %s\n", pGlobalData->mqttPort );
+    }else if (0 == strcmp(argKey, "--eventQueueSize")) {
+      getCountArg( argKey, argValue, 1, &pGlobalData->eventQueueSize );
+      dbg_out( DBG_VERBOSE, "Event queue size %u\n", pGlobalData->eventQueueSize );
+    }else if (0 == strcmp(argKey, "--overflowPolicy")) {
+      snprintf( pGlobalData->overflowPolicy, sizeof(pGlobalData->overflowPolicy), "%s", argValue );
+      dbg_out( DBG_VERBOSE, "Event queue overflow policy %s\n", pGlobalData->overflowPolicy );
+    }else if (0 == strcmp(argKey, "--eventWorkers")) {
+      i = atoi(argValue);
+      pGlobalData->eventWorkers = ( i < 1 ) ? 1 : ( i > EVENT_MAX_WORKERS ) ? EVENT_MAX_WORKERS : i;
+      dbg_out( DBG_VERBOSE, "Event dispatch threads %u\n", pGlobalData->eventWorkers );
+    }else if (0 == strcmp(argKey, "--eventTiming")) {
+      pGlobalData->eventTiming = atoi(argValue);
+      dbg_out( DBG_VERBOSE, "Event timing %s\n", pGlobalData->eventTiming ? "on" : "off" );
+    }else if (0 == strcmp(argKey, "--reactor")) {
+      pGlobalData->reactorMode = atoi(argValue);
+      dbg_out( DBG_VERBOSE, "Reactor mode %s\n", pGlobalData->reactorMode ? "on" : "off" );
+    }else if (0 == strcmp(argKey, "--outboxSize")) {
+      getCountArg( argKey, argValue, 1, &pGlobalData->outboxSize );
+      dbg_out( DBG_VERBOSE, "MQTT outbox size %u\n", pGlobalData->outboxSize );
+    }else if (0 == strcmp(argKey, "--inflightWindow")) {
+      getCountArg( argKey, argValue, 0, &pGlobalData->inflightWindow );   // 0=no limit
+      if( pGlobalData->inflightWindow > MQTT_INFLIGHT_MAX_WINDOW ) pGlobalData->inflightWindow = MQTT_INFLIGHT_MAX_WINDOW;
+      dbg_out( DBG_VERBOSE, "MQTT in-flight window %u\n", pGlobalData->inflightWindow );
+    }else if (0 == strcmp(argKey, "--bargeInStop")) {
+      pGlobalData->bargeInStop = atoi(argValue);
+      dbg_out( DBG_VERBOSE, "Barge-in stop request %s\n", pGlobalData->bargeInStop ? "on" : "off" );
+    }else if (0 == strcmp(argKey, "--parseOnReceive")) {
+      pGlobalData->parseOnReceive = atoi(argValue);
+      dbg_out( DBG_VERBOSE, "Parse on receive %s\n", pGlobalData->parseOnReceive ? "on" : "off" );
+    }else if (0 == strcmp(argKey, "--directPublish")) {
+      pGlobalData->directPublish = atoi(argValue);
+      dbg_out( DBG_VERBOSE, "Direct publish %s\n", pGlobalData->directPublish ? "on" : "off" );
+    }else if (0 == strcmp(argKey, "--spoolFile")) {
+      snprintf( pGlobalData->spoolFile, sizeof(pGlobalData->spoolFile), "%s", argValue );
+      dbg_out( DBG_VERBOSE, "Spool file %s\n", pGlobalData->spoolFile );
+    }else if (0 == strcmp(argKey, "--spoolSize")) {
+      getCountArg( argKey, argValue, 1, &pGlobalData->spoolSize );
+      dbg_out( DBG_VERBOSE, "Spool size %u\n", pGlobalData->spoolSize );
+    }else if (0 == strcmp(argKey, "--statsTopic")) {
+      snprintf( pGlobalData->statsTopic, sizeof(pGlobalData->statsTopic), "%s", argValue );
+      dbg_out( DBG_VERBOSE, "Statistics topic %s\n", pGlobalData->statsTopic );
+    }else if (0 == strcmp(argKey, "--statsInterval")) {
+      pGlobalData->statsInterval = atoi(argValue);
+      dbg_out( DBG_VERBOSE, "Statistics interval %u s\n", pGlobalData->statsInterval );
+    }else if (0 == strcmp(argKey, "--payloadPoolSize")) {
+      getCountArg( argKey, argValue, 0, &pGlobalData->payloadPoolSize );  // 0=heap only
+      dbg_out( DBG_VERBOSE, "Payload pool size %u\n", pGlobalData->payloadPoolSize );
+    }else if (0 == strcmp(argKey, "--payloadBlockSize")) {
+      getCountArg( argKey, argValue, 1, &pGlobalData->payloadBlockSize );
+      dbg_out( DBG_VERBOSE, "Payload block size %u\n", pGlobalData->payloadBlockSize );
+    }else if (0 == strcmp(argKey, "--payloadPoolFallback")) {
+      pGlobalData->payloadPoolFallback = ( 0 == strcmp(argValue, "drop") ) ? PAYLOAD_FALLBACK_DROP : PAYLOAD_FALLBACK_HEAP;
+      dbg_out( DBG_VERBOSE, "Payload pool fallback %s\n", argValue );
     }
 
 
@@ -247,15 +414,30 @@ int main( int argc, char *argv[] ) {
   }
   dbg_out( DBG_VERBOSE, "cJSON version: %s\n", cJSON_Version() );
 
-  app_init();
+  if( app_init() ){
+    dbg_out( DBG_FATAL, "Application initialization failed.\n" );
+    exit( -1 );
+  }
 
-  app_eventloop();
+  if( pGlobalData->reactorMode ){
+    reactor_run();
+  }else{
+    app_eventloop();
+  }
 
   cleanMemAllocations();
+  logEventTiming( DBG_NOTE );
+  eventQueue_logStats( pGlobalData->eventQueue, DBG_NOTE );
+  eventQueue_destroy( pGlobalData->eventQueue );
+  eventPayload_logStats( DBG_NOTE );
+  eventPayload_destroyPool();
+
+  mqttOutbox_logStats( DBG_NOTE );
+  mqttSpool_logStats( DBG_NOTE );
+  mqttStats_log( DBG_NOTE );
+  mqttSpool_sync();
 
   // Cleanup
-  free( pGlobalData->mqttSharedData.pTopic );
-  free( pGlobalData->mqttSharedData.pPayload );
   free( pGlobalData );
   dbg_out( DBG_NOTE, "*** Biometrics test action code execution terminating. ***" );
   
@@ -294,34 +476,34 @@ long timedifference_msec( struct timeval t0, struct timeval t1 )
   Returns:    void
 
   Description:
-  Pops an event from event queue
+  Pops an event from event queue. Blocks while the queue is empty.
     
 ********************************************************************/
 void popEvent( APPLICATION_EVENT *event, APPLICATION_EVENTDATA *eventData )
 {
-  // sem_wait( pGlobalData->eventSemap );  // Acquire semaphore
-  mt_semaphore_acquire( pGlobalData->eventSemap );
-  
-  //pthread_mutex_lock( pGlobalData->eventMutex );
-  mt_mutex_lock( pGlobalData->eventMutex );
-  if( pGlobalData->eventListHead != NULL ){
-    EVENTNODE_T *eventNode = pGlobalData->eventListHead;
-    *event = eventNode->eventType;
-    strcpy( eventData->topicPayload, eventNode->eventData.topicPayload );
-    eventData->payloadPtr = eventNode->eventData.payloadPtr;
-
-    pGlobalData->eventListHead = pGlobalData->eventListHead->next;
-    if( NULL == pGlobalData->eventListHead ){
-      pGlobalData->eventListTail = NULL;
-    }
-    free( eventNode );
-  }
-  //pthread_mutex_unlock( pGlobalData->eventMutex );
-  mt_mutex_unlock( pGlobalData->eventMutex );
-  return;
+  eventQueue_pop( pGlobalData->eventQueue, event, eventData );
 } // End of popEvent()
 
 
+/********************************************************************
+  popEvents()
+
+  Parameters: (out) Event array
+              (in)  Array size
+
+  Returns:    Number of events returned
+
+  Description:
+  Pops all pending events (up to array size) from event queue in one
+  step. Blocks while the queue is empty.
+    
+********************************************************************/
+int popEvents( EVENTITEM_T *pEvents, int maxEvents )
+{
+  return eventQueue_popBatch( pGlobalData->eventQueue, pEvents, maxEvents );
+} // End of popEvents()
+
+
 /********************************************************************
   pushEvent()
 
@@ -335,32 +517,55 @@ void popEvent( APPLICATION_EVENT *event, APPLICATION_EVENTDATA *eventData )
 ********************************************************************/
 void pushEvent( APPLICATION_EVENT event, const APPLICATION_EVENTDATA *eventData )
 {
-  EVENTNODE_T *newEvent = 0;
-  //pthread_mutex_lock( pGlobalData->eventMutex );
-  mt_mutex_lock( pGlobalData->eventMutex );
-
-  newEvent = malloc( sizeof(EVENTNODE_T) );
-  newEvent->eventType = event;
-  strcpy( newEvent->eventData.topicPayload, eventData->topicPayload );
-  newEvent->eventData.payloadPtr = eventData->payloadPtr;
-  newEvent->next = NULL;
-  if( NULL == pGlobalData->eventListHead ){
-    pGlobalData->eventListHead = newEvent;
-  }
+  eventQueue_push( routeEvent( event, 0 ), event, eventData );
+}  // End of pushEvent()
 
-  if( NULL == pGlobalData->eventListTail ){
-    pGlobalData->eventListTail = newEvent;
-  }
-  else{
-    pGlobalData->eventListTail->next = newEvent;
-    pGlobalData->eventListTail = newEvent;
-  }
-  //pthread_mutex_unlock( pGlobalData->eventMutex );
-  mt_mutex_unlock( pGlobalData->eventMutex );
 
-  //sem_post( pGlobalData->eventSemap ); // Release semaphore
-  mt_semaphore_release( pGlobalData->eventSemap );
-}  // End of pushEvent()
+/********************************************************************
+  pushEventKeyed()
+
+  Parameters: (in) Event structure
+              (in) Coalescing key
+
+  Returns:    void
+
+  Description:
+  Pushes a new event to event queue. A queued event of the same type
+  and key gets the new data instead.
+    
+********************************************************************/
+void pushEventKeyed( APPLICATION_EVENT event, const APPLICATION_EVENTDATA *eventData, const char *pKey )
+{
+  unsigned int       keyHash = 2166136261u;
+  const char        *p;
+
+  // FNV-1a. Events of one key always go to the same worker and stay in order.
+  for( p = pKey ? pKey : ""; *p; p++ ) keyHash = ( keyHash ^ (unsigned char)*p ) * 16777619u;
+  eventQueue_pushKeyed( routeEvent( event, keyHash ), event, eventData, pKey );
+}  // End of pushEventKeyed()
+
+
+/********************************************************************
+  routeEvent()
+
+  Parameters: (in) Event
+              (in) Hash of the event key, 0 if none
+
+  Returns:    Event queue of the worker that handles the event
+
+  Description:
+  Picks the dispatch thread of an event. Events are routed by type
+  and key, so events of the same type and key are handled in order
+  by one thread. Control events always go to the main thread.
+    
+********************************************************************/
+static EVENTQUEUE_T* routeEvent( APPLICATION_EVENT event, unsigned int keyHash )
+{
+  if( pGlobalData->eventWorkers <= 1 || EVQ_CLASS_CONTROL == eventQueue_classOf( event ) ){
+    return pGlobalData->eventQueue;
+  }
+  return pGlobalData->workerQueue[ ( (unsigned int)event * 2654435761u ^ keyHash ) % pGlobalData->eventWorkers ];
+}  // End of routeEvent()
 
 
 /********************************************************************
@@ -376,99 +581,283 @@ void pushEvent( APPLICATION_EVENT event, const APPLICATION_EVENTDATA *eventData
 ********************************************************************/
 void emptyEventList()
 {
-  //pthread_mutex_lock( pGlobalData->eventMutex );
-  mt_mutex_lock( pGlobalData->eventMutex );
+  eventQueue_clear( pGlobalData->eventQueue );
+}  // End of emptyEventList()
+
+
+/********************************************************************
+  dispatchEvent()
+
+  Parameters: (in) Event
+              (in) Event data
+
+  Returns:    void
+
+  Description:
+  Calls the handler of one application event
+    
+********************************************************************/
+static void dispatchEvent( APPLICATION_EVENT applicationEvent, APPLICATION_EVENTDATA *pEventData )
+{
+  switch( applicationEvent ){
+
+    case EVT_MQTT_WAKEWORD:
+      dbg_out(DBG_VERBOSE, "EVT_MQTT_WAKEWORD\n");
+      handleEvt_onWakeword(pEventData);
+      break;
+
+    case EVT_MQTT_INTENT_RECOGNIZED:
+      dbg_out(DBG_VERBOSE, "EVT_MQTT_INTENT_RECOGNIZED\n");
+      handleEvt_intentRecognized(pEventData);
+      break;
+
+    case EVT_MQTT_INTENT_NOT_RECOGNIZED:
+      dbg_out(DBG_VERBOSE, "EVT_MQTT_INTENT_NOT_RECOGNIZED\n");
+      handleEvt_intentNotRecognized(pEventData);
+      break;
+
+    case EVT_MQTT_BIOM_IDENTIFICATION:
+      dbg_out(DBG_VERBOSE, "EVT_MQTT_BIOM_IDENTIFICATION\n");
+      handleEvt_MQTTuserIdentified(pEventData);
+      break;
+
+    case EVT_KEYPRESS:
+      dbg_out(DBG_NORM, "EVT_KEYPRESS - Simulates push-to-talk button\n");
+      handleEvt_onWakeword( pEventData );
+
+      // Check what key was pressed and act upon that
+      if( ' ' == pEventData->param ){
+        // If space pressed, enable main grammar and after recognition result resume to Idle mode. (Waits for key press.)
+        setGrammar( "MAIN_9LV", 4000, "resumeToIdle" );
+      }else if( 'w' == pEventData->param || 'W' == pEventData->param ){
+        // If 'W' pressed, enable main grammar and after recognition result start listening to wakeword (and still keep reading also keyboard)
+        setGrammar( "MAIN_9LV", 4000, "goToAutomaticMode" );
+      }
+      break;
+
+    case EVT_STARTUP:
+      handleEvt_onStartup( pEventData );
+      break;
+
+    case EVT_APP_STOP:
+      dbg_out( DBG_VERBOSE, "EVT_APP_STOP\n");
+      pGlobalData->appExit=1;
+      break;
+
+    case EVT_MQTT_READY:
+      dbg_out( DBG_NORM, "EVT_MQTT_READY - subscriptions acknowledged %d ms after connect\n", pEventData->param );
+      break;
+
+    default:
+      dbg_out( DBG_ERROR, "Unknown event %d received\n",applicationEvent );
+
+  }  // End switch
+
+}  // End of dispatchEvent()
+
+
+/********************************************************************
+  runEventQueue()
+
+  Parameters: (in) Event queue
+
+  Returns:    void
+
+  Description:
+  Dispatch loop of one thread.
+  Takes all pending events from the queue in one step and dispatches
+  them locally. Blocks only when the queue is empty.
+    
+********************************************************************/
+static void runEventQueue( EVENTQUEUE_T *pQueue )
+{
+  EVENTITEM_T           events[EVQ_BATCH_MAX];
+  int                   numEvents;
+
+  do{
+
+    numEvents = eventQueue_popBatch( pQueue, events, EVQ_BATCH_MAX );
+    dispatchEvents( events, numEvents );
+
+  }while ( !pGlobalData->appExit );
+}  // End of runEventQueue()
+
+
+/********************************************************************
+  dispatchEvents()
+
+  Parameters: (in) Dequeued events
+              (in) Number of events
+
+  Returns:    void
+
+  Description:
+  Dispatches a batch of events, measuring them if they carry an
+  enqueue time stamp.
+    
+********************************************************************/
+void dispatchEvents( EVENTITEM_T *pEvents, int numEvents )
+{
+  int                   i;
+  uint64_t              t0;
+
+  for( i=0; i<numEvents; i++ ){
+    if( pGlobalData->appExit ){
+      // Exiting. Only release the payload.
+    }else if( pEvents[i].enqueueNs ){
+      t0 = monotonic_ns();
+      latency_record( &dwellHist[ pEvents[i].eventType ], t0 - pEvents[i].enqueueNs );
+      dispatchEvent( pEvents[i].eventType, &pEvents[i].eventData );
+      latency_record( &handlerHist[ pEvents[i].eventType ], monotonic_ns() - t0 );
+    }else{
+      dispatchEvent( pEvents[i].eventType, &pEvents[i].eventData );
+    }
+    // Payload was moved to us with the event. Release it once dispatched.
+    eventPayload_release( pEvents[i].eventData.pPayload );
+  }
+}  // End of dispatchEvents()
+
+
+/********************************************************************
+  logEventTiming()
+
+  Parameters: (in) dbg_out() category
+
+  Returns:    void
+
+  Description:
+  Prints dwell and handler time percentiles of every event type that
+  has been measured.
+    
+********************************************************************/
+static void logEventTiming( int type )
+{
+  char szName[64];
+  int  e;
 
-  while( pGlobalData->eventListHead != NULL ){
-    EVENTNODE_T *eventNode = pGlobalData->eventListHead;
-    pGlobalData->eventListHead = pGlobalData->eventListHead->next;
-    free( eventNode );
+  if( !pGlobalData->eventTiming ){
+    dbg_out( type, "Event timing is off. Start with --eventTiming=1\n" );
+    return;
   }
-  // pthread_mutex_unlock( pGlobalData->eventMutex );
-  mt_mutex_unlock( pGlobalData->eventMutex );
-}  // End of emptyEventList()
+
+  for( e=0; e<EVT_COUNT; e++ ){
+    if( 0 == atomic_load( &dwellHist[e].count ) ) continue;
+    snprintf( szName, sizeof(szName), "%s dwell", eventQueue_eventName( (APPLICATION_EVENT)e ) );
+    latency_log( type, szName, &dwellHist[e] );
+    snprintf( szName, sizeof(szName), "%s handler", eventQueue_eventName( (APPLICATION_EVENT)e ) );
+    latency_log( type, szName, &handlerHist[e] );
+  }
+}  // End of logEventTiming()
 
 
 /********************************************************************
-  app_eventloop()
+  eventWorkerThread()
+
+  Parameters: (in) Event queue of the worker
+
+  Returns:    NULL
+
+  Description:
+  Dispatch thread of one worker queue.
+    
+********************************************************************/
+static void* eventWorkerThread( void* pQueue )
+{
+  runEventQueue( (EVENTQUEUE_T*)pQueue );
+  return NULL;
+}  // End of eventWorkerThread()
+
+
+/********************************************************************
+  startEventWorkers()
 
   Parameters: void
-  Returns:    0=Requested stop, negative=error
+
+  Returns:    0=OK, negative=error
 
   Description:
-  Application main event loop
+  Creates the queues and threads of workers 1..eventWorkers-1.
+  Worker 0 is the main thread serving eventQueue.
     
 ********************************************************************/
-int app_eventloop(void){
+static int startEventWorkers( void )
+{
+  unsigned int i;
 
-  APPLICATION_EVENT     applicationEvent;
-  APPLICATION_EVENTDATA eventData;
-  int                   ret;
-  long                  elapsedTime;
-  //struct  timeval       nowtime;
-  //struct  timeval       prevtime;
-  uint64_t              delta_ms;
-  char                  message[128];
-  
-  dbg_out( DBG_NORM, "Event dispatcher starting...\n" );
-  //gettimeofday(&prevtime, NULL); // Previus trigger time is at device start
+  pGlobalData->workerQueue[0] = pGlobalData->eventQueue;
 
-  // Run the main event loop
-  do{
+  for( i=1; i<pGlobalData->eventWorkers; i++ ){
+    pGlobalData->workerQueue[i] = eventQueue_create( pGlobalData->eventQueueSize );
+    if( NULL == pGlobalData->workerQueue[i] ) break;
+    eventQueue_setTimestamps( pGlobalData->workerQueue[i], pGlobalData->eventTiming );
+    if( pGlobalData->overflowPolicy[0] ) eventQueue_parseOverflow( pGlobalData->workerQueue[i], pGlobalData->overflowPolicy );
 
-    popEvent( &applicationEvent, &eventData );
-    switch( applicationEvent ){
+    if( pthread_create( &eventWorker[i], NULL, eventWorkerThread, pGlobalData->workerQueue[i] ) ){
+      dbg_out( DBG_ERROR, "%s() Failed to start event worker %u.\n", __FUNCTION__, i );
+      eventQueue_destroy( pGlobalData->workerQueue[i] );
+      break;
+    }
+  } // End for
 
-      case EVT_MQTT_WAKEWORD:
-        dbg_out(DBG_VERBOSE, "EVT_MQTT_WAKEWORD\n");
-        handleEvt_onWakeword(&eventData);
-        break;
+  if( i < pGlobalData->eventWorkers ){
+    pGlobalData->eventWorkers = i;
+    stopEventWorkers();
+    return -1;
+  }
 
-      case EVT_MQTT_INTENT_RECOGNIZED:
-        dbg_out(DBG_VERBOSE, "EVT_MQTT_INTENT_RECOGNIZED\n");
-        handleEvt_intentRecognized(&eventData);
-        break;
+  dbg_out( DBG_NORM, "Dispatching events on %u threads.\n", pGlobalData->eventWorkers );
+  return 0;
+}  // End of startEventWorkers()
 
-      case EVT_MQTT_INTENT_NOT_RECOGNIZED:
-        dbg_out(DBG_VERBOSE, "EVT_MQTT_INTENT_NOT_RECOGNIZED\n");
-        handleEvt_intentNotRecognized(&eventData);
-        break;
 
-      case EVT_MQTT_BIOM_IDENTIFICATION:
-        dbg_out(DBG_VERBOSE, "EVT_MQTT_BIOM_IDENTIFICATION\n");
-        handleEvt_MQTTuserIdentified(&eventData);
-        break;
+/********************************************************************
+  stopEventWorkers()
 
-      case EVT_KEYPRESS:
-        dbg_out(DBG_NORM, "EVT_KEYPRESS - Simulates push-to-talk button\n");
-        handleEvt_onWakeword( &eventData );
+  Parameters: void
 
-        // Check what key was pressed and act upon that
-        if( ' ' == eventData.topicPayload[0] ){
-          // If space pressed, enable main grammar and after recognition result resume to Idle mode. (Waits for key press.)
-          setGrammar( "MAIN_9LV", 4000, "resumeToIdle" );
-        }else if( 'w' == eventData.topicPayload[0] || 'W' == eventData.topicPayload[0] ){
-          // If 'W' pressed, enable main grammar and after recognition result start listening to wakeword (and still keep reading also keyboard)
-          setGrammar( "MAIN_9LV", 4000, "goToAutomaticMode" );
-        }
-        break;
+  Returns:    void
 
-      case EVT_STARTUP:
-        handleEvt_onStartup( &eventData );
-        break;
+  Description:
+  Wakes every worker with EVT_APP_STOP, waits for it to exit and
+  releases its queue.
+    
+********************************************************************/
+static void stopEventWorkers( void )
+{
+  APPLICATION_EVENTDATA eventData;
+  unsigned int          i;
 
-      case EVT_APP_STOP:
-        dbg_out( DBG_VERBOSE, "EVT_APP_STOP\n");
-        pGlobalData->appExit=1;
-        break;
+  memset( &eventData, 0x00, sizeof(APPLICATION_EVENTDATA) );
+  pGlobalData->appExit = 1;
 
-      default:
-        dbg_out( DBG_ERROR, "Unknown event %d received\n",applicationEvent );
+  for( i=1; i<pGlobalData->eventWorkers; i++ ){
+    eventQueue_push( pGlobalData->workerQueue[i], EVT_APP_STOP, &eventData );
+    pthread_join( eventWorker[i], NULL );
+    eventQueue_logStats( pGlobalData->workerQueue[i], DBG_NOTE );
+    eventQueue_destroy( pGlobalData->workerQueue[i] );
+    pGlobalData->workerQueue[i] = NULL;
+  }
+  pGlobalData->eventWorkers = 1;
+}  // End of stopEventWorkers()
 
-    }  // End switch
 
+/********************************************************************
+  app_eventloop()
 
-  }while ( !pGlobalData->appExit );
+  Parameters: void
+  Returns:    0=Requested stop, negative=error
+
+  Description:
+  Application main event loop. Serves worker queue 0 on the main
+  thread, then stops the other workers.
+    
+********************************************************************/
+int app_eventloop(void){
+
+  dbg_out( DBG_NORM, "Event dispatcher starting...\n" );
+
+  runEventQueue( pGlobalData->eventQueue );
+  stopEventWorkers();
   dbg_out( DBG_NOTE, "Application event loop exit.\n");
 
   return 0;
@@ -492,10 +881,10 @@ int app_init( void ){
   int       rc = 1;
   int       i,ret;
   pthread_t kbrd_daemon;
+  pthread_t stats_daemon;
   APPLICATION_EVENTDATA eventData;
 
   memset(&eventData, 0x00, sizeof(APPLICATION_EVENTDATA));
-  eventData.payloadPtr = NULL;
   
   
   #if defined(_MSC_VER)
@@ -517,25 +906,50 @@ int app_init( void ){
   dbg_out( DBG_VERBOSE, "Application version %d.%d.%d\n",
            APP_VERSION_MAJOR, APP_VERSION_MINOR, APP_VERSION_BUILD );
 
-  // MQTT mutex initialization
-  //pthread_mutex_init( &pGlobalData->mqttSendMutex, NULL );
-  InitializeMQTTsendMutex(&pGlobalData->mqttSendMutex);
+  // Outbound MQTT message queue
+  if( mqttOutbox_init( pGlobalData->outboxSize, pGlobalData->inflightWindow ) ){
+    dbg_out( DBG_FATAL, "Unable to create MQTT outbox.\n" );
+    return -1;
+  }
 
-  // MQTT conditional variable initialization
-  #if defined(_MSC_VER)
-  // MSC condition variable initialized at variable instantiation.
-    InitializeConditionVariable(&pGlobalData->mqttSend_cv);
-  #else
-    pthread_cond_init(&pGlobalData->mqttSend_cv, NULL);
-  #endif
+  // Offline spool. Runs without it if the file cannot be used.
+  if( pGlobalData->spoolFile[0] && mqttSpool_open( pGlobalData->spoolFile, pGlobalData->spoolSize ) ){
+    dbg_out( DBG_ERROR, "Offline spool disabled.\n" );
+  }
+
+  // Pre-serialized fixed messages
+  if( action_init() ){
+    dbg_out( DBG_FATAL, "Unable to build prompt cache.\n" );
+    return -1;
+  }
   
-  // Main message loop semaphore and mutex init
-  pGlobalData->eventSemap = malloc( mt_semaphore_getinstancesize() );
-  //sem_init( pGlobalData->eventSemap, 0, 0 );
-  mt_semaphore_create(pGlobalData->eventSemap, 0, 5);
-  pGlobalData->eventMutex = malloc( mt_mutex_getinstancesize() );
-  //pthread_mutex_init( pGlobalData->eventMutex,NULL );
-  mt_mutex_init(pGlobalData->eventMutex);
+  // Event payload pool. Must exist before the MQTT client starts producing.
+  if( eventPayload_initPool( pGlobalData->payloadPoolSize, pGlobalData->payloadBlockSize,
+                             (PAYLOAD_FALLBACK)pGlobalData->payloadPoolFallback ) ){
+    dbg_out( DBG_FATAL, "Unable to create event payload pool.\n" );
+    return -1;
+  }
+
+  // Main message loop event queue
+  pGlobalData->eventQueue = eventQueue_create( pGlobalData->eventQueueSize );
+  if( NULL == pGlobalData->eventQueue ){
+    dbg_out( DBG_FATAL, "Unable to create application event queue.\n" );
+    return -1;
+  }
+  if( pGlobalData->overflowPolicy[0] && eventQueue_parseOverflow( pGlobalData->eventQueue, pGlobalData->overflowPolicy ) ){
+    dbg_out( DBG_FATAL, "Invalid --overflowPolicy=%s\n", pGlobalData->overflowPolicy );
+    return -1;
+  }
+  eventQueue_setTimestamps( pGlobalData->eventQueue, pGlobalData->eventTiming );
+  if( pGlobalData->reactorMode ){
+    // The reactor thread is the only producer and consumer
+    pGlobalData->eventWorkers = 1;
+    reactor_prepareQueue( pGlobalData->eventQueue );
+  }
+  if( startEventWorkers() ){
+    dbg_out( DBG_FATAL, "Unable to start event dispatch threads.\n" );
+    return -1;
+  }
 
   #if defined(_MSC_VER ) && defined(DEBUGGAA)
     dbg_out(DBG_NOTE, "Waiting 15 seconds for debugger attach...\n");
@@ -543,11 +957,23 @@ int app_init( void ){
     dbg_out(DBG_NOTE, "Now continuing\n");
   #endif
 
+  // Inbound topic routing index
+  if( mqttRouter_build( mqttActionRegister, mqttActionRegisterSize ) ){
+    dbg_out( DBG_FATAL, "Unable to build MQTT topic router.\n" );
+    return -1;
+  }
+
   mqtt_interface_init();
 
-  dbg_out( DBG_NORM,"Starting keyboard reader thread.\n" );
-  if( pthread_create( &kbrd_daemon, NULL, readKeyboard, NULL) ){
-    dbg_out( DBG_ERROR,"KBRD: Failed to start keyboard reader daemon.\n");
+  if( !pGlobalData->reactorMode ){
+    dbg_out( DBG_NORM,"Starting keyboard reader thread.\n" );
+    if( pthread_create( &kbrd_daemon, NULL, readKeyboard, NULL) ){
+      dbg_out( DBG_ERROR,"KBRD: Failed to start keyboard reader daemon.\n");
+    }
+    // In reactor mode the housekeeping timer publishes the statistics
+    if( pGlobalData->statsInterval && pthread_create( &stats_daemon, NULL, mqttStats_thread, NULL ) ){
+      dbg_out( DBG_ERROR,"Failed to start MQTT statistics thread.\n");
+    }
   }
 
   dbg_out( DBG_NORM,"application initialization complete.\n" );
@@ -43,6 +43,9 @@
 #define MQTT_SEND_TOPIC_SIZE            512         //!< Maximum size of MQTT send buffer. Increase if longer MQTT topics are used
 #define MQTT_SEND_PAYLOAD_SIZE          32768       //!< Maximum size of outgoing MQTT payload
 
+#define EVENT_MAX_WORKERS               16          //!< Upper limit for --eventWorkers
+#define MQTT_MAX_PUBLISH_POLICIES       16          //!< Upper limit for entries in mqttPublishPolicyRegister
+
 
 #if defined(_MSC_VER)
 #define MQTT_SEND_MTX CRITICAL_SECTION
@@ -60,17 +63,6 @@
   TYPEDEFS
 ********************************************************************/
 
-/**
- * @brief Internal data block for MQTT messages
- * 
- */
-typedef struct {
-  char *pTopic;       //!< Ptr to MQTT topic
-  char *pPayload;     //!< Ptr to MQTT payload
-  int  dataSent;      //!< 0=if this block is not sent yet
-} mqtt_Data_type;     //!< Internal data block for MQTT messages
-
-
 /**
  * @brief Event loop event types.
  * Application event loop is the main loop where things happen in this application.
@@ -87,32 +79,56 @@ typedef enum
   EVT_KEYPRESS,                         //!< Keyboard event
   EVT_STARTUP,                          //!< Application startup
   EVT_MQTT_BIOM_IDENTIFICATION,         //!< Biometric identification
-  EVT_APP_STOP                          //!< Application stop requested over MQTT
+  EVT_APP_STOP,                         //!< Application stop requested over MQTT
+  EVT_MQTT_READY,                       //!< All subscriptions of a new MQTT connection acknowledged. param = ms from CONNACK.
+  EVT_COUNT                             //!< Number of event types. Keep last.
 }APPLICATION_EVENT;
 
 
 /**
- * @brief Event loop event data structure
+ * @brief Priority lanes of the outbound MQTT queue. mqtt_sender() always
+ * publishes from the highest non-empty lane.
  * 
  */
-typedef struct
+typedef enum
 {
-  char *payloadPtr;           //!< Pointer to data structure if allocated from heap (bigger than 10k). Must be released by handler.
-  char topicPayload[10240];   //!< 10k storage for smaller data. No need to be released by handler
-}APPLICATION_EVENTDATA;
+  MQTT_LANE_HIGH,                       //!< Interactive output: speech, chimes
+  MQTT_LANE_NORMAL,                     //!< Control messages
+  MQTT_LANE_LOW,                        //!< Telemetry, statistics
+  MQTT_NUM_LANES                        //!< Number of lanes. Keep last.
+}MQTT_LANE;
 
 
+/**
+ * @brief Length-prefixed MQTT payload carried by an event.
+ * Allocated once when the message arrives and moved (not copied) through
+ * the event queue. See eventPayload.h
+ * 
+ */
+typedef struct EVENTPAYLOAD
+{
+  struct EVENTPAYLOAD *pNext; //!< Allocator free list link. Not used while the payload is owned by an event.
+  int    owner;               //!< Allocator bookkeeping: producer free list index or heap
+  size_t length;              //!< Payload length in bytes, excluding the terminating zero
+  char   data[];              //!< Payload bytes. Always zero terminated.
+}EVENTPAYLOAD_T;
+
 
 /**
- * @brief Linked list of events in application event queue
+ * @brief Event loop event data structure
  * 
  */
-typedef struct EVENTNODE
+typedef struct
 {
-  APPLICATION_EVENT        eventType;   //!< This event
-  APPLICATION_EVENTDATA    eventData;   //!< Data structure for the event
-  struct EVENTNODE *next;               //!< Pointer to next event in linked chain
-}EVENTNODE_T;
+  EVENTPAYLOAD_T *pPayload;   //!< Payload of the event or NULL. Owned by the event. Released by the event loop after dispatch.
+  int             param;      //!< Small inline argument. E.g. key code for EVT_KEYPRESS
+  short           parsed;     //!< Nonzero: pPayload holds the decoded record of the event, not JSON. See --parseOnReceive.
+}APPLICATION_EVENTDATA;
+
+
+
+struct EVENTQUEUE;   // Application event queue. See eventQueue.h
+struct EVENTITEM;    // Dequeued event. See eventQueue.h
 
 
 /**
@@ -122,18 +138,31 @@ typedef struct EVENTNODE
 typedef struct {
   struct mosquitto      *mosquittoClient;   //!< Handle to Mosquitto client
   short                 mqttConnected;      //!< Is MQTT connected
+  short                 mqttReady;          //!< Connected and every subscription acknowledged, see EVT_MQTT_READY
   char                  mqttHost[64];       //!< MQTT broker IP address
   char                  mqttPort[8];        //!< MQTT broker port
-  MQTT_SEND_MTX         mqttSendMutex;      //!< Mutex to protect MQTT message memory
-  MQTT_COND_VAR         mqttSend_cv;        //!< Condition variable for the send mutex
-  mqtt_Data_type        mqttSharedData;     //!< Pointers to topic and payload
+  unsigned int          outboxSize;         //!< Number of outbound MQTT message slots. See mqttOutbox.h
+  unsigned int          inflightWindow;     //!< Max unacknowledged QoS 1/2 publishes. 0=no limit.
+  int                   directPublish;      //!< Nonzero: the publishing thread calls mosquitto_publish(), mqtt_sender() is fallback only
+  int                   bargeInStop;        //!< Nonzero: a new interaction also asks the vocalizer to stop speaking
+  int                   parseOnReceive;     //!< Nonzero: ASR and biometrics JSON is decoded on the MQTT thread before queuing
+  char                  spoolFile[256];     //!< Offline spool file for outbound MQTT. Empty=no spool. See mqttSpool.h
+  unsigned int          spoolSize;          //!< Data area of the spool file in bytes
+  char                  statsTopic[128];    //!< Topic for periodic MQTT statistics. See mqttStats.h
+  unsigned int          statsInterval;      //!< Seconds between statistics publications. 0=off.
   short                 syslog;             //!< Output to: 0=stdout, 1=syslog, 2=stdout and syslog
-  EVENTNODE_T           *eventListHead;     //!< Pointer to event linked list head
-  EVENTNODE_T           *eventListTail;     //!< Pointer to event linked list tail
-  MT_SEMAPHORE          *eventSemap;        //!< Event queue semaphore
-  MQTT_SEND_MTX         *eventMutex;        //!< Mutex to protect event queue data
+  struct EVENTQUEUE     *eventQueue;        //!< Application event queue (bounded ring per priority class, see eventQueue.c)
+  unsigned int          eventQueueSize;     //!< Max number of queued events over all priority classes
+  char                  overflowPolicy[256];//!< Event queue overflow policies, see eventQueue_parseOverflow()
+  unsigned int          eventWorkers;       //!< Number of event dispatch threads. 1=all handlers run on the main thread.
+  int                   eventTiming;        //!< Nonzero: measure queue dwell and handler time of every event
+  int                   reactorMode;        //!< Nonzero: all I/O and handlers run in one epoll loop. See reactor.c
+  struct EVENTQUEUE     *workerQueue[EVENT_MAX_WORKERS]; //!< Event queue of each dispatch thread. [0] is eventQueue.
+  unsigned int          payloadPoolSize;    //!< Number of preallocated event payload blocks
+  unsigned int          payloadBlockSize;   //!< Size of one event payload block
+  int                   payloadPoolFallback;//!< PAYLOAD_FALLBACK policy when the payload pool is exhausted
   unsigned int          debugMask;          //!< Debug output mask
-  int                   mutexError;         //!< For debugging. 0=ok, 1=MQTT mutex send permission has failed.
+  int                   mutexError;         //!< For debugging. Number of messages dropped because the MQTT outbox was full.
   short                 appExit;           //!< If nonzero, application is terminating.
   #if defined(_MSC_VER)
   HWND                  hConsole;           /*!< Console handle (in windows) */
@@ -153,6 +182,31 @@ typedef struct {
  */
 void pushEvent( APPLICATION_EVENT event, const APPLICATION_EVENTDATA *eventData );
 
+/**
+ * @brief Pushes an event that replaces a still queued event of the same type and key.
+ * Used for events where only the newest one matters, e.g. biometric identification per speaker.
+ * 
+ * @param event The event. See enum APPLICATION_EVENT
+ * @param eventData Event data block. See definition of APPLICATION_EVENTDATA
+ * @param pKey Coalescing key
+ */
+void pushEventKeyed( APPLICATION_EVENT event, const APPLICATION_EVENTDATA *eventData, const char *pKey );
+
+/**
+ * @brief Acts on a key pressed on the console
+ * 
+ * @param c The key
+ */
+void handleKey( char c );
+
+/**
+ * @brief Dispatches a batch of dequeued events and releases their payloads
+ * 
+ * @param pEvents Events taken from an event queue
+ * @param numEvents Number of events
+ */
+void dispatchEvents( struct EVENTITEM *pEvents, int numEvents );
+
 /* MQTT handler function prototypes */
 
 
@@ -161,10 +215,10 @@ void pushEvent( APPLICATION_EVENT event, const APPLICATION_EVENTDATA *eventData
  * @brief Sample function to handle wakeword event
  * 
  * @param pTopic MQTT topic name
- * @param pData  MQTT payload
+ * @param pPayload MQTT payload. Ownership moves to the handler if 0 is returned.
  * @return int 0=OK, nonzero=error
  */
-int handle_MQTTonWakeword( const char* pTopic, const char *pData );
+int handle_MQTTonWakeword( const char* pTopic, EVENTPAYLOAD_T *pPayload );
 
 
 /**
@@ -172,10 +226,10 @@ int handle_MQTTonWakeword( const char* pTopic, const char *pData );
  * This topic is launched every time a valid recognition result occurs.
  * 
  * @param pTopic MQTT topic name
- * @param pData  MQTT payload
+ * @param pPayload MQTT payload. Ownership moves to the handler if 0 is returned.
  * @return int 0=OK, nonzero=error
  */
-int handle_MQTTintentRecognized(const char* pTopic, const char* pData);
+int handle_MQTTintentRecognized(const char* pTopic, EVENTPAYLOAD_T *pPayload);
 
 
 /**
@@ -183,10 +237,10 @@ int handle_MQTTintentRecognized(const char* pTopic, const char* pData);
  * This topic is launched every time a recognition is rejected.
  * 
  * @param pTopic MQTT topic name
- * @param pData  MQTT payload
+ * @param pPayload MQTT payload. Ownership moves to the handler if 0 is returned.
  * @return int 0=OK, nonzero=error
  */
-int handle_MQTTintentNotRecognized(const char* pTopic, const char* pData);
+int handle_MQTTintentNotRecognized(const char* pTopic, EVENTPAYLOAD_T *pPayload);
 
 
 /**
@@ -194,20 +248,20 @@ int handle_MQTTintentNotRecognized(const char* pTopic, const char* pData);
  * This topic is launched every time a recognition is rejected.
  * 
  * @param pTopic MQTT topic name
- * @param pData  MQTT payload
+ * @param pPayload MQTT payload. Ownership moves to the handler if 0 is returned.
  * @return int 0=OK, nonzero=error
  */
-int handle_MQTTuserIdentified(const char* pTopic, const char* pData);
+int handle_MQTTuserIdentified(const char* pTopic, EVENTPAYLOAD_T *pPayload);
 
 
 /**
  * @brief Sample function to handle topic creoir/app/stop. Stops the application.
  * 
  * @param pTopic MQTT topic name
- * @param pData  MQTT payload
+ * @param pPayload MQTT payload. Ownership moves to the handler if 0 is returned.
  * @return int 0=OK, nonzero=error
  */
-int handleMQTT_app_stop( const char* pTopic, const char *pData );
+int handleMQTT_app_stop( const char* pTopic, EVENTPAYLOAD_T *pPayload );
 
 
 /**
@@ -223,17 +277,34 @@ int mqtt_interface_init( void );
  */
 typedef struct MQTT_actions {
   const char* topic;                                      //!< Incoming MQTT topic name
-  int          (*function)(const char* ,const char*);     //!< Function pointer to be called when this MQTT topic is received
+  int          (*function)(const char* ,EVENTPAYLOAD_T*); //!< Function pointer to be called when this MQTT topic is received. Takes ownership of the payload when returning 0.
 } mqtt_action;
 
-/* Link MQTT topics and related handler functions */
-static const mqtt_action mqttActionRegister[] = {
-  {"creoir/asr/wakewordDetected",       &handle_MQTTonWakeword},
-  {"creoir/asr/intentRecognized",       &handle_MQTTintentRecognized},
-  {"creoir/asr/intentNotRecognized",    &handle_MQTTintentNotRecognized},
-  {"creoir/biometrics/identification",  &handle_MQTTuserIdentified},
-  {"creoir/app/stop",                   &handleMQTT_app_stop},
-};
+/* Topics and handlers registered at startup, see actionMain.c. More can be added at run time with mqttRouter_add(). */
+extern const mqtt_action mqttActionRegister[];
+extern const size_t      mqttActionRegisterSize;   //!< Number of entries in mqttActionRegister
+
+
+/**
+ * @brief Publish options of an outgoing MQTT topic
+ * 
+ */
+typedef struct MQTT_publishPolicy {
+  const char*   topic;          //!< Outgoing MQTT topic. # wildcard accepted, see mqtt_topic_compare()
+  int           qos;            //!< MQTT QoS level 0-2
+  bool          retain;         //!< Ask the broker to retain the message
+  MQTT_LANE     lane;           //!< Outbox priority lane
+  unsigned int  expiryMs;       //!< Drop the message if not published within this time. 0=never.
+  unsigned int  dedupMs;        //!< Drop a payload equal to the previous one on the topic within this time. 0=off.
+  unsigned int  ratePerSec;     //!< Token bucket refill rate, messages per second. 0=no rate limit.
+  unsigned int  burst;          //!< Token bucket size, messages
+  unsigned int  spoolTtlMs;     //!< Keep in the offline spool this long while disconnected. 0=not spooled.
+  bool          bargeIn;        //!< Queued messages are cancelled when a new interaction starts. Never spooled.
+} mqtt_publish_policy;
+
+/* Publish options per outgoing topic, see actionMain.c. First match wins. */
+extern const mqtt_publish_policy mqttPublishPolicyRegister[];
+extern const size_t              mqttPublishPolicyRegisterSize;   //!< Number of entries in mqttPublishPolicyRegister
 
 #endif
 
@@ -0,0 +1,403 @@
+/********************************************************************
+
+  Event payload allocator
+
+  Author: Markku Heiskari
+  Version history in github
+
+  (C) Copyright 2024, Creoir Oy
+
+  Payload blocks are carved from one preallocated area. Each producer
+  thread owns a private free list and a "returned" stack. The event
+  loop releases a block by pushing it to the returned stack of the
+  producer that allocated it (CAS push). The producer takes the whole
+  returned stack with a single exchange, so no pop ever races with
+  another pop and the stacks are ABA free. A shared depot holds the
+  blocks not in any producer's private list. A producer keeps at most
+  one refill batch privately and spills the rest of what it takes to
+  the depot. When the depot is empty it takes the returned stacks of
+  the other producers, so an idle producer strands at most one batch.
+
+********************************************************************/
+
+/********************************************************************
+  INCLUDES
+********************************************************************/
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <stdatomic.h>
+#include "actionMain.h"
+#include "util.h"
+#include "eventPayload.h"
+
+/********************************************************************
+  DEFINES
+********************************************************************/
+
+
+/********************************************************************
+  TYPES
+********************************************************************/
+
+/**
+ * @brief Free lists of one producer thread. Padded to keep producers
+ * off each other's cache lines.
+ *
+ */
+typedef struct
+{
+  _Alignas(64) EVENTPAYLOAD_T *pLocal;          //!< Private free list. Touched only by the owning producer.
+  _Alignas(64) EVENTPAYLOAD_T *_Atomic pReturned; //!< Blocks released by the consumer, pushed with CAS
+} PAYLOADCACHE_T;
+
+
+/**
+ * @brief Pool state
+ *
+ */
+typedef struct
+{
+  char               *pArea;                    //!< Preallocated block area
+  size_t              blocks;                   //!< Number of blocks
+  size_t              blockSize;                //!< Block size in bytes
+  PAYLOAD_FALLBACK    fallback;                 //!< Policy when pool is exhausted
+  EVENTPAYLOAD_T     *_Atomic pDepot;           //!< Blocks not yet given to a producer
+  atomic_int          numCaches;                //!< Producer caches in use
+  PAYLOADCACHE_T      caches[PAYLOAD_POOL_MAX_PRODUCERS];
+  atomic_ulong        inUse;
+  atomic_ulong        highWater;
+  atomic_ulong        heapInUse;
+  atomic_ulong        oversize;
+  atomic_ulong        exhausted;
+  atomic_ulong        dropped;
+} PAYLOADPOOL_T;
+
+
+/********************************************************************
+  FILE SCOPE VARIABLES
+********************************************************************/
+static PAYLOADPOOL_T  payloadPool;
+static _Thread_local int producerIdx = -1;     //!< Index of this thread's cache, -1 = not registered
+
+
+/********************************************************************
+  LOCAL PROTOTYPES
+********************************************************************/
+static void            pushChain( EVENTPAYLOAD_T *_Atomic *ppStack, EVENTPAYLOAD_T *pFirst, EVENTPAYLOAD_T *pLast );
+static EVENTPAYLOAD_T* keepBatch( EVENTPAYLOAD_T *pChain );
+static EVENTPAYLOAD_T* poolAlloc( void );
+
+
+/********************************************************************
+  FUNCTIONS
+********************************************************************/
+
+
+/********************************************************************
+  eventPayload_initPool()
+
+  Parameters: (in)  Number of blocks
+              (in)  Block size in bytes
+              (in)  Exhaustion policy
+  Returns:    0 = ok, nonzero = error code.
+
+  Description:
+  Preallocates the payload pool and links all blocks to the depot.
+
+********************************************************************/
+int eventPayload_initPool( unsigned int blocks, unsigned int blockSize, PAYLOAD_FALLBACK fallback ){
+  size_t          i;
+  EVENTPAYLOAD_T *pBlock;
+  EVENTPAYLOAD_T *pPrev = NULL;
+
+  memset( &payloadPool, 0x00, sizeof(payloadPool) );
+  payloadPool.fallback = fallback;
+
+  // Round block size up so that every block header stays aligned
+  if( blockSize < sizeof(EVENTPAYLOAD_T) + 64 ) blockSize = sizeof(EVENTPAYLOAD_T) + 64;
+  blockSize = (blockSize + 63) & ~63U;
+
+  if( 0 == blocks ){
+    dbg_out( DBG_NORM, "Payload pool disabled. Using heap for event payloads.\n" );
+    return 0;
+  }
+
+  payloadPool.pArea = aligned_alloc( 64, (size_t)blocks * blockSize );
+  if( NULL == payloadPool.pArea ){
+    dbg_out( DBG_FATAL, "%s() Unable to allocate %u payload blocks of %u bytes\n", __FUNCTION__, blocks, blockSize );
+    return -1;
+  }
+  payloadPool.blocks = blocks;
+  payloadPool.blockSize = blockSize;
+
+  // Link in reverse so the depot hands out blocks in address order
+  for( i=blocks; i>0; i-- ){
+    pBlock = (EVENTPAYLOAD_T*)( payloadPool.pArea + (i-1) * blockSize );
+    pBlock->pNext = pPrev;
+    pBlock->owner = PAYLOAD_OWNER_HEAP;
+    pPrev = pBlock;
+  }
+  atomic_store( &payloadPool.pDepot, pPrev );
+
+  dbg_out( DBG_VERBOSE, "Payload pool: %u blocks of %u bytes\n", blocks, blockSize );
+  return 0;
+} // End of eventPayload_initPool()
+
+
+/********************************************************************
+  eventPayload_destroyPool()
+
+  Parameters: void
+  Returns:    void
+
+  Description:
+  Frees the pool area.
+
+********************************************************************/
+void eventPayload_destroyPool( void ){
+  free( payloadPool.pArea );
+  payloadPool.pArea = NULL;
+  payloadPool.blocks = 0;
+  atomic_store( &payloadPool.pDepot, NULL );
+} // End of eventPayload_destroyPool()
+
+
+/********************************************************************
+  pushChain()
+
+  Parameters: (in)  Stack head
+              (in)  First block of chain
+              (in)  Last block of chain
+  Returns:    void
+
+  Description:
+  Pushes a chain of blocks to a lock-free stack.
+
+********************************************************************/
+static void pushChain( EVENTPAYLOAD_T *_Atomic *ppStack, EVENTPAYLOAD_T *pFirst, EVENTPAYLOAD_T *pLast ){
+  EVENTPAYLOAD_T *pHead = atomic_load_explicit( ppStack, memory_order_relaxed );
+  do{
+    pLast->pNext = pHead;
+  }while( !atomic_compare_exchange_weak_explicit( ppStack, &pHead, pFirst,
+                                                  memory_order_release, memory_order_relaxed ) );
+} // End of pushChain()
+
+
+/********************************************************************
+  keepBatch()
+
+  Parameters: (in)  Chain of free blocks, may be NULL
+  Returns:    First PAYLOAD_POOL_REFILL_BATCH blocks of the chain
+
+  Description:
+  Cuts a chain to one refill batch and pushes the rest to the depot.
+  A producer thus keeps at most one batch in its private list, and
+  the blocks it does not need are available to the others.
+
+********************************************************************/
+static EVENTPAYLOAD_T* keepBatch( EVENTPAYLOAD_T *pChain ){
+  EVENTPAYLOAD_T *pLast = pChain;
+  EVENTPAYLOAD_T *pRest;
+  EVENTPAYLOAD_T *pRestLast;
+  int             n;
+
+  if( NULL == pChain ) return NULL;
+  for( n=1; n<PAYLOAD_POOL_REFILL_BATCH && pLast->pNext; n++ ) pLast = pLast->pNext;
+  if( pLast->pNext ){
+    pRest = pRestLast = pLast->pNext;
+    while( pRestLast->pNext ) pRestLast = pRestLast->pNext;
+    pLast->pNext = NULL;
+    pushChain( &payloadPool.pDepot, pRest, pRestLast );
+  }
+  return pChain;
+} // End of keepBatch()
+
+
+/********************************************************************
+  poolAlloc()
+
+  Parameters: void
+  Returns:    Ptr to free block, NULL if pool exhausted
+
+  Description:
+  Takes a block from the calling producer's free lists, refilling
+  them from the returned stack or the depot when empty. As a last
+  resort the returned stacks of the other producers are taken, so
+  blocks released to an idle producer are not stranded there.
+
+********************************************************************/
+static EVENTPAYLOAD_T* poolAlloc( void ){
+  PAYLOADCACHE_T *pCache;
+  PAYLOADCACHE_T *pOther;
+  EVENTPAYLOAD_T *pBlock;
+  int             caches;
+  int             n;
+
+  if( producerIdx < 0 ){
+    producerIdx = atomic_fetch_add( &payloadPool.numCaches, 1 );
+    if( producerIdx >= PAYLOAD_POOL_MAX_PRODUCERS ){
+      dbg_out( DBG_ERROR, "%s() More than %d producer threads. Using heap.\n", __FUNCTION__, PAYLOAD_POOL_MAX_PRODUCERS );
+    }
+  }
+  if( producerIdx >= PAYLOAD_POOL_MAX_PRODUCERS ) return NULL;
+  pCache = &payloadPool.caches[producerIdx];
+
+  // 1. Private list
+  if( NULL == pCache->pLocal ){
+    // 2. Everything the consumer has handed back to us, in one exchange
+    pCache->pLocal = keepBatch( atomic_exchange_explicit( &pCache->pReturned, NULL, memory_order_acquire ) );
+  }
+  if( NULL == pCache->pLocal ){
+    // 3. A batch from the depot. Take the whole depot, keep a batch and give the rest back.
+    //    Another producer refilling at the same instant sees an empty depot and falls back once.
+    pCache->pLocal = keepBatch( atomic_exchange_explicit( &payloadPool.pDepot, NULL, memory_order_acquire ) );
+  }
+  if( NULL == pCache->pLocal ){
+    // 4. Blocks released to producers that have gone quiet. Taking a whole stack keeps it ABA free.
+    caches = atomic_load( &payloadPool.numCaches );
+    if( caches > PAYLOAD_POOL_MAX_PRODUCERS ) caches = PAYLOAD_POOL_MAX_PRODUCERS;
+    for( n=1; n<caches && NULL == pCache->pLocal; n++ ){
+      pOther = &payloadPool.caches[ (producerIdx + n) % caches ];
+      if( NULL == atomic_load_explicit( &pOther->pReturned, memory_order_relaxed ) ) continue;
+      pCache->pLocal = keepBatch( atomic_exchange_explicit( &pOther->pReturned, NULL, memory_order_acquire ) );
+    }
+  }
+
+  pBlock = pCache->pLocal;
+  if( pBlock ){
+    pCache->pLocal = pBlock->pNext;
+    pBlock->owner = producerIdx;
+  }
+  return pBlock;
+} // End of poolAlloc()
+
+
+/********************************************************************
+  eventPayload_create()
+
+  Parameters: (in)  Ptr to payload bytes
+              (in)  Payload length
+  Returns:    Ptr to payload block, NULL on error
+
+  Description:
+  Allocates a payload block, from the pool when the payload fits and
+  a block is free, otherwise according to the fallback policy. This is
+  the only copy of an inbound MQTT payload; afterwards the block is
+  moved by pointer.
+
+********************************************************************/
+EVENTPAYLOAD_T* eventPayload_create( const void *pData, size_t length ){
+  EVENTPAYLOAD_T *pPayload = NULL;
+  unsigned long   inUse;
+  unsigned long   highWater;
+
+  if( payloadPool.blocks ){
+    if( sizeof(EVENTPAYLOAD_T) + length + 1 > payloadPool.blockSize ){
+      atomic_fetch_add_explicit( &payloadPool.oversize, 1, memory_order_relaxed );
+    }else{
+      pPayload = poolAlloc();
+      if( pPayload ){
+        inUse = atomic_fetch_add_explicit( &payloadPool.inUse, 1, memory_order_relaxed ) + 1;
+        highWater = atomic_load_explicit( &payloadPool.highWater, memory_order_relaxed );
+        while( inUse > highWater &&
+               !atomic_compare_exchange_weak_explicit( &payloadPool.highWater, &highWater, inUse,
+                                                       memory_order_relaxed, memory_order_relaxed ) );
+      }else{
+        atomic_fetch_add_explicit( &payloadPool.exhausted, 1, memory_order_relaxed );
+        if( PAYLOAD_FALLBACK_DROP == payloadPool.fallback ){
+          atomic_fetch_add_explicit( &payloadPool.dropped, 1, memory_order_relaxed );
+          dbg_out( DBG_ERROR, "%s() Payload pool exhausted. Message of %zu bytes dropped.\n", __FUNCTION__, length );
+          return NULL;
+        }
+      }
+    }
+  }
+
+  if( NULL == pPayload ){
+    pPayload = malloc( sizeof(EVENTPAYLOAD_T) + length + 1 );
+    if( NULL == pPayload ){
+      dbg_out( DBG_ERROR, "%s() Unable to allocate %zu bytes for event payload\n", __FUNCTION__, length );
+      return NULL;
+    }
+    pPayload->owner = PAYLOAD_OWNER_HEAP;
+    atomic_fetch_add_explicit( &payloadPool.heapInUse, 1, memory_order_relaxed );
+  }
+
+  pPayload->pNext = NULL;
+  pPayload->length = length;
+  if( length ) memcpy( pPayload->data, pData, length );
+  pPayload->data[length] = 0;
+  return pPayload;
+} // End of eventPayload_create()
+
+
+/********************************************************************
+  eventPayload_release()
+
+  Parameters: (in)  Ptr to payload block
+  Returns:    void
+
+  Description:
+  Returns a pool block to the producer that allocated it, or frees a
+  heap block.
+
+********************************************************************/
+void eventPayload_release( EVENTPAYLOAD_T *pPayload ){
+  if( NULL == pPayload ) return;
+
+  if( PAYLOAD_OWNER_HEAP == pPayload->owner ){
+    atomic_fetch_sub_explicit( &payloadPool.heapInUse, 1, memory_order_relaxed );
+    free( pPayload );
+    return;
+  }
+
+  atomic_fetch_sub_explicit( &payloadPool.inUse, 1, memory_order_relaxed );
+  pushChain( &payloadPool.caches[pPayload->owner].pReturned, pPayload, pPayload );
+} // End of eventPayload_release()
+
+
+/********************************************************************
+  eventPayload_getStats()
+
+  Parameters: (out) Statistics
+  Returns:    void
+
+  Description:
+  Snapshot of pool counters.
+
+********************************************************************/
+void eventPayload_getStats( PAYLOAD_POOL_STATS *pStats ){
+  pStats->blocks    = payloadPool.blocks;
+  pStats->blockSize = payloadPool.blockSize;
+  pStats->inUse     = atomic_load( &payloadPool.inUse );
+  pStats->highWater = atomic_load( &payloadPool.highWater );
+  pStats->heapInUse = atomic_load( &payloadPool.heapInUse );
+  pStats->oversize  = atomic_load( &payloadPool.oversize );
+  pStats->exhausted = atomic_load( &payloadPool.exhausted );
+  pStats->dropped   = atomic_load( &payloadPool.dropped );
+} // End of eventPayload_getStats()
+
+
+/********************************************************************
+  eventPayload_logStats()
+
+  Parameters: (in)  dbg_out() category
+  Returns:    void
+
+  Description:
+  Prints the pool counters.
+
+********************************************************************/
+void eventPayload_logStats( int type ){
+  PAYLOAD_POOL_STATS stats;
+
+  eventPayload_getStats( &stats );
+  dbg_out( type, "Payload pool: %lu/%lu blocks in use (high water %lu), heap %lu, oversize %lu, exhausted %lu, dropped %lu\n",
+           stats.inUse, stats.blocks, stats.highWater, stats.heapInUse,
+           stats.oversize, stats.exhausted, stats.dropped );
+} // End of eventPayload_logStats()
+
+
+/** End of eventPayload.c ******************************************/
@@ -0,0 +1,122 @@
+/**
+ * @file eventPayload.h
+ * @author Markku Heiskari
+ * @brief Event payload allocator. Preallocated pool of payload blocks with
+ * per-producer free lists and lock-free recycling from the event loop.
+ *
+ * @copyright Copyright (c) 2024 Creoir Oy
+ *
+ */
+
+#ifndef __eventpayload_h
+#define __eventpayload_h
+
+/********************************************************************
+  INCLUDES
+********************************************************************/
+#include <stddef.h>
+#include "actionMain.h"
+
+/********************************************************************
+  DEFINES
+********************************************************************/
+#define PAYLOAD_POOL_DEFAULT_BLOCKS     128         //!< Default number of preallocated payload blocks
+#define PAYLOAD_POOL_DEFAULT_BLOCKSIZE  4096        //!< Default payload block size in bytes (header included)
+#define PAYLOAD_POOL_MAX_PRODUCERS      8           //!< Number of producer threads that get their own free list
+#define PAYLOAD_POOL_REFILL_BATCH       16          //!< Blocks a producer takes from the shared depot at a time
+
+#define PAYLOAD_OWNER_HEAP              -1          //!< EVENTPAYLOAD_T owner value for heap allocated blocks
+
+
+/********************************************************************
+  DATA TYPES
+********************************************************************/
+
+/**
+ * @brief What to do when the pool has no free blocks
+ *
+ */
+typedef enum
+{
+  PAYLOAD_FALLBACK_HEAP,                //!< Allocate the block from heap (default)
+  PAYLOAD_FALLBACK_DROP                 //!< Fail the allocation. The message is dropped.
+}PAYLOAD_FALLBACK;
+
+
+/**
+ * @brief Payload pool statistics
+ *
+ */
+typedef struct
+{
+  unsigned long blocks;                 //!< Blocks in the pool
+  unsigned long blockSize;              //!< Size of one block
+  unsigned long inUse;                  //!< Pool blocks currently owned by events
+  unsigned long highWater;              //!< Maximum of inUse since start
+  unsigned long heapInUse;              //!< Heap fallback blocks currently owned by events
+  unsigned long oversize;               //!< Allocations too big for a pool block (served from heap)
+  unsigned long exhausted;              //!< Allocations that found the pool empty
+  unsigned long dropped;                //!< Allocations failed because of PAYLOAD_FALLBACK_DROP
+}PAYLOAD_POOL_STATS;
+
+
+/********************************************************************
+  PROTOTYPES
+********************************************************************/
+
+/**
+ * @brief Preallocates the payload pool. Call once before any producer starts.
+ * With 0 blocks every payload is allocated from heap.
+ *
+ * @param blocks Number of blocks
+ * @param blockSize Size of each block in bytes
+ * @param fallback Policy when the pool runs out
+ * @return int 0=OK, nonzero=error
+ */
+int eventPayload_initPool( unsigned int blocks, unsigned int blockSize, PAYLOAD_FALLBACK fallback );
+
+
+/**
+ * @brief Releases the pool memory. All payloads must have been released.
+ *
+ */
+void eventPayload_destroyPool( void );
+
+
+/**
+ * @brief Allocates a length-prefixed event payload and copies the data into it.
+ *
+ * @param pData Payload bytes (may be NULL if length is 0)
+ * @param length Number of bytes in pData
+ * @return EVENTPAYLOAD_T* Zero terminated payload block, NULL on error
+ */
+EVENTPAYLOAD_T* eventPayload_create( const void *pData, size_t length );
+
+
+/**
+ * @brief Releases a payload created with eventPayload_create(). Safe from any thread.
+ *
+ * @param pPayload Payload block. NULL is accepted.
+ */
+void eventPayload_release( EVENTPAYLOAD_T *pPayload );
+
+
+/**
+ * @brief Reads the pool statistics
+ *
+ * @param pStats [out] Statistics
+ */
+void eventPayload_getStats( PAYLOAD_POOL_STATS *pStats );
+
+
+/**
+ * @brief Writes the pool statistics to debug output
+ *
+ * @param type dbg_out() message category
+ */
+void eventPayload_logStats( int type );
+
+
+#endif
+
+/* EOF *************************************************************/
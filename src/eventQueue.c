@@ -0,0 +1,1122 @@
+/********************************************************************
+
+  Application event queue
+
+  Author: Markku Heiskari
+  Version history in github
+
+  (C) Copyright 2024, Creoir Oy
+
+  One bounded ring of sequenced slots (D. Vyukov style) per priority
+  class. Producers (MQTT network thread, keyboard reader) claim an
+  enqueue position with a CAS loop on the slot sequence numbers and
+  publish the slot by bumping its sequence. Dequeue positions are
+  claimed with CAS as well: the consumer (app_eventloop) dequeues a
+  batch from the highest class first, and a producer dequeues the
+  oldest event of a class when its overflow policy evicts one. The
+  consumer sleeps on an eventfd only when every ring is empty.
+
+  The queue holds at most 'limit' events over all classes, counted
+  in 'count'. A producer that finds it full applies the overflow
+  policy of its event type: drop the new event, evict a queued one,
+  or wait. Waiting producers sleep on roomCv under roomMutex, and
+  whoever dequeues events broadcasts it while any are blocked.
+
+  Coalescable event types (biometric identification) go through
+  eventQueue_pushKeyed(), which looks up the coalescing cell of the
+  key under coalesceMutex. While an event of the same key is still
+  queued, only the payload in its coalescing cell is replaced. The
+  consumer takes the newest payload out of the cell when it dequeues
+  the event.
+
+********************************************************************/
+
+/********************************************************************
+  INCLUDES
+********************************************************************/
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <errno.h>
+#include <string.h>
+#include <unistd.h>
+#include <sched.h>
+#include <time.h>
+#include <sys/eventfd.h>
+#include "actionMain.h"
+#include "util.h"
+#include "eventQueue.h"
+#include "eventPayload.h"
+
+/********************************************************************
+  DEFINES
+********************************************************************/
+
+/********************************************************************
+  FILE SCOPE VARIABLES
+********************************************************************/
+
+/* Priority class of each application event */
+static const EVENT_CLASS eventClassOf[EVT_COUNT] = {
+  [EVT_MQTT_WAKEWORD]               = EVQ_CLASS_INTERACTIVE,
+  [EVT_MQTT_PING]                   = EVQ_CLASS_INTENT,
+  [EVT_MQTT_PONG]                   = EVQ_CLASS_INTENT,
+  [EVT_MQTT_INTENT_RECOGNIZED]      = EVQ_CLASS_INTENT,
+  [EVT_MQTT_INTENT_NOT_RECOGNIZED]  = EVQ_CLASS_INTENT,
+  [EVT_KEYPRESS]                    = EVQ_CLASS_INTERACTIVE,
+  [EVT_STARTUP]                     = EVQ_CLASS_CONTROL,
+  [EVT_MQTT_BIOM_IDENTIFICATION]    = EVQ_CLASS_BIOMETRIC,
+  [EVT_APP_STOP]                    = EVQ_CLASS_CONTROL,
+  [EVT_MQTT_READY]                  = EVQ_CLASS_CONTROL,
+};
+
+/* Default overflow policy of each application event. Unlisted ones block. */
+static const EVENT_OVERFLOW eventOverflowDefault[EVT_COUNT] = {
+  [EVT_MQTT_WAKEWORD]               = EVQ_OVERFLOW_DROP_LOWEST,
+  [EVT_MQTT_PING]                   = EVQ_OVERFLOW_DROP_NEWEST,
+  [EVT_MQTT_PONG]                   = EVQ_OVERFLOW_DROP_NEWEST,
+  [EVT_MQTT_INTENT_RECOGNIZED]      = EVQ_OVERFLOW_DROP_LOWEST,
+  [EVT_MQTT_INTENT_NOT_RECOGNIZED]  = EVQ_OVERFLOW_DROP_LOWEST,
+  [EVT_KEYPRESS]                    = EVQ_OVERFLOW_BLOCK,
+  [EVT_STARTUP]                     = EVQ_OVERFLOW_BLOCK,
+  [EVT_MQTT_BIOM_IDENTIFICATION]    = EVQ_OVERFLOW_DROP_OLDEST,
+  [EVT_APP_STOP]                    = EVQ_OVERFLOW_BLOCK,
+  [EVT_MQTT_READY]                  = EVQ_OVERFLOW_BLOCK,
+};
+
+static const char* const eventName[EVT_COUNT] = {
+  [EVT_MQTT_WAKEWORD]               = "EVT_MQTT_WAKEWORD",
+  [EVT_MQTT_PING]                   = "EVT_MQTT_PING",
+  [EVT_MQTT_PONG]                   = "EVT_MQTT_PONG",
+  [EVT_MQTT_INTENT_RECOGNIZED]      = "EVT_MQTT_INTENT_RECOGNIZED",
+  [EVT_MQTT_INTENT_NOT_RECOGNIZED]  = "EVT_MQTT_INTENT_NOT_RECOGNIZED",
+  [EVT_KEYPRESS]                    = "EVT_KEYPRESS",
+  [EVT_STARTUP]                     = "EVT_STARTUP",
+  [EVT_MQTT_BIOM_IDENTIFICATION]    = "EVT_MQTT_BIOM_IDENTIFICATION",
+  [EVT_APP_STOP]                    = "EVT_APP_STOP",
+  [EVT_MQTT_READY]                  = "EVT_MQTT_READY",
+};
+
+static const char* const overflowName[EVQ_NUM_OVERFLOW] = {
+  "block", "oldest", "newest", "lowest"
+};
+
+/* Event types that eventQueue_pushKeyed() may merge */
+static const int eventCoalescable[EVT_COUNT] = {
+  [EVT_MQTT_BIOM_IDENTIFICATION]    = 1,
+};
+
+static const char* const eventClassName[EVQ_NUM_CLASSES] = {
+  "control", "interactive", "intent", "biometric"
+};
+
+
+/********************************************************************
+  LOCAL PROTOTYPES
+********************************************************************/
+static void wakeConsumer( EVENTQUEUE_T *pQueue );
+static int  ringPush( EVENTQUEUE_T *pQueue, APPLICATION_EVENT event, const APPLICATION_EVENTDATA *eventData, int coalesceCell );
+static int  findCoalesceCell( EVENTQUEUE_T *pQueue, APPLICATION_EVENT event, const char *pKey );
+static int  admitEvent( EVENTQUEUE_T *pQueue, APPLICATION_EVENT event );
+static void waitForRoom( EVENTQUEUE_T *pQueue );
+static int  evictOldest( EVENTQUEUE_T *pQueue, int eventClass );
+static void countDrop( EVENTQUEUE_T *pQueue, APPLICATION_EVENT event );
+static void releaseRoom( EVENTQUEUE_T *pQueue, size_t n );
+static int  ringReady( const EVENTQUEUE_T *pQueue, EVENTRING_T *pRing );
+static int  ringClaim( EVENTQUEUE_T *pQueue, EVENTRING_T *pRing, EVENTITEM_T *pItems, int maxItems );
+static int  ringTakeBatch( EVENTQUEUE_T *pQueue, EVENTRING_T *pRing, EVENTITEM_T *pItems, int maxItems );
+
+
+/********************************************************************
+  FUNCTIONS
+********************************************************************/
+
+
+/********************************************************************
+  eventQueue_create()
+
+  Parameters: (in)  Max queued events
+  Returns:    Pointer to queue, NULL on error
+
+  Description:
+  Allocates the rings and the consumer wakeup eventfd. Every ring is
+  big enough to hold the whole limit, so only the shared event count
+  decides when the queue is full.
+
+********************************************************************/
+EVENTQUEUE_T* eventQueue_create( size_t capacity ){
+  EVENTQUEUE_T *pQueue;
+  EVENTRING_T  *pRing;
+  size_t        size = 2;
+  size_t        i;
+  int           c;
+
+  if( capacity > EVQ_MAX_CAPACITY ) capacity = EVQ_MAX_CAPACITY;
+  if( capacity < 1 ) capacity = 1;
+  while( size < capacity ) size <<= 1;
+
+  if( posix_memalign( (void**)&pQueue, EVQ_CACHELINE, sizeof(EVENTQUEUE_T) ) ){
+    dbg_out( DBG_FATAL, "%s() Unable to allocate event queue\n", __FUNCTION__ );
+    return NULL;
+  }
+  memset( pQueue, 0x00, sizeof(EVENTQUEUE_T) );
+  pQueue->capacity = size;
+  pQueue->mask = size - 1;
+  pQueue->limit = capacity;
+
+  for( c=0; c<EVQ_NUM_CLASSES; c++ ){
+    pRing = &pQueue->rings[c];
+    if( posix_memalign( (void**)&pRing->slots, EVQ_CACHELINE, size * sizeof(EVENTSLOT_T) ) ){
+      dbg_out( DBG_FATAL, "%s() Unable to allocate %zu event slots\n", __FUNCTION__, size );
+      while( c-- ) free( pQueue->rings[c].slots );
+      free( pQueue );
+      return NULL;
+    }
+    for( i=0; i<size; i++ ){
+      atomic_init( &pRing->slots[i].seq, i );
+      pRing->slots[i].eventData.pPayload = NULL;
+      pRing->slots[i].coalesceCell = -1;
+    }
+    atomic_init( &pRing->enqueuePos, 0 );
+    atomic_init( &pRing->dequeuePos, 0 );
+  }
+  atomic_init( &pQueue->sleeping, 0 );
+  atomic_init( &pQueue->count, 0 );
+  atomic_init( &pQueue->blocked, 0 );
+  atomic_init( &pQueue->shedding, 0 );
+  atomic_init( &pQueue->fullCount, 0 );
+  atomic_init( &pQueue->droppedTotal, 0 );
+  for( i=0; i<EVQ_COALESCE_CELLS; i++ ) atomic_init( &pQueue->cells[i].pPending, NULL );
+  for( i=0; i<EVT_COUNT; i++ ){
+    atomic_init( &pQueue->coalesced[i], 0 );
+    atomic_init( &pQueue->dropped[i], 0 );
+    pQueue->overflow[i] = eventOverflowDefault[i];
+  }
+  InitializeMQTTsendMutex( &pQueue->coalesceMutex );
+  pthread_mutex_init( &pQueue->roomMutex, NULL );
+  pthread_cond_init( &pQueue->roomCv, NULL );
+
+  pQueue->wakeFd = eventfd( 0, EFD_CLOEXEC );
+  if( pQueue->wakeFd < 0 ){
+    dbg_out( DBG_FATAL, "%s() eventfd failed: %s\n", __FUNCTION__, strerror(errno) );
+    for( c=0; c<EVQ_NUM_CLASSES; c++ ) free( pQueue->rings[c].slots );
+    free( pQueue );
+    return NULL;
+  }
+
+  dbg_out( DBG_VERBOSE, "Event queue created for %zu events, %d classes of %zu slots\n", capacity, EVQ_NUM_CLASSES, size );
+  return pQueue;
+} // End of eventQueue_create()
+
+
+/********************************************************************
+  eventQueue_destroy()
+
+  Parameters: (in)  Queue
+  Returns:    void
+
+  Description:
+  Releases queue memory and the wakeup descriptor. Clearing the queue
+  also empties the coalescing cells.
+
+********************************************************************/
+void eventQueue_destroy( EVENTQUEUE_T *pQueue ){
+  int c;
+
+  if( NULL == pQueue ) return;
+  eventQueue_clear( pQueue );
+  close( pQueue->wakeFd );
+  pthread_cond_destroy( &pQueue->roomCv );
+  pthread_mutex_destroy( &pQueue->roomMutex );
+  for( c=0; c<EVQ_NUM_CLASSES; c++ ) free( pQueue->rings[c].slots );
+  free( pQueue );
+} // End of eventQueue_destroy()
+
+
+/********************************************************************
+  wakeConsumer()
+
+  Parameters: (in)  Queue
+  Returns:    void
+
+  Description:
+  Signals the eventfd if the consumer has announced it is going to
+  sleep. The fence pairs with the one in eventQueue_popBatch() so that
+  either the consumer sees the new slot or we see its sleeping flag.
+
+********************************************************************/
+static void wakeConsumer( EVENTQUEUE_T *pQueue ){
+  uint64_t one = 1;
+
+  atomic_thread_fence( memory_order_seq_cst );
+  if( atomic_load_explicit( &pQueue->sleeping, memory_order_relaxed ) ){
+    if( write( pQueue->wakeFd, &one, sizeof(one) ) != sizeof(one) ){
+      dbg_out( DBG_ERROR, "%s() eventfd write failed: %s\n", __FUNCTION__, strerror(errno) );
+    }
+  }
+} // End of wakeConsumer()
+
+
+/********************************************************************
+  eventQueue_classOf()
+
+  Parameters: (in)  Event
+  Returns:    Priority class
+
+  Description:
+  Maps an application event to its priority class.
+
+********************************************************************/
+EVENT_CLASS eventQueue_classOf( APPLICATION_EVENT event ){
+  if( (unsigned)event >= EVT_COUNT ) return EVQ_CLASS_INTENT;
+  return eventClassOf[event];
+} // End of eventQueue_classOf()
+
+
+/********************************************************************
+  eventQueue_eventName()
+
+  Parameters: (in)  Event
+  Returns:    Event name
+
+  Description:
+  Name of an application event for logs and configuration.
+
+********************************************************************/
+const char* eventQueue_eventName( APPLICATION_EVENT event ){
+  if( (unsigned)event >= EVT_COUNT || NULL == eventName[event] ) return "EVT_UNKNOWN";
+  return eventName[event];
+} // End of eventQueue_eventName()
+
+
+/********************************************************************
+  eventQueue_setTimestamps()
+
+  Parameters: (in)  Queue
+              (in)  Nonzero = on
+  Returns:    void
+
+  Description:
+  Enables enqueue time stamping for dwell time measurement. When off
+  the push path skips the clock read.
+
+********************************************************************/
+void eventQueue_setTimestamps( EVENTQUEUE_T *pQueue, int enable ){
+  pQueue->timestamps = enable;
+} // End of eventQueue_setTimestamps()
+
+
+/********************************************************************
+  eventQueue_setOverflow()
+
+  Parameters: (in)  Queue
+              (in)  Event
+              (in)  Overflow policy
+  Returns:    void
+
+  Description:
+  Sets the overflow policy of an event type. Call before producers
+  start.
+
+********************************************************************/
+void eventQueue_setOverflow( EVENTQUEUE_T *pQueue, APPLICATION_EVENT event, EVENT_OVERFLOW policy ){
+  if( (unsigned)event >= EVT_COUNT || (unsigned)policy >= EVQ_NUM_OVERFLOW ) return;
+  pQueue->overflow[event] = policy;
+  dbg_out( DBG_VERBOSE, "%s overflow policy: %s\n", eventQueue_eventName( event ), overflowName[policy] );
+} // End of eventQueue_setOverflow()
+
+
+/********************************************************************
+  eventQueue_parseOverflow()
+
+  Parameters: (in)  Queue
+              (in)  Policy specification
+  Returns:    0 = ok, nonzero = syntax error
+
+  Description:
+  Parses a list like "EVT_MQTT_PING:newest,all:block". Entries are
+  applied in order, so "all" first and exceptions after it.
+
+********************************************************************/
+int eventQueue_parseOverflow( EVENTQUEUE_T *pQueue, const char *pSpec ){
+  char        szSpec[256];
+  char       *pSave = NULL;
+  char       *pEntry;
+  char       *pPolicy;
+  int         e, p;
+
+  snprintf( szSpec, sizeof(szSpec), "%s", pSpec );
+  for( pEntry = strtok_r( szSpec, ",", &pSave ); pEntry; pEntry = strtok_r( NULL, ",", &pSave ) ){
+    pPolicy = strchr( pEntry, ':' );
+    if( NULL == pPolicy ){
+      dbg_out( DBG_ERROR, "%s() Missing ':' in '%s'\n", __FUNCTION__, pEntry );
+      return -1;
+    }
+    *pPolicy++ = 0;
+
+    for( p=0; p<EVQ_NUM_OVERFLOW; p++ ){
+      if( 0 == strcmp( pPolicy, overflowName[p] ) ) break;
+    }
+    if( p == EVQ_NUM_OVERFLOW ){
+      dbg_out( DBG_ERROR, "%s() Unknown overflow policy '%s'\n", __FUNCTION__, pPolicy );
+      return -2;
+    }
+
+    if( 0 == strcmp( pEntry, "all" ) ){
+      for( e=0; e<EVT_COUNT; e++ ) eventQueue_setOverflow( pQueue, (APPLICATION_EVENT)e, (EVENT_OVERFLOW)p );
+      continue;
+    }
+    for( e=0; e<EVT_COUNT; e++ ){
+      if( eventName[e] && 0 == strcmp( pEntry, eventName[e] ) ) break;
+    }
+    if( e == EVT_COUNT ){
+      dbg_out( DBG_ERROR, "%s() Unknown event '%s'\n", __FUNCTION__, pEntry );
+      return -3;
+    }
+    eventQueue_setOverflow( pQueue, (APPLICATION_EVENT)e, (EVENT_OVERFLOW)p );
+  } // End for
+
+  return 0;
+} // End of eventQueue_parseOverflow()
+
+
+/********************************************************************
+  eventQueue_push()
+
+  Parameters: (in)  Queue
+              (in)  Event
+              (in)  Event data
+  Returns:    0 = ok, nonzero = error code.
+
+  Description:
+  Claims a slot in the ring of the event's class, copies the event in
+  and publishes it to the consumer. A dropped event's payload is
+  released here.
+
+********************************************************************/
+int eventQueue_push( EVENTQUEUE_T *pQueue, APPLICATION_EVENT event, const APPLICATION_EVENTDATA *eventData ){
+  return ringPush( pQueue, event, eventData, -1 );
+} // End of eventQueue_push()
+
+
+/********************************************************************
+  findCoalesceCell()
+
+  Parameters: (in)  Queue
+              (in)  Event
+              (in)  Key
+  Returns:    Cell index, -1 if all cells are busy
+
+  Description:
+  Finds the cell of the key, or assigns an idle one to it. A cell is
+  idle when it has no pending payload, which also means no event in
+  the ring refers to it. Called with coalesceMutex held.
+
+********************************************************************/
+static int findCoalesceCell( EVENTQUEUE_T *pQueue, APPLICATION_EVENT event, const char *pKey ){
+  EVENTCOALESCE_T *pCell;
+  int              idle = -1;
+  int              i;
+
+  for( i=0; i<EVQ_COALESCE_CELLS; i++ ){
+    pCell = &pQueue->cells[i];
+    if( pCell->inUse && pCell->eventType == event && 0 == strcmp( pCell->key, pKey ) ) return i;
+    if( idle < 0 && ( !pCell->inUse || NULL == atomic_load_explicit( &pCell->pPending, memory_order_acquire ) ) ) idle = i;
+  }
+  if( idle >= 0 ){
+    pCell = &pQueue->cells[idle];
+    pCell->inUse = 1;
+    pCell->eventType = event;
+    snprintf( pCell->key, sizeof(pCell->key), "%s", pKey );
+  }
+  return idle;
+} // End of findCoalesceCell()
+
+
+/********************************************************************
+  eventQueue_pushKeyed()
+
+  Parameters: (in)  Queue
+              (in)  Event
+              (in)  Event data
+              (in)  Coalescing key
+  Returns:    0 = ok, EVQ_PUSH_DROPPED = event was shed
+
+  Description:
+  Stores the payload in the coalescing cell of the key. If the cell
+  already held a payload, its event is still queued and will pick up
+  the new payload; the old one is released. Otherwise a new event that
+  refers to the cell is queued. Falls back to a plain push if the type
+  is not coalescable or all cells are busy.
+
+********************************************************************/
+int eventQueue_pushKeyed( EVENTQUEUE_T *pQueue, APPLICATION_EVENT event, const APPLICATION_EVENTDATA *eventData, const char *pKey ){
+  APPLICATION_EVENTDATA cellData = *eventData;
+  EVENTPAYLOAD_T       *pOld;
+  int                   cell;
+  int                   rc;
+
+  if( (unsigned)event >= EVT_COUNT ){
+    eventPayload_release( eventData->pPayload );
+    return EVQ_PUSH_DROPPED;
+  }
+  if( !eventCoalescable[event] || NULL == eventData->pPayload ){
+    return ringPush( pQueue, event, eventData, -1 );
+  }
+  if( NULL == pKey ) pKey = "";
+
+  request_mutex_lock( &pQueue->coalesceMutex );
+  cell = findCoalesceCell( pQueue, event, pKey );
+  if( cell < 0 ){
+    release_mutex_lock( &pQueue->coalesceMutex );
+    return ringPush( pQueue, event, eventData, -1 );
+  }
+
+  pOld = atomic_exchange_explicit( &pQueue->cells[cell].pPending, eventData->pPayload, memory_order_acq_rel );
+  if( pOld ){
+    // Event of this key is still queued. It will carry the new payload.
+    release_mutex_lock( &pQueue->coalesceMutex );
+    atomic_fetch_add_explicit( &pQueue->coalesced[event], 1, memory_order_relaxed );
+    eventPayload_release( pOld );
+    return 0;
+  }
+
+  // Push under the lock so the cell cannot be reassigned before its event is queued
+  cellData.pPayload = NULL;
+  rc = ringPush( pQueue, event, &cellData, cell );
+  if( rc ){
+    // Shed. No event refers to the cell, so nobody else can take the payload.
+    eventPayload_release( atomic_exchange_explicit( &pQueue->cells[cell].pPending, NULL, memory_order_acq_rel ) );
+  }
+  release_mutex_lock( &pQueue->coalesceMutex );
+  return rc;
+} // End of eventQueue_pushKeyed()
+
+
+/********************************************************************
+  ringPush()
+
+  Parameters: (in)  Queue
+              (in)  Event
+              (in)  Event data
+              (in)  Coalescing cell of the event, -1 if none
+  Returns:    0 = ok, EVQ_PUSH_DROPPED = event was shed
+
+  Description:
+  Takes a place in the queue by the overflow policy, then enqueues
+  the event into the ring of its class. An unknown event type is
+  dropped, since the per-type counters are indexed by it.
+
+********************************************************************/
+static int ringPush( EVENTQUEUE_T *pQueue, APPLICATION_EVENT event, const APPLICATION_EVENTDATA *eventData, int coalesceCell ){
+  EVENTRING_T *pRing = &pQueue->rings[ eventQueue_classOf( event ) ];
+  EVENTSLOT_T *pSlot;
+  size_t       pos;
+  size_t       seq;
+  intptr_t     diff;
+  uint64_t     enqueueNs;
+
+  if( (unsigned)event >= EVT_COUNT ){
+    eventPayload_release( eventData->pPayload );
+    return EVQ_PUSH_DROPPED;
+  }
+
+  enqueueNs = pQueue->timestamps ? monotonic_ns() : 0;   // Dwell time includes a blocked push
+  if( admitEvent( pQueue, event ) ){
+    eventPayload_release( eventData->pPayload );
+    return EVQ_PUSH_DROPPED;
+  }
+
+  pos = atomic_load_explicit( &pRing->enqueuePos, memory_order_relaxed );
+  for(;;){
+    pSlot = &pRing->slots[ pos & pQueue->mask ];
+    seq = atomic_load_explicit( &pSlot->seq, memory_order_acquire );
+    diff = (intptr_t)seq - (intptr_t)pos;
+
+    if( 0 == diff ){
+      // Slot is free. Try to claim it.
+      if( atomic_compare_exchange_weak_explicit( &pRing->enqueuePos, &pos, pos + 1,
+                                                 memory_order_relaxed, memory_order_relaxed ) ){
+        break;
+      }
+      // pos reloaded by failed CAS
+    }else if( diff < 0 ){
+      // Slot dequeued but not yet handed back. Admission guarantees it will be shortly.
+      sched_yield();
+      pos = atomic_load_explicit( &pRing->enqueuePos, memory_order_relaxed );
+    }else{
+      // Another producer claimed this position
+      pos = atomic_load_explicit( &pRing->enqueuePos, memory_order_relaxed );
+    }
+  } // End for(ever)
+
+  pSlot->eventType = event;
+  pSlot->eventData = *eventData;
+  pSlot->coalesceCell = coalesceCell;
+  pSlot->enqueueNs = enqueueNs;
+  atomic_store_explicit( &pSlot->seq, pos + 1, memory_order_release );
+
+  wakeConsumer( pQueue );
+  return 0;
+} // End of ringPush()
+
+
+/********************************************************************
+  admitEvent()
+
+  Parameters: (in)  Queue
+              (in)  Event
+  Returns:    0 = place reserved, 1 = event must be dropped
+
+  Description:
+  Reserves one place of the queue limit for the event. If the queue
+  is full, applies the overflow policy of the event type: waits, or
+  drops a queued event and tries again, or gives up.
+
+********************************************************************/
+static int admitEvent( EVENTQUEUE_T *pQueue, APPLICATION_EVENT event ){
+  EVENT_OVERFLOW policy = pQueue->overflow[event];
+  int            eventClass = eventQueue_classOf( event );
+  int            fullReported = 0;
+  int            c;
+
+  for(;;){
+    if( atomic_fetch_add( &pQueue->count, 1 ) < pQueue->limit ) return 0;
+    atomic_fetch_sub( &pQueue->count, 1 );
+
+    if( !fullReported ){
+      atomic_fetch_add_explicit( &pQueue->fullCount, 1, memory_order_relaxed );
+      fullReported = 1;
+    }
+    wakeConsumer( pQueue );
+
+    switch( policy ){
+      case EVQ_OVERFLOW_DROP_OLDEST:
+        if( evictOldest( pQueue, eventClass ) ) break;
+        countDrop( pQueue, event );
+        return 1;
+
+      case EVQ_OVERFLOW_DROP_LOWEST:
+        for( c=EVQ_NUM_CLASSES-1; c>=eventClass; c-- ){
+          if( evictOldest( pQueue, c ) ) break;
+        }
+        if( c >= eventClass ) break;
+        countDrop( pQueue, event );
+        return 1;
+
+      case EVQ_OVERFLOW_DROP_NEWEST:
+        countDrop( pQueue, event );
+        return 1;
+
+      case EVQ_OVERFLOW_BLOCK:
+      default:
+        waitForRoom( pQueue );
+        break;
+    } // End switch
+  } // End for(ever)
+} // End of admitEvent()
+
+
+/********************************************************************
+  waitForRoom()
+
+  Parameters: (in)  Queue
+  Returns:    void
+
+  Description:
+  Sleeps until releaseRoom() signals or EVQ_BLOCK_WAIT_MS passes.
+  The blocked count and the event count are both updated with
+  seq_cst operations, so either the consumer sees us waiting or we
+  see the room it made.
+
+********************************************************************/
+static void waitForRoom( EVENTQUEUE_T *pQueue ){
+  struct timespec ts;
+
+  atomic_fetch_add( &pQueue->blocked, 1 );
+  pthread_mutex_lock( &pQueue->roomMutex );
+  if( atomic_load( &pQueue->count ) >= pQueue->limit ){
+    clock_gettime( CLOCK_REALTIME, &ts );
+    ts.tv_nsec += EVQ_BLOCK_WAIT_MS * 1000000L;
+    ts.tv_sec += ts.tv_nsec / 1000000000L;
+    ts.tv_nsec %= 1000000000L;
+    pthread_cond_timedwait( &pQueue->roomCv, &pQueue->roomMutex, &ts );
+  }
+  pthread_mutex_unlock( &pQueue->roomMutex );
+  atomic_fetch_sub( &pQueue->blocked, 1 );
+} // End of waitForRoom()
+
+
+/********************************************************************
+  evictOldest()
+
+  Parameters: (in)  Queue
+              (in)  Priority class
+  Returns:    1 = an event was dropped, 0 = class was empty
+
+  Description:
+  Dequeues and drops the oldest event of a class on behalf of a
+  producer.
+
+********************************************************************/
+static int evictOldest( EVENTQUEUE_T *pQueue, int eventClass ){
+  EVENTITEM_T item;
+
+  if( !ringClaim( pQueue, &pQueue->rings[eventClass], &item, 1 ) ) return 0;
+  releaseRoom( pQueue, 1 );
+  countDrop( pQueue, item.eventType );
+  eventPayload_release( item.eventData.pPayload );
+  return 1;
+} // End of evictOldest()
+
+
+/********************************************************************
+  countDrop()
+
+  Parameters: (in)  Queue
+              (in)  Dropped event
+  Returns:    void
+
+  Description:
+  Counts a dropped event and reports the start of shedding.
+
+********************************************************************/
+static void countDrop( EVENTQUEUE_T *pQueue, APPLICATION_EVENT event ){
+  atomic_fetch_add_explicit( &pQueue->dropped[event], 1, memory_order_relaxed );
+  atomic_fetch_add_explicit( &pQueue->droppedTotal, 1, memory_order_relaxed );
+  if( !atomic_exchange( &pQueue->shedding, 1 ) ){
+    dbg_out( DBG_IMPORTANT, "Event queue full (%zu events). Shedding events, first %s.\n",
+             pQueue->limit, eventQueue_eventName( event ) );
+  }
+} // End of countDrop()
+
+
+/********************************************************************
+  releaseRoom()
+
+  Parameters: (in)  Queue
+              (in)  Number of events that left the queue
+  Returns:    void
+
+  Description:
+  Gives places back to producers and wakes blocked ones. Reports the
+  end of shedding once the queue has drained to half of its limit.
+
+********************************************************************/
+static void releaseRoom( EVENTQUEUE_T *pQueue, size_t n ){
+  size_t count = atomic_fetch_sub( &pQueue->count, n ) - n;
+
+  if( atomic_load( &pQueue->blocked ) ){
+    pthread_mutex_lock( &pQueue->roomMutex );
+    pthread_cond_broadcast( &pQueue->roomCv );
+    pthread_mutex_unlock( &pQueue->roomMutex );
+  }
+
+  if( count <= pQueue->limit / 2 && atomic_load_explicit( &pQueue->shedding, memory_order_relaxed )
+      && atomic_exchange( &pQueue->shedding, 0 ) ){
+    dbg_out( DBG_IMPORTANT, "Event queue no longer full. %lu events dropped since start.\n",
+             atomic_load( &pQueue->droppedTotal ) );
+  }
+} // End of releaseRoom()
+
+
+/********************************************************************
+  ringReady()
+
+  Parameters: (in)  Queue
+              (in)  Ring
+  Returns:    1 = oldest slot of the ring holds an event, 0 = empty
+
+  Description:
+  Consumer side emptiness check.
+
+********************************************************************/
+static int ringReady( const EVENTQUEUE_T *pQueue, EVENTRING_T *pRing ){
+  size_t pos = atomic_load_explicit( &pRing->dequeuePos, memory_order_relaxed );
+  return atomic_load_explicit( &pRing->slots[ pos & pQueue->mask ].seq, memory_order_acquire ) == pos + 1;
+} // End of ringReady()
+
+
+/********************************************************************
+  ringClaim()
+
+  Parameters: (in)  Queue
+              (in)  Ring
+              (out) Event array
+              (in)  Max events to take
+  Returns:    Number of events taken
+
+  Description:
+  Claims a run of consecutive published slots with one CAS on the
+  dequeue position, copies them out and hands the whole block back
+  to producers with one fence. The consumer and evicting producers
+  both come here. Coalesced events take the newest payload out of
+  their cell, after which a new push of that key queues a new event.
+
+********************************************************************/
+static int ringClaim( EVENTQUEUE_T *pQueue, EVENTRING_T *pRing, EVENTITEM_T *pItems, int maxItems ){
+  size_t       pos = atomic_load_explicit( &pRing->dequeuePos, memory_order_relaxed );
+  EVENTSLOT_T *pSlot;
+  int          n;
+  int          k;
+
+  for(;;){
+    for( n=0; n<maxItems; n++ ){
+      pSlot = &pRing->slots[ (pos + n) & pQueue->mask ];
+      if( atomic_load_explicit( &pSlot->seq, memory_order_acquire ) != pos + n + 1 ) break;
+    }
+    if( 0 == n ) return 0;
+    if( atomic_compare_exchange_weak_explicit( &pRing->dequeuePos, &pos, pos + n,
+                                               memory_order_relaxed, memory_order_relaxed ) ){
+      break;
+    }
+    // pos reloaded by failed CAS
+  } // End for(ever)
+
+  // The block is ours until the sequence numbers are bumped
+  for( k=0; k<n; k++ ){
+    pSlot = &pRing->slots[ (pos + k) & pQueue->mask ];
+    pItems[k].eventType = pSlot->eventType;
+    pItems[k].eventData = pSlot->eventData;
+    pItems[k].enqueueNs = pSlot->enqueueNs;
+    if( pSlot->coalesceCell >= 0 ){
+      pItems[k].eventData.pPayload = atomic_exchange_explicit( &pQueue->cells[ pSlot->coalesceCell ].pPending,
+                                                               NULL, memory_order_acq_rel );
+    }
+  }
+
+  atomic_thread_fence( memory_order_release );
+  for( k=0; k<n; k++ ){
+    atomic_store_explicit( &pRing->slots[ (pos + k) & pQueue->mask ].seq, pos + k + pQueue->capacity, memory_order_relaxed );
+  }
+  return n;
+} // End of ringClaim()
+
+
+/********************************************************************
+  ringTakeBatch()
+
+  Parameters: (in)  Queue
+              (in)  Ring
+              (out) Event array
+              (in)  Max events to take
+  Returns:    Number of events taken
+
+  Description:
+  Consumer side dequeue of one ring. Updates the class statistics.
+
+********************************************************************/
+static int ringTakeBatch( EVENTQUEUE_T *pQueue, EVENTRING_T *pRing, EVENTITEM_T *pItems, int maxItems ){
+  size_t depth = atomic_load_explicit( &pRing->enqueuePos, memory_order_relaxed )
+               - atomic_load_explicit( &pRing->dequeuePos, memory_order_relaxed );
+  int    n;
+
+  n = ringClaim( pQueue, pRing, pItems, maxItems );
+  if( 0 == n ) return 0;
+
+  if( depth > pRing->maxDepth ) pRing->maxDepth = depth;
+  pRing->popped += n;
+  pRing->skipped = 0;
+  releaseRoom( pQueue, n );
+  return n;
+} // End of ringTakeBatch()
+
+
+/********************************************************************
+  eventQueue_tryPopBatch()
+
+  Parameters: (in)  Queue
+              (out) Event array
+              (in)  Array size
+  Returns:    Number of events returned, 0 = queue empty
+
+  Description:
+  Non-blocking batch dequeue. Single consumer only.
+  Fills the batch from the highest class down, keeping FIFO order
+  within each class. A class that is left waiting with nothing taken
+  is marked as passed over; once it reaches EVQ_STARVATION_LIMIT it
+  gets the first place of the next batch.
+
+********************************************************************/
+int eventQueue_tryPopBatch( EVENTQUEUE_T *pQueue, EVENTITEM_T *pItems, int maxItems ){
+  int taken[EVQ_NUM_CLASSES];
+  int n = 0;
+  int c;
+
+  for( c=0; c<EVQ_NUM_CLASSES; c++ ){
+    taken[c] = 0;
+    if( n < maxItems && pQueue->rings[c].skipped >= EVQ_STARVATION_LIMIT ){
+      taken[c] = ringTakeBatch( pQueue, &pQueue->rings[c], &pItems[n], 1 );
+      pQueue->starvationServed += taken[c];
+      n += taken[c];
+    }
+  }
+
+  for( c=0; c<EVQ_NUM_CLASSES && n<maxItems; c++ ){
+    if( taken[c] ) continue;
+    taken[c] = ringTakeBatch( pQueue, &pQueue->rings[c], &pItems[n], maxItems - n );
+    n += taken[c];
+  }
+
+  for( c=0; c<EVQ_NUM_CLASSES; c++ ){
+    if( !taken[c] && ringReady( pQueue, &pQueue->rings[c] ) ) pQueue->rings[c].skipped++;
+  }
+  return n;
+} // End of eventQueue_tryPopBatch()
+
+
+/********************************************************************
+  eventQueue_popBatch()
+
+  Parameters: (in)  Queue
+              (out) Event array
+              (in)  Array size
+  Returns:    Number of events returned (at least 1)
+
+  Description:
+  Blocking batch dequeue. Sleeps on the eventfd only when all rings
+  are empty.
+
+********************************************************************/
+int eventQueue_popBatch( EVENTQUEUE_T *pQueue, EVENTITEM_T *pItems, int maxItems ){
+  uint64_t count;
+  int      n;
+
+  for(;;){
+    n = eventQueue_tryPopBatch( pQueue, pItems, maxItems );
+    if( n ) return n;
+
+    // Announce sleep, then re-check to close the race with wakeConsumer()
+    atomic_store_explicit( &pQueue->sleeping, 1, memory_order_relaxed );
+    atomic_thread_fence( memory_order_seq_cst );
+    n = eventQueue_tryPopBatch( pQueue, pItems, maxItems );
+    if( n ){
+      atomic_store_explicit( &pQueue->sleeping, 0, memory_order_relaxed );
+      return n;
+    }
+
+    if( read( pQueue->wakeFd, &count, sizeof(count) ) < 0 && errno != EINTR ){
+      dbg_out( DBG_ERROR, "%s() eventfd read failed: %s\n", __FUNCTION__, strerror(errno) );
+    }
+    atomic_store_explicit( &pQueue->sleeping, 0, memory_order_relaxed );
+  } // End for(ever)
+} // End of eventQueue_popBatch()
+
+
+/********************************************************************
+  eventQueue_getWakeFd()
+
+  Parameters: (in)  Queue
+  Returns:    Wakeup eventfd
+
+  Description:
+  Descriptor for consumers that wait in poll/epoll.
+
+********************************************************************/
+int eventQueue_getWakeFd( EVENTQUEUE_T *pQueue ){
+  return pQueue->wakeFd;
+} // End of eventQueue_getWakeFd()
+
+
+/********************************************************************
+  eventQueue_prepareWait()
+
+  Parameters: (in)  Queue
+  Returns:    1 = queue empty, consumer may wait. 0 = do not wait.
+
+  Description:
+  Same sleep handshake as in eventQueue_popBatch(), for a consumer
+  that waits on the wakeup eventfd in its own poll loop.
+
+********************************************************************/
+int eventQueue_prepareWait( EVENTQUEUE_T *pQueue ){
+  int c;
+
+  atomic_store_explicit( &pQueue->sleeping, 1, memory_order_relaxed );
+  atomic_thread_fence( memory_order_seq_cst );
+  for( c=0; c<EVQ_NUM_CLASSES; c++ ){
+    if( ringReady( pQueue, &pQueue->rings[c] ) ){
+      atomic_store_explicit( &pQueue->sleeping, 0, memory_order_relaxed );
+      return 0;
+    }
+  }
+  return 1;
+} // End of eventQueue_prepareWait()
+
+
+/********************************************************************
+  eventQueue_finishWait()
+
+  Parameters: (in)  Queue
+              (in)  Nonzero if the eventfd was reported readable
+  Returns:    void
+
+  Description:
+  Clears the sleeping flag and consumes the eventfd counter.
+
+********************************************************************/
+void eventQueue_finishWait( EVENTQUEUE_T *pQueue, int woken ){
+  uint64_t count;
+
+  atomic_store_explicit( &pQueue->sleeping, 0, memory_order_relaxed );
+  if( woken && read( pQueue->wakeFd, &count, sizeof(count) ) < 0 && errno != EINTR ){
+    dbg_out( DBG_ERROR, "%s() eventfd read failed: %s\n", __FUNCTION__, strerror(errno) );
+  }
+} // End of eventQueue_finishWait()
+
+
+/********************************************************************
+  eventQueue_tryPop()
+
+  Parameters: (in)  Queue
+              (out) Event
+              (out) Event data
+  Returns:    1 = event returned, 0 = queue empty
+
+  Description:
+  Non-blocking single event dequeue. Single consumer only.
+
+********************************************************************/
+int eventQueue_tryPop( EVENTQUEUE_T *pQueue, APPLICATION_EVENT *event, APPLICATION_EVENTDATA *eventData ){
+  EVENTITEM_T item;
+
+  if( !eventQueue_tryPopBatch( pQueue, &item, 1 ) ) return 0;
+  *event = item.eventType;
+  *eventData = item.eventData;
+  return 1;
+} // End of eventQueue_tryPop()
+
+
+/********************************************************************
+  eventQueue_pop()
+
+  Parameters: (in)  Queue
+              (out) Event
+              (out) Event data
+  Returns:    void
+
+  Description:
+  Blocking single event dequeue.
+
+********************************************************************/
+void eventQueue_pop( EVENTQUEUE_T *pQueue, APPLICATION_EVENT *event, APPLICATION_EVENTDATA *eventData ){
+  EVENTITEM_T item;
+
+  eventQueue_popBatch( pQueue, &item, 1 );
+  *event = item.eventType;
+  *eventData = item.eventData;
+} // End of eventQueue_pop()
+
+
+/********************************************************************
+  eventQueue_clear()
+
+  Parameters: (in)  Queue
+  Returns:    void
+
+  Description:
+  Drops all queued events.
+
+********************************************************************/
+void eventQueue_clear( EVENTQUEUE_T *pQueue ){
+  EVENTITEM_T items[EVQ_BATCH_MAX];
+  int         n;
+
+  while( (n = eventQueue_tryPopBatch( pQueue, items, EVQ_BATCH_MAX )) > 0 ){
+    while( n-- ) eventPayload_release( items[n].eventData.pPayload );
+  }
+} // End of eventQueue_clear()
+
+
+
+/********************************************************************
+  eventQueue_getClassStats()
+
+  Parameters: (in)  Queue
+              (in)  Priority class
+              (out) Statistics
+  Returns:    void
+
+  Description:
+  Depth statistics of one class. Current depth is approximate while
+  producers are active.
+
+********************************************************************/
+void eventQueue_getClassStats( EVENTQUEUE_T *pQueue, EVENT_CLASS eventClass, EVENTCLASS_STATS *pStats ){
+  EVENTRING_T *pRing = &pQueue->rings[eventClass];
+
+  pStats->depth = atomic_load( &pRing->enqueuePos ) - atomic_load( &pRing->dequeuePos );
+  pStats->maxDepth = pRing->maxDepth;
+  pStats->popped = pRing->popped;
+} // End of eventQueue_getClassStats()
+
+
+/********************************************************************
+  eventQueue_getCoalesced()
+
+  Parameters: (in)  Queue
+              (in)  Event
+  Returns:    Number of merged events
+
+  Description:
+  Coalescing counter of one event type.
+
+********************************************************************/
+unsigned long eventQueue_getCoalesced( EVENTQUEUE_T *pQueue, APPLICATION_EVENT event ){
+  if( (unsigned)event >= EVT_COUNT ) return 0;
+  return atomic_load_explicit( &pQueue->coalesced[event], memory_order_relaxed );
+} // End of eventQueue_getCoalesced()
+
+
+/********************************************************************
+  eventQueue_getDropped()
+
+  Parameters: (in)  Queue
+              (in)  Event
+  Returns:    Number of dropped events
+
+  Description:
+  Overflow drop counter of one event type.
+
+********************************************************************/
+unsigned long eventQueue_getDropped( EVENTQUEUE_T *pQueue, APPLICATION_EVENT event ){
+  if( (unsigned)event >= EVT_COUNT ) return 0;
+  return atomic_load_explicit( &pQueue->dropped[event], memory_order_relaxed );
+} // End of eventQueue_getDropped()
+
+
+/********************************************************************
+  eventQueue_logStats()
+
+  Parameters: (in)  Queue
+              (in)  dbg_out() category
+  Returns:    void
+
+  Description:
+  Prints per class queue depths.
+
+********************************************************************/
+void eventQueue_logStats( EVENTQUEUE_T *pQueue, int type ){
+  EVENTCLASS_STATS stats;
+  unsigned long    merged;
+  unsigned long    dropped;
+  int              c;
+
+  for( c=0; c<EVQ_NUM_CLASSES; c++ ){
+    eventQueue_getClassStats( pQueue, (EVENT_CLASS)c, &stats );
+    dbg_out( type, "Event queue [%s]: depth %zu, max depth %zu, delivered %lu\n",
+             eventClassName[c], stats.depth, stats.maxDepth, stats.popped );
+  }
+  dbg_out( type, "Event queue: limit %zu, full %lu times, %lu events dropped, %lu served by starvation protection\n",
+           pQueue->limit, atomic_load( &pQueue->fullCount ), atomic_load( &pQueue->droppedTotal ), pQueue->starvationServed );
+  for( c=0; c<EVT_COUNT; c++ ){
+    merged = eventCoalescable[c] ? eventQueue_getCoalesced( pQueue, (APPLICATION_EVENT)c ) : 0;
+    dropped = eventQueue_getDropped( pQueue, (APPLICATION_EVENT)c );
+    if( 0 == merged && 0 == dropped ) continue;
+    dbg_out( type, "Event queue: %s [%s] dropped %lu, coalesced %lu\n",
+             eventQueue_eventName( (APPLICATION_EVENT)c ), overflowName[ pQueue->overflow[c] ], dropped, merged );
+  }
+} // End of eventQueue_logStats()
+
+
+/** End of eventQueue.c ********************************************/
@@ -0,0 +1,397 @@
+/**
+ * @file eventQueue.h
+ * @author Markku Heiskari
+ * @brief Application event queue. One bounded multi-producer / single-consumer
+ * ring per priority class, used behind pushEvent() and popEvent().
+ *
+ * @copyright Copyright (c) 2024 Creoir Oy
+ *
+ */
+
+#ifndef __eventqueue_h
+#define __eventqueue_h
+
+/********************************************************************
+  INCLUDES
+********************************************************************/
+#include <stddef.h>
+#include <stdint.h>
+#include <stdatomic.h>
+#include <pthread.h>
+#include "actionMain.h"
+
+/********************************************************************
+  DEFINES
+********************************************************************/
+#define EVQ_CACHELINE                   64          //!< Cache line size used to pad the producer and consumer sides of the ring
+#define EVQ_DEFAULT_CAPACITY            256         //!< Default max number of queued events over all priority classes
+#define EVQ_MAX_CAPACITY                65536       //!< Upper limit for --eventQueueSize
+#define EVQ_BLOCK_WAIT_MS               100         //!< A producer blocked by a full queue re-checks at least this often
+#define EVQ_STARVATION_LIMIT            16          //!< A waiting class is served after being passed over this many times
+#define EVQ_BATCH_MAX                   16          //!< Max events app_eventloop() takes from the queue at once
+#define EVQ_COALESCE_CELLS              16          //!< Number of keys that can have a coalesced event pending at once
+#define EVQ_COALESCE_KEYLEN             64          //!< Max length of a coalescing key (e.g. speaker name)
+
+#define EVQ_PUSH_DROPPED                1           //!< eventQueue_push() return value: event was shed by its overflow policy
+
+
+/********************************************************************
+  DATA TYPES
+********************************************************************/
+
+/**
+ * @brief Event priority classes. Lower value is served first.
+ * Events of the same class are delivered in FIFO order.
+ *
+ */
+typedef enum
+{
+  EVQ_CLASS_CONTROL,                    //!< Application control: startup, stop
+  EVQ_CLASS_INTERACTIVE,                //!< User interaction: wakeword, keypress
+  EVQ_CLASS_INTENT,                     //!< ASR results
+  EVQ_CLASS_BIOMETRIC,                  //!< Biometric identification
+  EVQ_NUM_CLASSES                       //!< Number of classes. Keep last.
+}EVENT_CLASS;
+
+
+/**
+ * @brief What a producer does when the queue is at capacity. Set per event type.
+ *
+ */
+typedef enum
+{
+  EVQ_OVERFLOW_BLOCK,                   //!< Wait until the consumer makes room
+  EVQ_OVERFLOW_DROP_OLDEST,             //!< Drop the oldest queued event of the same class. Drop the new one if the class is empty.
+  EVQ_OVERFLOW_DROP_NEWEST,             //!< Drop the new event
+  EVQ_OVERFLOW_DROP_LOWEST,             //!< Drop the oldest event of the lowest non-empty class at or below the new event's class.
+                                        //!< Drop the new one if only higher classes are queued.
+  EVQ_NUM_OVERFLOW                      //!< Number of policies. Keep last.
+}EVENT_OVERFLOW;
+
+
+/**
+ * @brief One slot in an event ring.
+ * The sequence number tells whether the slot is free for the producer (seq == pos)
+ * or holds a published event for the consumer (seq == pos+1).
+ *
+ */
+typedef struct
+{
+  _Alignas(EVQ_CACHELINE) atomic_size_t seq;   //!< Slot sequence number
+  APPLICATION_EVENT        eventType;          //!< Event stored in this slot
+  APPLICATION_EVENTDATA    eventData;          //!< Data block for the event. Payload pointer is moved, not copied.
+  int                      coalesceCell;       //!< -1, or index of the coalescing cell that holds the payload
+  uint64_t                 enqueueNs;          //!< monotonic_ns() at push, 0 if timestamps are off
+} EVENTSLOT_T;
+
+
+/**
+ * @brief Coalescing cell. Holds the newest payload of one (event type, key)
+ * pair while its event waits in the ring. A newer payload for the same key
+ * replaces the pending one instead of adding another event.
+ *
+ */
+typedef struct
+{
+  EVENTPAYLOAD_T *_Atomic  pPending;           //!< Newest payload not yet taken by the consumer, NULL if none
+  APPLICATION_EVENT        eventType;          //!< Event type of the key
+  int                      inUse;              //!< Nonzero once the cell has been assigned a key
+  char                     key[EVQ_COALESCE_KEYLEN]; //!< The key
+} EVENTCOALESCE_T;
+
+
+/**
+ * @brief Ring of one priority class. Producer and consumer positions live on
+ * separate cache lines so that producers do not invalidate the consumer line.
+ *
+ */
+typedef struct
+{
+  _Alignas(EVQ_CACHELINE) atomic_size_t enqueuePos;  //!< Next position to be claimed by a producer
+  _Alignas(EVQ_CACHELINE) atomic_size_t dequeuePos;  //!< Next position to be read by the consumer
+  size_t                skipped;                     //!< Consumer only: times passed over for a higher class while pending
+  size_t                maxDepth;                    //!< Consumer only: deepest backlog seen at dequeue
+  unsigned long         popped;                      //!< Consumer only: events delivered from this class
+  EVENTSLOT_T          *slots;                       //!< Slot array
+} EVENTRING_T;
+
+
+/**
+ * @brief One dequeued event. Used by the batch API.
+ *
+ */
+typedef struct EVENTITEM
+{
+  APPLICATION_EVENT        eventType;          //!< The event
+  APPLICATION_EVENTDATA    eventData;          //!< Data block for the event. Payload is owned by the receiver.
+  uint64_t                 enqueueNs;          //!< monotonic_ns() at push, 0 if timestamps are off
+} EVENTITEM_T;
+
+
+/**
+ * @brief Depth statistics of one priority class
+ *
+ */
+typedef struct
+{
+  size_t        depth;                  //!< Events waiting now
+  size_t        maxDepth;               //!< Deepest backlog seen
+  unsigned long popped;                 //!< Events delivered
+}EVENTCLASS_STATS;
+
+
+/**
+ * @brief Application event queue.
+ *
+ */
+typedef struct EVENTQUEUE
+{
+  EVENTRING_T           rings[EVQ_NUM_CLASSES];      //!< One ring per priority class
+  _Alignas(EVQ_CACHELINE) atomic_int    sleeping;    //!< Nonzero while the consumer is blocked waiting for events
+  int                   wakeFd;                      //!< eventfd used to wake up the consumer
+  size_t                capacity;                    //!< Slots per ring. Power of two, at least limit.
+  size_t                mask;                        //!< capacity-1
+  size_t                limit;                       //!< Max events queued over all classes
+  int                   timestamps;                  //!< Nonzero: events are stamped with their enqueue time
+  _Alignas(EVQ_CACHELINE) atomic_size_t count;       //!< Events queued over all classes
+  atomic_int            blocked;                     //!< Producers waiting for room
+  pthread_mutex_t       roomMutex;                   //!< Protects the wait of blocked producers
+  pthread_cond_t        roomCv;                      //!< Signalled when events leave a full queue
+  atomic_int            shedding;                    //!< Nonzero while events are being dropped
+  atomic_ulong          fullCount;                   //!< Number of times a producer found the queue full
+  atomic_ulong          droppedTotal;                //!< Events dropped by overflow policies
+  atomic_ulong          dropped[EVT_COUNT];          //!< Per event type: events dropped
+  EVENT_OVERFLOW        overflow[EVT_COUNT];         //!< Per event type: overflow policy
+  EVENTCOALESCE_T       cells[EVQ_COALESCE_CELLS];   //!< Coalescing cells
+  MQTT_SEND_MTX         coalesceMutex;               //!< Serializes producers while they look up a coalescing cell
+  atomic_ulong          coalesced[EVT_COUNT];        //!< Per event type: events merged into a pending one
+  unsigned long         starvationServed;            //!< Consumer only: events served out of priority order by starvation protection
+} EVENTQUEUE_T;
+
+
+/********************************************************************
+  PROTOTYPES
+********************************************************************/
+
+/**
+ * @brief Creates an event queue
+ *
+ * @param capacity Max number of queued events over all classes
+ * @return EVENTQUEUE_T* Pointer to queue, NULL on error
+ */
+EVENTQUEUE_T* eventQueue_create( size_t capacity );
+
+
+/**
+ * @brief Releases an event queue. Events still in the queue are discarded.
+ *
+ * @param pQueue Queue created with eventQueue_create()
+ */
+void eventQueue_destroy( EVENTQUEUE_T *pQueue );
+
+
+/**
+ * @brief Priority class of an event type
+ *
+ * @param event The event
+ * @return EVENT_CLASS Class the event is queued in
+ */
+EVENT_CLASS eventQueue_classOf( APPLICATION_EVENT event );
+
+
+/**
+ * @brief Name of an event type, e.g. "EVT_MQTT_PING"
+ *
+ * @param event The event
+ * @return const char* Name
+ */
+const char* eventQueue_eventName( APPLICATION_EVENT event );
+
+
+/**
+ * @brief Turns enqueue timestamps on or off. Call before producers start.
+ *
+ * @param pQueue The queue
+ * @param enable Nonzero to stamp every event with monotonic_ns() at push
+ */
+void eventQueue_setTimestamps( EVENTQUEUE_T *pQueue, int enable );
+
+
+/**
+ * @brief Sets the overflow policy of an event type
+ *
+ * @param pQueue The queue
+ * @param event The event
+ * @param policy What to do when the queue is full
+ */
+void eventQueue_setOverflow( EVENTQUEUE_T *pQueue, APPLICATION_EVENT event, EVENT_OVERFLOW policy );
+
+
+/**
+ * @brief Sets overflow policies from text, e.g. "EVT_MQTT_PING:newest,all:block".
+ * Policies are block, oldest, newest and lowest. "all" applies to every event type.
+ *
+ * @param pQueue The queue
+ * @param pSpec Comma separated list of event:policy pairs
+ * @return int 0=OK, nonzero=syntax error
+ */
+int eventQueue_parseOverflow( EVENTQUEUE_T *pQueue, const char *pSpec );
+
+
+/**
+ * @brief Adds an event to the ring of its priority class. Safe to call from any thread.
+ * If the queue is full, the overflow policy of the event type decides whether
+ * the producer waits or an event is dropped.
+ *
+ * @param pQueue The queue
+ * @param event The event
+ * @param eventData Event data block. Ownership of the payload moves to the queue,
+ * also when the event is dropped.
+ * @return int 0=OK, EVQ_PUSH_DROPPED=event was shed
+ */
+int eventQueue_push( EVENTQUEUE_T *pQueue, APPLICATION_EVENT event, const APPLICATION_EVENTDATA *eventData );
+
+
+/**
+ * @brief Adds an event that may be merged with a pending event of the same type and key.
+ * If an event of this type and key is still waiting in the queue, its payload is
+ * replaced by the new one and no new event is added. Event types that are not
+ * coalescable are pushed normally.
+ *
+ * @param pQueue The queue
+ * @param event The event
+ * @param eventData Event data block. Ownership of the payload moves to the queue.
+ * @param pKey Coalescing key, e.g. speaker name
+ * @return int 0=OK, EVQ_PUSH_DROPPED=event was shed
+ */
+int eventQueue_pushKeyed( EVENTQUEUE_T *pQueue, APPLICATION_EVENT event, const APPLICATION_EVENTDATA *eventData, const char *pKey );
+
+
+/**
+ * @brief Takes the next event without blocking. Highest priority class first,
+ * except that a class passed over EVQ_STARVATION_LIMIT times is served next.
+ * Consumer thread only.
+ *
+ * @param pQueue The queue
+ * @param event [out] The event
+ * @param eventData [out] Event data block
+ * @return int 1=event returned, 0=queue empty
+ */
+int eventQueue_tryPop( EVENTQUEUE_T *pQueue, APPLICATION_EVENT *event, APPLICATION_EVENTDATA *eventData );
+
+
+/**
+ * @brief Takes the next event. Blocks while the queue is empty.
+ * Consumer thread only.
+ *
+ * @param pQueue The queue
+ * @param event [out] The event
+ * @param eventData [out] Event data block
+ */
+void eventQueue_pop( EVENTQUEUE_T *pQueue, APPLICATION_EVENT *event, APPLICATION_EVENTDATA *eventData );
+
+
+/**
+ * @brief Takes up to maxItems events without blocking, one ring block per class.
+ * Higher classes come first in the array; FIFO order is kept within a class.
+ * Consumer thread only.
+ *
+ * @param pQueue The queue
+ * @param pItems [out] Event array
+ * @param maxItems Size of the array
+ * @return int Number of events returned, 0=queue empty
+ */
+int eventQueue_tryPopBatch( EVENTQUEUE_T *pQueue, EVENTITEM_T *pItems, int maxItems );
+
+
+/**
+ * @brief Takes up to maxItems events. Blocks only while the whole queue is empty.
+ * Consumer thread only.
+ *
+ * @param pQueue The queue
+ * @param pItems [out] Event array
+ * @param maxItems Size of the array
+ * @return int Number of events returned. At least 1.
+ */
+int eventQueue_popBatch( EVENTQUEUE_T *pQueue, EVENTITEM_T *pItems, int maxItems );
+
+
+/**
+ * @brief Descriptor that becomes readable when a producer wakes a waiting consumer.
+ * For consumers that poll the queue together with other descriptors.
+ *
+ * @param pQueue The queue
+ * @return int eventfd descriptor
+ */
+int eventQueue_getWakeFd( EVENTQUEUE_T *pQueue );
+
+
+/**
+ * @brief Announces that the consumer is about to wait on the wake descriptor.
+ * Consumer thread only. Call eventQueue_finishWait() after the wait.
+ *
+ * @param pQueue The queue
+ * @return int 1=queue is empty, safe to wait; 0=events arrived, do not wait
+ */
+int eventQueue_prepareWait( EVENTQUEUE_T *pQueue );
+
+
+/**
+ * @brief Ends a wait started with eventQueue_prepareWait(). Consumer thread only.
+ *
+ * @param pQueue The queue
+ * @param woken Nonzero if the wake descriptor was readable. Its counter is then reset.
+ */
+void eventQueue_finishWait( EVENTQUEUE_T *pQueue, int woken );
+
+
+/**
+ * @brief Discards all events in the queue. Consumer thread only.
+ *
+ * @param pQueue The queue
+ */
+void eventQueue_clear( EVENTQUEUE_T *pQueue );
+
+
+/**
+ * @brief Reads depth statistics of one priority class
+ *
+ * @param pQueue The queue
+ * @param eventClass The class
+ * @param pStats [out] Statistics
+ */
+void eventQueue_getClassStats( EVENTQUEUE_T *pQueue, EVENT_CLASS eventClass, EVENTCLASS_STATS *pStats );
+
+
+/**
+ * @brief Number of events of a type that were merged into an already queued event
+ *
+ * @param pQueue The queue
+ * @param event The event type
+ * @return unsigned long Merge count
+ */
+unsigned long eventQueue_getCoalesced( EVENTQUEUE_T *pQueue, APPLICATION_EVENT event );
+
+
+/**
+ * @brief Number of events of a type dropped by overflow policies
+ *
+ * @param pQueue The queue
+ * @param event The event type
+ * @return unsigned long Drop count
+ */
+unsigned long eventQueue_getDropped( EVENTQUEUE_T *pQueue, APPLICATION_EVENT event );
+
+
+/**
+ * @brief Writes queue statistics to debug output
+ *
+ * @param pQueue The queue
+ * @param type dbg_out() message category
+ */
+void eventQueue_logStats( EVENTQUEUE_T *pQueue, int type );
+
+
+#endif
+
+/* EOF *************************************************************/
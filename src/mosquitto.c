@@ -24,11 +24,57 @@
 #include "util.h"
 #include "cJSON.h"
 #include "actionMain.h"
+#include "eventQueue.h"
+#include "eventPayload.h"
+#include "mqttOutbox.h"
+#include "mqttSpool.h"
+#include "mqttRouter.h"
+#include "mqttStats.h"
 
 
+/********************************************************************
+  DEFINES
+********************************************************************/
+#define MQTT_SUBSCRIBE_BATCH    64              // Most topic filters in one SUBSCRIBE packet
+#define MQTT_SUBACK_WAITS       32              // SUBSCRIBE packets tracked until their SUBACK
+
+
+/********************************************************************
+  TYPES
+********************************************************************/
+
+/* A SUBSCRIBE packet waiting for its SUBACK */
+typedef struct
+{
+	int     mid;                                  // 0=free
+	int     qos;                                  // Requested QoS of every filter
+	int     count;                                // Number of filters
+	bool    connect;                              // Sent by on_connect(). Counts for readiness.
+	char  **ppTopics;                             // Copies of the filters, for the granted QoS check
+} SUBACK_WAIT_T;
 
+
+/********************************************************************
+  FILE SCOPE VARIABLES
+********************************************************************/
 extern globalData_type *pGlobalData;
 
+static pthread_mutex_t  subackMutex = PTHREAD_MUTEX_INITIALIZER;
+static SUBACK_WAIT_T    subackWait[MQTT_SUBACK_WAITS];
+static int              connectPending;       // SUBACKs of on_connect() still missing
+static int              connectTopics;        // Filters subscribed by on_connect()
+static uint64_t         connectNs;            // CONNACK time
+
+
+/********************************************************************
+  LOCAL PROTOTYPES
+********************************************************************/
+static int  subscribeFilter( const char *pTopic, int qos, bool subscribe );
+static int  subscribeBatch( char *const *ppTopics, int count, int qos );
+static void waitSuback( int mid, char *const *ppTopics, int count, int qos, bool connect );
+static void freeSubackWait( SUBACK_WAIT_T *pWait );
+static void signalReady( void );
+
 
 /********************************************************************
   FUNCTIONS
@@ -50,6 +96,7 @@ extern globalData_type *pGlobalData;
 void on_connect(struct mosquitto *mosq, void *obj, int reason_code){
 	int i;
 	int rc;
+	bool ready;
 
 	dbg_out( DBG_MQTT, "%s(): %s\n",__FUNCTION__, mosquitto_connack_string(reason_code));
 	if(reason_code != 0){
@@ -59,38 +106,57 @@ void on_connect(struct mosquitto *mosq, void *obj, int reason_code){
 	}
 
 	dbg_out(DBG_NORM, "Mosquitto MQTT client connected\n");
+
+	// Forget the SUBACKs of an earlier connection. They never come.
+	pthread_mutex_lock(&subackMutex);
+	for( i=0;i<MQTT_SUBACK_WAITS;i++ ) freeSubackWait( &subackWait[i] );
+	connectPending = 0;
+	connectTopics = 0;
+	connectNs = monotonic_ns();
+	pthread_mutex_unlock(&subackMutex);
+	pGlobalData->mqttReady = 0;
 	pGlobalData->mqttConnected = 1;
 
-	// Subscribe topics defined in mqttActionRegister
-    for( i=0;i< (sizeof(mqttActionRegister)/sizeof(mqtt_action));i++ ){
-      dbg_out( DBG_VERBOSE,"Registering action register index %d [%s].\n",i,mqttActionRegister[i].topic );
-			
-			/* PING-PONG SAMPLE CODE START */
-			#if 0
-			if( 1==pGlobalData->role && strstr(mqttActionRegister[i].topic,"ping") ) {
-				dbg_out( DBG_VERBOSE,"Not subscribing to ping topic\n" );
-				continue;
-			}
-			if (0 == pGlobalData->role && strstr(mqttActionRegister[i].topic, "pong")) {
-				dbg_out(DBG_VERBOSE, "Not subscribing to pong topic\n");
-				continue;
-			}
-			#endif
-			/* PING-PONG SAMPLE CODE STOP */
-
-			rc = mosquitto_subscribe(mosq, NULL, mqttActionRegister[i].topic, 1);
-			if(rc != MOSQ_ERR_SUCCESS){
-				dbg_out( DBG_ERROR, "%s() Failed to subscribe %s. Error: %s\n", __FUNCTION__, mqttActionRegister[i].topic, mosquitto_strerror(rc));
-				mosquitto_disconnect(mosq);
-				pGlobalData->mqttConnected = 0;
-				return;
-			}
-    }	// End for()
+	// Subscribe the topics of the router registry, a few SUBSCRIBE packets in all
+	rc = mqttRouter_resubscribe( subscribeBatch, MQTT_SUBSCRIBE_BATCH );
+	if(rc != MOSQ_ERR_SUCCESS){
+		mosquitto_disconnect(mosq);
+		pGlobalData->mqttConnected = 0;
+		return;
+	}
+
+	// Nothing to wait for if no topics are registered
+	pthread_mutex_lock(&subackMutex);
+	ready = ( 0 == connectPending );
+	pthread_mutex_unlock(&subackMutex);
+	if( ready ) signalReady();
 
+	// Send what was spooled while disconnected
+	if( mqttSpool_pending() ) mqtt_flushOutbox();
 
 }	// End of on_connect()
 
 
+/********************************************************************
+  on_disconnect()
+
+  Parameters: Handle to client
+	            void ptr
+							reason code
+  Returns:    void
+
+  Description:
+  Callback called when the connection to the broker is lost or
+  closed. Publishing goes to the offline spool until on_connect().
+
+********************************************************************/
+void on_disconnect(struct mosquitto *mosq, void *obj, int rc){
+	dbg_out( DBG_NORM, "%s() MQTT disconnected: %s\n", __FUNCTION__, mosquitto_strerror(rc) );
+	pGlobalData->mqttConnected = 0;
+	pGlobalData->mqttReady = 0;
+}	// End of on_disconnect()
+
+
 /********************************************************************
   on_publish()
 
@@ -109,6 +175,10 @@ void on_connect(struct mosquitto *mosq, void *obj, int reason_code){
 ********************************************************************/
 void on_publish(struct mosquitto *mosq, void *obj, int mid){
 	dbg_out( DBG_MQTT, "%s() Message with mid %d has been published.\n",__FUNCTION__, mid);
+	mqttOutbox_acked( mid );
+	// The ack opened the window for the rest of a spool replay. The reactor
+	// flushes after every read, and may be inside mqtt_flushOutbox() here.
+	if( !pGlobalData->reactorMode && mqttSpool_pending() ) mqtt_flushOutbox();
 }	// End of on_publish()
 
 
@@ -118,31 +188,52 @@ void on_publish(struct mosquitto *mosq, void *obj, int mid){
   Parameters: Handle to client
 	            void ptr
 							message id
+							number of granted QoS values
+							granted QoS per topic of the SUBSCRIBE
   Returns:    void
 
   Description:
-  Callback called when the broker sends a SUBACK in response to a SUBSCRIBE
+  Callback called when the broker sends a SUBACK in response to a SUBSCRIBE.
+  Checks the granted QoS of every topic of the packet. A refused topic
+  is logged and counted, the others stay subscribed. The last SUBACK of
+  the subscriptions of on_connect() makes the client ready.
 
 ********************************************************************/
 void on_subscribe(struct mosquitto *mosq, void *obj, int mid, int qos_count, const int *granted_qos){
+	SUBACK_WAIT_T *pWait = NULL;
+	const char *pTopic;
+	unsigned int rejected = 0;
+	bool ready = false;
 	int i;
-	bool have_subscription = false;
 
-	/* In this example we only subscribe to a single topic at once, but a
-	 * SUBSCRIBE can contain many topics at once, so this is one way to check
-	 * them all. */
+	pthread_mutex_lock(&subackMutex);
+	for( i=0;i<MQTT_SUBACK_WAITS;i++ ){
+		if( subackWait[i].mid == mid ){
+			pWait = &subackWait[i];
+			break;
+		}
+	}
+
 	for(i=0; i<qos_count; i++){
-		dbg_out( DBG_MQTT, "%s() on_subscribe: %d:granted qos = %d\n", __FUNCTION__, i, granted_qos[i]);
-		if(granted_qos[i] <= 2){
-			have_subscription = true;
+		pTopic = ( pWait && i < pWait->count ) ? pWait->ppTopics[i] : "?";
+		dbg_out( DBG_MQTT, "%s() mid %d: %s granted qos = %d\n", __FUNCTION__, mid, pTopic, granted_qos[i]);
+		if(granted_qos[i] > 2){
+			/* The broker refused this topic */
+			dbg_out( DBG_ERROR, "%s(), Error: MQTT subscription of %s rejected.\n", __FUNCTION__, pTopic );
+			rejected++;
+		}else if( pWait && granted_qos[i] < pWait->qos ){
+			dbg_out( DBG_NOTE, "MQTT subscription of %s downgraded to QoS %d\n", pTopic, granted_qos[i] );
 		}
 	}
-	if(have_subscription == false){
-		/* The broker rejected our subscription */
-		dbg_out( DBG_ERROR, "%s(), Error: MQTT subscription rejected.\n", __FUNCTION__ );
-		mosquitto_disconnect(mosq);
-		pGlobalData->mqttConnected = 0;
+
+	if( pWait ){
+		if( pWait->connect && 0 == --connectPending ) ready = true;
+		freeSubackWait( pWait );
 	}
+	pthread_mutex_unlock(&subackMutex);
+
+	if( rejected ) mqttStats_recordRejected( rejected );
+	if( ready ) signalReady();
 }	// End of on_subscribe()
 
 
@@ -159,28 +250,182 @@ void on_subscribe(struct mosquitto *mosq, void *obj, int mid, int qos_count, con
 
 ********************************************************************/
 void on_message(struct mosquitto *mosq, void *obj, const struct mosquitto_message *msg){
-	int i;
+	int i, matches;
+	MQTT_ROUTE_HANDLER pHandlers[MQTT_ROUTER_MAX_MATCHES];
+	EVENTPAYLOAD_T *pPayload;
 	//dbg_out( DBG_NORM,"MQTT: %s %d %s\n", msg->topic, msg->qos, (char *)msg->payload);
 
 	dbg_out( DBG_MQTT,"MQTT: Received '%s'\n", msg->topic );
   dbg_out( DBG_MQTT,"MQTT: Payload: %s\n", (char *)msg->payload );
 
-  /* Loop the array of topics that must be reacted */
-  for( i=0;i< (sizeof(mqttActionRegister)/sizeof(mqtt_action));i++ ){
-    int (*pHandler)( const char*, const char* );
-    //dbg_out( DBG_VERBOSE,"Checking action register index %d [%s].\n",i,mqttActionRegister[i].topic );
-    // Instead of strcmp, use compare function that accepts "#" wildcard
-    if( mqtt_topic_compare(mqttActionRegister[i].topic,msg->topic)==1 ){
-      dbg_out( DBG_VERBOSE,"Action register MATCH at index %d\n",i );
-      // Call the handler
-      pHandler = mqttActionRegister[i].function;
-      pHandler( msg->topic,(char *)msg->payload );
-    }
+  /* Find the handlers of the topic in the router registry */
+  matches = mqttRouter_match( msg->topic, pHandlers, MQTT_ROUTER_MAX_MATCHES );
+  for( i=0;i<matches;i++ ){
+    dbg_out( DBG_VERBOSE,"Action register MATCH %d/%d\n",i+1,matches );
+    // Each handler gets its own length-prefixed copy and takes ownership of it. One topic usually has one handler.
+    pPayload = eventPayload_create( msg->payload, msg->payloadlen );
+    if( NULL == pPayload ) continue;
+    // Call the handler
+    if( pHandlers[i]( msg->topic, pPayload ) ) eventPayload_release( pPayload );
 	}	// End for()
 
 }	// End of on_message()
 
 
+/********************************************************************
+  subscribeFilter()
+
+  Parameters: (in)  Topic filter
+              (in)  QoS
+              (in)  true=subscribe, false=unsubscribe
+  Returns:    MOSQ_ERR_SUCCESS or mosquitto error
+
+  Description:
+  Router subscriber. Follows handler registry changes with broker
+  subscriptions. While disconnected there is nothing to do:
+  on_connect() subscribes the whole registry.
+
+********************************************************************/
+static int subscribeFilter( const char *pTopic, int qos, bool subscribe ){
+	struct mosquitto *mosq = pGlobalData->mosquittoClient;
+	int mid = 0;
+	int rc;
+
+	if( !pGlobalData->mqttConnected || NULL == mosq ) return MOSQ_ERR_SUCCESS;
+
+	dbg_out( DBG_VERBOSE, "%s %s [%s]\n", __FUNCTION__, subscribe ? "subscribe" : "unsubscribe", pTopic );
+	if( subscribe ){
+		// Recorded under the lock, before the SUBACK can be handled
+		pthread_mutex_lock(&subackMutex);
+		rc = mosquitto_subscribe(mosq, &mid, pTopic, qos);
+		if(rc == MOSQ_ERR_SUCCESS) waitSuback( mid, (char *const *)&pTopic, 1, qos, false );
+		pthread_mutex_unlock(&subackMutex);
+	}else{
+		rc = mosquitto_unsubscribe(mosq, NULL, pTopic);
+	}
+	if(rc != MOSQ_ERR_SUCCESS){
+		dbg_out( DBG_ERROR, "%s() Failed to %s %s. Error: %s\n", __FUNCTION__, subscribe ? "subscribe" : "unsubscribe", pTopic, mosquitto_strerror(rc));
+	}
+	return rc;
+}	// End of subscribeFilter()
+
+
+/********************************************************************
+  subscribeBatch()
+
+  Parameters: (in)  Topic filters
+              (in)  Number of filters
+              (in)  QoS of all of them
+  Returns:    MOSQ_ERR_SUCCESS or mosquitto error
+
+  Description:
+  Router subscriber of on_connect(). One SUBSCRIBE packet for the
+  whole batch. The SUBACK is awaited before the client is ready.
+
+********************************************************************/
+static int subscribeBatch( char *const *ppTopics, int count, int qos ){
+	struct mosquitto *mosq = pGlobalData->mosquittoClient;
+	int mid = 0;
+	int rc;
+
+	dbg_out( DBG_VERBOSE, "%s() %d topics with QoS %d\n", __FUNCTION__, count, qos );
+	pthread_mutex_lock(&subackMutex);
+	rc = mosquitto_subscribe_multiple(mosq, &mid, count, ppTopics, qos, 0, NULL);
+	if(rc == MOSQ_ERR_SUCCESS){
+		waitSuback( mid, ppTopics, count, qos, true );
+	}else{
+		dbg_out( DBG_ERROR, "%s() Failed to subscribe %d topics. Error: %s\n", __FUNCTION__, count, mosquitto_strerror(rc));
+	}
+	pthread_mutex_unlock(&subackMutex);
+	return rc;
+}	// End of subscribeBatch()
+
+
+/********************************************************************
+  waitSuback()
+
+  Parameters: (in)  mid of the SUBSCRIBE
+              (in)  Topic filters of the packet
+              (in)  Number of filters
+              (in)  Requested QoS
+              (in)  true=sent by on_connect()
+  Returns:    void
+
+  Description:
+  Remembers a SUBSCRIBE until on_subscribe(). subackMutex held, so
+  the SUBACK cannot be handled before it is recorded. A packet that
+  does not fit is not checked, and does not hold back readiness.
+
+********************************************************************/
+static void waitSuback( int mid, char *const *ppTopics, int count, int qos, bool connect ){
+	SUBACK_WAIT_T *pWait = NULL;
+	int i;
+
+	for( i=0;i<MQTT_SUBACK_WAITS && NULL == pWait;i++ ){
+		if( 0 == subackWait[i].mid ) pWait = &subackWait[i];
+	}
+	if( NULL == pWait ){
+		dbg_out( DBG_NOTE, "%s() Too many SUBSCRIBEs in flight. mid %d not checked.\n", __FUNCTION__, mid );
+		return;
+	}
+
+	pWait->ppTopics = calloc( count, sizeof(char*) );
+	for( i=0; pWait->ppTopics && i<count; i++ ) pWait->ppTopics[i] = strdup( ppTopics[i] );
+	pWait->mid = mid;
+	pWait->qos = qos;
+	pWait->count = pWait->ppTopics ? count : 0;
+	pWait->connect = connect;
+	if( connect ){
+		connectPending++;
+		connectTopics += count;
+	}
+}	// End of waitSuback()
+
+
+/********************************************************************
+  freeSubackWait()
+
+  Parameters: (in)  SUBACK wait
+  Returns:    void
+
+  Description:
+  Releases the entry. subackMutex held.
+
+********************************************************************/
+static void freeSubackWait( SUBACK_WAIT_T *pWait ){
+	int i;
+
+	for( i=0; pWait->ppTopics && i<pWait->count; i++ ) free( pWait->ppTopics[i] );
+	free( pWait->ppTopics );
+	memset( pWait, 0, sizeof(SUBACK_WAIT_T) );
+}	// End of freeSubackWait()
+
+
+/********************************************************************
+  signalReady()
+
+  Parameters: void
+  Returns:    void
+
+  Description:
+  Every subscription of the connection is acknowledged. Records the
+  time from CONNACK and tells the application with EVT_MQTT_READY.
+
+********************************************************************/
+static void signalReady( void ){
+	APPLICATION_EVENTDATA eventData;
+	uint64_t ns = monotonic_ns() - connectNs;
+
+	pGlobalData->mqttReady = 1;
+	mqttStats_recordReady( ns );
+	dbg_out( DBG_NORM, "MQTT ready: %d topics subscribed in %llu ms\n", connectTopics, (unsigned long long)( ns / 1000000ULL ) );
+
+	memset( &eventData, 0, sizeof(eventData) );
+	eventData.param = (int)( ns / 1000000ULL );
+	pushEvent( EVT_MQTT_READY, &eventData );
+}	// End of signalReady()
+
+
 /********************************************************************
   mqtt_interface_init()
 
@@ -215,11 +460,21 @@ int mqtt_interface_init( void ){
 
 	/* Configure callbacks. This should be done before connecting ideally. */
 	mosquitto_connect_callback_set(mosqClient, on_connect);
+	mosquitto_disconnect_callback_set(mosqClient, on_disconnect);
 	mosquitto_publish_callback_set(mosqClient, on_publish);
 
 	mosquitto_subscribe_callback_set(mosqClient, on_subscribe);
 	mosquitto_message_callback_set(mosqClient, on_message);
 
+	/* Handler registry changes subscribe and unsubscribe while connected */
+	mqttRouter_setSubscriber(subscribeFilter);
+
+	/* Let libmosquitto keep the whole in-flight window on the wire. Our window
+	 * holds the rest back in the outbox instead of inside the library. */
+	if( pGlobalData->inflightWindow ){
+		mosquitto_max_inflight_messages_set(mosqClient, pGlobalData->inflightWindow);
+	}
+
 
 	/* Connect to test.mosquitto.org on port 1883, with a keepalive of 60 seconds.
 	 * This call makes the socket connection only, it does not complete the MQTT
@@ -232,6 +487,11 @@ int mqtt_interface_init( void ){
 		return -1;
 	}
 
+	/* In reactor mode the network loop and publishing run in reactor_run() */
+	if( pGlobalData->reactorMode ){
+		return 0;
+	}
+
 	/* Run the network loop in a background thread, this call returns quickly. */
 	rc = mosquitto_loop_start(mosqClient);
 	if(rc != MOSQ_ERR_SUCCESS){
@@ -0,0 +1,807 @@
+/********************************************************************
+
+  Outbound MQTT message queue
+
+  Author: Markku Heiskari
+  Version history in github
+
+  (C) Copyright 2024, Creoir Oy
+
+  A pool of 'slots' message buffers linked by index into a free list
+  and one FIFO list per priority lane. A producer takes a slot from
+  the free list under the mutex, writes the topic and payload without
+  it and commits the slot to the tail of its lane. The sender takes
+  the head of the highest non-empty lane, publishes it without the
+  mutex and then returns the slot to the free list.
+
+  Producers wait on roomCv only when all slots are in use, the sender
+  waits on readyCv only when every lane is empty or the in-flight
+  window is full. Nobody polls.
+
+  The window is taken when mqttOutbox_next() hands out a QoS 1/2
+  message and given back when on_publish() reports its mid, so no
+  more than 'window' messages wait for an ack inside libmosquitto.
+  Held back messages stay in their lane where expiry and the full
+  outbox policy of the producers apply to them. on_publish() runs on
+  the network thread and may come before mqttOutbox_done() or
+  mqttOutbox_track() has recorded the mid, so either side may create the tracking entry and
+  the other one completes it. libmosquitto resends unacknowledged
+  messages after a reconnect, so the window drains without help.
+
+********************************************************************/
+
+/********************************************************************
+  INCLUDES
+********************************************************************/
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <pthread.h>
+#include "actionMain.h"
+#include "util.h"
+#include "mqttOutbox.h"
+#include "mqttStats.h"
+
+/********************************************************************
+  TYPES
+********************************************************************/
+
+typedef enum
+{
+  INFLIGHT_FREE,
+  INFLIGHT_SENT,                                //!< Published, waiting for on_publish()
+  INFLIGHT_ACKED                                //!< on_publish() came before mqttOutbox_done()
+}INFLIGHT_STATE;
+
+typedef struct
+{
+  INFLIGHT_STATE      state;
+  int                 mid;
+  int                 policy;
+  int                 qos;
+  uint64_t            ns;                       //!< Publish start (SENT) or ack time (ACKED)
+  MQTT_PUBLISH_DONE   pfDone;
+  void               *pUser;
+} INFLIGHT_T;
+
+typedef struct
+{
+  MQTT_OUTMSG        *pSlots;                   //!< Slot descriptors
+  char               *pArea;                    //!< Topic and payload buffers of all slots
+  unsigned int        slots;                    //!< Number of slots
+  int                 freeList;                 //!< First free slot, -1=none
+  int                 laneHead[MQTT_NUM_LANES]; //!< Oldest committed slot per lane, -1=empty
+  int                 laneTail[MQTT_NUM_LANES]; //!< Newest committed slot per lane
+  unsigned int        used;                     //!< Reserved, queued or publishing slots
+  pthread_mutex_t     mutex;
+  pthread_cond_t      roomCv;                   //!< Signalled when a slot is freed
+  pthread_cond_t      readyCv;                  //!< Signalled when a slot is committed or the window opens
+  INFLIGHT_T          tracked[MQTT_INFLIGHT_TRACKED];  //!< Published mids by mid & (MQTT_INFLIGHT_TRACKED-1)
+  unsigned int        window;                   //!< Max unacknowledged QoS 1/2 messages, 0=no limit
+  unsigned int        inflight;                 //!< QoS 1/2 messages handed out and not yet acknowledged
+  unsigned int        generation;               //!< Current interaction, see mqttOutbox_bargeIn()
+  unsigned long       queued[MQTT_NUM_LANES];
+  unsigned long       highWater;
+  unsigned long       sent;
+  unsigned long       expired;
+  unsigned long       cancelled;
+  unsigned long       fullWaits;
+  unsigned long       timeouts;
+  unsigned long       windowFull;
+  unsigned long       ackLost;
+} MQTTOUTBOX_T;
+
+
+/********************************************************************
+  FILE SCOPE VARIABLES
+********************************************************************/
+static MQTTOUTBOX_T outbox;
+
+
+/********************************************************************
+  LOCAL PROTOTYPES
+********************************************************************/
+static void freeSlot( MQTT_OUTMSG *pMsg );
+static void releaseWindow( int qos );
+static int  readyLane( void );
+static bool isStale( const MQTT_OUTMSG *pMsg );
+static void trackMid( int policy, int qos, int mid, uint64_t publishNs, int ok, MQTT_PUBLISH_DONE pfDone, void *pUser );
+
+
+/********************************************************************
+  FUNCTIONS
+********************************************************************/
+
+
+/********************************************************************
+  mqttOutbox_init()
+
+  Parameters: (in)  Number of slots
+              (in)  In-flight window, 0 = no limit
+  Returns:    0 = ok, nonzero = error code.
+
+  Description:
+  Allocates the slot descriptors and one area for their buffers.
+
+********************************************************************/
+int mqttOutbox_init( unsigned int slots, unsigned int window ){
+  size_t       slotSize = MQTT_SEND_TOPIC_SIZE + MQTT_SEND_PAYLOAD_SIZE;
+  unsigned int i;
+
+  if( slots < 1 ) slots = 1;
+  if( slots > MQTT_OUTBOX_MAX_SLOTS ) slots = MQTT_OUTBOX_MAX_SLOTS;
+  if( window > MQTT_INFLIGHT_MAX_WINDOW ) window = MQTT_INFLIGHT_MAX_WINDOW;
+
+  memset( &outbox, 0x00, sizeof(outbox) );
+  outbox.pSlots = calloc( slots, sizeof(MQTT_OUTMSG) );
+  outbox.pArea = malloc( slots * slotSize );
+  if( NULL == outbox.pSlots || NULL == outbox.pArea ){
+    dbg_out( DBG_FATAL, "%s() Unable to allocate %u outbound slots\n", __FUNCTION__, slots );
+    free( outbox.pSlots );
+    free( outbox.pArea );
+    return -1;
+  }
+  for( i = 0; i < slots; i++ ){
+    outbox.pSlots[i].pTopic = outbox.pArea + i * slotSize;
+    outbox.pSlots[i].pPayload = outbox.pSlots[i].pTopic + MQTT_SEND_TOPIC_SIZE;
+    outbox.pSlots[i].next = ( i + 1 < slots ) ? (int)i + 1 : -1;
+  }
+  outbox.freeList = 0;
+  for( i = 0; i < MQTT_NUM_LANES; i++ ){
+    outbox.laneHead[i] = -1;
+    outbox.laneTail[i] = -1;
+  }
+  outbox.slots = slots;
+  outbox.window = window;
+  pthread_mutex_init( &outbox.mutex, NULL );
+  pthread_cond_init( &outbox.roomCv, NULL );
+  pthread_cond_init( &outbox.readyCv, NULL );
+
+  dbg_out( DBG_VERBOSE, "%s() %u outbound MQTT slots, in-flight window %u\n", __FUNCTION__, slots, window );
+  return 0;
+} // End of mqttOutbox_init()
+
+
+/********************************************************************
+  mqttOutbox_destroy()
+
+  Parameters: void
+  Returns:    void
+
+  Description:
+  Frees the slots.
+
+********************************************************************/
+void mqttOutbox_destroy( void ){
+  if( 0 == outbox.slots ) return;
+  pthread_cond_destroy( &outbox.readyCv );
+  pthread_cond_destroy( &outbox.roomCv );
+  pthread_mutex_destroy( &outbox.mutex );
+  free( outbox.pArea );
+  free( outbox.pSlots );
+  outbox.slots = 0;
+} // End of mqttOutbox_destroy()
+
+
+/********************************************************************
+  mqttOutbox_reserve()
+
+  Parameters: (in)  Max wait in milliseconds, 0 = no wait
+  Returns:    Slot, NULL if the outbox stayed full
+
+  Description:
+  Takes a slot from the free list. When every slot is in use, sleeps
+  on roomCv until one is freed or the wait time is over.
+
+********************************************************************/
+MQTT_OUTMSG* mqttOutbox_reserve( unsigned int waitMs ){
+  MQTT_OUTMSG     *pMsg = NULL;
+  struct timespec  ts;
+
+  pthread_mutex_lock( &outbox.mutex );
+  if( outbox.freeList < 0 ){
+    outbox.fullWaits++;
+    if( waitMs ){
+      clock_gettime( CLOCK_REALTIME, &ts );
+      ts.tv_sec += waitMs / 1000;
+      ts.tv_nsec += (waitMs % 1000) * 1000000L;
+      ts.tv_sec += ts.tv_nsec / 1000000000L;
+      ts.tv_nsec %= 1000000000L;
+      while( outbox.freeList < 0 ){
+        if( pthread_cond_timedwait( &outbox.roomCv, &outbox.mutex, &ts ) ) break;
+      }
+    }
+  }
+  if( outbox.freeList >= 0 ){
+    pMsg = &outbox.pSlots[outbox.freeList];
+    outbox.freeList = pMsg->next;
+    pMsg->next = -1;
+    pMsg->pData = pMsg->pPayload;
+    pMsg->payloadLen = 0;
+    pMsg->qos = 0;
+    pMsg->retain = false;
+    pMsg->lane = MQTT_LANE_NORMAL;
+    pMsg->policy = -1;
+    pMsg->repeatable = false;
+    pMsg->expiresNs = 0;
+    pMsg->pfDone = NULL;
+    pMsg->pUser = NULL;
+    pMsg->generation = outbox.generation;
+    outbox.used++;
+    if( outbox.used > outbox.highWater ) outbox.highWater = outbox.used;
+  }else{
+    outbox.timeouts++;
+  }
+  pthread_mutex_unlock( &outbox.mutex );
+
+  return pMsg;
+} // End of mqttOutbox_reserve()
+
+
+/********************************************************************
+  mqttOutbox_commit()
+
+  Parameters: (in)  Slot
+              (in)  true = wake the sender
+  Returns:    void
+
+  Description:
+  Appends the slot to its lane and stamps the commit time for the
+  queue latency statistics.
+
+********************************************************************/
+void mqttOutbox_commit( MQTT_OUTMSG *pMsg, bool wakeSender ){
+  int idx = (int)( pMsg - outbox.pSlots );
+  int lane = ( pMsg->lane < MQTT_NUM_LANES ) ? pMsg->lane : MQTT_LANE_LOW;
+
+  pMsg->committedNs = monotonic_ns();
+  pthread_mutex_lock( &outbox.mutex );
+  pMsg->next = -1;
+  if( outbox.laneTail[lane] >= 0 ){
+    outbox.pSlots[outbox.laneTail[lane]].next = idx;
+  }else{
+    outbox.laneHead[lane] = idx;
+  }
+  outbox.laneTail[lane] = idx;
+  outbox.queued[lane]++;
+  if( wakeSender ) pthread_cond_signal( &outbox.readyCv );
+  pthread_mutex_unlock( &outbox.mutex );
+} // End of mqttOutbox_commit()
+
+
+/********************************************************************
+  readyLane()
+
+  Parameters: void
+  Returns:    Lane whose head can be sent, -1 = all lanes empty,
+              -2 = head held back by the in-flight window
+
+  Description:
+  Finds the highest non-empty lane. A QoS 1/2 head waits while the
+  in-flight window is full; lower lanes wait behind it so the lane
+  order holds. Called with the mutex held.
+
+********************************************************************/
+static int readyLane( void ){
+  int lane;
+
+  for( lane = 0; lane < MQTT_NUM_LANES && outbox.laneHead[lane] < 0; lane++ );
+  if( lane == MQTT_NUM_LANES ) return -1;
+  if( outbox.pSlots[outbox.laneHead[lane]].qos > 0 && outbox.window && outbox.inflight >= outbox.window ) return -2;
+  return lane;
+} // End of readyLane()
+
+
+/********************************************************************
+  isStale()
+
+  Parameters: (in)  Slot
+  Returns:    true = drop, a newer interaction has started
+
+  Description:
+  Messages of bargeIn topics belong to the interaction that was
+  current when they were reserved. Called with the mutex held.
+
+********************************************************************/
+static bool isStale( const MQTT_OUTMSG *pMsg ){
+  if( pMsg->policy < 0 || !mqttPublishPolicyRegister[pMsg->policy].bargeIn ) return false;
+  return pMsg->generation != outbox.generation;
+} // End of isStale()
+
+
+/********************************************************************
+  mqttOutbox_bargeIn()
+
+  Parameters: void
+  Returns:    Number of messages dropped
+
+  Description:
+  Starts a new interaction generation and unlinks the queued
+  messages of bargeIn topics from all lanes. Messages being filled
+  right now are dropped by mqttOutbox_next(). Their de-duplication
+  state is reset. Completion callbacks run after the mutex is
+  released.
+
+********************************************************************/
+unsigned int mqttOutbox_bargeIn( void ){
+  MQTT_PUBLISH_DONE  pfDone[MQTT_OUTBOX_MAX_SLOTS];
+  void              *pUser[MQTT_OUTBOX_MAX_SLOTS];
+  MQTT_OUTMSG       *pMsg;
+  unsigned int       count = 0;
+  unsigned int       calls = 0;
+  unsigned int       i;
+  int                lane, idx, prev, nextIdx;
+
+  if( 0 == outbox.slots ) return 0;
+
+  pthread_mutex_lock( &outbox.mutex );
+  outbox.generation++;
+  for( lane = 0; lane < MQTT_NUM_LANES; lane++ ){
+    prev = -1;
+    for( idx = outbox.laneHead[lane]; idx >= 0; idx = nextIdx ){
+      pMsg = &outbox.pSlots[idx];
+      nextIdx = pMsg->next;
+      if( !isStale( pMsg ) ){
+        prev = idx;
+        continue;
+      }
+      if( prev < 0 ) outbox.laneHead[lane] = nextIdx;
+      else outbox.pSlots[prev].next = nextIdx;
+      if( outbox.laneTail[lane] == idx ) outbox.laneTail[lane] = prev;
+      outbox.queued[lane]--;
+      outbox.cancelled++;
+      if( pMsg->pfDone ){
+        pfDone[calls] = pMsg->pfDone;
+        pUser[calls++] = pMsg->pUser;
+      }
+      freeSlot( pMsg );
+      count++;
+    }
+  }
+  pthread_mutex_unlock( &outbox.mutex );
+  mqtt_resetDedup();
+
+  for( i = 0; i < calls; i++ ) pfDone[i]( pUser[i], 0, MQTT_PUBLISH_CANCELLED );
+  return count;
+} // End of mqttOutbox_bargeIn()
+
+
+/********************************************************************
+  mqttOutbox_waitReady()
+
+  Parameters: void
+  Returns:    void
+
+  Description:
+  Sleeps until a committed message can be sent. Does not take it;
+  the caller drains the outbox with mqttOutbox_next().
+
+********************************************************************/
+void mqttOutbox_waitReady( void ){
+  int held = 0;
+  int lane;
+
+  pthread_mutex_lock( &outbox.mutex );
+  while( ( lane = readyLane() ) < 0 ){
+    if( -2 == lane && !held ) outbox.windowFull++;
+    held = ( -2 == lane );
+    pthread_cond_wait( &outbox.readyCv, &outbox.mutex );
+  }
+  pthread_mutex_unlock( &outbox.mutex );
+} // End of mqttOutbox_waitReady()
+
+
+/********************************************************************
+  mqttOutbox_cancel()
+
+  Parameters: (in)  Slot
+  Returns:    void
+
+  Description:
+  Returns the slot to the free list.
+
+********************************************************************/
+void mqttOutbox_cancel( MQTT_OUTMSG *pMsg ){
+  pthread_mutex_lock( &outbox.mutex );
+  freeSlot( pMsg );
+  pthread_mutex_unlock( &outbox.mutex );
+} // End of mqttOutbox_cancel()
+
+
+/********************************************************************
+  mqttOutbox_next()
+
+  Parameters: (in)  Nonzero = wait for a message that can be sent
+  Returns:    Slot to publish, NULL if none
+
+  Description:
+  Unlinks the head of the highest non-empty lane. The slot stays in
+  use until mqttOutbox_done(). Messages whose expiry passed while
+  they were queued, or that a barge-in made stale after they were
+  reserved, are freed here and never reach the broker. See
+  readyLane() for the in-flight window.
+
+********************************************************************/
+MQTT_OUTMSG* mqttOutbox_next( int wait ){
+  MQTT_OUTMSG         *pMsg = NULL;
+  MQTT_PUBLISH_DONE    pfDone;
+  MQTT_PUBLISH_RESULT  result;
+  void                *pUser;
+  uint64_t           now = 0;
+  int                held = 0;
+  int                lane;
+
+  pthread_mutex_lock( &outbox.mutex );
+  for(;;){
+    lane = readyLane();
+    if( lane < 0 ){
+      if( -2 == lane && !held ) outbox.windowFull++;
+      held = ( -2 == lane );
+      if( !wait ) break;
+      pthread_cond_wait( &outbox.readyCv, &outbox.mutex );
+      continue;
+    }
+
+    pMsg = &outbox.pSlots[outbox.laneHead[lane]];
+    outbox.laneHead[lane] = pMsg->next;
+    if( outbox.laneHead[lane] < 0 ) outbox.laneTail[lane] = -1;
+    outbox.queued[lane]--;
+
+    if( isStale( pMsg ) ){
+      dbg_out( DBG_NOTE, "%s() %s is from an earlier interaction. Not sent.\n", __FUNCTION__, pMsg->pTopic );
+      outbox.cancelled++;
+      result = MQTT_PUBLISH_CANCELLED;
+    }else if( pMsg->expiresNs && ( now ? now : ( now = monotonic_ns() ) ) > pMsg->expiresNs ){
+      dbg_out( DBG_NOTE, "%s() %s expired in the outbox. Not sent.\n", __FUNCTION__, pMsg->pTopic );
+      outbox.expired++;
+      result = MQTT_PUBLISH_EXPIRED;
+    }else{
+      if( pMsg->qos > 0 ) outbox.inflight++;
+      break;
+    }
+
+    pfDone = pMsg->pfDone;
+    pUser = pMsg->pUser;
+    freeSlot( pMsg );
+    pMsg = NULL;
+    if( pfDone ){
+      pthread_mutex_unlock( &outbox.mutex );
+      pfDone( pUser, 0, result );
+      pthread_mutex_lock( &outbox.mutex );
+    }
+  } // End for(ever)
+  pthread_mutex_unlock( &outbox.mutex );
+
+  return pMsg;
+} // End of mqttOutbox_next()
+
+
+/********************************************************************
+  mqttOutbox_done()
+
+  Parameters: (in)  Slot returned by mqttOutbox_next()
+              (in)  Message id
+              (in)  Publish start, monotonic ns
+              (in)  Nonzero = mosquitto_publish() succeeded
+  Returns:    void
+
+  Description:
+  Frees a published slot and starts tracking its mid.
+
+********************************************************************/
+void mqttOutbox_done( MQTT_OUTMSG *pMsg, int mid, uint64_t publishNs, int ok ){
+  MQTT_PUBLISH_DONE    pfDone = pMsg->pfDone;
+  void                *pUser = pMsg->pUser;
+  int                  policy = pMsg->policy;
+  int                  qos = pMsg->qos;
+
+  pthread_mutex_lock( &outbox.mutex );
+  freeSlot( pMsg );
+  outbox.sent++;
+  pthread_mutex_unlock( &outbox.mutex );
+
+  trackMid( policy, qos, mid, publishNs, ok, pfDone, pUser );
+} // End of mqttOutbox_done()
+
+
+/********************************************************************
+  mqttOutbox_spooled()
+
+  Parameters: (in)  Slot returned by mqttOutbox_next()
+  Returns:    void
+
+  Description:
+  Frees a slot whose message went to the offline spool instead of
+  the broker, and gives back its window.
+
+********************************************************************/
+void mqttOutbox_spooled( MQTT_OUTMSG *pMsg ){
+  MQTT_PUBLISH_DONE    pfDone = pMsg->pfDone;
+  void                *pUser = pMsg->pUser;
+
+  pthread_mutex_lock( &outbox.mutex );
+  releaseWindow( pMsg->qos );
+  freeSlot( pMsg );
+  pthread_mutex_unlock( &outbox.mutex );
+
+  if( pfDone ) pfDone( pUser, 0, MQTT_PUBLISH_SPOOLED );
+} // End of mqttOutbox_spooled()
+
+
+/********************************************************************
+  mqttOutbox_takeWindow()
+
+  Parameters: (in)  QoS of the message
+  Returns:    true = window taken, or not needed
+
+  Description:
+  Takes the window for a message published without an outbox slot,
+  i.e. replayed from the spool. Complete it with mqttOutbox_track().
+
+********************************************************************/
+bool mqttOutbox_takeWindow( int qos ){
+  bool taken = true;
+
+  if( qos <= 0 ) return true;
+  pthread_mutex_lock( &outbox.mutex );
+  if( outbox.window && outbox.inflight >= outbox.window ){
+    outbox.windowFull++;
+    taken = false;
+  }else{
+    outbox.inflight++;
+  }
+  pthread_mutex_unlock( &outbox.mutex );
+  return taken;
+} // End of mqttOutbox_takeWindow()
+
+
+/********************************************************************
+  mqttOutbox_track()
+
+  Parameters: (in)  Policy index
+              (in)  QoS
+              (in)  Message id
+              (in)  Publish start, monotonic ns
+              (in)  Nonzero = mosquitto_publish() succeeded
+  Returns:    void
+
+  Description:
+  Starts tracking a mid published after mqttOutbox_takeWindow().
+
+********************************************************************/
+void mqttOutbox_track( int policy, int qos, int mid, uint64_t publishNs, int ok ){
+  trackMid( policy, qos, mid, publishNs, ok, NULL, NULL );
+} // End of mqttOutbox_track()
+
+
+/********************************************************************
+  trackMid()
+
+  Parameters: (in)  Policy index
+              (in)  QoS
+              (in)  Message id
+              (in)  Publish start, monotonic ns
+              (in)  Nonzero = mosquitto_publish() succeeded
+              (in)  Completion callback or NULL
+              (in)  Argument of the callback
+  Returns:    void
+
+  Description:
+  Stores the mid for on_publish(), or completes it if on_publish()
+  already came. A failed publish gives its window back at once.
+
+********************************************************************/
+static void trackMid( int policy, int qos, int mid, uint64_t publishNs, int ok, MQTT_PUBLISH_DONE pfDone, void *pUser ){
+  INFLIGHT_T          *pEntry = &outbox.tracked[mid & (MQTT_INFLIGHT_TRACKED - 1)];
+  uint64_t             ackNs = 0;
+  int                  complete = 0;
+
+  pthread_mutex_lock( &outbox.mutex );
+  if( !ok ){
+    releaseWindow( qos );
+  }else if( INFLIGHT_ACKED == pEntry->state && pEntry->mid == mid ){
+    ackNs = pEntry->ns > publishNs ? pEntry->ns - publishNs : 0;
+    pEntry->state = INFLIGHT_FREE;
+    releaseWindow( qos );
+    complete = 1;
+  }else{
+    if( INFLIGHT_FREE != pEntry->state ){
+      outbox.ackLost++;
+      if( INFLIGHT_SENT == pEntry->state ) releaseWindow( pEntry->qos );
+    }
+    pEntry->state = INFLIGHT_SENT;
+    pEntry->mid = mid;
+    pEntry->policy = policy;
+    pEntry->qos = qos;
+    pEntry->ns = publishNs;
+    pEntry->pfDone = pfDone;
+    pEntry->pUser = pUser;
+  }
+  pthread_mutex_unlock( &outbox.mutex );
+
+  if( complete ) mqttStats_recordAck( policy, ackNs );
+  if( pfDone && ( complete || !ok ) ) pfDone( pUser, mid, ok ? MQTT_PUBLISH_ACKED : MQTT_PUBLISH_FAILED );
+} // End of trackMid()
+
+
+/********************************************************************
+  mqttOutbox_acked()
+
+  Parameters: (in)  Message id
+  Returns:    void
+
+  Description:
+  Completes the mid: records its ack latency, gives its window back
+  and calls its completion callback. If the mid is not recorded yet
+  the ack time is left for mqttOutbox_done().
+
+********************************************************************/
+void mqttOutbox_acked( int mid ){
+  INFLIGHT_T          *pEntry = &outbox.tracked[mid & (MQTT_INFLIGHT_TRACKED - 1)];
+  MQTT_PUBLISH_DONE    pfDone = NULL;
+  void                *pUser = NULL;
+  int                  policy = -1;
+  uint64_t             ackNs = 0;
+  uint64_t             now = monotonic_ns();
+
+  if( 0 == outbox.slots ) return;
+
+  pthread_mutex_lock( &outbox.mutex );
+  if( INFLIGHT_SENT == pEntry->state && pEntry->mid == mid ){
+    ackNs = now - pEntry->ns;
+    policy = pEntry->policy;
+    pfDone = pEntry->pfDone;
+    pUser = pEntry->pUser;
+    pEntry->state = INFLIGHT_FREE;
+    releaseWindow( pEntry->qos );
+  }else{
+    if( INFLIGHT_FREE != pEntry->state ){
+      outbox.ackLost++;
+      if( INFLIGHT_SENT == pEntry->state ) releaseWindow( pEntry->qos );
+    }
+    pEntry->state = INFLIGHT_ACKED;
+    pEntry->mid = mid;
+    pEntry->ns = now;
+  }
+  pthread_mutex_unlock( &outbox.mutex );
+
+  if( policy >= 0 ) mqttStats_recordAck( policy, ackNs );
+  if( pfDone ) pfDone( pUser, mid, MQTT_PUBLISH_ACKED );
+} // End of mqttOutbox_acked()
+
+
+/********************************************************************
+  releaseWindow()
+
+  Parameters: (in)  QoS of the completed message
+  Returns:    void
+
+  Description:
+  Gives back the window taken by a QoS 1/2 message and wakes the
+  sender. Called with the mutex held.
+
+********************************************************************/
+static void releaseWindow( int qos ){
+  if( qos <= 0 || 0 == outbox.inflight ) return;
+  outbox.inflight--;
+  pthread_cond_signal( &outbox.readyCv );
+} // End of releaseWindow()
+
+
+/********************************************************************
+  mqttOutbox_congested()
+
+  Parameters: void
+  Returns:    true = in-flight window full
+
+  Description:
+  Lets publishers of non-critical traffic skip their message instead
+  of adding to the backlog.
+
+********************************************************************/
+bool mqttOutbox_congested( void ){
+  bool full;
+
+  pthread_mutex_lock( &outbox.mutex );
+  full = outbox.window && outbox.inflight >= outbox.window;
+  pthread_mutex_unlock( &outbox.mutex );
+  return full;
+} // End of mqttOutbox_congested()
+
+
+/********************************************************************
+  freeSlot()
+
+  Parameters: (in)  Slot
+  Returns:    void
+
+  Description:
+  Returns a slot to the free list and wakes a producer waiting for
+  room. Called with the mutex held.
+
+********************************************************************/
+static void freeSlot( MQTT_OUTMSG *pMsg ){
+  pMsg->next = outbox.freeList;
+  outbox.freeList = (int)( pMsg - outbox.pSlots );
+  outbox.used--;
+  pthread_cond_signal( &outbox.roomCv );
+} // End of freeSlot()
+
+
+/********************************************************************
+  mqttOutbox_depth()
+
+  Parameters: void
+  Returns:    Reserved or unsent slots
+
+  Description:
+  Current depth of the outbox.
+
+********************************************************************/
+unsigned int mqttOutbox_depth( void ){
+  unsigned int depth;
+
+  pthread_mutex_lock( &outbox.mutex );
+  depth = outbox.used;
+  pthread_mutex_unlock( &outbox.mutex );
+  return depth;
+} // End of mqttOutbox_depth()
+
+
+/********************************************************************
+  mqttOutbox_getStats()
+
+  Parameters: (out) Statistics
+  Returns:    void
+
+  Description:
+  Copies the counters under the mutex.
+
+********************************************************************/
+void mqttOutbox_getStats( MQTT_OUTBOX_STATS *pStats ){
+  int i;
+
+  pthread_mutex_lock( &outbox.mutex );
+  pStats->slots = outbox.slots;
+  pStats->depth = outbox.used;
+  pStats->highWater = outbox.highWater;
+  for( i = 0; i < MQTT_NUM_LANES; i++ ) pStats->queued[i] = outbox.queued[i];
+  pStats->sent = outbox.sent;
+  pStats->expired = outbox.expired;
+  pStats->cancelled = outbox.cancelled;
+  pStats->fullWaits = outbox.fullWaits;
+  pStats->timeouts = outbox.timeouts;
+  pStats->window = outbox.window;
+  pStats->inflight = outbox.inflight;
+  pStats->windowFull = outbox.windowFull;
+  pStats->ackLost = outbox.ackLost;
+  pthread_mutex_unlock( &outbox.mutex );
+} // End of mqttOutbox_getStats()
+
+
+/********************************************************************
+  mqttOutbox_logStats()
+
+  Parameters: (in)  dbg_out() category
+  Returns:    void
+
+  Description:
+  Prints the outbox counters.
+
+********************************************************************/
+void mqttOutbox_logStats( int type ){
+  MQTT_OUTBOX_STATS stats;
+
+  if( 0 == outbox.slots ) return;
+  mqttOutbox_getStats( &stats );
+  dbg_out( type, "MQTT outbox: %lu/%lu slots in use (high water %lu), queued high/normal/low %lu/%lu/%lu, sent %lu, expired %lu, cancelled %lu, full %lu, timeouts %lu\n",
+           stats.depth, stats.slots, stats.highWater,
+           stats.queued[MQTT_LANE_HIGH], stats.queued[MQTT_LANE_NORMAL], stats.queued[MQTT_LANE_LOW],
+           stats.sent, stats.expired, stats.cancelled, stats.fullWaits, stats.timeouts );
+  dbg_out( type, "MQTT in flight: %lu/%lu, window full %lu, acks lost %lu\n",
+           stats.inflight, stats.window, stats.windowFull, stats.ackLost );
+} // End of mqttOutbox_logStats()
+
+
+/** End of mqttOutbox.c ********************************************/
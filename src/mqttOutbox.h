@@ -0,0 +1,254 @@
+/**
+ * @file mqttOutbox.h
+ * @author Markku Heiskari
+ * @brief Outbound MQTT message queue. A fixed set of message slots between
+ * the action code and mqtt_sender(). Producers reserve a slot, fill it in
+ * place and commit it to its priority lane; the sender publishes the oldest
+ * message of the highest lane and hands the slot back. Both sides sleep on
+ * condition variables. Published mids are tracked until on_publish(), and at
+ * most --inflightWindow QoS 1/2 messages are left unacknowledged at a time.
+ *
+ * @copyright Copyright (c) 2024 Creoir Oy
+ *
+ */
+
+#ifndef __mqttoutbox_h
+#define __mqttoutbox_h
+
+/********************************************************************
+  INCLUDES
+********************************************************************/
+#include <stdint.h>
+#include "actionMain.h"
+
+/********************************************************************
+  DEFINES
+********************************************************************/
+#define MQTT_OUTBOX_DEFAULT_SLOTS       8           //!< Default number of outbound message slots
+#define MQTT_OUTBOX_MAX_SLOTS           256         //!< Upper limit for --outboxSize
+#define MQTT_OUTBOX_WAIT_MS             10000       //!< Longest time a producer waits for a free slot
+#define MQTT_INFLIGHT_DEFAULT_WINDOW    16          //!< Default --inflightWindow. 0=no limit.
+#define MQTT_INFLIGHT_TRACKED           1024        //!< Published mids tracked until on_publish(). Power of two.
+#define MQTT_INFLIGHT_MAX_WINDOW        ( MQTT_INFLIGHT_TRACKED / 2 )  //!< Upper limit for --inflightWindow
+
+
+/********************************************************************
+  DATA TYPES
+********************************************************************/
+
+/**
+ * @brief Outcome of a publish, passed to the completion callback
+ *
+ */
+typedef enum
+{
+  MQTT_PUBLISH_ACKED,                   //!< on_publish(): PUBACK/PUBCOMP received, QoS 0 written to the socket
+  MQTT_PUBLISH_FAILED,                  //!< mosquitto_publish() failed
+  MQTT_PUBLISH_EXPIRED,                 //!< Expired in the outbox, never sent
+  MQTT_PUBLISH_SUPPRESSED,              //!< Duplicate or over the rate limit of the topic, never queued
+  MQTT_PUBLISH_SPOOLED,                 //!< Broker not connected. Stored in the offline spool for replay, no further result.
+  MQTT_PUBLISH_CANCELLED                //!< Barge-in: a new interaction started before it was sent
+}MQTT_PUBLISH_RESULT;
+
+/**
+ * @brief Completion callback of a publish. Runs on the MQTT network thread
+ * (ACKED) or the publishing thread (FAILED, EXPIRED) without outbox locks
+ * held. Must not block and must not publish.
+ *
+ * @param pUser pUser of the message
+ * @param mid Message id, 0 if the message was never passed to libmosquitto
+ * @param result Outcome
+ */
+typedef void (*MQTT_PUBLISH_DONE)( void *pUser, int mid, MQTT_PUBLISH_RESULT result );
+
+
+/**
+ * @brief One outbound message slot. Owned by the producer between
+ * mqttOutbox_reserve() and mqttOutbox_commit(), then by the sender.
+ * The producer fills in everything but the link.
+ *
+ */
+typedef struct MQTT_OUTMSG
+{
+  char          *pTopic;                //!< Topic buffer, MQTT_SEND_TOPIC_SIZE bytes. Zero terminated.
+  char          *pPayload;              //!< Payload buffer, MQTT_SEND_PAYLOAD_SIZE bytes
+  const char    *pData;                 //!< Payload to publish: pPayload, or a static payload published by reference
+  size_t        payloadLen;             //!< Bytes of payload to publish
+  int           qos;                    //!< MQTT QoS
+  bool          retain;                 //!< MQTT retain flag
+  MQTT_LANE     lane;                   //!< Priority lane
+  int           policy;                 //!< Index of the topic's entry in mqttPublishPolicyRegister
+  bool          repeatable;             //!< Exempt from the dedupMs check of the policy
+  uint64_t      expiresNs;              //!< monotonic_ns() deadline for publishing, 0=never expires
+  uint64_t      committedNs;            //!< Set by mqttOutbox_commit(), for the queue latency statistics
+  unsigned int  generation;             //!< Interaction generation when the slot was reserved
+  MQTT_PUBLISH_DONE pfDone;             //!< Completion callback, NULL=none
+  void          *pUser;                 //!< Argument of pfDone
+  int           next;                   //!< Outbox internal: next slot in the same list, -1=last
+}MQTT_OUTMSG;
+
+
+/**
+ * @brief Outbox statistics
+ *
+ */
+typedef struct
+{
+  unsigned long slots;                  //!< Slots in the outbox
+  unsigned long depth;                  //!< Slots currently reserved or waiting to be sent
+  unsigned long highWater;              //!< Maximum of depth since start
+  unsigned long queued[MQTT_NUM_LANES]; //!< Committed messages waiting per lane
+  unsigned long sent;                   //!< Messages handed back by the sender
+  unsigned long expired;                //!< Messages dropped because their expiry passed in the queue
+  unsigned long cancelled;              //!< Messages of an earlier interaction dropped by barge-in
+  unsigned long fullWaits;              //!< Reservations that had to wait for a free slot
+  unsigned long timeouts;               //!< Reservations that gave up after MQTT_OUTBOX_WAIT_MS
+  unsigned long window;                 //!< In-flight window, 0=no limit
+  unsigned long inflight;               //!< QoS 1/2 messages published and not yet acknowledged
+  unsigned long windowFull;             //!< Times the sender was held back by a full window
+  unsigned long ackLost;                //!< Tracked mids overwritten before their ack
+}MQTT_OUTBOX_STATS;
+
+
+/********************************************************************
+  PROTOTYPES
+********************************************************************/
+
+/**
+ * @brief Allocates the outbox and the slot buffers
+ *
+ * @param slots Number of message slots. Clamped to 1..MQTT_OUTBOX_MAX_SLOTS.
+ * @param window Max unacknowledged QoS 1/2 messages, 0=no limit. Clamped to MQTT_INFLIGHT_MAX_WINDOW.
+ * @return int 0=OK, negative=error
+ */
+int  mqttOutbox_init( unsigned int slots, unsigned int window );
+
+/**
+ * @brief Frees the outbox. The sender must not be using it.
+ *
+ */
+void mqttOutbox_destroy( void );
+
+/**
+ * @brief Reserves a free slot
+ *
+ * @param waitMs How long to wait when every slot is in use. 0=do not wait.
+ * @return MQTT_OUTMSG* The slot, NULL if none became free in time
+ */
+MQTT_OUTMSG* mqttOutbox_reserve( unsigned int waitMs );
+
+/**
+ * @brief Passes a filled slot to the sender. Messages of one lane are published in commit order.
+ *
+ * @param pMsg Slot from mqttOutbox_reserve()
+ * @param wakeSender false when the committing thread drains the outbox itself
+ */
+void mqttOutbox_commit( MQTT_OUTMSG *pMsg, bool wakeSender );
+
+/**
+ * @brief Gives a reserved slot back without publishing it
+ *
+ * @param pMsg Slot from mqttOutbox_reserve()
+ */
+void mqttOutbox_cancel( MQTT_OUTMSG *pMsg );
+
+/**
+ * @brief Returns the oldest message of the highest non-empty lane. Sender side.
+ * Expired messages are dropped on the way. A QoS 1/2 message is held back while
+ * the in-flight window is full.
+ *
+ * @param wait Nonzero: sleep until a message can be sent. 0: return NULL if none is ready.
+ * @return MQTT_OUTMSG* Slot to publish, NULL if none
+ */
+MQTT_OUTMSG* mqttOutbox_next( int wait );
+
+/**
+ * @brief Starts a new interaction. Queued messages of bargeIn topics from earlier
+ * interactions are dropped now, and ones committed later on the way out.
+ *
+ * @return unsigned int Messages dropped now
+ */
+unsigned int mqttOutbox_bargeIn( void );
+
+/**
+ * @brief Sleeps until a message can be sent. Sender side. The message is left in the outbox.
+ *
+ */
+void mqttOutbox_waitReady( void );
+
+/**
+ * @brief Frees a slot returned by mqttOutbox_next() after mosquitto_publish()
+ * and starts tracking its mid
+ *
+ * @param pMsg The slot
+ * @param mid Message id from mosquitto_publish()
+ * @param publishNs monotonic_ns() before the publish call
+ * @param ok Nonzero if mosquitto_publish() succeeded
+ */
+void mqttOutbox_done( MQTT_OUTMSG *pMsg, int mid, uint64_t publishNs, int ok );
+
+/**
+ * @brief Frees a slot returned by mqttOutbox_next() whose message went to the offline spool
+ *
+ * @param pMsg The slot
+ */
+void mqttOutbox_spooled( MQTT_OUTMSG *pMsg );
+
+/**
+ * @brief Takes in-flight window for a message published without a slot (spool replay)
+ *
+ * @param qos QoS of the message
+ * @return bool true=taken or not needed, false=window full
+ */
+bool mqttOutbox_takeWindow( int qos );
+
+/**
+ * @brief Starts tracking a mid published after mqttOutbox_takeWindow()
+ *
+ * @param policy Index of the message's entry in mqttPublishPolicyRegister
+ * @param qos QoS of the message
+ * @param mid Message id from mosquitto_publish()
+ * @param publishNs monotonic_ns() before the publish call
+ * @param ok Nonzero if mosquitto_publish() succeeded
+ */
+void mqttOutbox_track( int policy, int qos, int mid, uint64_t publishNs, int ok );
+
+/**
+ * @brief Completes a published mid. Called from on_publish().
+ *
+ * @param mid Message id
+ */
+void mqttOutbox_acked( int mid );
+
+/**
+ * @brief Tells if the in-flight window is full. Non-critical publishers may skip their message.
+ *
+ * @return bool true=window full
+ */
+bool mqttOutbox_congested( void );
+
+/**
+ * @brief Current number of reserved or unsent slots
+ *
+ * @return unsigned int Depth of the outbox
+ */
+unsigned int mqttOutbox_depth( void );
+
+/**
+ * @brief Reads the outbox statistics
+ *
+ * @param pStats [out] Statistics
+ */
+void mqttOutbox_getStats( MQTT_OUTBOX_STATS *pStats );
+
+/**
+ * @brief Writes the outbox statistics to debug output
+ *
+ * @param type dbg_out() message category
+ */
+void mqttOutbox_logStats( int type );
+
+
+#endif
+
+/* EOF *************************************************************/
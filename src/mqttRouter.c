@@ -0,0 +1,851 @@
+/********************************************************************
+
+  Inbound MQTT topic router
+
+  Author: Markku Heiskari
+  Version history in github
+
+  (C) Copyright 2024, Creoir Oy
+
+  The registry is a list of (topic filter, handler, QoS) entries in
+  registration order, changed under registryMutex. Every change
+  builds a new routing index from the list and swaps it in with one
+  atomic pointer store, so on_message() keeps dispatching from the
+  old index while the new one is built.
+
+  In the index, topics without wildcards go to an open addressing
+  hash table keyed on the whole topic, so the common case is one
+  hash and one strcmp(). Filters with '+' or '#' go to a trie with
+  one node per topic level. The edges of the trie live in a second
+  hash table keyed on the parent node and the level text; '+' and
+  '#' are fields of the node. A received topic is walked level by
+  level, following the literal edge and the '+' child, and collecting
+  the '#' filters of every node passed. Only '+' branches, so the
+  work grows with the number of topic levels, not with the number of
+  handlers.
+
+  Entries with the same filter are chained. The matches are returned
+  in registration order, which is also the order of the route array.
+
+  An index is freed only when no mqttRouter_match() can still be
+  reading it. A matcher counts itself in one of two reader counters,
+  chosen by the parity of 'epoch', before loading the index pointer.
+  After the swap the writer flips the epoch and waits for the old
+  counter to drain, twice, so both counters have been empty at least
+  once after the swap. New matchers go to the other counter and
+  cannot hold the writer back. Matching runs no callbacks, so the
+  wait is a few hundred nanoseconds at most and a handler may
+  register or remove handlers itself.
+
+  The subscriber callback is called under registryMutex when a filter
+  gets its first handler or loses its last one, so the broker side
+  subscriptions follow the registry in the same order. After a
+  connect the whole registry is subscribed in batches grouped by QoS.
+
+********************************************************************/
+
+/********************************************************************
+  INCLUDES
+********************************************************************/
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <stdatomic.h>
+#include <sched.h>
+#include <pthread.h>
+#include "actionMain.h"
+#include "util.h"
+#include "mqttRouter.h"
+
+/********************************************************************
+  TYPES
+********************************************************************/
+
+typedef struct
+{
+  char               *pTopic;                   //!< Topic filter, allocated
+  MQTT_ROUTE_HANDLER  pfHandler;
+  int                 qos;                      //!< Requested subscription QoS
+} ENTRY_T;
+
+typedef struct
+{
+  const char         *pTopic;                   //!< Topic filter in pStrings
+  MQTT_ROUTE_HANDLER  pfHandler;
+  int                 qos;                      //!< Requested subscription QoS
+  int                 next;                     //!< Next route with the same filter, -1=none
+} ROUTE_T;
+
+typedef struct
+{
+  uint32_t            hash;                     //!< FNV-1a of the whole topic
+  int                 route;                    //!< First route of the topic, -1=empty slot
+} EXACT_T;
+
+typedef struct
+{
+  int                 plus;                     //!< Child node for '+', -1=none
+  int                 routes;                   //!< First route of the filters ending at this node, -1=none
+  int                 hashRoutes;               //!< First route of the filters ending with '#' below this node, -1=none
+} NODE_T;
+
+typedef struct
+{
+  uint32_t            hash;                     //!< levelHash() of the level text
+  int                 parent;                   //!< Parent node
+  int                 child;                    //!< Child node, -1=empty slot
+  const char         *pLevel;                   //!< Level text inside the copied filter
+  size_t              levelLen;                 //!< Length of the level text
+} EDGE_T;
+
+typedef struct
+{
+  ROUTE_T            *pRoutes;                  //!< Routes in registration order
+  size_t              numRoutes;
+  char               *pStrings;                 //!< Copied topics
+  EXACT_T            *pExact;                   //!< Topics without wildcards
+  uint32_t            exactMask;                //!< Size of pExact - 1
+  NODE_T             *pNodes;                   //!< Trie nodes, 0 is the root
+  int                 numNodes;
+  EDGE_T             *pEdges;                   //!< Literal trie edges
+  uint32_t            edgeMask;                 //!< Size of pEdges - 1
+  bool                wildcards;                //!< Nonzero: the trie has filters
+} ROUTER_T;
+
+typedef struct
+{
+  const ROUTER_T     *pRouter;
+  const ROUTE_T      *pFound[MQTT_ROUTER_MAX_MATCHES];
+  int                 max;
+  int                 count;
+  bool                dollar;                   //!< Topic starts with '$'
+} MATCH_T;
+
+
+/********************************************************************
+  FILE SCOPE VARIABLES
+********************************************************************/
+static ROUTER_T * _Atomic pRouter;              //!< Current routing index
+static atomic_uint        epoch;                //!< Parity selects the reader counter of new matchers
+static atomic_uint        readers[2];           //!< Matchers inside mqttRouter_match() per epoch parity
+
+static pthread_mutex_t    registryMutex = PTHREAD_MUTEX_INITIALIZER;
+static ENTRY_T           *pEntries;             //!< Registry in registration order
+static size_t             numEntries;
+static size_t             maxEntries;           //!< Allocated size of pEntries
+static MQTT_ROUTER_SUBSCRIBE pfSubscriber;
+
+
+/********************************************************************
+  LOCAL PROTOTYPES
+********************************************************************/
+static ROUTER_T* buildIndex( const ENTRY_T *pList, size_t count );
+static void     swapIndex( ROUTER_T *p );
+static int      filterQos( const char *pTopic );
+static void     collectFilter( const ROUTER_T *p, int route, const char **ppByQos[3], int count[3] );
+static uint32_t levelHash( const char *pLevel, size_t *pLen );
+static uint32_t tableSize( size_t entries );
+static bool     validFilter( const char *pTopic, size_t *pLevels );
+static int      findEdge( const ROUTER_T *p, int parent, const char *pLevel, size_t len, uint32_t hash );
+static int      newNode( ROUTER_T *p );
+static void     appendRoute( ROUTER_T *p, int *pFirst, int route );
+static void     addRoutes( MATCH_T *pMatch, int route );
+static void     matchLevel( MATCH_T *pMatch, int node, const char *pLevel );
+static void     freeRouter( ROUTER_T *p );
+
+
+/********************************************************************
+  FUNCTIONS
+********************************************************************/
+
+
+/********************************************************************
+  mqttRouter_build()
+
+  Parameters: (in)  Handler register
+              (in)  Number of entries
+  Returns:    0=OK, negative=error
+
+  Description:
+  Replaces the registry with a static register. The subscriber is
+  not called; on_connect() subscribes with mqttRouter_resubscribe().
+
+********************************************************************/
+int mqttRouter_build( const mqtt_action *pActions, size_t count ){
+  ENTRY_T       *pList;
+  ROUTER_T      *p;
+  size_t         i, levels;
+
+  for( i = 0; i < count; i++ ){
+    if( !validFilter( pActions[i].topic, &levels ) ){
+      dbg_out( DBG_ERROR, "%s() Invalid topic filter [%s]\n", __FUNCTION__, pActions[i].topic );
+      return -1;
+    }
+  }
+
+  pList = calloc( count ? count : 1, sizeof(ENTRY_T) );
+  if( NULL == pList ) return -2;
+  for( i = 0; i < count; i++ ){
+    pList[i].pTopic    = strdup( pActions[i].topic );
+    pList[i].pfHandler = pActions[i].function;
+    pList[i].qos       = MQTT_ROUTER_DEFAULT_QOS;
+    if( NULL == pList[i].pTopic ) break;
+  }
+  p = ( i == count ) ? buildIndex( pList, count ) : NULL;
+  if( NULL == p ){
+    dbg_out( DBG_ERROR, "%s() Out of memory\n", __FUNCTION__ );
+    while( i-- ) free( pList[i].pTopic );
+    free( pList );
+    return -2;
+  }
+
+  pthread_mutex_lock( &registryMutex );
+  for( i = 0; i < numEntries; i++ ) free( pEntries[i].pTopic );
+  free( pEntries );
+  pEntries   = pList;
+  numEntries = count;
+  maxEntries = count ? count : 1;
+  swapIndex( p );
+  pthread_mutex_unlock( &registryMutex );
+  return 0;
+} // End of mqttRouter_build()
+
+
+/********************************************************************
+  mqttRouter_add()
+
+  Parameters: (in)  Topic filter
+              (in)  Handler
+              (in)  Subscription QoS
+  Returns:    0=OK, negative=error, positive=subscribe error
+
+  Description:
+  Adds an entry to the end of the registry and swaps in a new index.
+  Subscribes when the filter is new, or again with the higher QoS.
+  The entry stays even if the subscribe fails; on_connect() retries.
+
+********************************************************************/
+int mqttRouter_add( const char *pTopic, MQTT_ROUTE_HANDLER pfHandler, int qos ){
+  ENTRY_T       *pList;
+  ROUTER_T      *p;
+  size_t         levels, count;
+  int            oldQos, rc = 0;
+
+  if( NULL == pfHandler || qos < 0 || qos > 2 || !validFilter( pTopic, &levels ) ){
+    dbg_out( DBG_ERROR, "%s() Invalid topic filter [%s]\n", __FUNCTION__, pTopic ? pTopic : "" );
+    return -1;
+  }
+
+  pthread_mutex_lock( &registryMutex );
+  if( numEntries == maxEntries ){
+    pList = realloc( pEntries, ( maxEntries ? maxEntries * 2 : 16 ) * sizeof(ENTRY_T) );
+    if( NULL == pList ){
+      pthread_mutex_unlock( &registryMutex );
+      return -2;
+    }
+    pEntries   = pList;
+    maxEntries = maxEntries ? maxEntries * 2 : 16;
+  }
+  pEntries[numEntries].pTopic    = strdup( pTopic );
+  pEntries[numEntries].pfHandler = pfHandler;
+  pEntries[numEntries].qos       = qos;
+  p = pEntries[numEntries].pTopic ? buildIndex( pEntries, numEntries + 1 ) : NULL;
+  if( NULL == p ){
+    free( pEntries[numEntries].pTopic );
+    pthread_mutex_unlock( &registryMutex );
+    dbg_out( DBG_ERROR, "%s() Out of memory\n", __FUNCTION__ );
+    return -2;
+  }
+
+  oldQos = filterQos( pTopic );
+  count  = ++numEntries;
+  swapIndex( p );
+  if( pfSubscriber && qos > oldQos ) rc = pfSubscriber( pTopic, qos, true );
+  pthread_mutex_unlock( &registryMutex );
+
+  dbg_out( DBG_VERBOSE, "MQTT router: added [%s], %u handlers\n", pTopic, (unsigned int)count );
+  return rc;
+} // End of mqttRouter_add()
+
+
+/********************************************************************
+  mqttRouter_remove()
+
+  Parameters: (in)  Topic filter
+              (in)  Handler
+  Returns:    0=OK, negative=not registered or out of memory,
+              positive=unsubscribe error
+
+  Description:
+  Removes the first entry of the filter and handler and swaps in a
+  new index. Unsubscribes when it was the last handler of the filter.
+  A message matched just before the swap may still reach the handler.
+
+********************************************************************/
+int mqttRouter_remove( const char *pTopic, MQTT_ROUTE_HANDLER pfHandler ){
+  ENTRY_T        removed;
+  ROUTER_T      *p;
+  size_t         i, count;
+  int            rc = 0;
+
+  if( NULL == pTopic ) return -1;
+
+  pthread_mutex_lock( &registryMutex );
+  for( i = 0; i < numEntries; i++ ){
+    if( pEntries[i].pfHandler == pfHandler && !strcmp( pEntries[i].pTopic, pTopic ) ) break;
+  }
+  if( i == numEntries ){
+    pthread_mutex_unlock( &registryMutex );
+    return -1;
+  }
+
+  removed = pEntries[i];
+  memmove( &pEntries[i], &pEntries[i+1], ( numEntries - i - 1 ) * sizeof(ENTRY_T) );
+  p = buildIndex( pEntries, numEntries - 1 );
+  if( NULL == p ){
+    memmove( &pEntries[i+1], &pEntries[i], ( numEntries - i - 1 ) * sizeof(ENTRY_T) );
+    pEntries[i] = removed;
+    pthread_mutex_unlock( &registryMutex );
+    dbg_out( DBG_ERROR, "%s() Out of memory\n", __FUNCTION__ );
+    return -2;
+  }
+  count = --numEntries;
+  swapIndex( p );
+  if( pfSubscriber && filterQos( pTopic ) < 0 ) rc = pfSubscriber( pTopic, 0, false );
+  pthread_mutex_unlock( &registryMutex );
+
+  dbg_out( DBG_VERBOSE, "MQTT router: removed [%s], %u handlers\n", pTopic, (unsigned int)count );
+  free( removed.pTopic );
+  return rc;
+} // End of mqttRouter_remove()
+
+
+/********************************************************************
+  mqttRouter_setSubscriber()
+
+  Parameters: (in)  Subscriber callback, NULL=none
+  Returns:    void
+
+********************************************************************/
+void mqttRouter_setSubscriber( MQTT_ROUTER_SUBSCRIBE pfSubscribe ){
+  pthread_mutex_lock( &registryMutex );
+  pfSubscriber = pfSubscribe;
+  pthread_mutex_unlock( &registryMutex );
+} // End of mqttRouter_setSubscriber()
+
+
+/********************************************************************
+  mqttRouter_resubscribe()
+
+  Parameters: (in)  Subscriber of a batch of filters
+              (in)  Most filters per call
+  Returns:    0=OK, else the first error of the subscriber
+
+  Description:
+  Subscribes every filter once with the highest QoS of its handlers,
+  in as few calls as the QoS levels and the batch size allow. Every
+  chain of the routing index is one distinct filter, so the index is
+  walked instead of comparing the registry entries with each other.
+  Called from on_connect(); the session starts without subscriptions.
+
+********************************************************************/
+int mqttRouter_resubscribe( MQTT_ROUTER_SUBSCRIBE_MANY pfSubscribe, int maxBatch ){
+  const ROUTER_T  *p;
+  const char     **ppByQos[3];
+  int              count[3] = { 0, 0, 0 };
+  int              qos, i, n, rc = 0;
+  uint32_t         slot;
+
+  if( maxBatch < 1 ) maxBatch = 1;
+
+  pthread_mutex_lock( &registryMutex );
+  p = atomic_load( &pRouter );
+  if( NULL == p || 0 == p->numRoutes ){
+    pthread_mutex_unlock( &registryMutex );
+    return 0;
+  }
+  for( qos = 0; qos < 3; qos++ ){
+    ppByQos[qos] = malloc( p->numRoutes * sizeof(char*) );
+  }
+  if( !ppByQos[0] || !ppByQos[1] || !ppByQos[2] ){
+    rc = -2;
+  }else{
+    for( slot = 0; slot <= p->exactMask; slot++ ) collectFilter( p, p->pExact[slot].route, ppByQos, count );
+    for( i = 0; i < p->numNodes; i++ ){
+      collectFilter( p, p->pNodes[i].routes, ppByQos, count );
+      collectFilter( p, p->pNodes[i].hashRoutes, ppByQos, count );
+    }
+    for( qos = 0; qos < 3 && 0 == rc; qos++ ){
+      for( i = 0; i < count[qos] && 0 == rc; i += n ){
+        n  = ( count[qos] - i < maxBatch ) ? count[qos] - i : maxBatch;
+        rc = pfSubscribe( (char *const *)&ppByQos[qos][i], n, qos );
+      }
+    }
+  }
+  pthread_mutex_unlock( &registryMutex );
+
+  for( qos = 0; qos < 3; qos++ ) free( (void*)ppByQos[qos] );
+  return rc;
+} // End of mqttRouter_resubscribe()
+
+
+/********************************************************************
+  collectFilter()
+
+  Parameters: (in)  Routing index
+              (in)  First route of a chain, -1=none
+              (out) Filters per QoS
+              (out) Number of filters per QoS
+  Returns:    void
+
+  Description:
+  Adds the filter of a chain to the list of its highest QoS.
+
+********************************************************************/
+static void collectFilter( const ROUTER_T *p, int route, const char **ppByQos[3], int count[3] ){
+  const char     *pTopic;
+  int             qos = -1;
+
+  if( route < 0 ) return;
+  pTopic = p->pRoutes[route].pTopic;
+  for( ; route >= 0; route = p->pRoutes[route].next ){
+    if( p->pRoutes[route].qos > qos ) qos = p->pRoutes[route].qos;
+  }
+  ppByQos[qos][ count[qos]++ ] = pTopic;
+} // End of collectFilter()
+
+
+/********************************************************************
+  filterQos()
+
+  Parameters: (in)  Topic filter
+  Returns:    Highest QoS of the registered entries of the filter,
+              -1=none
+
+  Description:
+  Registry mutex held.
+
+********************************************************************/
+static int filterQos( const char *pTopic ){
+  size_t         i;
+  int            qos = -1;
+
+  for( i = 0; i < numEntries; i++ ){
+    if( pEntries[i].qos > qos && !strcmp( pEntries[i].pTopic, pTopic ) ) qos = pEntries[i].qos;
+  }
+  return qos;
+} // End of filterQos()
+
+
+/********************************************************************
+  swapIndex()
+
+  Parameters: (in)  New routing index
+  Returns:    void
+
+  Description:
+  Publishes the new index and frees the old one when no matcher can
+  be using it any more. Registry mutex held.
+
+********************************************************************/
+static void swapIndex( ROUTER_T *p ){
+  ROUTER_T      *pOld;
+  unsigned int   e;
+  int            flip;
+
+  pOld = atomic_exchange( &pRouter, p );
+  if( NULL == pOld ) return;
+  for( flip = 0; flip < 2; flip++ ){
+    e = atomic_fetch_add( &epoch, 1 ) & 1;
+    while( atomic_load( &readers[e] ) ) sched_yield();
+  }
+  freeRouter( pOld );
+} // End of swapIndex()
+
+
+/********************************************************************
+  buildIndex()
+
+  Parameters: (in)  Registry entries
+              (in)  Number of entries
+  Returns:    New routing index, NULL=out of memory
+
+  Description:
+  Sizes are counted first, so the tables never grow. The entries are
+  valid filters; the registry checks them on the way in.
+
+********************************************************************/
+static ROUTER_T* buildIndex( const ENTRY_T *pList, size_t count ){
+  ROUTER_T      *p;
+  size_t         i, len, topicLen, levels, strBytes = 0, trieLevels = 0, exact = 0;
+  char          *pStr;
+  const char    *pLevel;
+  uint32_t       hash;
+  int            node, slot;
+
+  for( i = 0; i < count; i++ ){
+    validFilter( pList[i].pTopic, &levels );
+    strBytes += strlen( pList[i].pTopic ) + 1;
+    if( strpbrk( pList[i].pTopic, "+#" ) ) trieLevels += levels;
+    else exact++;
+  }
+
+  p = calloc( 1, sizeof(ROUTER_T) );
+  if( NULL == p ) return NULL;
+  p->exactMask = tableSize( exact ) - 1;
+  p->edgeMask  = tableSize( trieLevels ) - 1;
+  p->pRoutes   = calloc( count ? count : 1, sizeof(ROUTE_T) );
+  p->pStrings  = malloc( strBytes ? strBytes : 1 );
+  p->pExact    = malloc( ( p->exactMask + 1 ) * sizeof(EXACT_T) );
+  p->pNodes    = malloc( ( trieLevels + 1 ) * sizeof(NODE_T) );
+  p->pEdges    = malloc( ( p->edgeMask + 1 ) * sizeof(EDGE_T) );
+  if( !p->pRoutes || !p->pStrings || !p->pExact || !p->pNodes || !p->pEdges ){
+    freeRouter( p );
+    return NULL;
+  }
+  for( i = 0; i <= p->exactMask; i++ ) p->pExact[i].route = -1;
+  for( i = 0; i <= p->edgeMask; i++ ) p->pEdges[i].child = -1;
+  newNode( p );                                   // Root
+
+  pStr = p->pStrings;
+  for( i = 0; i < count; i++ ){
+    topicLen = strlen( pList[i].pTopic );
+    memcpy( pStr, pList[i].pTopic, topicLen + 1 );
+    p->pRoutes[i].pTopic    = pStr;
+    p->pRoutes[i].pfHandler = pList[i].pfHandler;
+    p->pRoutes[i].qos       = pList[i].qos;
+    p->pRoutes[i].next      = -1;
+    p->numRoutes++;
+
+    if( NULL == strpbrk( pStr, "+#" ) ){
+      // Plain topic: exact hash. Equal topics share a slot.
+      hash = levelHash( pStr, NULL );
+      for( slot = hash & p->exactMask; p->pExact[slot].route >= 0; slot = ( slot + 1 ) & p->exactMask ){
+        if( p->pExact[slot].hash == hash && !strcmp( p->pRoutes[ p->pExact[slot].route ].pTopic, pStr ) ) break;
+      }
+      p->pExact[slot].hash = hash;
+      appendRoute( p, &p->pExact[slot].route, (int)i );
+    }else{
+      // Filter: one trie node per level
+      p->wildcards = true;
+      node = 0;
+      for( pLevel = pStr; ; pLevel += len + 1 ){
+        hash = levelHash( pLevel, &len );
+        if( 1 == len && '#' == *pLevel ){
+          appendRoute( p, &p->pNodes[node].hashRoutes, (int)i );
+          break;
+        }
+        if( 1 == len && '+' == *pLevel ){
+          if( p->pNodes[node].plus < 0 ) p->pNodes[node].plus = newNode( p );
+          node = p->pNodes[node].plus;
+        }else{
+          slot = findEdge( p, node, pLevel, len, hash );
+          if( p->pEdges[slot].child < 0 ){
+            p->pEdges[slot].hash     = hash;
+            p->pEdges[slot].parent   = node;
+            p->pEdges[slot].pLevel   = pLevel;
+            p->pEdges[slot].levelLen = len;
+            p->pEdges[slot].child    = newNode( p );
+          }
+          node = p->pEdges[slot].child;
+        }
+        if( 0 == pLevel[len] ){
+          appendRoute( p, &p->pNodes[node].routes, (int)i );
+          break;
+        }
+      }
+    }
+    pStr += topicLen + 1;
+  }
+  return p;
+} // End of buildIndex()
+
+
+/********************************************************************
+  mqttRouter_match()
+
+  Parameters: (in)  Received topic
+              (out) Handlers of the matching entries
+              (in)  Size of the output array
+  Returns:    Number of matches
+
+  Description:
+  Looks the topic up in the exact hash, then walks the trie. The
+  matches are sorted back into registration order; the route array
+  is in that order, so the route addresses are. Nothing of the index
+  is handed out, so the reader section ends here.
+
+********************************************************************/
+int mqttRouter_match( const char *pTopic, MQTT_ROUTE_HANDLER *pOut, int max ){
+  const ROUTER_T      *p;
+  const ROUTE_T       *pTmp;
+  MATCH_T              match;
+  uint32_t             hash;
+  unsigned int         e;
+  int                  slot, i, j;
+
+  if( NULL == pTopic ) return 0;
+
+  e = atomic_load( &epoch ) & 1;
+  atomic_fetch_add( &readers[e], 1 );
+  p = atomic_load( &pRouter );
+  if( NULL == p ){
+    atomic_fetch_sub( &readers[e], 1 );
+    return 0;
+  }
+
+  match.pRouter = p;
+  match.max     = ( max < MQTT_ROUTER_MAX_MATCHES ) ? max : MQTT_ROUTER_MAX_MATCHES;
+  match.count   = 0;
+  match.dollar  = ( '$' == pTopic[0] );
+
+  hash = levelHash( pTopic, NULL );
+  for( slot = hash & p->exactMask; p->pExact[slot].route >= 0; slot = ( slot + 1 ) & p->exactMask ){
+    if( p->pExact[slot].hash == hash && !strcmp( p->pRoutes[ p->pExact[slot].route ].pTopic, pTopic ) ){
+      addRoutes( &match, p->pExact[slot].route );
+      break;
+    }
+  }
+
+  if( p->wildcards ) matchLevel( &match, 0, pTopic );
+
+  for( i = 1; i < match.count; i++ ){
+    pTmp = match.pFound[i];
+    for( j = i; j > 0 && match.pFound[j-1] > pTmp; j-- ) match.pFound[j] = match.pFound[j-1];
+    match.pFound[j] = pTmp;
+  }
+  for( i = 0; i < match.count; i++ ) pOut[i] = match.pFound[i]->pfHandler;
+
+  atomic_fetch_sub( &readers[e], 1 );
+  return match.count;
+} // End of mqttRouter_match()
+
+
+/********************************************************************
+  matchLevel()
+
+  Parameters: (in)  Match state
+              (in)  Trie node reached
+              (in)  Rest of the topic, NULL when all levels are used
+  Returns:    void
+
+  Description:
+  A '#' below a node matches whatever is left, also nothing. Filters
+  ending at the node match only when the topic ends there. Recurses
+  into the literal child and the '+' child of the next level.
+
+********************************************************************/
+static void matchLevel( MATCH_T *pMatch, int node, const char *pLevel ){
+  const ROUTER_T  *p = pMatch->pRouter;
+  const NODE_T    *pNode = &p->pNodes[node];
+  const char      *pNext;
+  uint32_t         hash;
+  size_t           len;
+  int              slot;
+  bool             wild = !( 0 == node && pMatch->dollar );
+
+  if( wild ) addRoutes( pMatch, pNode->hashRoutes );
+  if( NULL == pLevel ){
+    addRoutes( pMatch, pNode->routes );
+    return;
+  }
+
+  hash  = levelHash( pLevel, &len );
+  pNext = pLevel[len] ? pLevel + len + 1 : NULL;
+
+  slot = findEdge( p, node, pLevel, len, hash );
+  if( p->pEdges[slot].child >= 0 ) matchLevel( pMatch, p->pEdges[slot].child, pNext );
+  if( wild && pNode->plus >= 0 ) matchLevel( pMatch, pNode->plus, pNext );
+} // End of matchLevel()
+
+
+/********************************************************************
+  addRoutes()
+
+  Parameters: (in)  Match state
+              (in)  First route of a chain, -1=none
+  Returns:    void
+
+  Description:
+  Adds a chain of routes to the output, as far as it fits.
+
+********************************************************************/
+static void addRoutes( MATCH_T *pMatch, int route ){
+  for( ; route >= 0 && pMatch->count < pMatch->max; route = pMatch->pRouter->pRoutes[route].next ){
+    pMatch->pFound[ pMatch->count++ ] = &pMatch->pRouter->pRoutes[route];
+  }
+} // End of addRoutes()
+
+
+/********************************************************************
+  levelHash()
+
+  Parameters: (in)  Start of a topic level
+              (out) Level length, NULL=hash the whole rest of the topic
+  Returns:    FNV-1a of the level
+
+  Description:
+  Hashes up to the next '/' and returns the length, or with no length
+  pointer hashes to the end of the string.
+
+********************************************************************/
+static uint32_t levelHash( const char *pLevel, size_t *pLen ){
+  uint32_t        hash = 2166136261u;
+  const char     *pc;
+
+  for( pc = pLevel; *pc && ( NULL == pLen || '/' != *pc ); pc++ ) hash = ( hash ^ (unsigned char)*pc ) * 16777619u;
+  if( pLen ) *pLen = pc - pLevel;
+  return hash;
+} // End of levelHash()
+
+
+/********************************************************************
+  findEdge()
+
+  Parameters: (in)  Routing index
+              (in)  Parent node
+              (in)  Level text
+              (in)  Level length
+              (in)  levelHash() of the level
+  Returns:    Edge slot: the matching edge, or the empty slot where
+              it would be inserted
+
+  Description:
+  Linear probing from the level hash mixed with the parent node. The
+  table is at least twice the number of edges.
+
+********************************************************************/
+static int findEdge( const ROUTER_T *p, int parent, const char *pLevel, size_t len, uint32_t hash ){
+  const EDGE_T   *pEdge;
+  uint32_t        slot;
+
+  for( slot = ( hash ^ (uint32_t)parent * 2654435761u ) & p->edgeMask; ; slot = ( slot + 1 ) & p->edgeMask ){
+    pEdge = &p->pEdges[slot];
+    if( pEdge->child < 0 ) return slot;
+    if( pEdge->hash == hash && pEdge->parent == parent && pEdge->levelLen == len && !memcmp( pEdge->pLevel, pLevel, len ) ) return slot;
+  }
+} // End of findEdge()
+
+
+/********************************************************************
+  validFilter()
+
+  Parameters: (in)  Topic filter
+              (out) Number of levels
+  Returns:    true=valid
+
+  Description:
+  '+' and '#' must fill a whole level, and '#' must be the last one.
+
+********************************************************************/
+static bool validFilter( const char *pTopic, size_t *pLevels ){
+  const char     *pc;
+  size_t          len;
+
+  *pLevels = 0;
+  if( NULL == pTopic || 0 == pTopic[0] ) return false;
+  for( pc = pTopic; ; pc += len + 1 ){
+    levelHash( pc, &len );
+    (*pLevels)++;
+    if( ( memchr( pc, '+', len ) || memchr( pc, '#', len ) ) && 1 != len ) return false;
+    if( '#' == *pc && 0 != pc[len] ) return false;
+    if( 0 == pc[len] ) return true;
+  }
+} // End of validFilter()
+
+
+/********************************************************************
+  tableSize()
+
+  Parameters: (in)  Number of entries
+  Returns:    Power of two at least twice the entries, at least 8
+
+********************************************************************/
+static uint32_t tableSize( size_t entries ){
+  uint32_t        size = 8;
+
+  while( size < entries * 2 ) size <<= 1;
+  return size;
+} // End of tableSize()
+
+
+/********************************************************************
+  newNode()
+
+  Parameters: (in)  Routing index being built
+  Returns:    Index of an empty trie node
+
+********************************************************************/
+static int newNode( ROUTER_T *p ){
+  NODE_T         *pNode = &p->pNodes[ p->numNodes ];
+
+  pNode->plus       = -1;
+  pNode->routes     = -1;
+  pNode->hashRoutes = -1;
+  return p->numNodes++;
+} // End of newNode()
+
+
+/********************************************************************
+  appendRoute()
+
+  Parameters: (in)  Routing index being built
+              (in)  Head of a route chain
+              (in)  Route to add
+  Returns:    void
+
+  Description:
+  Adds the route to the end of the chain, keeping register order.
+
+********************************************************************/
+static void appendRoute( ROUTER_T *p, int *pFirst, int route ){
+  while( *pFirst >= 0 ) pFirst = &p->pRoutes[ *pFirst ].next;
+  *pFirst = route;
+} // End of appendRoute()
+
+
+/********************************************************************
+  mqttRouter_destroy()
+
+  Parameters: void
+  Returns:    void
+
+  Description:
+  Releases the registry and the routing index. The MQTT client must
+  be stopped.
+
+********************************************************************/
+void mqttRouter_destroy( void ){
+  size_t         i;
+
+  pthread_mutex_lock( &registryMutex );
+  swapIndex( NULL );
+  for( i = 0; i < numEntries; i++ ) free( pEntries[i].pTopic );
+  free( pEntries );
+  pEntries   = NULL;
+  numEntries = 0;
+  maxEntries = 0;
+  pthread_mutex_unlock( &registryMutex );
+} // End of mqttRouter_destroy()
+
+
+/********************************************************************
+  freeRouter()
+
+  Parameters: (in)  Routing index, NULL accepted
+  Returns:    void
+
+********************************************************************/
+static void freeRouter( ROUTER_T *p ){
+  if( NULL == p ) return;
+  free( p->pRoutes );
+  free( p->pStrings );
+  free( p->pExact );
+  free( p->pNodes );
+  free( p->pEdges );
+  free( p );
+} // End of freeRouter()
+
+
+/** End of mqttRouter.c *********************************************/
@@ -0,0 +1,137 @@
+/**
+ * @file mqttRouter.h
+ * @author Markku Heiskari
+ * @brief Inbound MQTT topic router. A registry of topic handlers that can be changed
+ * while messages are delivered, and a routing index that finds the handlers of a
+ * received topic with a hash of the plain topics and a trie of the filters with
+ * '+' and '#' wildcards, in time proportional to the topic levels.
+ *
+ * @copyright Copyright (c) 2024 Creoir Oy
+ *
+ */
+
+#ifndef __mqttrouter_h
+#define __mqttrouter_h
+
+/********************************************************************
+  INCLUDES
+********************************************************************/
+#include <stddef.h>
+#include "actionMain.h"
+
+/********************************************************************
+  DEFINES
+********************************************************************/
+#define MQTT_ROUTER_MAX_MATCHES         16          //!< Most handlers called for one message
+#define MQTT_ROUTER_DEFAULT_QOS         1           //!< Subscription QoS of the entries of mqttRouter_build()
+
+
+/********************************************************************
+  DATA TYPES
+********************************************************************/
+
+/**
+ * @brief Topic handler, see mqtt_action
+ *
+ */
+typedef int (*MQTT_ROUTE_HANDLER)( const char *pTopic, EVENTPAYLOAD_T *pPayload );
+
+/**
+ * @brief Subscribes or unsubscribes a topic filter at the broker. Called with the
+ * registry locked: must not call the registry functions.
+ *
+ * @param pTopic Topic filter
+ * @param qos Subscription QoS
+ * @param subscribe true=subscribe, false=unsubscribe
+ * @return int 0=OK, else error
+ */
+typedef int (*MQTT_ROUTER_SUBSCRIBE)( const char *pTopic, int qos, bool subscribe );
+
+/**
+ * @brief Subscribes a batch of topic filters with one QoS at the broker. Called with the
+ * registry locked: must not call the registry functions. The topics are valid only
+ * during the call.
+ *
+ * @param ppTopics Topic filters
+ * @param count Number of filters
+ * @param qos Subscription QoS of all of them
+ * @return int 0=OK, else error
+ */
+typedef int (*MQTT_ROUTER_SUBSCRIBE_MANY)( char *const *ppTopics, int count, int qos );
+
+
+/********************************************************************
+  PROTOTYPES
+********************************************************************/
+
+/**
+ * @brief Replaces the registry with a static handler register. Topics and handlers are
+ * copied. Does not subscribe.
+ *
+ * @param pActions Handler register, e.g. mqttActionRegister
+ * @param count Number of entries
+ * @return int 0=OK, negative=invalid topic filter or out of memory
+ */
+int  mqttRouter_build( const mqtt_action *pActions, size_t count );
+
+/**
+ * @brief Adds a topic handler. Any thread, also a handler. The filter is subscribed
+ * when it gets its first handler.
+ *
+ * @param pTopic Topic filter, copied
+ * @param pfHandler Handler
+ * @param qos Subscription QoS 0-2
+ * @return int 0=OK, negative=invalid filter or out of memory, positive=subscribe error.
+ * The handler stays registered after a subscribe error.
+ */
+int  mqttRouter_add( const char *pTopic, MQTT_ROUTE_HANDLER pfHandler, int qos );
+
+/**
+ * @brief Removes a topic handler added with mqttRouter_build() or mqttRouter_add().
+ * Any thread. The filter is unsubscribed when its last handler goes.
+ *
+ * @param pTopic Topic filter
+ * @param pfHandler Handler
+ * @return int 0=OK, negative=not registered or out of memory, positive=unsubscribe error
+ */
+int  mqttRouter_remove( const char *pTopic, MQTT_ROUTE_HANDLER pfHandler );
+
+/**
+ * @brief Sets the callback that follows the registry with broker subscriptions
+ *
+ * @param pfSubscribe Subscriber, NULL=none
+ */
+void mqttRouter_setSubscriber( MQTT_ROUTER_SUBSCRIBE pfSubscribe );
+
+/**
+ * @brief Subscribes every registered filter once, with the highest QoS of its handlers,
+ * in batches of one QoS. Called from on_connect().
+ *
+ * @param pfSubscribe Subscriber of one batch
+ * @param maxBatch Most filters per batch
+ * @return int 0=OK, negative=out of memory, else the first subscriber error
+ */
+int  mqttRouter_resubscribe( MQTT_ROUTER_SUBSCRIBE_MANY pfSubscribe, int maxBatch );
+
+/**
+ * @brief Finds the handlers of a received topic. Lock-free, any thread. MQTT 3.1.1
+ * filter rules: '+' matches one level, a trailing '#' the parent level and everything
+ * below it, and wildcards in the first level do not match topics starting with '$'.
+ *
+ * @param pTopic Received topic
+ * @param pOut [out] Handlers of the matching entries in registration order
+ * @param max Size of pOut
+ * @return int Number of matches, at most max and MQTT_ROUTER_MAX_MATCHES
+ */
+int  mqttRouter_match( const char *pTopic, MQTT_ROUTE_HANDLER *pOut, int max );
+
+/**
+ * @brief Releases the registry and the routing index
+ *
+ */
+void mqttRouter_destroy( void );
+
+
+#endif
+
+/* EOF *************************************************************/
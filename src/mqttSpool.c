@@ -0,0 +1,592 @@
+/********************************************************************
+
+  Offline spool for outbound MQTT messages
+
+  Author: Markku Heiskari
+  Version history in github
+
+  (C) Copyright 2024, Creoir Oy
+
+  The spool file is a header followed by a ring of variable size
+  records, mapped with MAP_SHARED. Appends are memcpy's into the
+  mapping plus an msync(MS_ASYNC), so the publishing thread never
+  waits for the disk. The page cache keeps the data if the process
+  dies; the kernel writes it out in the background.
+
+  A record is written with a zero magic, its check sum is computed
+  and only then is the magic stored. Every record carries a sequence
+  number one higher than the previous one. At start the ring is
+  walked from the head in the header, and the first record with a
+  bad magic, check sum or sequence number ends it, so a torn append
+  or a stale record from an earlier lap is never replayed. The head
+  is moved after a message has been replayed: a crash in between
+  replays that message again.
+
+  A record never wraps. If it does not fit at the end of the area, a
+  wrap marker is left there and the record goes to the start. When
+  the ring is full the oldest records are dropped.
+
+  All calls except mqttSpool_pending() and the statistics run under
+  the publish lock of util.c.
+
+********************************************************************/
+
+/********************************************************************
+  INCLUDES
+********************************************************************/
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stddef.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <time.h>
+#include <unistd.h>
+#include <stdatomic.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include "actionMain.h"
+#include "util.h"
+#include "mqttSpool.h"
+
+/********************************************************************
+  DEFINES
+********************************************************************/
+#define SPOOL_FILE_MAGIC    0x4C4F5053u         // "SPOL"
+#define SPOOL_VERSION       1
+#define SPOOL_REC_MAGIC     0x43455253u         // "SREC"
+#define SPOOL_WRAP_MAGIC    0x50415257u         // "WRAP"
+#define SPOOL_HDR_SIZE      64                  // Header area, data area starts after it
+#define SPOOL_ALIGN(x)      ( ( (x) + 7 ) & ~(uint64_t)7 )
+
+/********************************************************************
+  TYPES
+********************************************************************/
+
+typedef struct
+{
+  uint32_t            magic;                    //!< SPOOL_FILE_MAGIC
+  uint32_t            version;
+  uint64_t            size;                     //!< Data area bytes
+  uint64_t            head;                     //!< Offset of the oldest record
+  uint64_t            headSeq;                  //!< Sequence number of the oldest record
+  uint64_t            tail;                     //!< Offset of the next record
+  uint64_t            nextSeq;                  //!< Sequence number of the next record
+} SPOOL_HDR_T;
+
+typedef struct
+{
+  uint32_t            magic;                    //!< SPOOL_REC_MAGIC, or SPOOL_WRAP_MAGIC with length only
+  uint32_t            length;                   //!< Whole record, multiple of 8
+  uint64_t            seq;
+  int64_t             expiresMs;                //!< Wall clock ms, survives restarts
+  uint32_t            payloadLen;
+  uint16_t            topicLen;                 //!< Without the terminator. Topic is stored zero terminated.
+  uint8_t             qos;
+  uint8_t             retain;
+  uint32_t            check;                    //!< FNV-1a of seq..retain, topic and payload
+  uint32_t            reserved;
+} SPOOL_REC_T;                                  // Followed by topic and payload
+
+typedef struct
+{
+  int                 fd;
+  uint8_t            *pMap;
+  size_t              mapLen;
+  SPOOL_HDR_T        *pHdr;
+  uint8_t            *pData;
+  uint64_t            size;
+  atomic_uint         pending;
+  atomic_ulong        spooled;
+  atomic_ulong        replayed;
+  atomic_ulong        expired;
+  atomic_ulong        overwritten;
+  unsigned long       recovered;
+} SPOOL_T;
+
+
+/********************************************************************
+  FILE SCOPE VARIABLES
+********************************************************************/
+static SPOOL_T spool = { .fd = -1 };
+
+
+/********************************************************************
+  LOCAL PROTOTYPES
+********************************************************************/
+static uint32_t     recordCheck( const SPOOL_REC_T *pRec );
+static SPOOL_REC_T* validRecord( uint64_t pos, uint64_t seq );
+static uint64_t     skipWrap( uint64_t pos );
+static void         recover( void );
+static void         dropHead( void );
+static void         makeRoom( uint64_t from, uint64_t to );
+static void         scheduleWrite( const void *p, size_t length );
+static int64_t      wallMs( void );
+
+
+/********************************************************************
+  FUNCTIONS
+********************************************************************/
+
+
+/********************************************************************
+  mqttSpool_open()
+
+  Parameters: (in)  Spool file
+              (in)  Data area size in bytes
+  Returns:    0 = ok, nonzero = error code.
+
+  Description:
+  Maps the spool file, creating or resizing it as needed, and finds
+  the messages left from the previous run.
+
+********************************************************************/
+int mqttSpool_open( const char *pPath, size_t size ){
+  struct stat st;
+  size_t      mapLen;
+  int         fd;
+
+  size &= ~(size_t)7;
+  if( size < MQTT_SPOOL_MIN_SIZE ) size = MQTT_SPOOL_MIN_SIZE;
+  mapLen = SPOOL_HDR_SIZE + size;
+
+  fd = open( pPath, O_RDWR | O_CREAT, 0600 );
+  if( fd < 0 ){
+    dbg_out( DBG_ERROR, "%s() Unable to open %s: %s\n", __FUNCTION__, pPath, strerror(errno) );
+    return -1;
+  }
+  if( fstat( fd, &st ) || ( (size_t)st.st_size != mapLen && ftruncate( fd, (off_t)mapLen ) ) ){
+    dbg_out( DBG_ERROR, "%s() Unable to size %s: %s\n", __FUNCTION__, pPath, strerror(errno) );
+    close( fd );
+    return -1;
+  }
+  spool.pMap = mmap( NULL, mapLen, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0 );
+  if( MAP_FAILED == spool.pMap ){
+    dbg_out( DBG_ERROR, "%s() Unable to map %s: %s\n", __FUNCTION__, pPath, strerror(errno) );
+    spool.pMap = NULL;
+    close( fd );
+    return -1;
+  }
+  spool.fd = fd;
+  spool.mapLen = mapLen;
+  spool.pHdr = (SPOOL_HDR_T*)spool.pMap;
+  spool.pData = spool.pMap + SPOOL_HDR_SIZE;
+  spool.size = size;
+
+  if( SPOOL_FILE_MAGIC != spool.pHdr->magic || SPOOL_VERSION != spool.pHdr->version || size != spool.pHdr->size ){
+    if( spool.pHdr->magic ) dbg_out( DBG_NOTE, "%s() %s has another format or size. Starting over.\n", __FUNCTION__, pPath );
+    memset( spool.pHdr, 0x00, SPOOL_HDR_SIZE );
+    spool.pHdr->version = SPOOL_VERSION;
+    spool.pHdr->size = size;
+    spool.pHdr->headSeq = 1;
+    spool.pHdr->nextSeq = 1;
+    spool.pHdr->magic = SPOOL_FILE_MAGIC;
+  }else{
+    recover();
+  }
+  scheduleWrite( spool.pHdr, SPOOL_HDR_SIZE );
+
+  dbg_out( DBG_VERBOSE, "%s() Spool %s, %zu bytes, %u messages to replay\n", __FUNCTION__, pPath, size,
+           atomic_load( &spool.pending ) );
+  return 0;
+} // End of mqttSpool_open()
+
+
+/********************************************************************
+  recover()
+
+  Parameters: void
+  Returns:    void
+
+  Description:
+  Walks the records from the head while each one is intact and has
+  the next sequence number. The end of the walk is the new tail.
+
+********************************************************************/
+static void recover( void ){
+  SPOOL_REC_T *pRec;
+  uint64_t     pos = spool.pHdr->head;
+  uint64_t     seq = spool.pHdr->headSeq;
+  uint64_t     at;
+  unsigned int count = 0;
+
+  if( pos >= spool.size ) pos = 0;
+  for(;;){
+    at = skipWrap( pos );
+    pRec = validRecord( at, seq );
+    if( NULL == pRec ) break;
+    if( 0 == count ) spool.pHdr->head = at;
+    count++;
+    seq++;
+    pos = at + pRec->length;
+  }
+  if( 0 == count ){
+    spool.pHdr->head = 0;
+    spool.pHdr->tail = 0;
+  }else{
+    spool.pHdr->tail = pos;
+  }
+  spool.pHdr->headSeq = seq - count;
+  spool.pHdr->nextSeq = seq;
+  atomic_store( &spool.pending, count );
+  spool.recovered = count;
+} // End of recover()
+
+
+/********************************************************************
+  mqttSpool_sync()
+
+  Parameters: void
+  Returns:    void
+
+  Description:
+  Asks the kernel to write the whole mapping out.
+
+********************************************************************/
+void mqttSpool_sync( void ){
+  if( NULL == spool.pMap ) return;
+  msync( spool.pMap, spool.mapLen, MS_ASYNC );
+} // End of mqttSpool_sync()
+
+
+/********************************************************************
+  mqttSpool_enabled()
+
+  Parameters: void
+  Returns:    true = spool file open
+
+  Description:
+  --spoolFile was given and could be mapped.
+
+********************************************************************/
+bool mqttSpool_enabled( void ){
+  return NULL != spool.pMap;
+} // End of mqttSpool_enabled()
+
+
+/********************************************************************
+  mqttSpool_append()
+
+  Parameters: (in)  Topic
+              (in)  Payload
+              (in)  Payload length
+              (in)  QoS
+              (in)  Retain flag
+              (in)  Time to live in ms
+  Returns:    0 = ok, nonzero = error code.
+
+  Description:
+  Writes the message at the tail, dropping the oldest messages it
+  overlaps.
+
+********************************************************************/
+int mqttSpool_append( const char *pTopic, const char *pPayload, size_t payloadLen, int qos, bool retain, unsigned int ttlMs ){
+  SPOOL_HDR_T *pHdr = spool.pHdr;
+  SPOOL_REC_T *pRec;
+  size_t       topicLen;
+  uint64_t     need;
+  uint64_t     pos;
+
+  if( NULL == spool.pMap ) return -1;
+  topicLen = strlen( pTopic );
+  need = SPOOL_ALIGN( sizeof(SPOOL_REC_T) + topicLen + 1 + payloadLen );
+  if( topicLen > UINT16_MAX || need > spool.size / 2 ){
+    dbg_out( DBG_ERROR, "%s() %s is too large for the spool\n", __FUNCTION__, pTopic );
+    return -1;
+  }
+
+  pos = pHdr->tail;
+  if( pos + need > spool.size ){
+    makeRoom( pos, spool.size );
+    if( pos + sizeof(uint32_t) * 2 <= spool.size ){
+      pRec = (SPOOL_REC_T*)( spool.pData + pos );
+      pRec->length = (uint32_t)( spool.size - pos );
+      pRec->magic = SPOOL_WRAP_MAGIC;
+    }
+    pos = 0;
+  }
+  makeRoom( pos, pos + need );
+  if( 0 == atomic_load( &spool.pending ) ){
+    pHdr->head = pos;
+    pHdr->headSeq = pHdr->nextSeq;
+  }
+
+  pRec = (SPOOL_REC_T*)( spool.pData + pos );
+  pRec->magic = 0;
+  pRec->length = (uint32_t)need;
+  pRec->seq = pHdr->nextSeq;
+  pRec->expiresMs = wallMs() + ttlMs;
+  pRec->payloadLen = (uint32_t)payloadLen;
+  pRec->topicLen = (uint16_t)topicLen;
+  pRec->qos = (uint8_t)qos;
+  pRec->retain = retain ? 1 : 0;
+  pRec->reserved = 0;
+  memcpy( pRec + 1, pTopic, topicLen + 1 );
+  memcpy( (char*)( pRec + 1 ) + topicLen + 1, pPayload, payloadLen );
+  pRec->check = recordCheck( pRec );
+  atomic_thread_fence( memory_order_release );
+  pRec->magic = SPOOL_REC_MAGIC;
+
+  pHdr->tail = pos + need;
+  pHdr->nextSeq++;
+  atomic_fetch_add( &spool.pending, 1 );
+  atomic_fetch_add( &spool.spooled, 1 );
+
+  scheduleWrite( pRec, need );
+  scheduleWrite( pHdr, SPOOL_HDR_SIZE );
+  return 0;
+} // End of mqttSpool_append()
+
+
+/********************************************************************
+  mqttSpool_pending()
+
+  Parameters: void
+  Returns:    Messages waiting for replay
+
+  Description:
+  Lock free, so the network callbacks can check it.
+
+********************************************************************/
+unsigned int mqttSpool_pending( void ){
+  return atomic_load( &spool.pending );
+} // End of mqttSpool_pending()
+
+
+/********************************************************************
+  mqttSpool_replay()
+
+  Parameters: (in)  Publish function
+  Returns:    Number of messages replayed
+
+  Description:
+  Passes the pending messages to pfSend() oldest first, dropping the
+  ones past their TTL. Stops when pfSend() refuses a message; that
+  message stays at the head for the next replay.
+
+********************************************************************/
+unsigned int mqttSpool_replay( MQTT_SPOOL_SEND pfSend ){
+  SPOOL_REC_T  *pRec;
+  const char   *pTopic;
+  int64_t       now = wallMs();
+  unsigned int  count = 0;
+
+  if( NULL == spool.pMap ) return 0;
+
+  while( atomic_load( &spool.pending ) ){
+    pRec = (SPOOL_REC_T*)( spool.pData + spool.pHdr->head );
+    if( SPOOL_REC_MAGIC != pRec->magic ){
+      dbg_out( DBG_ERROR, "%s() Spool corrupted at %llu. %u messages lost.\n", __FUNCTION__,
+               (unsigned long long)spool.pHdr->head, atomic_load( &spool.pending ) );
+      atomic_store( &spool.pending, 0 );
+      spool.pHdr->head = spool.pHdr->tail;
+      spool.pHdr->headSeq = spool.pHdr->nextSeq;
+      break;
+    }
+    pTopic = (const char*)( pRec + 1 );
+    if( pRec->expiresMs < now ){
+      dbg_out( DBG_NOTE, "%s() Spooled %s expired. Not sent.\n", __FUNCTION__, pTopic );
+      atomic_fetch_add( &spool.expired, 1 );
+      dropHead();
+      continue;
+    }
+    if( pfSend( pTopic, pTopic + pRec->topicLen + 1, pRec->payloadLen, pRec->qos, pRec->retain ) ) break;
+    atomic_fetch_add( &spool.replayed, 1 );
+    count++;
+    dropHead();
+  }
+  scheduleWrite( spool.pHdr, SPOOL_HDR_SIZE );
+
+  if( count ) dbg_out( DBG_NORM, "%s() Replayed %u spooled messages, %u left\n", __FUNCTION__, count,
+                       atomic_load( &spool.pending ) );
+  return count;
+} // End of mqttSpool_replay()
+
+
+/********************************************************************
+  dropHead()
+
+  Parameters: void
+  Returns:    void
+
+  Description:
+  Removes the oldest record.
+
+********************************************************************/
+static void dropHead( void ){
+  SPOOL_REC_T *pRec = (SPOOL_REC_T*)( spool.pData + spool.pHdr->head );
+
+  spool.pHdr->headSeq++;
+  if( 1 == atomic_fetch_sub( &spool.pending, 1 ) ){
+    spool.pHdr->head = spool.pHdr->tail;
+  }else{
+    spool.pHdr->head = skipWrap( spool.pHdr->head + pRec->length );
+  }
+} // End of dropHead()
+
+
+/********************************************************************
+  makeRoom()
+
+  Parameters: (in)  Start of the area to write
+              (in)  End of the area to write
+  Returns:    void
+
+  Description:
+  Drops the oldest records while the head is inside the area.
+
+********************************************************************/
+static void makeRoom( uint64_t from, uint64_t to ){
+  while( atomic_load( &spool.pending ) && spool.pHdr->head >= from && spool.pHdr->head < to ){
+    atomic_fetch_add( &spool.overwritten, 1 );
+    dropHead();
+  }
+} // End of makeRoom()
+
+
+/********************************************************************
+  skipWrap()
+
+  Parameters: (in)  Offset of a record
+  Returns:    Offset of the record, 0 if the ring wraps here
+
+  Description:
+  Follows a wrap marker or the end of the data area.
+
+********************************************************************/
+static uint64_t skipWrap( uint64_t pos ){
+  if( pos + sizeof(uint32_t) * 2 > spool.size ) return 0;
+  if( SPOOL_WRAP_MAGIC == ((SPOOL_REC_T*)( spool.pData + pos ))->magic ) return 0;
+  return pos;
+} // End of skipWrap()
+
+
+/********************************************************************
+  validRecord()
+
+  Parameters: (in)  Offset
+              (in)  Expected sequence number
+  Returns:    The record, NULL if there is no intact record
+
+  Description:
+  Checks the magic, the sizes, the sequence number and the check sum.
+
+********************************************************************/
+static SPOOL_REC_T* validRecord( uint64_t pos, uint64_t seq ){
+  SPOOL_REC_T *pRec;
+
+  if( pos + sizeof(SPOOL_REC_T) > spool.size ) return NULL;
+  pRec = (SPOOL_REC_T*)( spool.pData + pos );
+  if( SPOOL_REC_MAGIC != pRec->magic || pRec->seq != seq ) return NULL;
+  if( pRec->length & 7 || pos + pRec->length > spool.size ) return NULL;
+  if( sizeof(SPOOL_REC_T) + pRec->topicLen + 1 + (uint64_t)pRec->payloadLen > pRec->length ) return NULL;
+  if( recordCheck( pRec ) != pRec->check ) return NULL;
+  return pRec;
+} // End of validRecord()
+
+
+/********************************************************************
+  recordCheck()
+
+  Parameters: (in)  Record
+  Returns:    Check sum
+
+  Description:
+  FNV-1a over the header fields from seq to retain, the topic and
+  the payload.
+
+********************************************************************/
+static uint32_t recordCheck( const SPOOL_REC_T *pRec ){
+  const uint8_t *p = (const uint8_t*)&pRec->seq;
+  uint32_t       hash = 2166136261u;
+  size_t         length = offsetof( SPOOL_REC_T, check ) - offsetof( SPOOL_REC_T, seq );
+  size_t         i;
+
+  for( i = 0; i < length; i++ ) hash = ( hash ^ p[i] ) * 16777619u;
+  p = (const uint8_t*)( pRec + 1 );
+  length = pRec->topicLen + 1 + (size_t)pRec->payloadLen;
+  for( i = 0; i < length; i++ ) hash = ( hash ^ p[i] ) * 16777619u;
+  return hash;
+} // End of recordCheck()
+
+
+/********************************************************************
+  scheduleWrite()
+
+  Parameters: (in)  Start of the changed bytes
+              (in)  Number of bytes
+  Returns:    void
+
+  Description:
+  msync(MS_ASYNC) of the pages under the bytes. Does not wait.
+
+********************************************************************/
+static void scheduleWrite( const void *p, size_t length ){
+  uintptr_t page = (uintptr_t)sysconf( _SC_PAGESIZE );
+  uintptr_t start = (uintptr_t)p & ~( page - 1 );
+
+  msync( (void*)start, (uintptr_t)p + length - start, MS_ASYNC );
+} // End of scheduleWrite()
+
+
+/********************************************************************
+  wallMs()
+
+  Parameters: void
+  Returns:    Wall clock time in ms
+
+  Description:
+  Record expiry uses the wall clock, since it must hold over a
+  restart.
+
+********************************************************************/
+static int64_t wallMs( void ){
+  struct timespec ts;
+
+  clock_gettime( CLOCK_REALTIME, &ts );
+  return (int64_t)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+} // End of wallMs()
+
+
+/********************************************************************
+  mqttSpool_getStats()
+
+  Parameters: (out) Statistics
+  Returns:    void
+
+  Description:
+  Copies the counters.
+
+********************************************************************/
+void mqttSpool_getStats( MQTT_SPOOL_STATS *pStats ){
+  pStats->size = (unsigned long)spool.size;
+  pStats->pending = atomic_load( &spool.pending );
+  pStats->spooled = atomic_load( &spool.spooled );
+  pStats->replayed = atomic_load( &spool.replayed );
+  pStats->expired = atomic_load( &spool.expired );
+  pStats->overwritten = atomic_load( &spool.overwritten );
+  pStats->recovered = spool.recovered;
+} // End of mqttSpool_getStats()
+
+
+/********************************************************************
+  mqttSpool_logStats()
+
+  Parameters: (in)  dbg_out() category
+  Returns:    void
+
+  Description:
+  Prints the spool counters.
+
+********************************************************************/
+void mqttSpool_logStats( int type ){
+  MQTT_SPOOL_STATS stats;
+
+  if( NULL == spool.pMap ) return;
+  mqttSpool_getStats( &stats );
+  dbg_out( type, "MQTT spool: %lu pending, spooled %lu, replayed %lu, expired %lu, overwritten %lu, recovered %lu\n",
+           stats.pending, stats.spooled, stats.replayed, stats.expired, stats.overwritten, stats.recovered );
+} // End of mqttSpool_logStats()
+
+
+/** End of mqttSpool.c *********************************************/
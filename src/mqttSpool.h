@@ -0,0 +1,130 @@
+/**
+ * @file mqttSpool.h
+ * @author Markku Heiskari
+ * @brief Offline spool for outbound MQTT messages. A memory mapped ring file that
+ * keeps messages published while the broker is unreachable, each with the spool
+ * TTL of its topic, and gives them back in order for replay after reconnect.
+ * Survives a crash or restart of the application.
+ *
+ * @copyright Copyright (c) 2024 Creoir Oy
+ *
+ */
+
+#ifndef __mqttspool_h
+#define __mqttspool_h
+
+/********************************************************************
+  INCLUDES
+********************************************************************/
+#include <stdint.h>
+#include <stddef.h>
+#include "actionMain.h"
+
+/********************************************************************
+  DEFINES
+********************************************************************/
+#define MQTT_SPOOL_DEFAULT_SIZE         (1024*1024) //!< Default --spoolSize in bytes
+#define MQTT_SPOOL_MIN_SIZE             (64*1024)   //!< Smallest accepted --spoolSize
+
+
+/********************************************************************
+  DATA TYPES
+********************************************************************/
+
+/**
+ * @brief Publishes one replayed message
+ *
+ * @return int 0=sent, nonzero=stop the replay and keep this message
+ */
+typedef int (*MQTT_SPOOL_SEND)( const char *pTopic, const char *pPayload, size_t payloadLen, int qos, bool retain );
+
+/**
+ * @brief Spool statistics
+ *
+ */
+typedef struct
+{
+  unsigned long size;                   //!< Data area of the spool file in bytes
+  unsigned long pending;                //!< Messages waiting for replay
+  unsigned long spooled;                //!< Messages written since start
+  unsigned long replayed;               //!< Messages replayed since start
+  unsigned long expired;                //!< Messages past their TTL at replay
+  unsigned long overwritten;            //!< Oldest messages dropped to make room
+  unsigned long recovered;              //!< Messages found in the file at start
+}MQTT_SPOOL_STATS;
+
+
+/********************************************************************
+  PROTOTYPES
+********************************************************************/
+
+/**
+ * @brief Opens or creates the spool file and recovers its messages
+ *
+ * @param pPath Spool file
+ * @param size Data area in bytes. A file of another size is started over.
+ * @return int 0=OK, negative=error. The spool is then disabled.
+ */
+int  mqttSpool_open( const char *pPath, size_t size );
+
+/**
+ * @brief Schedules the spool pages for writing to disk. Does not wait.
+ *
+ */
+void mqttSpool_sync( void );
+
+/**
+ * @brief Tells if the spool is open
+ *
+ * @return bool true=open
+ */
+bool mqttSpool_enabled( void );
+
+/**
+ * @brief Appends a message. Never blocks; drops the oldest messages when full.
+ * Not thread safe: call with the publish lock held, see mqtt_flushOutbox().
+ *
+ * @param pTopic Topic
+ * @param pPayload Payload
+ * @param payloadLen Payload length
+ * @param qos MQTT QoS
+ * @param retain MQTT retain flag
+ * @param ttlMs Time to live from now
+ * @return int 0=OK, negative=not spooled
+ */
+int  mqttSpool_append( const char *pTopic, const char *pPayload, size_t payloadLen, int qos, bool retain, unsigned int ttlMs );
+
+/**
+ * @brief Number of messages waiting for replay. Any thread.
+ *
+ * @return unsigned int Pending messages
+ */
+unsigned int mqttSpool_pending( void );
+
+/**
+ * @brief Replays pending messages oldest first. Expired ones are dropped.
+ * Not thread safe: call with the publish lock held.
+ *
+ * @param pfSend Publishes one message
+ * @return unsigned int Messages replayed
+ */
+unsigned int mqttSpool_replay( MQTT_SPOOL_SEND pfSend );
+
+/**
+ * @brief Reads the spool statistics
+ *
+ * @param pStats [out] Statistics
+ */
+void mqttSpool_getStats( MQTT_SPOOL_STATS *pStats );
+
+/**
+ * @brief Writes the spool statistics to debug output
+ *
+ * @param type dbg_out() message category
+ */
+void mqttSpool_logStats( int type );
+
+
+#endif
+
+/* EOF *************************************************************/
@@ -0,0 +1,413 @@
+/********************************************************************
+
+  Outbound MQTT statistics
+
+  Author: Markku Heiskari
+  Version history in github
+
+  (C) Copyright 2024, Creoir Oy
+
+  Statistics are kept per entry of mqttPublishPolicyRegister, so
+  every configured topic has its own histograms and the catch-all
+  entry collects the rest.
+
+  Ack latency is measured from the start of mosquitto_publish() to
+  on_publish() of the same mid. The mids are matched by the in-flight
+  tracking of mqttOutbox.c, which reports each completed one here.
+
+********************************************************************/
+
+/********************************************************************
+  INCLUDES
+********************************************************************/
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <pthread.h>
+#include "actionMain.h"
+#include "util.h"
+#include "mqttOutbox.h"
+#include "mqttStats.h"
+#include "mqttSpool.h"
+
+/********************************************************************
+  DEFINES
+********************************************************************/
+#define NUM_POLICIES    mqttPublishPolicyRegisterSize
+
+/********************************************************************
+  TYPES
+********************************************************************/
+
+typedef struct
+{
+  LATENCY_HIST        queueHist;                //!< Commit to the start of mosquitto_publish()
+  LATENCY_HIST        callHist;                 //!< mosquitto_publish() call time
+  LATENCY_HIST        ackHist;                  //!< Publish start to on_publish()
+  atomic_ulong        errors;                   //!< Failed publish calls
+  atomic_ulong        duplicates;               //!< Dropped by the de-duplication window
+  atomic_ulong        rateLimited;              //!< Dropped by the token bucket
+} TOPICSTATS_T;
+
+
+/********************************************************************
+  FILE SCOPE VARIABLES
+********************************************************************/
+extern globalData_type *pGlobalData;
+
+static TOPICSTATS_T     topicStats[MQTT_MAX_PUBLISH_POLICIES];
+static LATENCY_HIST     readyHist;              //!< CONNACK to the last SUBACK
+static atomic_ulong     subscribeRejected;      //!< Topic filters refused by the broker
+static _Atomic uint64_t startNs;                //!< First publish, for uptime
+static uint64_t         lastPublishNs;          //!< Last stats publication, mqttStats_poll()
+
+
+/********************************************************************
+  LOCAL PROTOTYPES
+********************************************************************/
+static void writeHist( JSON_WRITER *pJson, const char *pName, LATENCY_HIST *pHist );
+static void applyStatsPolicy( MQTT_OUTMSG *pMsg );
+
+
+/********************************************************************
+  FUNCTIONS
+********************************************************************/
+
+
+/********************************************************************
+  mqttStats_recordCall()
+
+  Parameters: (in)  Policy index
+              (in)  Call duration in ns
+              (in)  Nonzero = success
+  Returns:    void
+
+  Description:
+  Adds the call time to the histogram of the topic.
+
+********************************************************************/
+void mqttStats_recordCall( int policy, uint64_t ns, int ok ){
+  uint64_t noStart = 0;
+
+  if( policy < 0 || policy >= (int)NUM_POLICIES ) return;
+
+  if( 0 == atomic_load( &startNs ) ) atomic_compare_exchange_strong( &startNs, &noStart, monotonic_ns() );
+  latency_record( &topicStats[policy].callHist, ns );
+  if( !ok ) atomic_fetch_add( &topicStats[policy].errors, 1 );
+  if( ns > MQTT_STATS_SLOW_CALL_MS * 1000000ULL ){
+    dbg_out( DBG_NOTE, "MQTT publish of %s took %llu ms\n", mqttPublishPolicyRegister[policy].topic,
+             (unsigned long long)( ns / 1000000ULL ) );
+  }
+} // End of mqttStats_recordCall()
+
+
+/********************************************************************
+  mqttStats_recordQueue()
+
+  Parameters: (in)  Policy index
+              (in)  Commit to publish in ns
+  Returns:    void
+
+  Description:
+  Adds the time the message waited in the outbox to the histogram of
+  the topic. Shows the cost of the hand-off to mqtt_sender() compared
+  to --directPublish.
+
+********************************************************************/
+void mqttStats_recordQueue( int policy, uint64_t ns ){
+  if( policy < 0 || policy >= (int)NUM_POLICIES ) return;
+  latency_record( &topicStats[policy].queueHist, ns );
+} // End of mqttStats_recordQueue()
+
+
+/********************************************************************
+  mqttStats_recordSuppressed()
+
+  Parameters: (in)  Policy index
+              (in)  true = duplicate, false = over the rate limit
+  Returns:    void
+
+  Description:
+  Counts a message that was dropped before it reached the outbox.
+
+********************************************************************/
+void mqttStats_recordSuppressed( int policy, bool duplicate ){
+  if( policy < 0 || policy >= (int)NUM_POLICIES ) return;
+  atomic_fetch_add( duplicate ? &topicStats[policy].duplicates : &topicStats[policy].rateLimited, 1 );
+} // End of mqttStats_recordSuppressed()
+
+
+/********************************************************************
+  mqttStats_recordAck()
+
+  Parameters: (in)  Policy index
+              (in)  Publish start to on_publish() in ns
+  Returns:    void
+
+  Description:
+  Adds the ack latency to the histogram of the topic.
+
+********************************************************************/
+void mqttStats_recordAck( int policy, uint64_t ns ){
+  if( policy < 0 || policy >= (int)NUM_POLICIES ) return;
+  latency_record( &topicStats[policy].ackHist, ns );
+} // End of mqttStats_recordAck()
+
+
+/********************************************************************
+  mqttStats_recordReady()
+
+  Parameters: (in)  CONNACK to the last SUBACK in ns
+  Returns:    void
+
+  Description:
+  One sample per connection. Shows how long a reconnect leaves the
+  device deaf.
+
+********************************************************************/
+void mqttStats_recordReady( uint64_t ns ){
+  latency_record( &readyHist, ns );
+} // End of mqttStats_recordReady()
+
+
+/********************************************************************
+  mqttStats_recordRejected()
+
+  Parameters: (in)  Number of refused topic filters
+  Returns:    void
+
+********************************************************************/
+void mqttStats_recordRejected( unsigned int count ){
+  atomic_fetch_add( &subscribeRejected, count );
+} // End of mqttStats_recordRejected()
+
+
+/********************************************************************
+  writeHist()
+
+  Parameters: (in)  JSON writer
+              (in)  Member name
+              (in)  Histogram
+  Returns:    void
+
+  Description:
+  Writes {"n":..,"p50":..,"p95":..,"p99":..,"max":..}, times in us.
+
+********************************************************************/
+static void writeHist( JSON_WRITER *pJson, const char *pName, LATENCY_HIST *pHist ){
+  json_writeObjectBegin( pJson, pName );
+  json_writeNumber( pJson, "n", (long)atomic_load( &pHist->count ) );
+  json_writeNumber( pJson, "p50", (long)( latency_percentile( pHist, 50 ) / 1000 ) );
+  json_writeNumber( pJson, "p95", (long)( latency_percentile( pHist, 95 ) / 1000 ) );
+  json_writeNumber( pJson, "p99", (long)( latency_percentile( pHist, 99 ) / 1000 ) );
+  json_writeNumber( pJson, "max", (long)( atomic_load( &pHist->maxNs ) / 1000 ) );
+  json_writeObjectEnd( pJson );
+} // End of writeHist()
+
+
+/********************************************************************
+  applyStatsPolicy()
+
+  Parameters: [in,out] Reserved statistics message
+
+  Returns:    void
+
+  Description:
+  Gives the message the publish policy of MQTT_STATS_DEFAULT_TOPIC.
+  mqtt_beginPublish() looks the policy up by topic, so a --statsTopic
+  without its own entry would otherwise fall to the catch-all entry
+  and be published with QoS 2 and spooled.
+
+********************************************************************/
+static void applyStatsPolicy( MQTT_OUTMSG *pMsg ){
+  const mqtt_publish_policy *pPolicy;
+  size_t                     i;
+
+  for( i = 0; i < NUM_POLICIES; i++ ){
+    if( 0 == strcmp( mqttPublishPolicyRegister[i].topic, MQTT_STATS_DEFAULT_TOPIC ) ) break;
+  }
+  if( i >= NUM_POLICIES || (int)i == pMsg->policy ) return;
+
+  pPolicy = &mqttPublishPolicyRegister[i];
+  pMsg->policy = (int)i;
+  pMsg->qos = pPolicy->qos;
+  pMsg->retain = pPolicy->retain;
+  pMsg->lane = pPolicy->lane;
+  pMsg->expiresNs = pPolicy->expiryMs ? monotonic_ns() + (uint64_t)pPolicy->expiryMs * 1000000ULL : 0;
+} // End of applyStatsPolicy()
+
+
+/********************************************************************
+  mqttStats_publish()
+
+  Parameters: void
+  Returns:    0 = ok, nonzero = error code.
+
+  Description:
+  Serializes the outbox counters and the per topic histograms into
+  an outbox slot and publishes them on the stats topic. Example:
+  {"uptime":600,"outbox":{"depth":0,"highWater":3,"sent":118,
+   "expired":0,"cancelled":0,"timeouts":0,"inflight":0,"windowFull":0},"ackLost":0,
+   "subscribe":{"rejected":0,"ready":{"n":..}},
+   "spool":{"pending":0,..} (with --spoolFile),
+   "topics":[{"topic":"creoir/talk/speak","errors":0,"duplicates":0,
+   "rateLimited":0,"queue":{"n":..},
+   "call":{..},"ack":{..}},..]}
+  Skipped while the in-flight window is full; the statistics are not
+  worth delaying the speech and grammar traffic for.
+
+********************************************************************/
+int mqttStats_publish( void ){
+  MQTT_OUTBOX_STATS  outboxStats;
+  MQTT_SPOOL_STATS   spoolStats;
+  MQTT_OUTMSG       *pMsg;
+  JSON_WRITER        json;
+  uint64_t           start = atomic_load( &startNs );
+  size_t             i;
+
+  if( 0 == pGlobalData->statsTopic[0] ) return 0;
+  if( mqttOutbox_congested() ){
+    dbg_out( DBG_MQTT, "%s() In-flight window full. Statistics skipped.\n", __FUNCTION__ );
+    return 0;
+  }
+
+  mqttOutbox_getStats( &outboxStats );
+
+  pMsg = mqtt_beginPublish( pGlobalData->statsTopic, __FUNCTION__ );
+  if( NULL == pMsg ) return -1;
+  applyStatsPolicy( pMsg );
+
+  json_writerInit( &json, pMsg->pPayload, MQTT_SEND_PAYLOAD_SIZE );
+  json_writeNumber( &json, "uptime", start ? (long)( ( monotonic_ns() - start ) / 1000000000ULL ) : 0 );
+  json_writeObjectBegin( &json, "outbox" );
+  json_writeNumber( &json, "depth", (long)outboxStats.depth );
+  json_writeNumber( &json, "highWater", (long)outboxStats.highWater );
+  json_writeNumber( &json, "sent", (long)outboxStats.sent );
+  json_writeNumber( &json, "expired", (long)outboxStats.expired );
+  json_writeNumber( &json, "cancelled", (long)outboxStats.cancelled );
+  json_writeNumber( &json, "timeouts", (long)outboxStats.timeouts );
+  json_writeNumber( &json, "inflight", (long)outboxStats.inflight );
+  json_writeNumber( &json, "windowFull", (long)outboxStats.windowFull );
+  json_writeObjectEnd( &json );
+  json_writeNumber( &json, "ackLost", (long)outboxStats.ackLost );
+  json_writeObjectBegin( &json, "subscribe" );
+  json_writeNumber( &json, "rejected", (long)atomic_load( &subscribeRejected ) );
+  writeHist( &json, "ready", &readyHist );
+  json_writeObjectEnd( &json );
+  if( mqttSpool_enabled() ){
+    mqttSpool_getStats( &spoolStats );
+    json_writeObjectBegin( &json, "spool" );
+    json_writeNumber( &json, "pending", (long)spoolStats.pending );
+    json_writeNumber( &json, "spooled", (long)spoolStats.spooled );
+    json_writeNumber( &json, "replayed", (long)spoolStats.replayed );
+    json_writeNumber( &json, "expired", (long)spoolStats.expired );
+    json_writeNumber( &json, "overwritten", (long)spoolStats.overwritten );
+    json_writeObjectEnd( &json );
+  }
+  json_writeArrayBegin( &json, "topics" );
+  for( i = 0; i < NUM_POLICIES; i++ ){
+    if( 0 == atomic_load( &topicStats[i].callHist.count ) ) continue;
+    json_writeObjectBegin( &json, NULL );
+    json_writeString( &json, "topic", mqttPublishPolicyRegister[i].topic );
+    json_writeNumber( &json, "errors", (long)atomic_load( &topicStats[i].errors ) );
+    json_writeNumber( &json, "duplicates", (long)atomic_load( &topicStats[i].duplicates ) );
+    json_writeNumber( &json, "rateLimited", (long)atomic_load( &topicStats[i].rateLimited ) );
+    writeHist( &json, "queue", &topicStats[i].queueHist );
+    writeHist( &json, "call", &topicStats[i].callHist );
+    writeHist( &json, "ack", &topicStats[i].ackHist );
+    json_writeObjectEnd( &json );
+  }
+  json_writeArrayEnd( &json );
+
+  return mqtt_endPublish( pMsg, json_writerFinish( &json ), __FUNCTION__ );
+} // End of mqttStats_publish()
+
+
+/********************************************************************
+  mqttStats_poll()
+
+  Parameters: void
+  Returns:    void
+
+  Description:
+  Publishes the statistics once per --statsInterval.
+
+********************************************************************/
+void mqttStats_poll( void ){
+  uint64_t now;
+
+  if( 0 == pGlobalData->statsInterval ) return;
+
+  now = monotonic_ns();
+  if( 0 == lastPublishNs ){
+    lastPublishNs = now;
+    return;
+  }
+  if( now - lastPublishNs < (uint64_t)pGlobalData->statsInterval * 1000000000ULL ) return;
+  lastPublishNs = now;
+  mqttStats_publish();
+} // End of mqttStats_poll()
+
+
+/********************************************************************
+  mqttStats_thread()
+
+  Parameters: (in)  Not used
+  Returns:    NULL
+
+  Description:
+  Publishes the statistics every --statsInterval seconds until the
+  application exits. Not used in reactor mode.
+
+********************************************************************/
+void* mqttStats_thread( void *pArg ){
+  unsigned int i;
+
+  dbg_out( DBG_VERBOSE, "%s() Publishing statistics on %s every %u s\n", __FUNCTION__,
+           pGlobalData->statsTopic, pGlobalData->statsInterval );
+  while( !pGlobalData->appExit ){
+    for( i = 0; i < pGlobalData->statsInterval && !pGlobalData->appExit; i++ ) sleep( 1 );
+    if( !pGlobalData->appExit ) mqttStats_publish();
+  }
+  return NULL;
+} // End of mqttStats_thread()
+
+
+/********************************************************************
+  mqttStats_log()
+
+  Parameters: (in)  dbg_out() category
+  Returns:    void
+
+  Description:
+  Prints queue, call and ack latency of every topic that has been
+  published, and the messages suppressed on it. Then the connect to
+  ready time and the refused subscriptions.
+
+********************************************************************/
+void mqttStats_log( int type ){
+  char   label[MQTT_SEND_TOPIC_SIZE];
+  size_t i;
+
+  for( i = 0; i < NUM_POLICIES; i++ ){
+    if( 0 == atomic_load( &topicStats[i].callHist.count ) ) continue;
+    snprintf( label, sizeof(label), "queue   %s", mqttPublishPolicyRegister[i].topic );
+    latency_log( type, label, &topicStats[i].queueHist );
+    snprintf( label, sizeof(label), "publish %s", mqttPublishPolicyRegister[i].topic );
+    latency_log( type, label, &topicStats[i].callHist );
+    snprintf( label, sizeof(label), "ack     %s", mqttPublishPolicyRegister[i].topic );
+    latency_log( type, label, &topicStats[i].ackHist );
+    if( atomic_load( &topicStats[i].duplicates ) || atomic_load( &topicStats[i].rateLimited ) ){
+      dbg_out( type, "suppressed %s: %lu duplicates, %lu over rate\n", mqttPublishPolicyRegister[i].topic,
+               (unsigned long)atomic_load( &topicStats[i].duplicates ), (unsigned long)atomic_load( &topicStats[i].rateLimited ) );
+    }
+  }
+  if( atomic_load( &readyHist.count ) ) latency_log( type, "connect to ready", &readyHist );
+  if( atomic_load( &subscribeRejected ) ){
+    dbg_out( type, "subscriptions rejected: %lu\n", (unsigned long)atomic_load( &subscribeRejected ) );
+  }
+} // End of mqttStats_log()
+
+
+/** End of mqttStats.c *********************************************/
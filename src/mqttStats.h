@@ -0,0 +1,112 @@
+/**
+ * @file mqttStats.h
+ * @author Markku Heiskari
+ * @brief Outbound MQTT statistics. Latency histograms of the outbox wait, the mosquitto_publish()
+ * call and of the broker acknowledgement (PUBACK / PUBCOMP, matched by mid) per
+ * entry of mqttPublishPolicyRegister, and of the connect to ready time of the
+ * subscriptions, published periodically as compact JSON.
+ *
+ * @copyright Copyright (c) 2024 Creoir Oy
+ *
+ */
+
+#ifndef __mqttstats_h
+#define __mqttstats_h
+
+/********************************************************************
+  INCLUDES
+********************************************************************/
+#include <stdint.h>
+#include "actionMain.h"
+
+/********************************************************************
+  DEFINES
+********************************************************************/
+#define MQTT_STATS_DEFAULT_TOPIC        "creoir/app/stats"  //!< Default --statsTopic
+#define MQTT_STATS_DEFAULT_INTERVAL     60          //!< Default --statsInterval in seconds. 0=no stats topic.
+#define MQTT_STATS_SLOW_CALL_MS         1000        //!< mosquitto_publish() calls slower than this are logged
+
+
+/********************************************************************
+  PROTOTYPES
+********************************************************************/
+
+/**
+ * @brief Records how long one message waited in the outbox before its publish call
+ *
+ * @param policy Index of the message's entry in mqttPublishPolicyRegister
+ * @param ns Commit to the start of mosquitto_publish()
+ */
+void mqttStats_recordQueue( int policy, uint64_t ns );
+
+/**
+ * @brief Records the duration of one mosquitto_publish() call
+ *
+ * @param policy Index of the message's entry in mqttPublishPolicyRegister
+ * @param ns Call duration
+ * @param ok Nonzero if the call succeeded
+ */
+void mqttStats_recordCall( int policy, uint64_t ns, int ok );
+
+/**
+ * @brief Counts a message dropped by the de-duplication window or the rate limit of its topic
+ *
+ * @param policy Index of the message's entry in mqttPublishPolicyRegister
+ * @param duplicate true=duplicate, false=over the rate limit
+ */
+void mqttStats_recordSuppressed( int policy, bool duplicate );
+
+/**
+ * @brief Records the ack latency of one message. Called by the in-flight tracking of the outbox.
+ *
+ * @param policy Index of the message's entry in mqttPublishPolicyRegister
+ * @param ns Publish start to on_publish()
+ */
+void mqttStats_recordAck( int policy, uint64_t ns );
+
+/**
+ * @brief Records the time from CONNACK to the last SUBACK of the subscriptions of a connection
+ *
+ * @param ns Connect to ready
+ */
+void mqttStats_recordReady( uint64_t ns );
+
+/**
+ * @brief Counts topic filters the broker refused to subscribe
+ *
+ * @param count Refused filters
+ */
+void mqttStats_recordRejected( unsigned int count );
+
+/**
+ * @brief Publishes the statistics on the stats topic now
+ *
+ * @return int 0=OK, negative=error
+ */
+int  mqttStats_publish( void );
+
+/**
+ * @brief Publishes the statistics if the stats interval has passed. Called from the reactor timer.
+ *
+ */
+void mqttStats_poll( void );
+
+/**
+ * @brief Thread that publishes the statistics every stats interval
+ *
+ * @param pArg Not used
+ * @return void* NULL
+ */
+void* mqttStats_thread( void *pArg );
+
+/**
+ * @brief Writes the histograms to debug output
+ *
+ * @param type dbg_out() message category
+ */
+void mqttStats_log( int type );
+
+
+#endif
+
+/* EOF *************************************************************/
@@ -0,0 +1,409 @@
+/********************************************************************
+
+  Reactor mode
+
+  Author: Markku Heiskari
+  Version history in github
+
+  (C) Copyright 2024, Creoir Oy
+
+  Alternative to the threaded runtime. One epoll loop watches the
+  mosquitto socket, stdin, a timerfd for MQTT housekeeping and the
+  event queue eventfd. MQTT callbacks push events, the loop drains
+  the queue and runs the handlers, and handlers publish directly with
+  mosquitto_publish() from the same thread. Nothing is handed over
+  between threads.
+
+********************************************************************/
+
+/********************************************************************
+  INCLUDES
+********************************************************************/
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <errno.h>
+#include <string.h>
+#if !defined(_MSC_VER)
+#include <unistd.h>
+#include <termios.h>
+#include <sys/epoll.h>
+#include <sys/timerfd.h>
+#endif
+#include "mosquitto.h"
+#include "actionMain.h"
+#include "util.h"
+#include "eventQueue.h"
+#include "mqttStats.h"
+#include "reactor.h"
+
+
+extern globalData_type *pGlobalData;
+
+
+#if !defined(_MSC_VER)
+/********************************************************************
+  FILE SCOPE VARIABLES
+********************************************************************/
+static int             epollFd = -1;        // The reactor
+static int             timerFd = -1;        // Housekeeping tick
+static int             mosqFd = -1;         // MQTT socket currently watched, -1 if none
+static int             mosqWantWrite;       // EPOLLOUT armed for mosqFd
+static int             stdinWatched;        // Console is in the reactor
+static int             stdinRaw;            // Terminal settings changed
+static struct termios  oldTerm;             // Terminal settings to restore
+static unsigned int    reconnectDelayMs = REACTOR_RECONNECT_MIN_MS;  // Wait after the next failed reconnect
+static uint64_t        reconnectNs;         // monotonic_ns() of the next reconnect attempt, 0=now
+
+
+/********************************************************************
+  LOCAL PROTOTYPES
+********************************************************************/
+static int  reactorOpen( int wakeFd );
+static void reactorClose( void );
+static void syncMosquittoFd( struct mosquitto *mosq );
+static void handleMosquitto( struct mosquitto *mosq, uint32_t events );
+static void handleTimer( struct mosquitto *mosq );
+static void handleStdin( void );
+static void drainEvents( EVENTQUEUE_T *pQueue );
+#endif
+
+
+/********************************************************************
+  FUNCTIONS
+********************************************************************/
+
+
+/********************************************************************
+  reactor_prepareQueue()
+
+  Parameters: (in)  Event queue
+  Returns:    void
+
+  Description:
+  A blocked push would wait for this very thread forever. Events that
+  block by default are switched to drop the lowest priority event
+  instead, so control events still get in.
+
+********************************************************************/
+void reactor_prepareQueue( EVENTQUEUE_T *pQueue ){
+  int e;
+
+  for( e=0; e<EVT_COUNT; e++ ){
+    if( EVQ_OVERFLOW_BLOCK == pQueue->overflow[e] ){
+      eventQueue_setOverflow( pQueue, (APPLICATION_EVENT)e, EVQ_OVERFLOW_DROP_LOWEST );
+    }
+  }
+} // End of reactor_prepareQueue()
+
+
+#if defined(_MSC_VER)
+/********************************************************************
+  reactor_run()
+
+  Description:
+  Not available on Windows.
+
+********************************************************************/
+int reactor_run( void ){
+  dbg_out( DBG_FATAL, "%s() Reactor mode requires Linux.\n", __FUNCTION__ );
+  return -1;
+} // End of reactor_run()
+
+#else
+
+/********************************************************************
+  reactorOpen()
+
+  Parameters: (in)  Event queue wakeup descriptor
+  Returns:    0 = ok, nonzero = error code.
+
+  Description:
+  Creates the epoll instance and the timer, and adds the static
+  descriptors. stdin is switched to unbuffered input like in
+  readKeyboard().
+
+********************************************************************/
+static int reactorOpen( int wakeFd ){
+  struct epoll_event ev;
+  struct itimerspec  its;
+  struct termios     newTerm;
+
+  epollFd = epoll_create1( EPOLL_CLOEXEC );
+  if( epollFd < 0 ){
+    dbg_out( DBG_FATAL, "%s() epoll_create1 failed: %s\n", __FUNCTION__, strerror(errno) );
+    return -1;
+  }
+
+  timerFd = timerfd_create( CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC );
+  if( timerFd < 0 ){
+    dbg_out( DBG_FATAL, "%s() timerfd_create failed: %s\n", __FUNCTION__, strerror(errno) );
+    return -2;
+  }
+  its.it_value.tv_sec = REACTOR_TICK_MS / 1000;
+  its.it_value.tv_nsec = ( REACTOR_TICK_MS % 1000 ) * 1000000L;
+  its.it_interval = its.it_value;
+  timerfd_settime( timerFd, 0, &its, NULL );
+
+  memset( &ev, 0x00, sizeof(ev) );
+  ev.events = EPOLLIN;
+  ev.data.fd = timerFd;
+  epoll_ctl( epollFd, EPOLL_CTL_ADD, timerFd, &ev );
+  ev.data.fd = wakeFd;
+  epoll_ctl( epollFd, EPOLL_CTL_ADD, wakeFd, &ev );
+
+  // Console. Fails harmlessly if stdin is a regular file or /dev/null.
+  ev.data.fd = STDIN_FILENO;
+  stdinWatched = ( 0 == epoll_ctl( epollFd, EPOLL_CTL_ADD, STDIN_FILENO, &ev ) );
+  if( stdinWatched && 0 == tcgetattr( STDIN_FILENO, &oldTerm ) ){
+    newTerm = oldTerm;
+    newTerm.c_lflag &= ~(ICANON | ECHO);
+    tcsetattr( STDIN_FILENO, TCSANOW, &newTerm );
+    stdinRaw = 1;
+  }
+  return 0;
+} // End of reactorOpen()
+
+
+/********************************************************************
+  reactorClose()
+
+  Parameters: void
+  Returns:    void
+
+  Description:
+  Restores the terminal and closes the reactor descriptors.
+
+********************************************************************/
+static void reactorClose( void ){
+  if( stdinRaw ) tcsetattr( STDIN_FILENO, TCSANOW, &oldTerm );
+  if( timerFd >= 0 ) close( timerFd );
+  if( epollFd >= 0 ) close( epollFd );
+  stdinRaw = stdinWatched = 0;
+  timerFd = epollFd = mosqFd = -1;
+} // End of reactorClose()
+
+
+/********************************************************************
+  syncMosquittoFd()
+
+  Parameters: (in)  Mosquitto client
+  Returns:    void
+
+  Description:
+  Follows the client socket across reconnects and arms EPOLLOUT only
+  while the client has data to write.
+
+********************************************************************/
+static void syncMosquittoFd( struct mosquitto *mosq ){
+  struct epoll_event ev;
+  int                fd = mosquitto_socket( mosq );
+  int                wantWrite = ( fd >= 0 ) && mosquitto_want_write( mosq );
+
+  if( fd == mosqFd && wantWrite == mosqWantWrite ) return;
+
+  memset( &ev, 0x00, sizeof(ev) );
+  ev.events = EPOLLIN | ( wantWrite ? EPOLLOUT : 0 );
+  ev.data.fd = fd;
+
+  if( fd != mosqFd ){
+    if( mosqFd >= 0 ) epoll_ctl( epollFd, EPOLL_CTL_DEL, mosqFd, NULL );
+    if( fd >= 0 && epoll_ctl( epollFd, EPOLL_CTL_ADD, fd, &ev ) ){
+      dbg_out( DBG_ERROR, "%s() Cannot watch MQTT socket: %s\n", __FUNCTION__, strerror(errno) );
+      fd = -1;
+    }
+  }else{
+    epoll_ctl( epollFd, EPOLL_CTL_MOD, fd, &ev );
+  }
+  mosqFd = fd;
+  mosqWantWrite = wantWrite;
+} // End of syncMosquittoFd()
+
+
+/********************************************************************
+  handleMosquitto()
+
+  Parameters: (in)  Mosquitto client
+              (in)  epoll event mask
+  Returns:    void
+
+  Description:
+  Runs the client network I/O. Incoming messages reach on_message()
+  from here and are queued as application events.
+
+********************************************************************/
+static void handleMosquitto( struct mosquitto *mosq, uint32_t events ){
+  int rc = MOSQ_ERR_SUCCESS;
+
+  if( events & (EPOLLIN | EPOLLERR | EPOLLHUP) ) rc = mosquitto_loop_read( mosq, 1 );
+  if( MOSQ_ERR_SUCCESS == rc && (events & EPOLLOUT) ) rc = mosquitto_loop_write( mosq, 1 );
+
+  if( MOSQ_ERR_SUCCESS != rc ){
+    dbg_out( DBG_ERROR, "%s() MQTT connection lost: %s\n", __FUNCTION__, mosquitto_strerror(rc) );
+    pGlobalData->mqttConnected = 0;
+    // The client closed the socket. Forget it before the number is reused.
+    epoll_ctl( epollFd, EPOLL_CTL_DEL, mosqFd, NULL );
+    mosqFd = -1;
+  }
+} // End of handleMosquitto()
+
+
+/********************************************************************
+  handleTimer()
+
+  Parameters: (in)  Mosquitto client
+  Returns:    void
+
+  Description:
+  Periodic MQTT housekeeping: keepalive, retries, reconnect and the
+  statistics topic. The reconnect does not block: the TCP connect
+  and CONNECT complete through EPOLLOUT on the new socket, see
+  syncMosquittoFd(). Failed attempts back off exponentially from
+  REACTOR_RECONNECT_MIN_MS to REACTOR_RECONNECT_MAX_MS, like
+  mosquitto_reconnect_delay_set() in the threaded runtime.
+
+********************************************************************/
+static void handleTimer( struct mosquitto *mosq ){
+  uint64_t expirations;
+  uint64_t now;
+  int      rc;
+
+  if( read( timerFd, &expirations, sizeof(expirations) ) < 0 ) return;
+  if( NULL == mosq ) return;
+
+  rc = mosquitto_loop_misc( mosq );
+  now = monotonic_ns();
+  if( pGlobalData->mqttConnected ){
+    reconnectDelayMs = REACTOR_RECONNECT_MIN_MS;
+    reconnectNs = 0;
+  }else if( ( MOSQ_ERR_NO_CONN == rc || mosquitto_socket( mosq ) < 0 ) && now >= reconnectNs ){
+    rc = mosquitto_reconnect_async( mosq );
+    if( MOSQ_ERR_SUCCESS != rc ){
+      dbg_out( DBG_ERROR, "%s() MQTT reconnect: %s. Next attempt in %u ms.\n", __FUNCTION__, mosquitto_strerror(rc), reconnectDelayMs );
+    }else{
+      dbg_out( DBG_VERBOSE, "%s() MQTT reconnecting\n", __FUNCTION__ );
+    }
+    // Until on_connect() the next attempt waits for the backoff
+    reconnectNs = now + (uint64_t)reconnectDelayMs * 1000000ULL;
+    reconnectDelayMs = ( reconnectDelayMs * 2 > REACTOR_RECONNECT_MAX_MS ) ? REACTOR_RECONNECT_MAX_MS : reconnectDelayMs * 2;
+  }
+  mqttStats_poll();
+} // End of handleTimer()
+
+
+/********************************************************************
+  handleStdin()
+
+  Parameters: void
+  Returns:    void
+
+  Description:
+  Reads pending console input and acts on each key.
+
+********************************************************************/
+static void handleStdin( void ){
+  char    buf[REACTOR_STDIN_CHUNK];
+  ssize_t n, i;
+
+  n = read( STDIN_FILENO, buf, sizeof(buf) );
+  if( n <= 0 ){
+    if( n < 0 && EINTR == errno ) return;
+    // End of input. Stop watching so the loop does not spin.
+    epoll_ctl( epollFd, EPOLL_CTL_DEL, STDIN_FILENO, NULL );
+    stdinWatched = 0;
+    return;
+  }
+  for( i=0; i<n; i++ ) handleKey( buf[i] );
+} // End of handleStdin()
+
+
+/********************************************************************
+  drainEvents()
+
+  Parameters: (in)  Event queue
+  Returns:    void
+
+  Description:
+  Dispatches everything queued so far, before waiting for more I/O.
+  Keeps the queue short since the loop is its only consumer.
+
+********************************************************************/
+static void drainEvents( EVENTQUEUE_T *pQueue ){
+  EVENTITEM_T events[EVQ_BATCH_MAX];
+  int         n;
+
+  while( !pGlobalData->appExit && (n = eventQueue_tryPopBatch( pQueue, events, EVQ_BATCH_MAX )) > 0 ){
+    dispatchEvents( events, n );
+  }
+} // End of drainEvents()
+
+
+/********************************************************************
+  reactor_run()
+
+  Parameters: void
+  Returns:    0 = requested stop, negative = error
+
+  Description:
+  The reactor loop. Dispatches queued events, then sleeps in
+  epoll_wait() only if the queue is still empty after announcing the
+  wait, so a push from any other thread also wakes the loop.
+
+********************************************************************/
+int reactor_run( void ){
+  struct epoll_event events[REACTOR_MAX_EVENTS];
+  struct mosquitto  *mosq = pGlobalData->mosquittoClient;
+  EVENTQUEUE_T      *pQueue = pGlobalData->eventQueue;
+  int                wakeFd = eventQueue_getWakeFd( pQueue );
+  int                n, i, fd;
+  int                woken;
+  int                ret = 0;
+
+  if( reactorOpen( wakeFd ) ){
+    reactorClose();
+    return -1;
+  }
+  dbg_out( DBG_NORM, "Reactor loop starting...\n" );
+
+  while( !pGlobalData->appExit ){
+
+    drainEvents( pQueue );
+    if( pGlobalData->appExit ) break;
+    if( mosq ) syncMosquittoFd( mosq );
+
+    n = epoll_wait( epollFd, events, REACTOR_MAX_EVENTS, eventQueue_prepareWait( pQueue ) ? -1 : 0 );
+    if( n < 0 ){
+      eventQueue_finishWait( pQueue, 0 );
+      if( EINTR == errno ) continue;
+      dbg_out( DBG_FATAL, "%s() epoll_wait failed: %s\n", __FUNCTION__, strerror(errno) );
+      ret = -2;
+      break;
+    }
+
+    woken = 0;
+    for( i=0; i<n; i++ ){
+      fd = events[i].data.fd;
+      if( fd == wakeFd ){
+        woken = 1;
+      }else if( fd == timerFd ){
+        handleTimer( mosq );
+      }else if( fd == STDIN_FILENO && stdinWatched ){
+        handleStdin();
+      }else if( fd == mosqFd && mosq ){
+        handleMosquitto( mosq, events[i].events );
+        mqtt_flushOutbox();
+      }
+    }
+    eventQueue_finishWait( pQueue, woken );
+
+  } // End while(!appExit)
+
+  reactorClose();
+  dbg_out( DBG_NOTE, "Reactor loop exit.\n" );
+  return ret;
+} // End of reactor_run()
+
+#endif
+
+
+/** End of reactor.c ***********************************************/
@@ -0,0 +1,54 @@
+/**
+ * @file reactor.h
+ * @author Markku Heiskari
+ * @brief Single-threaded reactor mode. One epoll loop serves the MQTT socket,
+ * the console, a housekeeping timer and the event queue, and runs the event
+ * handlers inline. Linux only.
+ *
+ * @copyright Copyright (c) 2024 Creoir Oy
+ *
+ */
+
+#ifndef __reactor_h
+#define __reactor_h
+
+/********************************************************************
+  INCLUDES
+********************************************************************/
+#include "actionMain.h"
+
+/********************************************************************
+  DEFINES
+********************************************************************/
+#define REACTOR_TICK_MS                 1000        //!< Housekeeping timer period: MQTT keepalive and reconnect
+#define REACTOR_RECONNECT_MIN_MS        1000        //!< First reconnect delay after the broker connection is lost
+#define REACTOR_RECONNECT_MAX_MS        32000       //!< Longest reconnect delay. The delay doubles after every failed attempt.
+#define REACTOR_MAX_EVENTS              8           //!< epoll events handled per wakeup
+#define REACTOR_STDIN_CHUNK             16          //!< Console bytes read per wakeup
+
+
+/********************************************************************
+  PROTOTYPES
+********************************************************************/
+
+/**
+ * @brief Adapts an event queue for the reactor. Overflow policies that would block
+ * the producer are changed to drop, since in reactor mode the producer is the consumer.
+ *
+ * @param pQueue The event queue served by the reactor
+ */
+void reactor_prepareQueue( struct EVENTQUEUE *pQueue );
+
+
+/**
+ * @brief Runs the reactor loop until the application exits.
+ * Replaces app_eventloop(), the MQTT network and sender threads and the keyboard thread.
+ *
+ * @return int 0=Requested stop, negative=error
+ */
+int reactor_run( void );
+
+
+#endif
+
+/* EOF *************************************************************/
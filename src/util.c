@@ -23,47 +23,83 @@
 #include <windows.h>
 #endif
 #include <string.h>
+#include <ctype.h>
+#include <limits.h>
 #include <signal.h>
 #include <time.h>
 #include "actionMain.h"
 #include "util.h"
+#include "mqttOutbox.h"
+#include "mqttStats.h"
+#include "mqttSpool.h"
 
 /********************************************************************
-  LOCAL PROTOTYPES
+  DEFINES
 ********************************************************************/
-static int  wakeMQTTsender(MQTT_COND_VAR* pConditionVariable);
+#define NUM_PUBLISH_POLICIES  mqttPublishPolicyRegisterSize
+
+#define GATE_PASS             0
+#define GATE_DUPLICATE        1
+#define GATE_RATE_LIMITED     2
 
 /********************************************************************
-  DEFINES
+  TYPES
 ********************************************************************/
 
-extern globalData_type *pGlobalData;
-
+// De-duplication and rate limit state of one mqttPublishPolicyRegister entry
+typedef struct {
+  char          *pLast;         //!< Topic, zero and payload of the last published message
+  size_t        lastSize;       //!< Bytes used in pLast
+  size_t        lastCap;        //!< Bytes allocated for pLast
+  uint64_t      lastNs;         //!< When the last message was published, 0=never
+  uint64_t      milliTokens;    //!< Token bucket level, 1000 per message
+  uint64_t      refillNs;       //!< Last token bucket refill
+} PUBLISH_GATE_T;
+
+// Read position of json_extract()
+typedef struct {
+  const char    *p;             //!< Next character
+  const char    *pEnd;          //!< End of the text
+  int           depth;          //!< Open objects and arrays
+} JSON_READER;
 
+/********************************************************************
+  LOCAL PROTOTYPES
+********************************************************************/
+static int  publishMessage(MQTT_OUTMSG* pMsg);
+static int  findPublishPolicy(const char* pTopic);
+static int  gateMessage(const MQTT_OUTMSG* pMsg);
+static void gateRecord(int policy, const char* pTopic, const char* pPayload, size_t payloadLen);
+static int  spoolMessage(MQTT_OUTMSG* pMsg);
+static int  replayMessage(const char* pTopic, const char* pPayload, size_t payloadLen, int qos, bool retain);
+static void jsonPut(JSON_WRITER* pWriter, const char* pText, size_t length);
+static void jsonPutString(JSON_WRITER* pWriter, const char* pText);
+static void jsonPutName(JSON_WRITER* pWriter, const char* pName);
+static void jsonSkipSpace(JSON_READER* pReader);
+static int  jsonHex4(const char* p, const char* pEnd, unsigned int* pCode);
+static int  jsonReadString(JSON_READER* pReader, char* pOut, size_t outSize);
+static int  jsonReadNumber(JSON_READER* pReader);
+static int  jsonSkipValue(JSON_READER* pReader);
+static int  jsonReadField(JSON_READER* pReader, const JSON_FIELD* pField, void* pRecord);
+static int  jsonReadArray(JSON_READER* pReader, const JSON_FIELD* pField, void* pRecord);
+static int  jsonReadObject(JSON_READER* pReader, const JSON_FIELD* pFields, int numFields, void* pRecord, bool stopEarly, unsigned int* pFound);
 
 /********************************************************************
-  FUNCTIONS
+  FILE SCOPE VARIABLES
 ********************************************************************/
 
+extern globalData_type *pGlobalData;
 
-/********************************************************************
-  wakeMQTTsender()
+// Held while the outbox is drained, so only one thread publishes at a time and lane order holds
+static pthread_mutex_t publishMutex = PTHREAD_MUTEX_INITIALIZER;
 
-  Parameters: Pointer to mutex / critical section
-  Returns:    0 = ok, nonzero = error code.
+static PUBLISH_GATE_T  publishGate[MQTT_MAX_PUBLISH_POLICIES];
+static pthread_mutex_t gateMutex = PTHREAD_MUTEX_INITIALIZER;
 
-  Description:
-  Wrapper for waking conditional variable
 
+/********************************************************************
+  FUNCTIONS
 ********************************************************************/
-static int wakeMQTTsender(MQTT_COND_VAR* pConditionVariable) {
-  #if defined(_MSC_VER)
-    WakeConditionVariable(pConditionVariable);
-  #else
-    pthread_cond_signal(pConditionVariable);
-  #endif
-  return 0;
-} // End of wakeMQTTsender()
 
 
 /********************************************************************
@@ -157,6 +193,745 @@ int mqtt_topic_compare(const char* haystack, const char* needle) {
 } // End of mqtt_topic_compare()
 
 
+/********************************************************************
+  jsonSkipSpace()
+
+  Parameters: (in)  Reader
+  Returns:    void
+
+  Description:
+  Moves the reader past white space.
+
+********************************************************************/
+static void jsonSkipSpace(JSON_READER* pReader) {
+  while (pReader->p < pReader->pEnd && isspace((unsigned char)*pReader->p)) pReader->p++;
+} // End of jsonSkipSpace()
+
+
+/********************************************************************
+  jsonHex4()
+
+  Parameters: (in)  Four hex digits
+              (in)  End of the text
+              (out) Value
+  Returns:    0 = ok, -1 = not four hex digits
+
+  Description:
+  Reads the digits of a \u escape.
+
+********************************************************************/
+static int jsonHex4(const char* p, const char* pEnd, unsigned int* pCode) {
+  int i;
+
+  if (pEnd - p < 4) return -1;
+  for (*pCode = 0, i = 0; i < 4; i++) {
+    if (!isxdigit((unsigned char)p[i])) return -1;
+    *pCode = (*pCode << 4) | (unsigned int)(isdigit((unsigned char)p[i]) ? p[i] - '0' : (tolower((unsigned char)p[i]) - 'a' + 10));
+  }
+  return 0;
+} // End of jsonHex4()
+
+
+/********************************************************************
+  jsonReadString()
+
+  Parameters: (in)  Reader at the opening quote
+              (out) Buffer for the value, NULL = skip
+              (in)  Buffer size
+  Returns:    Length of the whole value, -1 = syntax error
+
+  Description:
+  Reads a string and decodes its escapes, \u as UTF-8. The buffer
+  gets as much as fits, zero terminated.
+
+********************************************************************/
+static int jsonReadString(JSON_READER* pReader, char* pOut, size_t outSize) {
+  const char*   p = pReader->p + 1;
+  size_t        n = 0;
+  unsigned int  code, low;
+  char          utf8[4];
+  int           len, k;
+
+  while (p < pReader->pEnd && *p != '"') {
+    if ((unsigned char)*p < 0x20) return -1;
+    if (*p != '\\') {
+      if (pOut && n + 1 < outSize) pOut[n] = *p;
+      n++;
+      p++;
+      continue;
+    }
+
+    if (++p >= pReader->pEnd) return -1;
+    len = 1;
+    switch (*p++) {
+      case '"':  utf8[0] = '"';  break;
+      case '\\': utf8[0] = '\\'; break;
+      case '/':  utf8[0] = '/';  break;
+      case 'b':  utf8[0] = '\b'; break;
+      case 'f':  utf8[0] = '\f'; break;
+      case 'n':  utf8[0] = '\n'; break;
+      case 'r':  utf8[0] = '\r'; break;
+      case 't':  utf8[0] = '\t'; break;
+      case 'u':
+        if (jsonHex4(p, pReader->pEnd, &code)) return -1;
+        p += 4;
+        if (code >= 0xDC00 && code <= 0xDFFF) return -1;            // Lone low surrogate
+        if (code >= 0xD800 && code <= 0xDBFF) {
+          if (pReader->pEnd - p < 6 || p[0] != '\\' || p[1] != 'u' || jsonHex4(p + 2, pReader->pEnd, &low) || low < 0xDC00 || low > 0xDFFF) return -1;
+          p += 6;
+          code = 0x10000 + ((code - 0xD800) << 10) + (low - 0xDC00);
+        }
+        if (code < 0x80) {
+          utf8[0] = (char)code;
+        } else if (code < 0x800) {
+          utf8[0] = (char)(0xC0 | (code >> 6));
+          utf8[1] = (char)(0x80 | (code & 0x3F));
+          len = 2;
+        } else if (code < 0x10000) {
+          utf8[0] = (char)(0xE0 | (code >> 12));
+          utf8[1] = (char)(0x80 | ((code >> 6) & 0x3F));
+          utf8[2] = (char)(0x80 | (code & 0x3F));
+          len = 3;
+        } else {
+          utf8[0] = (char)(0xF0 | (code >> 18));
+          utf8[1] = (char)(0x80 | ((code >> 12) & 0x3F));
+          utf8[2] = (char)(0x80 | ((code >> 6) & 0x3F));
+          utf8[3] = (char)(0x80 | (code & 0x3F));
+          len = 4;
+        }
+        break;
+      default:
+        return -1;
+    }
+    for (k = 0; k < len; k++, n++) {
+      if (pOut && n + 1 < outSize) pOut[n] = utf8[k];
+    }
+  } // End while
+
+  if (p >= pReader->pEnd) return -1;   // No closing quote
+  if (pOut && outSize) pOut[n < outSize ? n : outSize - 1] = 0;
+  pReader->p = p + 1;
+  return n > INT_MAX ? INT_MAX : (int)n;
+} // End of jsonReadString()
+
+
+/********************************************************************
+  jsonReadNumber()
+
+  Parameters: (in)  Reader at the first character of the number
+  Returns:    Length of the number, -1 = syntax error
+
+  Description:
+  Moves the reader past a number. The value is not converted.
+
+********************************************************************/
+static int jsonReadNumber(JSON_READER* pReader) {
+  const char* p = pReader->p;
+  const char* pEnd = pReader->pEnd;
+  int         len;
+
+  if (p < pEnd && *p == '-') p++;
+  if (p >= pEnd || !isdigit((unsigned char)*p)) return -1;
+  if (*p == '0') p++;
+  else while (p < pEnd && isdigit((unsigned char)*p)) p++;
+
+  if (p < pEnd && *p == '.') {
+    if (++p >= pEnd || !isdigit((unsigned char)*p)) return -1;
+    while (p < pEnd && isdigit((unsigned char)*p)) p++;
+  }
+  if (p < pEnd && (*p == 'e' || *p == 'E')) {
+    p++;
+    if (p < pEnd && (*p == '+' || *p == '-')) p++;
+    if (p >= pEnd || !isdigit((unsigned char)*p)) return -1;
+    while (p < pEnd && isdigit((unsigned char)*p)) p++;
+  }
+
+  len = (int)(p - pReader->p);
+  pReader->p = p;
+  return len;
+} // End of jsonReadNumber()
+
+
+/********************************************************************
+  jsonSkipValue()
+
+  Parameters: (in)  Reader at a value
+  Returns:    0 = ok, -1 = syntax error
+
+  Description:
+  Moves the reader past a value of any type.
+
+********************************************************************/
+static int jsonSkipValue(JSON_READER* pReader) {
+  static const char* const literals[] = { "true", "false", "null" };
+  size_t i, len;
+
+  if (pReader->p >= pReader->pEnd) return -1;
+  switch (*pReader->p) {
+    case '"': return jsonReadString(pReader, NULL, 0) < 0 ? -1 : 0;
+    case '{': return jsonReadObject(pReader, NULL, 0, NULL, false, NULL);
+    case '[': return jsonReadArray(pReader, NULL, NULL);
+    default:  break;
+  }
+
+  for (i = 0; i < sizeof(literals) / sizeof(literals[0]); i++) {
+    len = strlen(literals[i]);
+    if ((size_t)(pReader->pEnd - pReader->p) >= len && 0 == memcmp(pReader->p, literals[i], len)) {
+      pReader->p += len;
+      return 0;
+    }
+  }
+  return jsonReadNumber(pReader) < 0 ? -1 : 0;
+} // End of jsonSkipValue()
+
+
+/********************************************************************
+  jsonReadField()
+
+  Parameters: (in)  Reader at a value
+              (in)  Field of the member
+              (out) Record
+  Returns:    1 = stored, 0 = other type, skipped, -1 = syntax error
+
+  Description:
+  Stores a member value into its field of the record.
+
+********************************************************************/
+static int jsonReadField(JSON_READER* pReader, const JSON_FIELD* pField, void* pRecord) {
+  char*       pDst = (char*)pRecord + pField->offset;
+  const char* pStart = pReader->p;
+  char        number[64];
+  double      value;
+  int         len;
+  bool        isNumber = (*pStart == '-' || isdigit((unsigned char)*pStart));
+
+  switch (pField->type) {
+    case JSON_FIELD_STRING:
+    case JSON_FIELD_TEXT:
+      if (*pStart == '"') return jsonReadString(pReader, pDst, pField->size) < 0 ? -1 : 1;
+      if (JSON_FIELD_TEXT == pField->type && isNumber) {
+        if ((len = jsonReadNumber(pReader)) < 0) return -1;
+        if ((size_t)len >= pField->size) len = (int)pField->size - 1;
+        memcpy(pDst, pStart, len);
+        pDst[len] = 0;
+        return 1;
+      }
+      break;
+
+    case JSON_FIELD_INT:
+      if (!isNumber) break;
+      if ((len = jsonReadNumber(pReader)) < 0) return -1;
+      if ((size_t)len >= sizeof(number)) return 0;            // Not a sensible int
+      memcpy(number, pStart, len);
+      number[len] = 0;
+      value = strtod(number, NULL);
+      *(int*)pDst = (value >= INT_MAX) ? INT_MAX : (value <= INT_MIN) ? INT_MIN : (int)value;
+      return 1;
+
+    case JSON_FIELD_ARRAY:
+      if (*pStart == '[') return jsonReadArray(pReader, pField, pRecord) < 0 ? -1 : 1;
+      break;
+  }
+
+  return jsonSkipValue(pReader) < 0 ? -1 : 0;
+} // End of jsonReadField()
+
+
+/********************************************************************
+  jsonReadArray()
+
+  Parameters: (in)  Reader at the opening bracket
+              (in)  ARRAY field, NULL = skip the array
+              (out) Record
+  Returns:    0 = ok, -1 = syntax error
+
+  Description:
+  Reads object elements into the element records of an ARRAY field
+  until it is full. Elements without the required members and other
+  values are skipped.
+
+********************************************************************/
+static int jsonReadArray(JSON_READER* pReader, const JSON_FIELD* pField, void* pRecord) {
+  int*          pCount = pField ? (int*)((char*)pRecord + pField->countOffset) : NULL;
+  char*         pItem;
+  unsigned int  found;
+
+  if (++pReader->depth > JSON_EXTRACT_MAX_DEPTH) return -1;
+  pReader->p++;
+  jsonSkipSpace(pReader);
+  if (pReader->p < pReader->pEnd && *pReader->p == ']') {
+    pReader->p++;
+    pReader->depth--;
+    return 0;
+  }
+
+  for (;;) {
+    jsonSkipSpace(pReader);
+    if (pReader->p >= pReader->pEnd) return -1;
+
+    if (pCount && *pCount < pField->maxCount && *pReader->p == '{') {
+      pItem = (char*)pRecord + pField->offset + (size_t)*pCount * pField->size;
+      memset(pItem, 0x00, pField->size);
+      if (jsonReadObject(pReader, pField->pItems, pField->numItems, pItem, false, &found)) return -1;
+      if ((found & pField->required) == pField->required) (*pCount)++;
+    } else if (jsonSkipValue(pReader)) {
+      return -1;
+    }
+
+    jsonSkipSpace(pReader);
+    if (pReader->p >= pReader->pEnd) return -1;
+    if (*pReader->p == ']') break;
+    if (*pReader->p++ != ',') return -1;
+  } // End for
+
+  pReader->p++;
+  pReader->depth--;
+  return 0;
+} // End of jsonReadArray()
+
+
+/********************************************************************
+  jsonReadObject()
+
+  Parameters: (in)  Reader at the opening brace
+              (in)  Field table, NULL = skip the object
+              (in)  Number of fields
+              (out) Record
+              (in)  true = return once every field is found
+              (out) Bits of the fields found, may be NULL
+  Returns:    0 = ok, -1 = syntax error
+
+  Description:
+  Reads the members of an object into the fields of a record.
+
+********************************************************************/
+static int jsonReadObject(JSON_READER* pReader, const JSON_FIELD* pFields, int numFields, void* pRecord, bool stopEarly, unsigned int* pFound) {
+  char          key[64];
+  unsigned int  found = 0;
+  unsigned int  all = (1u << numFields) - 1;
+  int           keyLen, i, rc;
+
+  if (numFields > JSON_EXTRACT_MAX_FIELDS || ++pReader->depth > JSON_EXTRACT_MAX_DEPTH) return -1;
+  pReader->p++;
+  jsonSkipSpace(pReader);
+  if (pReader->p < pReader->pEnd && *pReader->p == '}') {
+    pReader->p++;
+    pReader->depth--;
+    if (pFound) *pFound = 0;
+    return 0;
+  }
+
+  for (;;) {
+    jsonSkipSpace(pReader);
+    if (pReader->p >= pReader->pEnd || *pReader->p != '"') return -1;
+    keyLen = jsonReadString(pReader, numFields ? key : NULL, sizeof(key));
+    if (keyLen < 0) return -1;
+    jsonSkipSpace(pReader);
+    if (pReader->p >= pReader->pEnd || *pReader->p++ != ':') return -1;
+    jsonSkipSpace(pReader);
+    if (pReader->p >= pReader->pEnd) return -1;
+
+    // First member of each name counts. Longer keys than the buffer match no field.
+    for (i = 0; i < numFields; i++) {
+      if (!(found & (1u << i)) && (size_t)keyLen < sizeof(key) && 0 == strcmp(key, pFields[i].pName)) break;
+    }
+    if (i < numFields) {
+      rc = jsonReadField(pReader, &pFields[i], pRecord);
+      if (rc < 0) return -1;
+      if (rc > 0) found |= 1u << i;
+      if (stopEarly && found == all) break;
+    } else if (jsonSkipValue(pReader)) {
+      return -1;
+    }
+
+    jsonSkipSpace(pReader);
+    if (pReader->p >= pReader->pEnd) return -1;
+    if (*pReader->p == '}') {
+      pReader->p++;
+      break;
+    }
+    if (*pReader->p++ != ',') return -1;
+  } // End for
+
+  pReader->depth--;
+  if (pFound) *pFound = found;
+  return 0;
+} // End of jsonReadObject()
+
+
+/********************************************************************
+  json_extract()
+
+  Parameters: (in)  JSON text
+              (in)  Length of the text
+              (in)  Field table
+              (in)  Number of fields
+              (out) Record
+  Returns:    Bit n set = field n found, -1 = not a JSON object or
+              a syntax error
+
+  Description:
+  Fills a fixed record from a JSON object in a single pass without
+  building a document. Stops reading as soon as every field of the
+  table has been found, so the rest of the text is not validated.
+
+********************************************************************/
+int json_extract(const char* pJson, size_t length, const JSON_FIELD* pFields, int numFields, void* pRecord) {
+  JSON_READER   reader;
+  unsigned int  found;
+
+  reader.p = pJson;
+  reader.pEnd = pJson + length;
+  reader.depth = 0;
+
+  jsonSkipSpace(&reader);
+  if (reader.p >= reader.pEnd || *reader.p != '{') return -1;
+  if (jsonReadObject(&reader, pFields, numFields, pRecord, true, &found)) return -1;
+  return (int)found;
+} // End of json_extract()
+
+
+/********************************************************************
+  jsonPut()
+
+  Parameters: (in)  Writer
+              (in)  Text
+              (in)  Length of the text
+  Returns:    void
+
+  Description:
+  Appends raw text. Always leaves room for the terminating zero.
+
+********************************************************************/
+static void jsonPut(JSON_WRITER* pWriter, const char* pText, size_t length) {
+  if (pWriter->overflow || pWriter->len + length >= pWriter->size) {
+    pWriter->overflow = 1;
+    return;
+  }
+  memcpy(pWriter->pBuf + pWriter->len, pText, length);
+  pWriter->len += length;
+  pWriter->pBuf[pWriter->len] = 0;
+} // End of jsonPut()
+
+
+/********************************************************************
+  jsonPutString()
+
+  Parameters: (in)  Writer
+              (in)  Zero terminated text
+  Returns:    void
+
+  Description:
+  Appends a quoted JSON string. Quotes, backslashes and control
+  characters are escaped; other bytes, UTF-8 included, are copied.
+
+********************************************************************/
+static void jsonPutString(JSON_WRITER* pWriter, const char* pText) {
+  const char* pRun = pText;
+  char        esc[8];
+
+  jsonPut(pWriter, "\"", 1);
+  for (; *pText; pText++) {
+    unsigned char c = (unsigned char)*pText;
+    if (c >= 0x20 && c != '"' && c != '\\') continue;
+
+    jsonPut(pWriter, pRun, pText - pRun);
+    switch (c) {
+      case '"':  jsonPut(pWriter, "\\\"", 2); break;
+      case '\\': jsonPut(pWriter, "\\\\", 2); break;
+      case '\n': jsonPut(pWriter, "\\n", 2);  break;
+      case '\r': jsonPut(pWriter, "\\r", 2);  break;
+      case '\t': jsonPut(pWriter, "\\t", 2);  break;
+      default:
+        snprintf(esc, sizeof(esc), "\\u%04x", c);
+        jsonPut(pWriter, esc, 6);
+        break;
+    }
+    pRun = pText + 1;
+  }
+  jsonPut(pWriter, pRun, pText - pRun);
+  jsonPut(pWriter, "\"", 1);
+} // End of jsonPutString()
+
+
+/********************************************************************
+  jsonPutName()
+
+  Parameters: (in)  Writer
+              (in)  Member name, NULL for an array element
+  Returns:    void
+
+  Description:
+  Writes the separator and the member name of the next value.
+
+********************************************************************/
+static void jsonPutName(JSON_WRITER* pWriter, const char* pName) {
+  if (pWriter->comma) jsonPut(pWriter, ",", 1);
+  pWriter->comma = 1;
+  if (pName) {
+    jsonPutString(pWriter, pName);
+    jsonPut(pWriter, ":", 1);
+  }
+} // End of jsonPutName()
+
+
+/********************************************************************
+  json_writerInit()
+
+  Parameters: (in)  Writer
+              (in)  Output buffer
+              (in)  Buffer size
+  Returns:    void
+
+  Description:
+  Starts a JSON object. Produces the same compact text as
+  cJSON_PrintUnformatted(), without allocating.
+
+********************************************************************/
+void json_writerInit(JSON_WRITER* pWriter, char* pBuf, size_t size) {
+  pWriter->pBuf = pBuf;
+  pWriter->size = size;
+  pWriter->len = 0;
+  pWriter->comma = 0;
+  pWriter->overflow = 0;
+  jsonPut(pWriter, "{", 1);
+} // End of json_writerInit()
+
+
+/********************************************************************
+  json_writeString()
+
+  Parameters: (in)  Writer
+              (in)  Member name, NULL for an array element
+              (in)  Value
+  Returns:    void
+
+  Description:
+  Adds a string value.
+
+********************************************************************/
+void json_writeString(JSON_WRITER* pWriter, const char* pName, const char* pValue) {
+  jsonPutName(pWriter, pName);
+  jsonPutString(pWriter, pValue);
+} // End of json_writeString()
+
+
+/********************************************************************
+  json_writeNumber()
+
+  Parameters: (in)  Writer
+              (in)  Member name, NULL for an array element
+              (in)  Value
+  Returns:    void
+
+  Description:
+  Adds an integer value.
+
+********************************************************************/
+void json_writeNumber(JSON_WRITER* pWriter, const char* pName, long value) {
+  char number[24];
+  int  n;
+
+  jsonPutName(pWriter, pName);
+  n = snprintf(number, sizeof(number), "%ld", value);
+  jsonPut(pWriter, number, n);
+} // End of json_writeNumber()
+
+
+/********************************************************************
+  json_writeArrayBegin()
+
+  Parameters: (in)  Writer
+              (in)  Member name
+  Returns:    void
+
+  Description:
+  Opens an array.
+
+********************************************************************/
+void json_writeArrayBegin(JSON_WRITER* pWriter, const char* pName) {
+  jsonPutName(pWriter, pName);
+  jsonPut(pWriter, "[", 1);
+  pWriter->comma = 0;
+} // End of json_writeArrayBegin()
+
+
+/********************************************************************
+  json_writeArrayEnd()
+
+  Parameters: (in)  Writer
+  Returns:    void
+
+  Description:
+  Closes the array.
+
+********************************************************************/
+void json_writeArrayEnd(JSON_WRITER* pWriter) {
+  jsonPut(pWriter, "]", 1);
+  pWriter->comma = 1;
+} // End of json_writeArrayEnd()
+
+
+/********************************************************************
+  json_writeObjectBegin()
+
+  Parameters: (in)  Writer
+              (in)  Member name, NULL for an array element
+  Returns:    void
+
+  Description:
+  Opens a nested object.
+
+********************************************************************/
+void json_writeObjectBegin(JSON_WRITER* pWriter, const char* pName) {
+  jsonPutName(pWriter, pName);
+  jsonPut(pWriter, "{", 1);
+  pWriter->comma = 0;
+} // End of json_writeObjectBegin()
+
+
+/********************************************************************
+  json_writeObjectEnd()
+
+  Parameters: (in)  Writer
+  Returns:    void
+
+  Description:
+  Closes the nested object.
+
+********************************************************************/
+void json_writeObjectEnd(JSON_WRITER* pWriter) {
+  jsonPut(pWriter, "}", 1);
+  pWriter->comma = 1;
+} // End of json_writeObjectEnd()
+
+
+/********************************************************************
+  json_writerFinish()
+
+  Parameters: (in)  Writer
+  Returns:    Length of the text, -1 = buffer too small
+
+  Description:
+  Closes the object.
+
+********************************************************************/
+int json_writerFinish(JSON_WRITER* pWriter) {
+  jsonPut(pWriter, "}", 1);
+  return pWriter->overflow ? -1 : (int)pWriter->len;
+} // End of json_writerFinish()
+
+
+/********************************************************************
+  monotonic_ns()
+
+  Parameters: void
+  Returns:    Monotonic time in nanoseconds
+
+  Description:
+  Clock for measuring intervals. Not affected by wall clock changes.
+
+********************************************************************/
+uint64_t monotonic_ns(void) {
+#if defined(_MSC_VER)
+  static LARGE_INTEGER freq;
+  LARGE_INTEGER        now;
+
+  if (!freq.QuadPart) QueryPerformanceFrequency(&freq);
+  QueryPerformanceCounter(&now);
+  return (uint64_t)((double)now.QuadPart * 1e9 / (double)freq.QuadPart);
+#else
+  struct timespec ts;
+
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t)ts.tv_sec * 1000000000ULL + (uint64_t)ts.tv_nsec;
+#endif
+} // End of monotonic_ns()
+
+
+/********************************************************************
+  latency_record()
+
+  Parameters: (in)  Histogram
+              (in)  Sample in ns
+  Returns:    void
+
+  Description:
+  Counts the sample in bucket n where 2^(n-1) <= ns < 2^n. Relaxed
+  atomics only; readers see an approximate snapshot.
+
+********************************************************************/
+void latency_record(LATENCY_HIST* pHist, uint64_t ns) {
+  unsigned long long max = atomic_load_explicit(&pHist->maxNs, memory_order_relaxed);
+  int                n;
+
+#if defined(__GNUC__)
+  n = ns ? 64 - __builtin_clzll(ns) : 0;
+#else
+  uint64_t v;
+  for (n = 0, v = ns; v; v >>= 1) n++;
+#endif
+  if (n >= LATENCY_BUCKETS) n = LATENCY_BUCKETS - 1;
+
+  atomic_fetch_add_explicit(&pHist->bucket[n], 1, memory_order_relaxed);
+  atomic_fetch_add_explicit(&pHist->count, 1, memory_order_relaxed);
+  while (ns > max && !atomic_compare_exchange_weak_explicit(&pHist->maxNs, &max, ns, memory_order_relaxed, memory_order_relaxed));
+} // End of latency_record()
+
+
+/********************************************************************
+  latency_percentile()
+
+  Parameters: (in)  Histogram
+              (in)  Percentile 0-100
+  Returns:    Upper bound of the percentile in ns
+
+  Description:
+  Walks the buckets until the requested share of samples is covered.
+  Capped to the largest sample seen.
+
+********************************************************************/
+uint64_t latency_percentile(LATENCY_HIST* pHist, double percent) {
+  unsigned long count = atomic_load_explicit(&pHist->count, memory_order_relaxed);
+  uint64_t      max = atomic_load_explicit(&pHist->maxNs, memory_order_relaxed);
+  unsigned long target, seen = 0;
+  int           n;
+
+  if (0 == count) return 0;
+  target = (unsigned long)(count * percent / 100.0 + 0.5);
+  if (target < 1) target = 1;
+
+  for (n = 0; n < LATENCY_BUCKETS; n++) {
+    seen += atomic_load_explicit(&pHist->bucket[n], memory_order_relaxed);
+    if (seen >= target) break;
+  }
+  if (n >= 63) return max;
+  return ((1ULL << n) - 1 < max) ? (1ULL << n) - 1 : max;
+} // End of latency_percentile()
+
+
+/********************************************************************
+  latency_log()
+
+  Parameters: (in)  dbg_out() category
+              (in)  Label
+              (in)  Histogram
+  Returns:    void
+
+  Description:
+  Prints one summary line of a histogram in microseconds.
+
+********************************************************************/
+void latency_log(int type, const char* pName, LATENCY_HIST* pHist) {
+  dbg_out(type, "%-40s n=%-8lu p50 %8.1f  p95 %8.1f  p99 %8.1f  max %8.1f us\n", pName,
+          atomic_load_explicit(&pHist->count, memory_order_relaxed),
+          latency_percentile(pHist, 50.0) / 1000.0,
+          latency_percentile(pHist, 95.0) / 1000.0,
+          latency_percentile(pHist, 99.0) / 1000.0,
+          atomic_load_explicit(&pHist->maxNs, memory_order_relaxed) / 1000.0);
+} // End of latency_log()
+
+
 #if defined(_MSC_VER)
 /********************************************************************
   gettimeofday()
@@ -371,7 +1146,9 @@ void dbg_out(int type, const char* format, ...) {
   Returns:    void.
 
   Description:
-  Sends MQTT messages from shared buffer whenever triggered.
+  Publishes the outbound MQTT queue. Sleeps until a message can be
+  sent. With --directPublish the producers publish themselves and
+  this thread only sends what the in-flight window held back.
 
 ********************************************************************/
 #if defined(_MSC_VER)
@@ -380,164 +1157,407 @@ void dbg_out(int type, const char* format, ...) {
   void* mqtt_sender(void* mqttClient)
 #endif
 {
-  int  iRet;
-  long mqttMaxDuration = 0;
-  long mqttDuration;
+  dbg_out( DBG_MQTT,"MQTT sender thread started.\n" );
+  while(1){
+    mqttOutbox_waitReady();
+
+    dbg_out( DBG_MQTT,"MQTT sender thread activated. %u queued.\n", mqttOutbox_depth() );
+    mqtt_flushOutbox();
+
+  }  // End while(1)
   #if defined(_MSC_VER)
-    SYSTEMTIME mqttStartTime;
-    SYSTEMTIME mqttEndTime;
+    return 0;
   #else
-    struct timeval mqttStartTime;
-    struct timeval mqttEndTime;
+    return NULL;
   #endif
-  int urgency;
+}  // End of mqtt_sender()
 
 
-  dbg_out( DBG_MQTT,"MQTT sender thread started.\n" );
-  while(1){
-    // Wait for data to be sent.
-    
-    // Lock the mqtt send mutex
-    //pthread_mutex_lock( &pGlobalData->mqttSendMutex );
-    iRet = request_mutex_lock(&pGlobalData->mqttSendMutex);
-    if (iRet != 0) {
-      dbg_out(DBG_ERROR, "MQTT sender mutex lock return value:%d\n", iRet);
-    }
-    else {
-      dbg_out(DBG_MQTT, "Mutex locked for sender thread.\n");
-    }
+/********************************************************************
+  publishMessage()
 
-    // If conditional variable signalled while waiting for mutex lock above, the flag "dataSent" is zero
-    // In this case no waiting for conditional variable should be done
-    if( pGlobalData->mqttSharedData.dataSent == 0 ){ 
-      dbg_out( DBG_MQTT,"MQTT sender thread detects unsent data block. Not waiting for conditional variable.\n" );
-    }else{
-      // Wait for conditional variable (this unlocks the mutex while it waits)
-      dbg_out( DBG_MQTT,"MQTT sender thread ready to send again. Waiting for a new post...\n" );
-      // pthread_cond_wait( &pGlobalData->mqttSend_cv, &pGlobalData->mqttSendMutex ); 
-      #if defined(_MSC_VER)
-        dbg_out(DBG_MQTT, "Conditional variable %x wait. Mutex %x\n", pGlobalData->mqttSend_cv, &pGlobalData->mqttSendMutex);
-        SleepConditionVariableCS(&pGlobalData->mqttSend_cv, &pGlobalData->mqttSendMutex, INFINITE);
-      #else
-        iRet = pthread_cond_wait(&pGlobalData->mqttSend_cv, &pGlobalData->mqttSendMutex);
-      #endif
-    }
+  Parameters: (in)  Outbox slot
+  Returns:    0=Success, negative=error
 
-    dbg_out( DBG_MQTT,"MQTT sender thread activated.\n" );
-
-    // Compose the message based on data in shared memory
-    dbg_out( DBG_MQTT,"Posting topic [%s] with payload [%s]\n",
-             pGlobalData->mqttSharedData.pTopic,
-             pGlobalData->mqttSharedData.pPayload );
- 
-    #if defined(_MSC_VER)
-      GetSystemTime(&mqttStartTime);
-    #else
-      gettimeofday(&mqttStartTime, NULL);
-    #endif
-
-    iRet = mosquitto_publish( pGlobalData->mosquittoClient,NULL, pGlobalData->mqttSharedData.pTopic, 
-                              strlen(pGlobalData->mqttSharedData.pPayload), pGlobalData->mqttSharedData.pPayload,2,false );
-    if( MOSQ_ERR_SUCCESS != iRet ){
-      dbg_out( DBG_ERROR,"MQTT publish error: %s\n", mosquitto_strerror(iRet) );
-    }
+  Description:
+  Publishes one outbox message and hands the slot back to the outbox
+  with its mid. Called by mqtt_flushOutbox(). The payload goes to
+  libmosquitto straight from the slot buffer or the static payload.
+  While the broker is not connected the message goes to the offline
+  spool instead, if its topic has a spool TTL.
 
+********************************************************************/
+static int publishMessage(MQTT_OUTMSG* pMsg) {
+  uint64_t startNs;
+  int      mid = 0;
+  int      iRet;
+
+  dbg_out( DBG_MQTT,"Posting topic [%s] with payload [%.*s]\n", pMsg->pTopic, (int)pMsg->payloadLen, pMsg->pData );
+
+  if( !pGlobalData->mqttConnected && 0 == spoolMessage( pMsg ) ) return 0;
+
+  startNs = monotonic_ns();
+  mqttStats_recordQueue( pMsg->policy, startNs - pMsg->committedNs );
+  iRet = mosquitto_publish( pGlobalData->mosquittoClient, &mid, pMsg->pTopic, 
+                            (int)pMsg->payloadLen, pMsg->pData, pMsg->qos, pMsg->retain );
+  mqttStats_recordCall( pMsg->policy, monotonic_ns() - startNs, MOSQ_ERR_SUCCESS == iRet );
+  if( ( MOSQ_ERR_NO_CONN == iRet || MOSQ_ERR_CONN_LOST == iRet ) && 0 == spoolMessage( pMsg ) ) return 0;
+  if( MOSQ_ERR_SUCCESS != iRet ){
+    dbg_out( DBG_ERROR,"MQTT publish error: %s\n", mosquitto_strerror(iRet) );
+  }
+  if( MOSQ_ERR_SUCCESS == iRet ) gateRecord( pMsg->policy, pMsg->pTopic, pMsg->pData, pMsg->payloadLen );
+  mqttOutbox_done( pMsg, mid, startNs, MOSQ_ERR_SUCCESS == iRet );
 
-    #if defined(_MSC_VER)
-      GetSystemTime(&mqttEndTime);
-      mqttDuration = ((mqttEndTime.wMilliseconds) + (mqttEndTime.wSecond * 1000) + (mqttEndTime.wMinute * 60000) +
-        (mqttEndTime.wHour * 60 * 60000) + (mqttEndTime.wDay * 24 * 60 * 60000) + (mqttEndTime.wMonth * 30 * 24 * 60 * 60000)) -
-        ((mqttStartTime.wMilliseconds) + (mqttStartTime.wSecond * 1000) + (mqttStartTime.wMinute * 60000) +
-          (mqttStartTime.wHour * 60 * 60000) + (mqttStartTime.wDay * 24 * 60 * 60000) + (mqttStartTime.wMonth * 30 * 24 * 60 * 60000));
-    #else
-      gettimeofday(&mqttEndTime, NULL);
-      mqttDuration = ((mqttEndTime.tv_sec * 1000000) + (mqttEndTime.tv_usec)) -
-        ((mqttStartTime.tv_sec * 1000000) + (mqttStartTime.tv_usec));
-    #endif
+  return ( MOSQ_ERR_SUCCESS == iRet ) ? 0 : -1;
+}  // End of publishMessage()
 
-    if (mqttDuration > mqttMaxDuration)mqttMaxDuration = mqttDuration;
-    urgency = DBG_MQTT;
-    if (mqttDuration > 1000000 || (mqttDuration == mqttMaxDuration && mqttDuration > 25)) urgency = DBG_NOTE;
-    dbg_out(urgency, "MQTT publish took %d u/mSecs. Max so far is %d u/mSecs.\n", mqttDuration, mqttMaxDuration);
 
-    if( pGlobalData->mqttSharedData.dataSent == 0)dbg_out( DBG_MQTT,"Setting data sent -flag TRUE\n" );
-    pGlobalData->mqttSharedData.dataSent=1;
+/********************************************************************
+  spoolMessage()
 
-    // Unlock the mutex
-    //pthread_mutex_unlock( &pGlobalData->mqttSendMutex );
-    release_mutex_lock(&pGlobalData->mqttSendMutex);
+  Parameters: (in)  Outbox slot
+  Returns:    0=Spooled and the slot handed back, negative=not spooled
 
-  }  // End while(1)
-  #if defined(_MSC_VER)
-    return 0;
-  #else
-    return NULL;
-  #endif
-}  // End of mqtt_sender()
+  Description:
+  Moves an unpublishable message to the offline spool with the
+  spool TTL of its topic. Messages of bargeIn topics are not spooled:
+  mqttOutbox_bargeIn() cannot reach them there, and they would be
+  replayed into a later interaction.
+
+********************************************************************/
+static int spoolMessage(MQTT_OUTMSG* pMsg) {
+  unsigned int ttlMs;
+
+  if( !mqttSpool_enabled() || pMsg->policy < 0 ) return -1;
+  if( mqttPublishPolicyRegister[pMsg->policy].bargeIn ) return -1;
+  ttlMs = mqttPublishPolicyRegister[pMsg->policy].spoolTtlMs;
+  if( 0 == ttlMs ) return -1;
+  if( mqttSpool_append( pMsg->pTopic, pMsg->pData, pMsg->payloadLen, pMsg->qos, pMsg->retain, ttlMs ) ) return -1;
+
+  dbg_out( DBG_MQTT,"MQTT not connected. %s spooled.\n", pMsg->pTopic );
+  mqttOutbox_spooled( pMsg );
+  return 0;
+}  // End of spoolMessage()
 
 
 /********************************************************************
-  getMQTTsendAccess()
+  replayMessage()
 
-  Parameters: (in)  pointer pthread_mutex_t
-              (in)  calling function name (__FUNCTION__)
-  Returns:    0=Success, negative=error
+  Parameters: (in)  Topic
+              (in)  Payload
+              (in)  Payload length
+              (in)  QoS
+              (in)  Retain flag
+  Returns:    0=Published, nonzero=stop the replay
 
   Description:
-  Gets a mutex for protected MQTT data block.
-  If the block contains unsent data, releases the lock and tries
-  again after a short while.
-  Returns once mutex is got for "empty" data block
+  Publishes one spooled message within the in-flight window.
 
 ********************************************************************/
-int getMQTTsendAccess(MQTT_SEND_MTX* pMutex, const char* pCaller) {
-  int i = 100;
+static int replayMessage(const char* pTopic, const char* pPayload, size_t payloadLen, int qos, bool retain) {
+  uint64_t startNs;
+  int      policy = findPublishPolicy( pTopic );
+  int      mid = 0;
+  int      iRet;
+
+  if( !pGlobalData->mqttConnected ) return 1;
+  if( !mqttOutbox_takeWindow( qos ) ) return 1;   // Continued when acks open the window
+
+  startNs = monotonic_ns();
+  iRet = mosquitto_publish( pGlobalData->mosquittoClient, &mid, pTopic, (int)payloadLen, pPayload, qos, retain );
+  mqttStats_recordCall( policy, monotonic_ns() - startNs, MOSQ_ERR_SUCCESS == iRet );
+  mqttOutbox_track( policy, qos, mid, startNs, MOSQ_ERR_SUCCESS == iRet );
+  if( MOSQ_ERR_SUCCESS != iRet ){
+    dbg_out( DBG_ERROR,"MQTT replay of %s failed: %s\n", pTopic, mosquitto_strerror(iRet) );
+    return -1;
+  }
+  gateRecord( policy, pTopic, pPayload, payloadLen );
+  return 0;
+}  // End of replayMessage()
 
-  dbg_out(DBG_MQTT, "getMQTTsendAccess(%x) asked by %s()\n", pMutex, pCaller);
-  // Loop until have "empty" data block or failed for 100 times.
-  while (i) {
-    request_mutex_lock(pMutex);
-    if (pGlobalData->mqttSharedData.dataSent == 1) {
-      dbg_out(DBG_MQTT, "getMQTTsendAccess() mutex locked for %s().\n", pCaller);
-      return 0;
+
+/********************************************************************
+  findPublishPolicy()
+
+  Parameters: (in)  Topic
+  Returns:    Index of the publish policy of the topic
+
+  Description:
+  First matching entry of mqttPublishPolicyRegister. The register
+  ends with a catch-all entry.
+
+********************************************************************/
+static int findPublishPolicy(const char* pTopic) {
+  size_t i;
+
+  for (i = 0; i < NUM_PUBLISH_POLICIES - 1; i++) {
+    if (mqtt_topic_compare(mqttPublishPolicyRegister[i].topic, pTopic)) break;
+  }
+  return (int)i;
+}  // End of findPublishPolicy()
+
+
+/********************************************************************
+  gateMessage()
+
+  Parameters: (in)  Filled outbox slot
+  Returns:    GATE_PASS, GATE_DUPLICATE or GATE_RATE_LIMITED
+
+  Description:
+  Applies dedupMs and the ratePerSec/burst token bucket of the
+  topic's publish policy. A message byte for byte equal to the last
+  published one of the same policy entry within dedupMs is a
+  duplicate, unless the producer marked it repeatable. Duplicates
+  do not take a token. The last message is recorded by gateRecord()
+  only once it reaches the client, so a message that expires,
+  is cancelled or is suppressed never blocks its successor.
+
+********************************************************************/
+static int gateMessage(const MQTT_OUTMSG* pMsg) {
+  const mqtt_publish_policy* pPolicy;
+  PUBLISH_GATE_T*            pGate;
+  size_t                     topicSize;
+  uint64_t                   now;
+  int                        gate = GATE_PASS;
+
+  if (pMsg->policy < 0 || pMsg->policy >= (int)NUM_PUBLISH_POLICIES) return GATE_PASS;
+  pPolicy = &mqttPublishPolicyRegister[pMsg->policy];
+  if (0 == pPolicy->dedupMs && 0 == pPolicy->ratePerSec) return GATE_PASS;
+  pGate = &publishGate[pMsg->policy];
+  topicSize = strlen(pMsg->pTopic) + 1;
+  now = monotonic_ns();
+
+  pthread_mutex_lock(&gateMutex);
+  if (pPolicy->dedupMs && !pMsg->repeatable && pGate->lastNs &&
+      now - pGate->lastNs < (uint64_t)pPolicy->dedupMs * 1000000ULL &&
+      topicSize + pMsg->payloadLen == pGate->lastSize &&
+      0 == memcmp(pGate->pLast, pMsg->pTopic, topicSize) &&
+      0 == memcmp(pGate->pLast + topicSize, pMsg->pData, pMsg->payloadLen)) {
+    gate = GATE_DUPLICATE;
+  } else if (pPolicy->ratePerSec) {
+    if (0 == pGate->refillNs) pGate->milliTokens = (uint64_t)pPolicy->burst * 1000;
+    else pGate->milliTokens += (now - pGate->refillNs) * pPolicy->ratePerSec / 1000000;
+    if (pGate->milliTokens > (uint64_t)pPolicy->burst * 1000) pGate->milliTokens = (uint64_t)pPolicy->burst * 1000;
+    pGate->refillNs = now;
+    if (pGate->milliTokens < 1000) gate = GATE_RATE_LIMITED;
+    else pGate->milliTokens -= 1000;
+  }
+  pthread_mutex_unlock(&gateMutex);
+
+  return gate;
+}  // End of gateMessage()
+
+
+/********************************************************************
+  gateRecord()
+
+  Parameters: (in)  Index of the publish policy
+              (in)  Topic
+              (in)  Payload
+              (in)  Payload length
+  Returns:    void
+
+  Description:
+  Keeps a copy of a message handed to the client, for the dedupMs
+  check of gateMessage(). Policies without dedupMs keep nothing.
+  If the copy cannot be allocated the next message is not checked.
+
+********************************************************************/
+static void gateRecord(int policy, const char* pTopic, const char* pPayload, size_t payloadLen) {
+  PUBLISH_GATE_T* pGate;
+  char*           pNew;
+  size_t          topicSize;
+
+  if (policy < 0 || policy >= (int)NUM_PUBLISH_POLICIES) return;
+  if (0 == mqttPublishPolicyRegister[policy].dedupMs) return;
+  pGate = &publishGate[policy];
+  topicSize = strlen(pTopic) + 1;
+
+  pthread_mutex_lock(&gateMutex);
+  if (topicSize + payloadLen > pGate->lastCap) {
+    pNew = realloc(pGate->pLast, topicSize + payloadLen);
+    if (NULL == pNew) {
+      pGate->lastNs = 0;
+      pthread_mutex_unlock(&gateMutex);
+      return;
     }
-    // Buffer is occupied. Release mutex and wait for the buffer to be consumed
-    release_mutex_lock(pMutex);
-    #if defined(_MSC_VER)
-      Sleep(100); // Wait 100ms
-    #else
-      usleep(100000U); // Wait 100ms
-    #endif
-    i--;
+    pGate->pLast = pNew;
+    pGate->lastCap = topicSize + payloadLen;
+  }
+  memcpy(pGate->pLast, pTopic, topicSize);
+  memcpy(pGate->pLast + topicSize, pPayload, payloadLen);
+  pGate->lastSize = topicSize + payloadLen;
+  pGate->lastNs = monotonic_ns();
+  pthread_mutex_unlock(&gateMutex);
+}  // End of gateRecord()
+
+
+/********************************************************************
+  mqtt_resetDedup()
+
+  Parameters: void
+  Returns:    void
+
+  Description:
+  Forgets the last published message of the bargeIn topics. Called
+  by mqttOutbox_bargeIn(): an answer of the new interaction must be
+  spoken even if it repeats the one just cut off.
+
+********************************************************************/
+void mqtt_resetDedup(void) {
+  size_t i;
+
+  pthread_mutex_lock(&gateMutex);
+  for (i = 0; i < NUM_PUBLISH_POLICIES; i++) {
+    if (mqttPublishPolicyRegister[i].bargeIn) publishGate[i].lastNs = 0;
   }
-  pGlobalData->mutexError++;
-  dbg_out(DBG_ERROR, "%s(%x) FAILED to get mutex lock for %s()\n",__FUNCTION__, pMutex, pCaller);
-  return -1;
+  pthread_mutex_unlock(&gateMutex);
+}  // End of mqtt_resetDedup()
 
-}  // End of getMQTTsendAccess()
+
+/********************************************************************
+  mqtt_beginPublish()
+
+  Parameters: (in)  Topic
+              (in)  calling function name (__FUNCTION__)
+  Returns:    Outbox slot, NULL = outbox full
+
+  Description:
+  Reserves an outbox slot, writes the topic to it and applies the
+  QoS, retain, lane and expiry of the topic from
+  mqttPublishPolicyRegister. The caller
+  serializes the payload straight into the slot and passes its length
+  to mqtt_endPublish(). Any thread may publish; no lock is held
+  between the two calls.
+
+********************************************************************/
+MQTT_OUTMSG* mqtt_beginPublish(const char* pTopic, const char* pCaller) {
+  const mqtt_publish_policy *pPolicy;
+  MQTT_OUTMSG               *pMsg;
+
+  // In reactor mode nothing else drains the outbox, and mqtt_endPublish() empties it.
+  pMsg = mqttOutbox_reserve( pGlobalData->reactorMode ? 0 : MQTT_OUTBOX_WAIT_MS );
+  if (NULL == pMsg) {
+    pGlobalData->mutexError++;
+    dbg_out(DBG_ERROR, "%s() MQTT outbox full. Dropping %s from %s()\n",__FUNCTION__, pTopic, pCaller);
+    return NULL;
+  }
+  snprintf(pMsg->pTopic, MQTT_SEND_TOPIC_SIZE, "%s", pTopic);
+
+  pMsg->policy = findPublishPolicy(pTopic);
+  pPolicy = &mqttPublishPolicyRegister[pMsg->policy];
+  pMsg->qos = pPolicy->qos;
+  pMsg->retain = pPolicy->retain;
+  pMsg->lane = pPolicy->lane;
+  pMsg->expiresNs = pPolicy->expiryMs ? monotonic_ns() + (uint64_t)pPolicy->expiryMs * 1000000ULL : 0;
+  return pMsg;
+
+}  // End of mqtt_beginPublish()
 
 
 /********************************************************************
-  sendMQTTtopic()
+  mqtt_endPublish()
 
-  Parameters: (in)  pointer pthread_mutex_t
+  Parameters: (in)  Slot from mqtt_beginPublish()
+              (in)  Payload length, negative = cancel
               (in)  calling function name (__FUNCTION__)
-  Returns:    0=Success, negative=error
+  Returns:    0=Success or suppressed, negative=error
 
   Description:
-  Sends data stored in MQTT global data area.
+  Drops the message if it repeats the previous payload of the topic
+  or the topic is over its rate, see gateMessage(). Otherwise
+  commits the slot to the outbox. In reactor mode, and with
+  --directPublish, publishes it right away on the calling thread
+  instead of handing it to mqtt_sender(). libmosquitto's publish is
+  thread safe, so the only cost is waiting for a publish already in
+  progress on another thread.
 
 ********************************************************************/
-int sendMQTTtopic( const char* pCaller ) {
+int mqtt_endPublish(MQTT_OUTMSG* pMsg, int payloadLen, const char* pCaller) {
+  MQTT_PUBLISH_DONE pfDone;
+  void*             pUser;
+  int               gate;
+
+  if (payloadLen < 0) {
+    dbg_out(DBG_ERROR, "%s() %s payload from %s() does not fit. Not sent.\n",__FUNCTION__, pMsg->pTopic, pCaller);
+    mqttOutbox_cancel(pMsg);
+    return -1;
+  }
+  pMsg->payloadLen = (size_t)payloadLen;
+
+  gate = gateMessage(pMsg);
+  if (GATE_PASS != gate) {
+    dbg_out(DBG_MQTT, "%s() %s from %s() %s. Not sent.\n",__FUNCTION__, pMsg->pTopic, pCaller,
+            GATE_DUPLICATE == gate ? "repeats the previous message" : "is over the topic rate");
+    mqttStats_recordSuppressed(pMsg->policy, GATE_DUPLICATE == gate);
+    pfDone = pMsg->pfDone;
+    pUser = pMsg->pUser;
+    mqttOutbox_cancel(pMsg);
+    if (pfDone) pfDone(pUser, 0, MQTT_PUBLISH_SUPPRESSED);
+    return 0;
+  }
 
   dbg_out(DBG_MQTT, "%s() Sending MQTT topic requested by %s\n",__FUNCTION__, pCaller);
-  pGlobalData->mqttSharedData.dataSent = 0;
-  wakeMQTTsender(&pGlobalData->mqttSend_cv);
-
-  // Unlock the mutex
-  release_mutex_lock(&pGlobalData->mqttSendMutex);
+  if (pGlobalData->reactorMode || pGlobalData->directPublish) {
+    // Queue the message to the client now. The reactor or the network thread writes it out.
+    mqttOutbox_commit(pMsg, false);
+    mqtt_flushOutbox();
+  } else {
+    mqttOutbox_commit(pMsg, true);
+  }
   return 0;
-} // End of sendMQTTtopic
+} // End of mqtt_endPublish()
+
+
+/********************************************************************
+  mqtt_flushOutbox()
+
+  Parameters: void
+  Returns:    void
+
+  Description:
+  Replays the offline spool once connected, then publishes every
+  outbox message that can go now, in lane order. Messages held back
+  by the in-flight window stay queued until their acks arrive; then
+  mqtt_sender(), on_publish() or, in reactor mode, the reactor calls
+  this again.
+
+********************************************************************/
+void mqtt_flushOutbox(void) {
+  MQTT_OUTMSG* pMsg;
+
+  pthread_mutex_lock(&publishMutex);
+  if (pGlobalData->mqttConnected && mqttSpool_pending()) {
+    mqttSpool_replay(replayMessage);
+  }
+  while ((pMsg = mqttOutbox_next(0))) {
+    publishMessage(pMsg);
+  }
+  pthread_mutex_unlock(&publishMutex);
+} // End of mqtt_flushOutbox()
+
+
+/********************************************************************
+  mqtt_publishStatic()
+
+  Parameters: (in)  Pre-serialized message
+              (in)  calling function name (__FUNCTION__)
+  Returns:    0=Success, negative=error
+
+  Description:
+  Queues a reference to an immutable payload. Nothing is serialized
+  or copied except the topic.
+
+********************************************************************/
+int mqtt_publishStatic(const MQTT_STATIC_MSG* pStatic, const char* pCaller) {
+  MQTT_OUTMSG *pMsg;
+
+  pMsg = mqtt_beginPublish(pStatic->pTopic, pCaller);
+  if (NULL == pMsg) return -1;
+  pMsg->pData = pStatic->pPayload;
+  pMsg->repeatable = pStatic->repeatable;
+  return mqtt_endPublish(pMsg, (int)pStatic->length, pCaller);
+} // End of mqtt_publishStatic()
 
 
 #if !defined(_MSC_VER)
@@ -15,8 +15,94 @@
 #if !defined(_MSC_VER)
 #include <syslog.h>
 #endif
+#include <stdint.h>
+#include <stdatomic.h>
 #include "actionMain.h"
 
+/********************************************************************
+  DEFINES
+********************************************************************/
+#define LATENCY_BUCKETS                 64          //!< Log2 buckets of a latency histogram. Bucket n counts values below 2^n ns.
+#define JSON_EXTRACT_MAX_FIELDS         16          //!< Most fields in one json_extract() field table
+#define JSON_EXTRACT_MAX_DEPTH          32          //!< Deepest nesting of objects and arrays json_extract() accepts
+
+
+/********************************************************************
+  TYPES
+********************************************************************/
+
+/**
+ * @brief Latency histogram with power of two buckets. Lock-free; any thread may record.
+ * A zero initialized histogram is empty.
+ * 
+ */
+typedef struct
+{
+  atomic_ulong          count;                      //!< Number of samples
+  atomic_ullong         maxNs;                      //!< Largest sample
+  atomic_ulong          bucket[LATENCY_BUCKETS];    //!< Samples per log2 bucket
+}LATENCY_HIST;
+
+
+/**
+ * @brief Writes JSON text into a caller supplied buffer. See json_writerInit().
+ * Nothing is allocated. An overflow is remembered and reported by json_writerFinish().
+ * 
+ */
+typedef struct
+{
+  char                  *pBuf;                      //!< Output buffer
+  size_t                size;                       //!< Size of pBuf
+  size_t                len;                        //!< Bytes written so far
+  int                   comma;                      //!< Nonzero: next member needs a separating comma
+  int                   overflow;                   //!< Nonzero: the text did not fit
+}JSON_WRITER;
+
+
+/**
+ * @brief Value types of json_extract()
+ * 
+ */
+typedef enum
+{
+  JSON_FIELD_STRING,                                //!< String into a char buffer, truncated to size
+  JSON_FIELD_TEXT,                                  //!< String, or a number as written, into a char buffer
+  JSON_FIELD_INT,                                   //!< Number into an int. Fraction dropped, saturated like cJSON valueint.
+  JSON_FIELD_ARRAY                                  //!< Array of objects into an array of records, see pItems
+}JSON_FIELD_TYPE;
+
+
+/**
+ * @brief One member json_extract() stores into a record. A member of another type is skipped.
+ * 
+ */
+typedef struct JSON_FIELD
+{
+  const char            *pName;                     //!< Member name, e.g. JSONKEY_INTENT
+  JSON_FIELD_TYPE       type;                       //!< Value type
+  size_t                offset;                     //!< offsetof() the value in the record
+  size_t                size;                       //!< STRING, TEXT: buffer size. ARRAY: size of one element record.
+  unsigned int          required;                   //!< ARRAY: bits of pItems an element must have to be kept
+  const struct JSON_FIELD *pItems;                  //!< ARRAY: fields of one element object
+  int                   numItems;                   //!< ARRAY: number of pItems
+  size_t                countOffset;                //!< ARRAY: offsetof() the int element count in the record
+  int                   maxCount;                   //!< ARRAY: capacity of the element array. Later elements are skipped.
+}JSON_FIELD;
+
+
+/**
+ * @brief Immutable, pre-serialized outbound message. Published by reference, see mqtt_publishStatic().
+ * 
+ */
+typedef struct
+{
+  const char            *pTopic;                    //!< MQTT topic
+  const char            *pPayload;                  //!< Payload text. Must stay valid and unchanged while the application runs.
+  size_t                length;                     //!< Payload length
+  bool                  repeatable;                 //!< Never dropped as a repeat of the previous message, see dedupMs. E.g. chimes.
+}MQTT_STATIC_MSG;
+
+
 /********************************************************************
   PROTOTYPES
 ********************************************************************/
@@ -69,6 +155,118 @@ int  release_mutex_lock(MQTT_SEND_MTX* pMutex);
  */
 int  mqtt_topic_compare(const char* haystack, const char* needle);
 
+/**
+ * @brief Reads the members of a field table from a JSON object in one pass, without
+ * allocating. Unknown members are skipped, and reading stops as soon as every field
+ * has been found. Of duplicate members the first one counts.
+ * 
+ * @param pJson JSON text
+ * @param length Length of the text
+ * @param pFields Field table, at most JSON_EXTRACT_MAX_FIELDS
+ * @param numFields Number of fields
+ * @param pRecord [out] Record the field offsets refer to. Fields not found are left as they were.
+ * @return int Bit n set = pFields[n] found. -1 = not a JSON object or a syntax error.
+ */
+int  json_extract(const char* pJson, size_t length, const JSON_FIELD* pFields, int numFields, void* pRecord);
+
+/**
+ * @brief Monotonic clock in nanoseconds
+ * 
+ * @return uint64_t Nanoseconds from an arbitrary starting point
+ */
+uint64_t monotonic_ns(void);
+
+/**
+ * @brief Adds a sample to a latency histogram
+ * 
+ * @param pHist The histogram
+ * @param ns Sample in nanoseconds
+ */
+void latency_record(LATENCY_HIST* pHist, uint64_t ns);
+
+/**
+ * @brief Reads a percentile from a latency histogram. Resolution is one log2 bucket.
+ * 
+ * @param pHist The histogram
+ * @param percent Percentile, 0-100
+ * @return uint64_t Upper bound of the bucket holding the percentile, in nanoseconds
+ */
+uint64_t latency_percentile(LATENCY_HIST* pHist, double percent);
+
+/**
+ * @brief Writes count, p50, p95, p99 and max of a histogram to debug output
+ * 
+ * @param type dbg_out() message category
+ * @param pName Label of the line
+ * @param pHist The histogram
+ */
+void latency_log(int type, const char* pName, LATENCY_HIST* pHist);
+
+/**
+ * @brief Starts a JSON object in a buffer
+ * 
+ * @param pWriter The writer
+ * @param pBuf Output buffer
+ * @param size Size of the buffer
+ */
+void json_writerInit(JSON_WRITER* pWriter, char* pBuf, size_t size);
+
+/**
+ * @brief Adds a string member, escaped. pName=NULL adds an array element.
+ * 
+ * @param pWriter The writer
+ * @param pName Member name or NULL
+ * @param pValue Value
+ */
+void json_writeString(JSON_WRITER* pWriter, const char* pName, const char* pValue);
+
+/**
+ * @brief Adds an integer member. pName=NULL adds an array element.
+ * 
+ * @param pWriter The writer
+ * @param pName Member name or NULL
+ * @param value Value
+ */
+void json_writeNumber(JSON_WRITER* pWriter, const char* pName, long value);
+
+/**
+ * @brief Opens an array member. Add the elements with pName=NULL.
+ * 
+ * @param pWriter The writer
+ * @param pName Member name
+ */
+void json_writeArrayBegin(JSON_WRITER* pWriter, const char* pName);
+
+/**
+ * @brief Closes the array opened by json_writeArrayBegin()
+ * 
+ * @param pWriter The writer
+ */
+void json_writeArrayEnd(JSON_WRITER* pWriter);
+
+/**
+ * @brief Opens a nested object. pName=NULL adds an array element.
+ * 
+ * @param pWriter The writer
+ * @param pName Member name or NULL
+ */
+void json_writeObjectBegin(JSON_WRITER* pWriter, const char* pName);
+
+/**
+ * @brief Closes the object opened by json_writeObjectBegin()
+ * 
+ * @param pWriter The writer
+ */
+void json_writeObjectEnd(JSON_WRITER* pWriter);
+
+/**
+ * @brief Closes the object
+ * 
+ * @param pWriter The writer
+ * @return int Length of the text, -1 if it did not fit
+ */
+int  json_writerFinish(JSON_WRITER* pWriter);
+
 #if defined(_MSC_VER)
   DWORD WINAPI mqtt_sender(LPVOID pVoid);
   DWORD WINAPI mqtt_client_refresher(LPVOID mqttClient);
@@ -78,26 +276,51 @@ int  mqtt_topic_compare(const char* haystack, const char* needle);
 #endif
 
 
+struct MQTT_OUTMSG;    // Outbox slot. See mqttOutbox.h
+
+/**
+ * @brief Reserves an outbox slot for a message and writes its topic.
+ * Fill pPayload and call mqtt_endPublish(). Waits only if every slot is unsent.
+ * Set pfDone and pUser of the slot to be told when the broker has the message.
+ * 
+ * @param pTopic Topic of the message
+ * @param pCaller Name of calling function. (For debug purposes)
+ * @return struct MQTT_OUTMSG* The slot, NULL=outbox full
+ */
+struct MQTT_OUTMSG* mqtt_beginPublish(const char* pTopic, const char* pCaller);
+
+/**
+ * @brief Queues the slot for publishing. A negative length cancels the message.
+ * 
+ * @param pMsg Slot from mqtt_beginPublish()
+ * @param payloadLen Bytes written to pPayload, e.g. json_writerFinish() result
+ * @param pCaller Name of calling function. (For debug purposes)
+ * @return int 0=Success, negative=message cancelled
+ */
+int   mqtt_endPublish(struct MQTT_OUTMSG* pMsg, int payloadLen, const char* pCaller);
+
 /**
- * @brief Gets a mutex for protected MQTT data block.
-  If the block contains unsent data, releases the lock and tries
-  again after a short while.
-  Returns once mutex is got for "empty" data block
+ * @brief Queues a pre-serialized message. Only a reference to the payload is queued.
  * 
- * @param pMutex Pointer to mutex object
+ * @param pStatic The message
  * @param pCaller Name of calling function. (For debug purposes)
- * @return int 0=Success, Negative=Error
+ * @return int 0=Success, negative=error
  */
-int   getMQTTsendAccess(MQTT_SEND_MTX* pMutex, const char* pCaller);
+int   mqtt_publishStatic(const MQTT_STATIC_MSG* pStatic, const char* pCaller);
 
+/**
+ * @brief Publishes the outbox messages that can be sent now on the calling thread.
+ * Used by mqtt_sender(), --directPublish and the reactor.
+ * 
+ */
+void  mqtt_flushOutbox(void);
 
 /**
- * @brief Sends data stored in MQTT global data area.
+ * @brief Forgets the last published message of the bargeIn topics, so the
+ * de-duplication window does not drop the first answer of a new interaction.
  * 
- * @param pCaller calling function name (__FUNCTION__)
- * @return int 0=Success, negative=error 
  */
-int   sendMQTTtopic(const char* pCaller);
+void  mqtt_resetDedup(void);
 
 
 #endif